@@ -32,10 +32,13 @@
 #include <mach/kmod.h>
 #include <libkern/version.h>
 #include <IOKit/IOKitKeys.h>
+#include <IOKit/IOUserClient.h>
 
 #include <IOKit/usb/IOUSBHostDevice.h>
 #include <IOKit/usb/IOUSBHostInterface.h>
+#include <IOKit/network/IOBasicOutputQueue.h>
 #include <IOKit/network/IOGatedOutputQueue.h>
+#include <IOKit/IOMultiMemoryDescriptor.h>
 // May be useful for supporting suspend/resume:
 // #include <IOKit/pwr_mgt/RootDomain.h>
 
@@ -207,26 +210,218 @@ bool HoRNDIS::init(OSDictionary *properties) {
 	fInPipe = NULL;
 	fOutPipe = NULL;
 
-	numFreeOutBufs = 0;
+	fCommPipe = NULL;
+	fNotifyBuf.mdp = NULL;
+	fNotifyPosted = false;
+	fResponsesAvailable = 0;
+	fCtrlCmdInProgress = false;
+	fStatusThreadCall = thread_call_allocate(statusThreadEntry, this);
+	if (!fStatusThreadCall) {
+		LOG(V_ERROR, "Cannot allocate the status thread call");
+		return false;
+	}
+
+	fTxFreeHead = 0;
+	fTxFreeTail = 0;
+	fPersistentBuffers = false;
+	fPoolIdleTrimSec = DEFAULT_POOL_IDLE_TRIM_SEC;
+	fResourcesAllocated = false;
+	fPoolTrimTimer = NULL;
 	for (int i = 0; i < N_OUT_BUFS; i++) {
 		outbufs[i].mdp = NULL;
-		outbufStack[i] = i;  // Value does not matter here.
+		fTxFreeRing[i] = i;  // Value does not matter here.
+	}
+	fNumInBufs = DEFAULT_IN_BUFS;
+	fInRingHead = 0;
+	fRxBatchSize = DEFAULT_RX_BATCH;
+	fRxQueued = 0;
+	for (int i = 0 ; i < MAX_IN_BUFS; i++) {
+		inbufs[i].buf.mdp = NULL;
+		inbufs[i].rx = NULL;
+		inbufs[i].posted = false;
+		inbufs[i].completed = false;
+		inbufs[i].deferred = false;
+		inbufs[i].inPipe = false;
+	}
+
+	bzero(&fInStall, sizeof(fInStall));
+	fInStall.name = "InPipe";
+	bzero(&fOutStall, sizeof(fOutStall));
+	fOutStall.name = "OutPipe";
+	fNumTxDeferred = 0;
+	fTxNonGated = false;
+
+	fTxPriority = false;
+	fTxFqCodel = false;
+	fTxCodelEcn = false;
+	bzero(&fTxCodelParams, sizeof(fTxCodelParams));
+	fTxFlowPerturb = 0;
+	bzero(fTxClasses, sizeof(fTxClasses));
+	fTxBql = false;
+	bzero(&fTxDql, sizeof(fTxDql));
+	fTxStallWater = 0;
+	fTxResumeWater = 1;
+	fTxQueueStalled = false;
+	fTxStalledSince = 0;
+	txQueueReset();
+
+	fLatHist = false;
+	bzero(fLatStages, sizeof(fLatStages));
+	fTxOpenStamp = 0;
+	bzero(fTxPostStamp, sizeof(fTxPostStamp));
+	fTraceOn = false;
+	bzero(&fTrace, sizeof(fTrace));
+	fTraceRecs = NULL;
+	fUtilSampler = false;
+	fUtilTimer = NULL;
+	utilReset(&fUtilHistory);
+	fTxBusyTime = 0;
+	fInReadsInPipe = 0;
+	fInIdleSince = 0;
+	fInIdleTime = 0;
+
+	fTxCoalesceUs = 0;
+	fTxCoalesceTimer = NULL;
+	fTxCoalesceArmed = false;
+
+	fDataWorkLoop = NULL;
+	fDataGate = NULL;
+	fDataEvent = NULL;
+	fDataDoneLock = NULL;
+	fDataDone = NULL;
+	fDataDoneTail = &fDataDone;
+	fDataAction = NULL;
+	fDataActionResult = kIOReturnSuccess;
+	fDataActionDone = false;
+	fDataThreadCall = thread_call_allocate(dataThreadEntry, this);
+	if (!fDataThreadCall) {
+		LOG(V_ERROR, "Cannot allocate the data thread call");
+		return false;
+	}
+
+	fTxAggregation = true;
+	fTxOpenIndx = -1;
+	fTxOpenLen = 0;
+	fTxOpenFrames = 0;
+	fTxOpenBytes = 0;
+	fTxLastMsgOfs = 0;
+
+	fTxZeroCopy = false;
+	fTxTso = false;
+	fTxTsoPacket = NULL;
+	memset(&fTxTsoInfo, 0, sizeof(fTxTsoInfo));
+	fTxTsoNext = 0;
+	for (int i = 0; i < N_OUT_BUFS; i++) {
+		fTxSg[i].hdr = NULL;
+		fTxSg[i].desc = NULL;
+		fTxSg[i].packet = NULL;
 	}
-	for (int i = 0 ; i < N_IN_BUFS; i++) {
-		inbufs[i].mdp = NULL;
+
+	fTxTransfers = 0;
+	fTxFrames = 0;
+	fTxMaxFramesPerTransfer = 0;
+	fTxBytes = 0;
+	fTxTransferBytes = 0;
+	fTxOutOfBuffers = 0;
+	fTxZeroCopyFrames = 0;
+	fTxZeroCopyFallbacks = 0;
+	fTxCoalesceFlushes = 0;
+	fTxTsoPackets = 0;
+	fTxTsoSegments = 0;
+	fTxTsoErrors = 0;
+	fTxCodelDrops = 0;
+	fTxCodelMarks = 0;
+	fTxFqNewFlows = 0;
+	fTxBqlStalls = 0;
+	fTxQueueStalls = 0;
+	fTxQueueResumes = 0;
+	fTxQueueStalledUs = 0;
+	fTxBqlMaxInflight = 0;
+	fCtrlCommands = 0;
+	fCtrlNotifications = 0;
+	fCtrlLastLatencyUs = 0;
+	fCtrlMaxLatencyUs = 0;
+	fIndicateConnect = 0;
+	fIndicateDisconnect = 0;
+	fIndicateOther = 0;
+	fKeepalives = 0;
+	fRxTransfers = 0;
+	fRxFrames = 0;
+	fRxMaxFramesPerTransfer = 0;
+	fRxBytes = 0;
+	fRxTransferBytes = 0;
+	bzero(fRxParseErrors, sizeof(fRxParseErrors));
+	fRxAllocFailures = 0;
+	fRxWrapFailures = 0;
+	fRxCopyFailures = 0;
+	bzero(&fInErrors, sizeof(fInErrors));
+	bzero(&fOutErrors, sizeof(fOutErrors));
+	fRxBatchFlushes = 0;
+	fRxBatchMaxFrames = 0;
+	fRxZeroCopyTransfers = 0;
+	fRxZeroCopyFrames = 0;
+	fRxPoolExhausted = 0;
+	fPoolAllocations = 0;
+	fPoolReuses = 0;
+	fPoolTrims = 0;
+
+	fRxZeroCopy = false;
+	fNumRxSpares = DEFAULT_RX_SPARE_BUFS;
+	for (int i = 0; i < MAX_RX_SPARE_BUFS; i++) {
+		fRxSpares[i] = NULL;
 	}
 
 	rndisXid = 1;
 	maxOutTransferSize = 0;
+	fOutTransferSizeLimit = DEFAULT_MAX_OUT_TRANSFER_SIZE;
+	fMtuLimit = MAX_JUMBO_MTU;
+	fMaxMtu = ETHERNET_MTU;
+	maxOutPktsPerTransfer = 1;
+	outPktAlignMask = 0;
 	
 	return true;
 }
 
 void HoRNDIS::free() {
 	// Here, we shall free everything allocated by the 'init'.
+	// The notification buffer outlives the interrupt pipe, just in case
+	// its aborted read completes late:
+	OSSafeReleaseNULL(fNotifyBuf.mdp);
+	// A scheduled call holds a reference, so it cannot be pending here:
+	if (fStatusThreadCall) {
+		thread_call_free(fStatusThreadCall);
+		fStatusThreadCall = NULL;
+	}
+	// 'runDataAction' waits for it, so it cannot be pending either:
+	if (fDataThreadCall) {
+		thread_call_free(fDataThreadCall);
+		fDataThreadCall = NULL;
+	}
+	if (fDataWorkLoop) {
+		if (fDataEvent) {
+			fDataWorkLoop->removeEventSource(fDataEvent);
+		}
+		if (fDataGate) {
+			fDataWorkLoop->removeEventSource(fDataGate);
+		}
+	}
+	OSSafeReleaseNULL(fDataEvent);
+	OSSafeReleaseNULL(fDataGate);
+	if (fDataDoneLock) {
+		IOSimpleLockFree(fDataDoneLock);
+		fDataDoneLock = NULL;
+	}
+	if (fTraceRecs) {
+		IOFree(fTraceRecs, TRACE_RING_RECS * sizeof(trace_rec));
+		fTraceRecs = NULL;
+	}
+	// The output queue, that 'super::free' releases, may still refer to it:
+	IOWorkLoop *dataWorkLoop = fDataWorkLoop;
+	fDataWorkLoop = NULL;
 
 	LOG(V_NOTE, "driver instance terminated");  // For the default level
 	super::free();
+	OSSafeReleaseNULL(dataWorkLoop);
 }
 
 /*
@@ -271,6 +466,27 @@ FIX/HACK:
  and update our "IOProviderClass" to that.
 */
 
+// Accepts both numbers and booleans as the tunables' values:
+static bool configNumber(OSObject *obj, uint32_t *value) {
+	if (OSNumber *num = OSDynamicCast(OSNumber, obj)) {
+		*value = num->unsigned32BitValue();
+		return true;
+	}
+	if (OSBoolean *boolean = OSDynamicCast(OSBoolean, obj)) {
+		*value = boolean->isTrue() ? 1 : 0;
+		return true;
+	}
+	return false;
+}
+
+// Reads an optional tunable (see HoRNDIS.h) from the driver's properties,
+// returning 'defValue' if the key is absent.
+static uint32_t getConfigValue(const IOService *service, const char *key,
+	uint32_t defValue) {
+	uint32_t value;
+	return configNumber(service->getProperty(key), &value) ? value : defValue;
+}
+
 bool HoRNDIS::start(IOService *provider) {
 	LOG(V_DEBUG, ">");
 
@@ -291,10 +507,115 @@ bool HoRNDIS::start(IOService *provider) {
 		}
 	}
 
+	fTxAggregation = getConfigValue(this, kTxAggregationKey, true) != 0;
+	fOutTransferSizeLimit = getConfigValue(this, kMaxOutTransferSizeKey,
+		DEFAULT_MAX_OUT_TRANSFER_SIZE);
+	fOutTransferSizeLimit = max(fOutTransferSizeLimit, MIN_OUT_TRANSFER_SIZE);
+	fOutTransferSizeLimit = min(fOutTransferSizeLimit, MAX_OUT_BUF_SIZE);
+	fMtuLimit = getConfigValue(this, kMaxMtuKey, MAX_JUMBO_MTU);
+	fMtuLimit = max(fMtuLimit, MIN_MTU);
+	fMtuLimit = min(fMtuLimit, MAX_JUMBO_MTU);
+	fNumInBufs = getConfigValue(this, kInBufCountKey, DEFAULT_IN_BUFS);
+	fNumInBufs = max(1, min(fNumInBufs, MAX_IN_BUFS));
+	fRxBatchSize = getConfigValue(this, kRxBatchSizeKey, DEFAULT_RX_BATCH);
+	fRxBatchSize = max(1, min(fRxBatchSize, MAX_RX_BATCH));
+	fTxZeroCopy = getConfigValue(this, kTxZeroCopyKey, false) != 0;
+	fRxZeroCopy = getConfigValue(this, kRxZeroCopyKey, false) != 0;
+	fNumRxSpares = getConfigValue(this, kRxZeroCopyPoolSizeKey,
+		DEFAULT_RX_SPARE_BUFS);
+	fNumRxSpares = max(1, min(fNumRxSpares, MAX_RX_SPARE_BUFS));
+	fPersistentBuffers = getConfigValue(this, kPersistentBuffersKey, false) != 0;
+	fPoolIdleTrimSec = min(getConfigValue(this, kPoolIdleTrimSecKey,
+		DEFAULT_POOL_IDLE_TRIM_SEC), MAX_POOL_IDLE_TRIM_SEC);
+	fTxCoalesceUs = min(getConfigValue(this, kTxCoalesceUsecKey, 0),
+		MAX_TX_COALESCE_USEC);
+	// Only the gated transmit is serialized with the completions that
+	// drain the class queues:
+	fTxPriority = getConfigValue(this, kTxPriorityKey, false) != 0 &&
+		!fTxNonGated;
+	fTxFqCodel = getConfigValue(this, kTxFqCodelKey, false) != 0 &&
+		!fTxNonGated;
+	fTxCodelEcn = getConfigValue(this, kTxCodelEcnKey, true) != 0;
+	nanoseconds_to_absolutetime(1000ULL * getConfigValue(this,
+		kTxCodelTargetUsecKey, DEFAULT_CODEL_TARGET_USEC),
+		&fTxCodelParams.target);
+	nanoseconds_to_absolutetime(1000ULL * getConfigValue(this,
+		kTxCodelIntervalUsecKey, DEFAULT_CODEL_INTERVAL_USEC),
+		&fTxCodelParams.interval);
+	fTxCodelParams.mtu = TX_FQ_QUANTUM;
+	{
+		uint64_t now;
+		clock_get_uptime(&now);
+		fTxFlowPerturb = (uint32_t)(now ^ (now >> 32));
+	}
+	txQueueReset();  // The class limits depend on these.
+	fTxBql = getConfigValue(this, kTxByteQueueLimitKey, false) != 0 &&
+		!fTxNonGated;
+	// The super-packet being cut is continued by the completions:
+	fTxTso = getConfigValue(this, kTxTsoKey, false) != 0 && !fTxNonGated;
+	fTxStallWater = min(getConfigValue(this, kTxStallLowWaterKey, 0),
+		N_OUT_BUFS - 1);
+	fTxResumeWater = max(fTxStallWater + 1, min(getConfigValue(this,
+		kTxResumeHighWaterKey, fTxStallWater + 1), N_OUT_BUFS));
+	fLatHist = getConfigValue(this, kLatencyHistogramsKey, false) != 0;
+	if (getConfigValue(this, kTraceKey, false)) {
+		fDataGate->runAction(traceSwitchAction, (void *)(uintptr_t)true);
+	}
+	fUtilSampler = getConfigValue(this, kThroughputSamplerKey, true) != 0;
+
+	fInStall.timer = IOTimerEventSource::timerEventSource(this, stallTimeout);
+	fOutStall.timer = IOTimerEventSource::timerEventSource(this, stallTimeout);
+	fInStall.lock = IOSimpleLockAlloc();
+	fOutStall.lock = IOSimpleLockAlloc();
+	if (!fInStall.lock || !fOutStall.lock) {
+		LOG(V_ERROR, "Cannot allocate the stall recovery locks");
+		goto bailout;
+	}
+	if (!fInStall.timer || !fOutStall.timer ||
+			fDataWorkLoop->addEventSource(fInStall.timer) != kIOReturnSuccess ||
+			fDataWorkLoop->addEventSource(fOutStall.timer) != kIOReturnSuccess) {
+		LOG(V_ERROR, "Cannot create the stall recovery timers");
+		goto bailout;
+	}
+	fTxCoalesceTimer = IOTimerEventSource::timerEventSource(this,
+		txCoalesceTimeout);
+	if (!fTxCoalesceTimer ||
+			fDataWorkLoop->addEventSource(fTxCoalesceTimer) != kIOReturnSuccess) {
+		LOG(V_ERROR, "Cannot create the transmit coalescing timer");
+		goto bailout;
+	}
+
+	if (fUtilSampler) {
+		fUtilTimer = IOTimerEventSource::timerEventSource(this, utilTimeout);
+		if (!fUtilTimer ||
+				fDataWorkLoop->addEventSource(fUtilTimer) != kIOReturnSuccess) {
+			LOG(V_ERROR, "Cannot create the throughput sampler timer");
+			goto bailout;
+		}
+		clock_get_uptime(&fInIdleSince);  // No reads yet.
+		fUtilTimer->setTimeoutMS(UTIL_SAMPLE_MS);
+	}
+
+	if (fPersistentBuffers && fPoolIdleTrimSec > 0) {
+		fPoolTrimTimer = IOTimerEventSource::timerEventSource(this,
+			poolTrimTimeout);
+		if (!fPoolTrimTimer ||
+				getWorkLoop()->addEventSource(fPoolTrimTimer) != kIOReturnSuccess) {
+			LOG(V_ERROR, "Cannot create the pool trim timer");
+			OSSafeReleaseNULL(fPoolTrimTimer);
+			goto bailout;
+		}
+	}
+
 	if (!openUSBInterfaces(provider)) {
 		goto bailout;
 	}
 
+	if (fCommPipe && !startNotifyRead()) {
+		// Not fatal: 'rndisCommand' just polls for the responses.
+		LOG(V_ERROR, "Cannot read RNDIS notifications, will poll instead");
+	}
+
 	if (!rndisInit()) {
 		goto bailout;
 	}
@@ -361,6 +682,43 @@ void HoRNDIS::stop(IOService *provider) {
 	
 	closeUSBInterfaces();  // Just in case - supposed to be closed by now.
 
+	if (fPoolTrimTimer) {
+		fPoolTrimTimer->cancelTimeout();
+		getWorkLoop()->removeEventSource(fPoolTrimTimer);
+		OSSafeReleaseNULL(fPoolTrimTimer);
+	}
+	if (fTxCoalesceTimer) {
+		fTxCoalesceTimer->cancelTimeout();
+		fDataWorkLoop->removeEventSource(fTxCoalesceTimer);
+		OSSafeReleaseNULL(fTxCoalesceTimer);
+	}
+	if (fUtilTimer) {
+		fUtilTimer->cancelTimeout();
+		fDataWorkLoop->removeEventSource(fUtilTimer);
+		OSSafeReleaseNULL(fUtilTimer);
+	}
+	stallrec_t *const stallRecs[] = { &fInStall, &fOutStall };
+	for (int i = 0; i < 2; i++) {
+		if (stallRecs[i]->timer) {
+			stallRecs[i]->timer->cancelTimeout();
+			fDataWorkLoop->removeEventSource(stallRecs[i]->timer);
+			OSSafeReleaseNULL(stallRecs[i]->timer);
+		}
+		if (stallRecs[i]->lock) {
+			IOSimpleLockFree(stallRecs[i]->lock);
+			stallRecs[i]->lock = NULL;
+		}
+	}
+	// With 'fPersistentBuffers', the buffers outlive 'disable':
+	if (fResourcesAllocated) {
+		releaseResources();
+	}
+
+	// Drop the status fetch that did not start yet, with its reference:
+	if (thread_call_cancel(fStatusThreadCall)) {
+		release();
+	}
+
 	super::stop(provider);
 }
 
@@ -476,6 +834,29 @@ bool HoRNDIS::openUSBInterfaces(IOService *provider) {
 			return false;
 		}
 	}
+
+	{  // Get the notification pipe for the control interface:
+		const EndpointDescriptor *candidate = NULL;
+		const InterfaceDescriptor *intDesc = fCommInterface->getInterfaceDescriptor();
+		const ConfigurationDescriptor *confDesc = fCommInterface->getConfigurationDescriptor();
+		while((candidate = StandardUSB::getNextEndpointDescriptor(
+					confDesc, intDesc, candidate)) != NULL) {
+			const bool isEPIn =
+				(candidate->bEndpointAddress & kEndpointDescriptorDirection) != 0;
+			const bool isEPInterrupt =
+				(candidate->bmAttributes & kEndpointDescriptorTransferType) ==
+					kEndpointDescriptorTransferTypeInterrupt;
+			if (isEPIn && isEPInterrupt) {
+				// Note, 'copyPipe' already performs 'retain'.
+				fCommPipe = fCommInterface->copyPipe(candidate->bEndpointAddress);
+				break;
+			}
+		}
+		if (fCommPipe == NULL) {
+			// It's optional for us: we can poll for the responses.
+			LOG(V_NOTE, "No notification endpoint on the control interface");
+		}
+	}
 	
 	return true;
 }
@@ -492,6 +873,7 @@ void HoRNDIS::closeUSBInterfaces() {
 
 	OSSafeReleaseNULL(fInPipe);
 	OSSafeReleaseNULL(fOutPipe);
+	OSSafeReleaseNULL(fCommPipe);
 	OSSafeReleaseNULL(fDataInterface);
 	OSSafeReleaseNULL(fCommInterface);  // First one to open, last one to die.
 }
@@ -596,12 +978,14 @@ IOService *HoRNDIS::probeDevice(IOUSBHostDevice *device, SInt32 *score) {
  * I've seen have "max_transfer_size" large enough to accomodate a max-length 
  * Ethernet frames. */
 
-bool HoRNDISInterface::init(IONetworkController *controller, int mtu) {
-	maxmtu = mtu;
+bool HoRNDISInterface::init(IONetworkController *controller, int mtu,
+		int maxMtu) {
+	maxmtu = maxMtu;
 	if (IOEthernetInterface::init(controller) == false) {
 		return false;
 	}
-	LOG(V_NOTE, "(network interface) starting up with MTU %d", mtu);
+	LOG(V_NOTE, "(network interface) starting up with MTU %d (up to %d)",
+		mtu, maxMtu);
 	setMaxTransferUnit(mtu);
 	return true;
 }
@@ -624,11 +1008,9 @@ IONetworkInterface *HoRNDIS::createInterface() {
 		return NULL;
 	}
 
-	int mtuLimit = maxOutTransferSize
-		- (int)sizeof(rndis_data_hdr)
-		- 14;  // Size of ethernet header (no QLANs). Checksum is not included.
-
-	if (!netif->init(this, min(ETHERNET_MTU, mtuLimit))) {
+	// Start with the standard MTU; 'rndisInit' has fit the device's maximum
+	// frame size into the buffers, so "ifconfig mtu" can go up to 'fMaxMtu':
+	if (!netif->init(this, min(ETHERNET_MTU, fMaxMtu), fMaxMtu)) {
 		netif->release();
 		return NULL;
 	}
@@ -677,37 +1059,515 @@ HoRNDIS::ReentryLocker::~ReentryLocker() {
 	}
 }
 
-static IOReturn loopClearPipeStall(IOUSBHostPipe *pipe) {
+/*
+===============================
+||  STALL RECOVERY
+===============================
+For some reason, 'clearStall' may keep on returning kUSBHostReturnPipeStalled
+many times, before finally returning success (Android keeps on sending
+packtes, each generating a stall?). We used to call it in a loop of up to
+1000 iterations right where the stall was seen - within the USB completion,
+holding up the work loop for as long as it took.
+
+Now, a stall (returned by 'io', or reported by a completion) starts the
+recovery of that pipe, and returns right away:
+ * 'fXxxStall.timer' calls 'clearStall' in bursts of STALL_BURST_ATTEMPTS,
+   with exponential backoff between the bursts (up to STALL_BACKOFF_MAX_MS).
+ * While the pipe is recovering, the transfers are not issued, but deferred:
+   the IN ring marks the reads 'deferred', and the OUT transfers go to
+   'fTxDeferred'. They still count as in-flight ('fCallbackCount'), so the
+   network queue and 'disable' treat them just like the pending transfers.
+ * Once the stall is cleared, the deferred transfers are issued in order.
+ * If the stall is not cleared within STALL_RECOVERY_BUDGET_MS, we give up:
+   the deferred writes fail, and the reader stops, as if 'io' had failed.
+ * 'disable' cancels the recovery, failing the deferred transfers.
+
+'enable' clears the stalls synchronously, within STALL_ENABLE_BUDGET_MS.
+The stall counts, 'clearStall' attempts and recovery times of each pipe are
+published in the statistics.
+*/
+
+IOReturn HoRNDIS::clearStallBurst(IOUSBHostPipe *pipe, stallrec_t *rec) {
 	IOReturn rc = kUSBHostReturnPipeStalled;
 	int count = 0;
-	// For some reason, 'clearStall' may keep on returning
-	// kUSBHostReturnPipeStalled many times, before finally returning success
-	// (Android keeps on sending packtes, each generating a stall?).
-	const int NUM_RETRIES = 1000;
-	for (; count < NUM_RETRIES && rc == kUSBHostReturnPipeStalled; count++) {
+	for (; count < STALL_BURST_ATTEMPTS && rc == kUSBHostReturnPipeStalled;
+			count++) {
 		rc = pipe->clearStall(true);
 	}
-	LOG(V_DEBUG, "Called 'clearStall' %d times", count);
+	rec->clearAttempts += count;
+	LOG(V_DEBUG, "%s: called 'clearStall' %d times: %08x", rec->name, count, rc);
 	return rc;
 }
 
-/*!
- * Calls 'pipe->io', and if there is a stall, tries to clear that 
- * stall and calls it again.
- */
-static inline IOReturn robustIO(IOUSBHostPipe *pipe, pipebuf_t *buf,
+static uint32_t elapsedMs(uint64_t since, uint32_t *elapsedUs = NULL) {
+	uint64_t now, elapsedNs;
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now - since, &elapsedNs);
+	if (elapsedUs) {
+		*elapsedUs = (uint32_t)min(elapsedNs / 1000, UINT_MAX);
+	}
+	return (uint32_t)min(elapsedNs / 1000000, UINT_MAX);
+}
+
+bool HoRNDIS::clearStallSync(IOUSBHostPipe *pipe, stallrec_t *rec,
+	uint32_t budgetMs) {
+	uint64_t startTime;
+	clock_get_uptime(&startTime);
+	uint32_t backoffMs = 1;
+	IOReturn rc;
+	while ((rc = clearStallBurst(pipe, rec)) == kUSBHostReturnPipeStalled &&
+			elapsedMs(startTime) + backoffMs < budgetMs) {
+		IOSleep(backoffMs);
+		backoffMs = min(backoffMs * 2, STALL_BACKOFF_MAX_MS);
+	}
+	if (rc != kIOReturnSuccess) {
+		LOG(V_ERROR, "%s: cannot clear the stall: %08x", rec->name, rc);
+	}
+	return rc == kIOReturnSuccess;
+}
+
+void HoRNDIS::stallBegin(stallrec_t *rec) {
+	IOSimpleLockLock(rec->lock);
+	const bool wasRecovering = rec->recovering;
+	rec->recovering = true;
+	IOSimpleLockUnlock(rec->lock);
+	if (!wasRecovering) {  // Otherwise, already on it.
+		stallStart(rec);
+	}
+}
+
+void HoRNDIS::stallStart(stallrec_t *rec) {
+	// Whoever has set 'recovering' starts the 'clearStall' attempts:
+	LOG(V_DEBUG, "%s: USB pipe is stalled, starting recovery", rec->name);
+	rec->stalls++;
+	rec->backoffMs = 0;
+	clock_get_uptime(&rec->startTime);
+	// The first burst, as soon as we're out of the completion:
+	rec->timer->setTimeoutUS(1);
+}
+
+void HoRNDIS::stallEnd(stallrec_t *rec, bool recovered) {
+	uint32_t elapsedUs;
+	elapsedMs(rec->startTime, &elapsedUs);
+	// 'recovering' stays set, until the deferred transfers are taken care of.
+	rec->timer->cancelTimeout();
+	if (recovered) {
+		LOG(V_DEBUG, "%s: stall cleared in %d us", rec->name, elapsedUs);
+		rec->recoveries++;
+		rec->lastRecoveryUs = elapsedUs;
+		rec->maxRecoveryUs = max(rec->maxRecoveryUs, elapsedUs);
+	} else {
+		LOG(V_ERROR, "%s: giving up on the stall after %d us", rec->name,
+			elapsedUs);
+		rec->failures++;
+	}
+}
+
+void HoRNDIS::stallTimeout(OSObject *owner, IOTimerEventSource *sender) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	const bool isIn = sender == me->fInStall.timer;
+	stallrec_t *rec = isIn ? &me->fInStall : &me->fOutStall;
+	IOUSBHostPipe *pipe = isIn ? me->fInPipe : me->fOutPipe;
+	// 'disable' cancels the recovery: nothing to do, if it got here anyway.
+	if (!rec->recovering || !me->fReadyToTransfer || !pipe) {
+		return;
+	}
+
+	IOReturn rc = me->clearStallBurst(pipe, rec);
+	if (rc == kIOReturnSuccess) {
+		me->stallEnd(rec, true);
+		me->stallReissueDeferred(rec, true);
+		return;
+	}
+	const uint32_t nextMs = max(rec->backoffMs * 2, 1);
+	if (rc != kUSBHostReturnPipeStalled ||
+			elapsedMs(rec->startTime) + nextMs >= STALL_RECOVERY_BUDGET_MS) {
+		me->stallEnd(rec, false);
+		me->stallReissueDeferred(rec, false);
+		return;
+	}
+	rec->backoffMs = min(nextMs, STALL_BACKOFF_MAX_MS);
+	rec->timer->setTimeoutMS(rec->backoffMs);
+}
+
+void HoRNDIS::stallReissueDeferred(stallrec_t *rec, bool recovered) {
+	if (rec == &fInStall) {
+		// The IN pipe is only used within the work loop:
+		rec->recovering = false;
+		// Issue the deferred reads in ring order:
+		for (int n = 0; n < fNumInBufs; n++) {
+			inbuf_t *inbuf = &inbufs[(fInRingHead + n) % fNumInBufs];
+			if (!inbuf->deferred) {
+				continue;
+			}
+			inbuf->deferred = false;
+			if (recovered) {
+				rxPostRead(inbuf);  // May defer it again.
+			} else {
+				LOG(V_ERROR, "READER STOPPED: USB pipe stall was not cleared");
+				inbuf->posted = false;
+				callbackExit();
+				fDataDead = true;
+			}
+		}
+		// The stopped readers may have been holding up the ring:
+		processInRing();
+		return;
+	}
+
+	if (!recovered) {
+		txFailDeferred(kIOReturnError);
+		return;
+	}
+	// Issue the deferred writes one by one, in order. The pipe stays
+	// 'recovering' until the list is empty, so the writes that 'outputPacket'
+	// makes in the meantime (see "NON-GATED TRANSMIT") queue up behind them.
+	for (;;) {
+		IOSimpleLockLock(rec->lock);
+		if (fNumTxDeferred == 0) {
+			rec->recovering = false;
+			IOSimpleLockUnlock(rec->lock);
+			return;
+		}
+		const txdefer_t d = fTxDeferred[0];
+		fNumTxDeferred--;
+		memmove(&fTxDeferred[0], &fTxDeferred[1],
+			fNumTxDeferred * sizeof(txdefer_t));
+		IOSimpleLockUnlock(rec->lock);
+
+		IOReturn ior = fOutPipe->io(d.mdp, d.len, &outbufs[d.poolIndx].comp);
+		if (ior == kUSBHostReturnPipeStalled) {
+			// Stalled again: put it back in front, and start over.
+			IOSimpleLockLock(rec->lock);
+			memmove(&fTxDeferred[1], &fTxDeferred[0],
+				fNumTxDeferred * sizeof(txdefer_t));
+			fTxDeferred[0] = d;
+			fNumTxDeferred++;
+			IOSimpleLockUnlock(rec->lock);
+			stallStart(rec);
+			return;
+		}
+		if (ior != kIOReturnSuccess) {
+			// Complete it as a failed transfer: frees the buffer.
+			dataWriteComplete(this, (void *)(uintptr_t)d.poolIndx, ior, 0);
+		}
+	}
+}
+
+void HoRNDIS::txFailDeferred(IOReturn status) {
+	// Take the whole list, and let the new writes through: the order of the
+	// failed ones does not matter.
+	txdefer_t deferred[N_OUT_BUFS];
+	IOSimpleLockLock(fOutStall.lock);
+	const int numDeferred = fNumTxDeferred;
+	memcpy(deferred, fTxDeferred, numDeferred * sizeof(txdefer_t));
+	fNumTxDeferred = 0;
+	fOutStall.recovering = false;
+	IOSimpleLockUnlock(fOutStall.lock);
+	for (int i = 0; i < numDeferred; i++) {
+		// Complete it as a failed transfer: frees the buffer.
+		dataWriteComplete(this, (void *)(uintptr_t)deferred[i].poolIndx,
+			status, 0);
+	}
+}
+
+void HoRNDIS::stallCancel() {
+	// Called by 'disable', with 'fReadyToTransfer' cleared: the deferred
+	// transfers are completed as aborted ones.
+	stallrec_t *const recs[] = { &fInStall, &fOutStall };
+	for (int i = 0; i < 2; i++) {
+		if (recs[i]->recovering) {
+			stallEnd(recs[i], false);
+		}
+	}
+	fInStall.recovering = false;
+	for (int i = 0; i < MAX_IN_BUFS; i++) {
+		if (inbufs[i].deferred) {
+			inbufs[i].deferred = false;
+			dataReadComplete(this, &inbufs[i], kIOReturnAborted, 0);
+		}
+	}
+	txFailDeferred(kIOReturnAborted);
+}
+
+// Counts a failed submit or completion on a bulk pipe, see 'usberrs_t'.
+// Not the transfers that we abort ourselves, as we stop or disable.
+static void countUsbError(usberrs_t *errs, IOReturn rc) {
+	if (rc == kIOReturnAborted) {
+		return;
+	}
+	for (int i = 0; i < USB_ERROR_CODES; i++) {
+		if (errs->counts[i] == 0) {
+			errs->codes[i] = rc;  // The first time we see this one.
+		}
+		if (errs->codes[i] == rc) {
+			errs->counts[i]++;
+			return;
+		}
+	}
+	errs->other++;
+}
+
+bool HoRNDIS::rxPostRead(inbuf_t *inbuf) {
+	// The caller has set 'posted', and counted the callback:
+	IOReturn ior = kUSBHostReturnPipeStalled;
+	if (!fInStall.recovering) {
+		const uint64_t start = latStamp();
+		ior = fInPipe->io(inbuf->buf.mdp,
+			(uint32_t)inbuf->buf.mdp->getLength(), &inbuf->buf.comp);
+		latSince(LAT_RX_SUBMIT, start);
+		if (ior == kIOReturnSuccess) {
+			utilReadPosted(inbuf);
+			return true;  // Callback is in-progress.
+		}
+	}
+	if (ior == kUSBHostReturnPipeStalled) {
+		inbuf->deferred = true;
+		stallBegin(&fInStall);
+		return true;
+	}
+
+	LOG(V_ERROR, "READER STOPPED: USB failure trying to read: %08x", ior);
+	countUsbError(&fInErrors, ior);
+	inbuf->posted = false;
+	callbackExit();
+	fDataDead = true;
+	return false;
+}
+
+IOReturn HoRNDIS::txPostWrite(int poolIndx, IOMemoryDescriptor *mdp,
 	uint32_t len) {
-	IOReturn rc = pipe->io(buf->mdp, len, &buf->comp);
-	if (rc == kUSBHostReturnPipeStalled) {
-		LOG(V_DEBUG, "USB Pipe is stalled. Trying to clear ...");
-		rc = loopClearPipeStall(pipe);
-		// If clearing the stall succeeded, try the IO operation again:
-		if (rc == kIOReturnSuccess) {
-			LOG(V_DEBUG, "Cleared USB Stall, Retrying the operation");
-			rc = pipe->io(buf->mdp, len, &buf->comp);
+	// The caller has set up the 'outbufs[poolIndx].comp'. With the non-gated
+	// queue, the recovery may be going on concurrently: hence the lock.
+	IOSimpleLockLock(fOutStall.lock);
+	const bool recovering = fOutStall.recovering;
+	IOSimpleLockUnlock(fOutStall.lock);
+	// Set before the 'io': the completion may come before it returns. A
+	// deferred transfer counts as in flight from here, too.
+	fTxPostStamp[poolIndx] = utilStamp();
+	IOReturn ior = kUSBHostReturnPipeStalled;
+	if (!recovering) {
+		ior = fOutPipe->io(mdp, len, &outbufs[poolIndx].comp);
+		latSince(LAT_TX_SUBMIT, fTxPostStamp[poolIndx]);
+	}
+	if (ior == kUSBHostReturnPipeStalled) {
+		IOSimpleLockLock(fOutStall.lock);
+		txdefer_t &d = fTxDeferred[fNumTxDeferred++];
+		d.poolIndx = poolIndx;
+		d.mdp = mdp;
+		d.len = len;
+		const bool wasRecovering = fOutStall.recovering;
+		fOutStall.recovering = true;
+		IOSimpleLockUnlock(fOutStall.lock);
+		if (!wasRecovering) {
+			stallStart(&fOutStall);
 		}
+		return kIOReturnSuccess;  // In-flight, as far as the caller knows.
 	}
-	return rc;
+	if (ior != kIOReturnSuccess) {
+		countUsbError(&fOutErrors, ior);
+	}
+	return ior;
+}
+
+/*
+===============================
+||  DATA WORK LOOP
+===============================
+The work loop that 'getWorkLoop' returns is the USB stack's: the USB
+completions arrive there, and 'enable', 'disable' and 'rndisCommand' hold its
+gate. 'rndisCommand' may hold it for a long time: without the interrupt
+endpoint, it polls the device with 'IOSleep', and a slow device keeps it
+retrying for up to RNDIS_CMD_ATTEMPTS polls. On the same work loop, the data
+path would wait for all of that: the completions, the stall recovery, and
+the gated output queue.
+
+So the data path runs on a work loop of its own, 'fDataWorkLoop':
+ * It serves the gated output queue, the stall recovery timers, and
+   'fDataEvent'.
+ * The bulk pipe completions only link the transfer's buffer into
+   'fDataDone' and signal 'fDataEvent', which runs 'dataReadComplete' and
+   'dataWriteComplete' in the data gate.
+ * 'enable' and 'disable' start and stop the transfers with 'runDataAction'.
+The lock order is: the data gate, then the USB stack's. The data path calls
+into the USB stack (e.g. 'io' and 'clearStall' take its gate), so nothing
+that holds the command gate may wait for the data gate. 'runDataAction'
+hands the action over to 'fDataThreadCall', and sleeps in the command gate
+until it's done: the same way "STATUS MESSAGES" get off the USB thread.
+*/
+
+bool HoRNDIS::createDataWorkLoop() {
+	fDataWorkLoop = IOWorkLoop::workLoop();
+	fDataGate = IOCommandGate::commandGate(this);
+	fDataEvent = IOInterruptEventSource::interruptEventSource(this,
+		dataEventAction);
+	fDataDoneLock = IOSimpleLockAlloc();
+	if (!fDataWorkLoop || !fDataGate || !fDataEvent || !fDataDoneLock ||
+			fDataWorkLoop->addEventSource(fDataGate) != kIOReturnSuccess ||
+			fDataWorkLoop->addEventSource(fDataEvent) != kIOReturnSuccess) {
+		LOG(V_ERROR, "Cannot create the data work loop");
+		return false;  // 'free' takes care of whatever was created.
+	}
+	return true;
+}
+
+void HoRNDIS::dataReadDone(void *obj, void *param, IOReturn rc,
+	UInt32 transferred) {
+	HoRNDIS *me = (HoRNDIS *)obj;
+	me->queueDataDone(&((inbuf_t *)param)->buf, dataReadComplete, param, rc,
+		transferred);
+}
+
+void HoRNDIS::dataWriteDone(void *obj, void *param, IOReturn rc,
+	UInt32 transferred) {
+	HoRNDIS *me = (HoRNDIS *)obj;
+	me->queueDataDone(&me->outbufs[(uintptr_t)param], dataWriteComplete, param,
+		rc, transferred);
+}
+
+void HoRNDIS::queueDataDone(pipebuf_t *pb, IOUSBHostCompletionAction action,
+	void *param, IOReturn rc, UInt32 transferred) {
+	// On the USB completion thread: must not block on the data gate. The
+	// transfer's own buffer holds the completion, so it cannot be dropped.
+	const uint64_t stamp = latStamp();
+	IOSimpleLockLock(fDataDoneLock);
+	datadone_t &d = pb->done;
+	d.action = action;
+	d.param = param;
+	d.rc = rc;
+	d.transferred = transferred;
+	d.stamp = stamp;
+	d.next = NULL;
+	*fDataDoneTail = pb;
+	fDataDoneTail = &d.next;
+	IOSimpleLockUnlock(fDataDoneLock);
+	fDataEvent->interruptOccurred(NULL, NULL, 0);
+}
+
+void HoRNDIS::dataEventAction(OSObject *owner, IOInterruptEventSource *sender,
+	int count) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	// The completions may re-post the transfers, that may complete meanwhile:
+	for (;;) {
+		IOSimpleLockLock(me->fDataDoneLock);
+		pipebuf_t *pb = me->fDataDone;
+		me->fDataDone = NULL;
+		me->fDataDoneTail = &me->fDataDone;
+		IOSimpleLockUnlock(me->fDataDoneLock);
+		if (!pb) {
+			break;
+		}
+		for (pipebuf_t *next; pb; pb = next) {
+			// Taken before the dispatch, which may post the transfer again:
+			const datadone_t d = pb->done;
+			next = d.next;
+			if (me->fLatHist) {
+				const bool write = d.action == dataWriteComplete;
+				if (write) {
+					me->latSince(LAT_TX_USB,
+						me->fTxPostStamp[(uintptr_t)d.param], d.stamp);
+				}
+				me->latSince(write ? LAT_TX_DISPATCH : LAT_RX_DISPATCH,
+					d.stamp);
+			}
+			d.action(me, d.param, d.rc, d.transferred);
+		}
+	}
+}
+
+IOReturn HoRNDIS::runDataAction(IOCommandGate::Action action) {
+	// Called within the command gate, by 'enable' and 'disable': the
+	// 'fEnableDisableInProgress' guard keeps it to one action at a time.
+	fDataAction = action;
+	fDataActionDone = false;
+	// The pending call holds a reference, dropped by 'dataThreadEntry':
+	retain();
+	thread_call_enter(fDataThreadCall);
+	while (!fDataActionDone) {
+		getCommandGate()->commandSleep(&fDataActionDone);
+	}
+	return fDataActionResult;
+}
+
+void HoRNDIS::dataThreadEntry(thread_call_param_t param0,
+	thread_call_param_t param1) {
+	HoRNDIS *me = (HoRNDIS *)param0;
+	IOReturn rc = me->fDataGate->runAction(me->fDataAction);
+	// Takes the command gate, so the wakeup cannot come before the sleep:
+	me->getCommandGate()->runAction(dataActionDoneAction,
+		(void *)(uintptr_t)rc);
+	me->release();
+}
+
+IOReturn HoRNDIS::dataActionDoneAction(OSObject *owner, void *arg0,
+	void *arg1, void *arg2, void *arg3) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	me->fDataActionResult = (IOReturn)(uintptr_t)arg0;
+	me->fDataActionDone = true;
+	me->getCommandGate()->commandWakeup(&me->fDataActionDone);
+	return kIOReturnSuccess;
+}
+
+IOReturn HoRNDIS::dataStartAction(OSObject *owner, void *arg0, void *arg1,
+	void *arg2, void *arg3) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	me->fReadyToTransfer = true;
+	me->txBqlReset();
+
+	// Kick off the read requests, in ring order:
+	me->fInRingHead = 0;
+	for (int i = 0; i < me->fNumInBufs; i++) {
+		inbuf_t &inbuf = me->inbufs[i];
+		inbuf.buf.comp.owner = me;
+		inbuf.buf.comp.action = dataReadDone;
+		inbuf.buf.comp.parameter = &inbuf;
+		inbuf.completed = false;
+		inbuf.deferred = false;
+
+		inbuf.posted = true;
+		OSIncrementAtomic(&me->fCallbackCount);
+		if (!me->rxPostRead(&inbuf)) {
+			LOG(V_ERROR, "Failed to start the read %d\n", i);
+			return kIOReturnError;
+		}
+	}
+	return kIOReturnSuccess;
+}
+
+IOReturn HoRNDIS::dataStopAction(OSObject *owner, void *arg0, void *arg1,
+	void *arg2, void *arg3) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	// Stop the the new transfers. The code below would cancel the pending
+	// ones. In the data gate, no gated 'outputPacket' is half-way done:
+	me->fReadyToTransfer = false;
+
+	// If USB interfaces are still up, abort the reader and writer. Their
+	// completions only get recorded: they are dispatched while we sleep below.
+	if (me->fInPipe) {
+		me->fInPipe->abort(IOUSBHostIOSource::kAbortSynchronous,
+			kIOReturnAborted, NULL);
+	}
+	if (me->fOutPipe) {
+		me->fOutPipe->abort(IOUSBHostIOSource::kAbortSynchronous,
+			kIOReturnAborted, NULL);
+	}
+	// The transfers waiting for a stall recovery are not in the pipes:
+	me->stallCancel();
+	// The open buffer is dropped with the rest of the transmit state, and
+	// so are the frames waiting in the class queues:
+	me->fTxCoalesceTimer->cancelTimeout();
+	me->fTxCoalesceArmed = false;
+	me->txQueueFlush();
+	me->txTsoFlush();
+	// Make sure all the callbacks have exited:
+	LOG(V_DEBUG, "Callback count: %d. If not zero, delaying ...",
+		me->fCallbackCount);
+	while (me->fCallbackCount > 0) {
+		// No timeout: in our callbacks we trust!
+		me->fDataGate->commandSleep((void *)&me->fCallbackCount);
+	}
+	LOG(V_DEBUG, "All callbacks exited");
+	return kIOReturnSuccess;
 }
 
 /* Contains buffer alloc and dealloc, notably.  Why do that here?  
@@ -734,7 +1594,11 @@ IOReturn HoRNDIS::enable(IONetworkInterface *netif) {
 		return kIOReturnError;
 	}
 
+	if (fPoolTrimTimer) {
+		fPoolTrimTimer->cancelTimeout();
+	}
 	if (!allocateResources()) {
+		releaseResources();  // Whatever was allocated before the failure.
 		return kIOReturnNoMemory;
 	}
 
@@ -748,25 +1612,14 @@ IOReturn HoRNDIS::enable(IONetworkInterface *netif) {
 	// after that, followed by another "enable". This happens when user runs
 	// "sudo ifconfig <netif> down", followed by "sudo ifconfig <netif> up"
 	LOG(V_DEBUG, "Clearing potential Pipe stalls on Input and Output pipes");
-	loopClearPipeStall(fInPipe);
-	loopClearPipeStall(fOutPipe);
+	clearStallSync(fInPipe, &fInStall, STALL_ENABLE_BUDGET_MS);
+	clearStallSync(fOutPipe, &fOutStall, STALL_ENABLE_BUDGET_MS);
 
-	// We can now perform reads and writes between Network stack and USB device:
-	fReadyToTransfer = true;
-	
-	// Kick off the read requests:
-	for (int i = 0; i < N_IN_BUFS; i++) {
-		pipebuf_t &inbuf = inbufs[i];
-		inbuf.comp.owner = this;
-		inbuf.comp.action = dataReadComplete;
-		inbuf.comp.parameter = &inbuf;
-
-		rtn = robustIO(fInPipe, &inbuf, (uint32_t)inbuf.mdp->getLength());
-		if (rtn != kIOReturnSuccess) {
-			LOG(V_ERROR, "Failed to start the first read: %08x\n", rtn);
-			goto bailout;
-		}
-		fCallbackCount++;
+	// We can now perform reads and writes between Network stack and USB
+	// device. The reads are started on the data work loop:
+	rtn = runDataAction(dataStartAction);
+	if (rtn != kIOReturnSuccess) {
+		goto bailout;
 	}
 
 	// Tell the world that the link is up...
@@ -832,9 +1685,6 @@ IOReturn HoRNDIS::disable(IONetworkInterface *netif) {
 void HoRNDIS::disableImpl() {
 	disableNetworkQueue();
 
-	// Stop the the new transfers. The code below would cancel the pending ones:
-	fReadyToTransfer = false;
-
 	// If the device has not been disconnected, ask it to stop xmitting:
 	if (fCommInterface) {
 		rndisSetPacketFilter(0);
@@ -844,26 +1694,19 @@ void HoRNDIS::disableImpl() {
 	// It sets the link status to 0x1 in the disable call:
 	setLinkStatus(kIONetworkLinkValid, 0);
 
-	// If USB interfaces are still up, abort the reader and writer:
-	if (fInPipe) {
-		fInPipe->abort(IOUSBHostIOSource::kAbortSynchronous,
-			kIOReturnAborted, NULL);
-	}
-	if (fOutPipe) {
-		fOutPipe->abort(IOUSBHostIOSource::kAbortSynchronous,
-			kIOReturnAborted, NULL);
-	}
-	// Make sure all the callbacks have exited:
-	LOG(V_DEBUG, "Callback count: %d. If not zero, delaying ...",
-		fCallbackCount);
-	while (fCallbackCount > 0) {
-		// No timeout: in our callbacks we trust!
-		getCommandGate()->commandSleep(&fCallbackCount);
-	}
-	LOG(V_DEBUG, "All callbacks exited");
+	// Stop the transfers, and wait for the callbacks to exit:
+	runDataAction(dataStopAction);
 
-	// Release all resources
-	releaseResources();
+	// Release all resources, unless we keep them for the next 'enable'.
+	// After the device is gone, there's no next 'enable'.
+	if (fPersistentBuffers && fInPipe && fOutPipe) {
+		resetResources();
+		if (fPoolTrimTimer) {
+			fPoolTrimTimer->setTimeoutMS(fPoolIdleTrimSec * 1000);
+		}
+	} else {
+		releaseResources();
+	}
 
 	fNetifEnabled = false;
 }
@@ -897,81 +1740,609 @@ bool HoRNDIS::createMediumTables(const IONetworkMedium **primary) {
 }
 
 bool HoRNDIS::allocateResources() {
+	if (fResourcesAllocated) {
+		// Persistent buffers, left from the previous 'enable':
+		LOG(V_DEBUG, "Reusing the buffers");
+		resetResources();
+		fPoolReuses++;
+		return true;
+	}
+
 	LOG(V_DEBUG, "Allocating %d input buffers (size=%d) and %d output "
-		"buffers (size=%d)", N_IN_BUFS, IN_BUF_SIZE, N_OUT_BUFS, OUT_BUF_SIZE);
+		"buffers (size=%d)", fNumInBufs, IN_BUF_SIZE, N_OUT_BUFS,
+		maxOutTransferSize);
 	
 	// Grab a memory descriptor pointer for data-in.
-	for (int i = 0; i < N_IN_BUFS; i++) {
-		inbufs[i].mdp = IOBufferMemoryDescriptor::withCapacity(IN_BUF_SIZE, kIODirectionIn);
-		if (!inbufs[i].mdp) {
-			return false;
+	for (int i = 0; i < fNumInBufs; i++) {
+		if (fRxZeroCopy) {
+			// The ring buffers get swapped with the spares, so they
+			// all are managed the same way:
+			if (!(inbufs[i].rx = allocateRxBuf())) {
+				return false;
+			}
+			inbufs[i].buf.mdp = inbufs[i].rx->mdp;
+		} else {
+			inbufs[i].buf.mdp = IOBufferMemoryDescriptor::withCapacity(IN_BUF_SIZE, kIODirectionIn);
+			if (!inbufs[i].buf.mdp) {
+				return false;
+			}
+		}
+		LOG(V_PTR, "PTR: inbuf[%d].mdp: %p", i, inbufs[i].buf.mdp);
+	}
+
+	if (fRxZeroCopy) {
+		LOG(V_DEBUG, "Allocating %d spare input buffers", fNumRxSpares);
+		for (int i = 0; i < fNumRxSpares; i++) {
+			if (!(fRxSpares[i] = allocateRxBuf())) {
+				return false;
+			}
 		}
-		inbufs[i].mdp->setLength(IN_BUF_SIZE);
-		LOG(V_PTR, "PTR: inbuf[%d].mdp: %p", i, inbufs[i].mdp);
 	}
 
 	// And a handful for data-out...
 	for (int i = 0; i < N_OUT_BUFS; i++) {
+		// Sized by 'rndisInit', so we can fill up the whole transfer:
 		outbufs[i].mdp = IOBufferMemoryDescriptor::withCapacity(
-			OUT_BUF_SIZE, kIODirectionOut);
+			maxOutTransferSize, kIODirectionOut);
 		if (!outbufs[i].mdp) {
 			LOG(V_ERROR, "allocate output descriptor failed");
 			return false;
 		}
 		LOG(V_PTR, "PTR: outbufs[%d].mdp: %p", i, outbufs[i].mdp);
-		outbufs[i].mdp->setLength(OUT_BUF_SIZE);
-		outbufStack[i] = i;
+
+		if (fTxZeroCopy) {
+			fTxSg[i].hdr = IOBufferMemoryDescriptor::withCapacity(
+				sizeof(rndis_data_hdr), kIODirectionOut);
+			if (!fTxSg[i].hdr) {
+				LOG(V_ERROR, "allocate header descriptor failed");
+				return false;
+			}
+			fTxSg[i].hdr->setLength(sizeof(rndis_data_hdr));
+		}
 	}
-	numFreeOutBufs = N_OUT_BUFS;
+	fResourcesAllocated = true;
+	fPoolAllocations++;
+	resetResources();
 	
 	return true;
 }
 
+void HoRNDIS::resetResources() {
+	// Brings the allocated buffers to the state 'enable' expects. They must
+	// not be in use: no callbacks are pending, and nothing is open.
+	for (int i = 0; i < fNumInBufs; i++) {
+		inbufs[i].buf.mdp->setLength(IN_BUF_SIZE);
+		inbufs[i].posted = false;
+		inbufs[i].completed = false;
+	}
+	for (int i = 0; i < N_OUT_BUFS; i++) {
+		outbufs[i].mdp->setLength(maxOutTransferSize);
+		txReleaseScatterGather(i);  // Should have been done on completion.
+	}
+	txResetFreeBufs(N_OUT_BUFS);
+	fTxOpenIndx = -1;  // Whatever was not sent, is lost.
+	fRxQueued = 0;
+}
+
+void HoRNDIS::poolTrimTimeout(OSObject *owner, IOTimerEventSource *sender) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	// Runs within the work loop gate, so 'enable' cannot be half-way done:
+	if (me->fNetifEnabled || me->fEnableDisableInProgress ||
+			!me->fResourcesAllocated) {
+		return;
+	}
+	LOG(V_NOTE, "Interface idle for %d seconds: releasing the buffers",
+		me->fPoolIdleTrimSec);
+	me->releaseResources();
+	me->fPoolTrims++;
+}
+
 void HoRNDIS::releaseResources() {
 	LOG(V_DEBUG, "releaseResources");
 
 	fReadyToTransfer = false;  // No transfers without buffers.
 	for (int i = 0; i < N_OUT_BUFS; i++) {
 		OSSafeReleaseNULL(outbufs[i].mdp);
-		outbufStack[i] = i;
+		txReleaseScatterGather(i);  // Should have been done on completion.
+		OSSafeReleaseNULL(fTxSg[i].hdr);
 	}
-	numFreeOutBufs = 0;
-
-	for (int i = 0; i < N_IN_BUFS; i++) {
-		OSSafeReleaseNULL(inbufs[i].mdp);
+	txResetFreeBufs(0);
+	fTxOpenIndx = -1;  // Whatever was not sent, is lost.
+	fResourcesAllocated = false;
+
+	for (int i = 0; i < MAX_IN_BUFS; i++) {
+		if (inbufs[i].rx) {
+			// Buffers still lent to the network stack are freed on return:
+			freeRxBuf(inbufs[i].rx);
+			inbufs[i].rx = NULL;
+			inbufs[i].buf.mdp = NULL;
+		}
+		OSSafeReleaseNULL(inbufs[i].buf.mdp);
+		inbufs[i].posted = false;
+		inbufs[i].completed = false;
+	}
+	for (int i = 0; i < MAX_RX_SPARE_BUFS; i++) {
+		if (fRxSpares[i]) {
+			freeRxBuf(fRxSpares[i]);
+			fRxSpares[i] = NULL;
+		}
 	}
 }
 
 IOOutputQueue *HoRNDIS::createOutputQueue() {
 	LOG(V_DEBUG, ">");
-	// The gated Output Queue keeps things simple: everything is
+	// Called by 'super::start', before it returns: so the property is read
+	// here, rather than with the other ones.
+	fTxNonGated = getConfigValue(this, kTxNonGatedQueueKey, false) != 0;
+	// It's also the first thing that needs the data work loop:
+	if (!createDataWorkLoop()) {
+		return NULL;
+	}
+	if (fTxNonGated) {
+		// See "NON-GATED TRANSMIT":
+		return IOBasicOutputQueue::withTarget(this, TRANSMIT_QUEUE_SIZE);
+	}
+	// The gated Output Queue keeps things simple: the whole data path is
 	// serialized, no need to worry about locks or concurrency.
-	// The device is not very fast, so the serial execution should be more
-	// than capable of keeping up.
-	// Note, if we ever switch to non-gated queue, we shall update the
-	// 'outputPacket' to access the shared state using locks + update all the
-	// other users of that state + may want to use locks for USB calls as well.
 	return IOGatedOutputQueue::withTarget(this,
-		getWorkLoop(), TRANSMIT_QUEUE_SIZE);
+		fDataWorkLoop, TRANSMIT_QUEUE_SIZE);
 }
 
-bool HoRNDIS::configureInterface(IONetworkInterface *netif) {
-	LOG(V_DEBUG, ">");
-	IONetworkData *nd;
-	
-	if (super::configureInterface(netif) == false) {
-		LOG(V_ERROR, "super failed");
-		return false;
-	}
-	
-	nd = netif->getNetworkData(kIONetworkStatsKey);
-	if (!nd || !(fpNetStats = (IONetworkStats *)nd->getBuffer())) {
-		LOG(V_ERROR, "network statistics buffer unavailable?");
-		return false;
+static void setDictNumber(OSDictionary *dict, const char *key, uint64_t value) {
+	OSNumber *num = OSNumber::withNumber(value, 64);
+	if (num) {
+		dict->setObject(key, num);
+		num->release();
 	}
-	
-	LOG(V_PTR, "fpNetStats: %p", fpNetStats);
-	
+}
+
+/*
+===============================
+||  LATENCY HISTOGRAMS
+===============================
+With 'kLatencyHistogramsKey', the data path takes a timestamp (the absolute
+time, which is cheap to read) as a frame or a transfer enters and leaves each
+stage, see the LAT_* stages in HoRNDIS.h. The time spent there goes into
+a log-scale histogram of the stage, see "LatencyHist.h": bucket i counts
+the samples of 2^(i-1) to 2^i - 1 microseconds.
+
+'publishStats' publishes them under "Latency", with the count, average,
+maximum, and the 50th, 90th and 99th percentiles of each: 'ioreg' shows them
+with the rest of the statistics. The percentiles are the top of the bucket
+they fall into, i.e. within a factor of two. The histograms can be cleared
+through 'setProperties', with 'kResetLatencyKey'.
+
+Every histogram has one writer: the data work loop, or, for the transmit
+stages, the thread that runs 'outputPacket' (the same thing, unless it's the
+non-gated queue). Like the other statistics, they are read without a lock,
+and may be a sample behind.
+*/
+
+static const char *const gLatStageNames[LAT_NUM_STAGES] = {
+	"TxQueue", "TxOutput", "TxHold", "TxSubmit", "TxUsb", "TxDispatch",
+	"RxDispatch", "RxProcess", "RxSubmit"
+};
+
+void HoRNDIS::latSince(int stage, uint64_t since, uint64_t now) {
+	if (!fLatHist) {
+		return;
+	}
+	if (!now) {
+		clock_get_uptime(&now);
+	}
+	uint64_t elapsedNs;
+	absolutetime_to_nanoseconds(now - since, &elapsedNs);
+	latHistAdd(&fLatStages[stage], (uint32_t)min(elapsedNs / 1000, UINT_MAX));
+}
+
+IOReturn HoRNDIS::latResetAction(OSObject *owner, void *arg0, void *arg1,
+	void *arg2, void *arg3) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	for (int i = 0; i < LAT_NUM_STAGES; i++) {
+		latHistReset(&me->fLatStages[i]);
+	}
+	return kIOReturnSuccess;
+}
+
+void HoRNDIS::publishLatency(OSDictionary *dict) {
+	OSDictionary *latDict = OSDictionary::withCapacity(LAT_NUM_STAGES);
+	if (!latDict) {
+		return;
+	}
+	for (int i = 0; i < LAT_NUM_STAGES; i++) {
+		const lat_hist &h = fLatStages[i];
+		OSDictionary *stageDict = OSDictionary::withCapacity(7);
+		if (!stageDict) {
+			continue;
+		}
+		setDictNumber(stageDict, "Count", h.count);
+		setDictNumber(stageDict, "AvgUs", h.count ? h.sumUs / h.count : 0);
+		setDictNumber(stageDict, "MaxUs", h.maxUs);
+		setDictNumber(stageDict, "P50Us", latHistPercentile(&h, 500));
+		setDictNumber(stageDict, "P90Us", latHistPercentile(&h, 900));
+		setDictNumber(stageDict, "P99Us", latHistPercentile(&h, 990));
+		// The buckets, up to the last one that's not empty:
+		int numBuckets = LAT_HIST_BUCKETS;
+		while (numBuckets > 0 && h.buckets[numBuckets - 1] == 0) {
+			numBuckets--;
+		}
+		OSArray *buckets = OSArray::withCapacity(max(numBuckets, 1));
+		if (buckets) {
+			for (int b = 0; b < numBuckets; b++) {
+				OSNumber *num = OSNumber::withNumber(h.buckets[b], 32);
+				if (num) {
+					buckets->setObject(num);
+					num->release();
+				}
+			}
+			stageDict->setObject("Buckets", buckets);
+			buckets->release();
+		}
+		latDict->setObject(gLatStageNames[i], stageDict);
+		stageDict->release();
+	}
+	dict->setObject("Latency", latDict);
+	latDict->release();
+}
+
+/*
+===============================
+||  EVENT TRACE
+===============================
+The 'LOG' macro is for the rare events: with V_PACKET, every frame goes
+through 'IOLog' and its formatting, and the throughput is gone. It's also
+chosen at compile time. The event trace is for the hot path: with
+'kTraceKey', 'outputPacket', 'dataWriteComplete', 'dataReadComplete' and
+'receivePacket' add a fixed-size binary record (the event, the absolute
+time, and a few numbers) to 'fTrace', a ring of the last TRACE_RING_RECS
+events, see "TraceRing.h". Adding one takes an atomic increment and a few
+stores: no lock, no formatting, so the non-gated transmit adds its own
+records along with the data work loop.
+
+The ring is allocated the first time the trace is switched on, in the data
+gate, and kept until 'free': the writers never see it go away. Whenever the
+properties are read while the trace is on, 'publishTrace' dumps it under
+'kHoRNDISTraceKey'. To read it:
+  ioreg -a -r -c HoRNDIS > trace.plist
+  TraceDecode trace.plist
+"test/TraceDecode.cpp" builds on Linux as well. Switching the trace off
+freezes the ring, and dumps it one last time: that dump stays, and the
+reads of the properties no longer copy the ring.
+*/
+
+IOReturn HoRNDIS::traceSwitchAction(OSObject *owner, void *arg0, void *arg1,
+	void *arg2, void *arg3) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	const bool on = arg0 != NULL;
+	if (on && !me->fTraceRecs) {
+		trace_rec *recs = (trace_rec *)IOMalloc(
+			TRACE_RING_RECS * sizeof(trace_rec));
+		if (!recs) {
+			LOG(V_ERROR, "Cannot allocate the event trace");
+			return kIOReturnNoMemory;
+		}
+		traceInit(&me->fTrace, recs, TRACE_RING_RECS);
+		// 'publishTrace' reads it outside the data gate:
+		OSMemoryBarrier();
+		me->fTraceRecs = recs;
+	}
+	me->fTraceOn = on;
+	return kIOReturnSuccess;
+}
+
+void HoRNDIS::publishTrace() {
+	trace_rec *const recs = fTraceRecs;
+	if (!recs) {
+		return;  // Never switched on.
+	}
+	OSMemoryBarrier();  // The ring was initialized before 'fTraceRecs' was set.
+	const uint32_t size = traceDumpSize(&fTrace);
+	void *buf = IOMalloc(size);
+	if (!buf) {
+		return;
+	}
+	uint64_t ticksPerSec;
+	nanoseconds_to_absolutetime(NSEC_PER_SEC, &ticksPerSec);
+	OSData *data = OSData::withBytes(buf, traceDump(&fTrace, buf, ticksPerSec));
+	IOFree(buf, size);
+	if (data) {
+		setProperty(kHoRNDISTraceKey, data);
+		data->release();
+	}
+}
+
+/*
+===============================
+||  THROUGHPUT SAMPLER
+===============================
+With 'kThroughputSamplerKey', 'utilTimeout' runs every UTIL_SAMPLE_MS on the
+data work loop. It takes a sample of the byte and frame counters of the
+statistics, and of the pipes' utilization, into 'fUtilHistory', and
+publishes the rates over the last 1, 10 and 60 seconds under
+'kHoRNDISThroughputKey', see "UtilSampler.h". The monitoring that polls
+'ioreg' gets them as they are: no need to diff the 'IONetworkStats'.
+
+The OUT pipe's utilization is the average number of transfers in flight,
+from 'txPostWrite' to 'dataWriteComplete': by Little's law, the sum of
+their times in flight over the window. A transfer is only added as it
+completes, so a window misses the time of the ones still in flight at its
+end, a few milliseconds at most. The IN pipe's is the fraction of the time
+it had no read in it: stalled, stopping, or all the reads completed and
+waiting to be processed. Then the device cannot send us anything.
+
+The hot path only reads the clock as a transfer completes, and as the IN
+pipe goes idle and back.
+*/
+
+void HoRNDIS::utilReadPosted(inbuf_t *inbuf) {
+	inbuf->inPipe = true;
+	if (fInReadsInPipe++ == 0 && fUtilSampler) {
+		uint64_t now;
+		clock_get_uptime(&now);
+		fInIdleTime += now - fInIdleSince;
+	}
+}
+
+void HoRNDIS::utilReadDone(inbuf_t *inbuf) {
+	// Not for the deferred reads, that never made it to the pipe:
+	if (!inbuf->inPipe) {
+		return;
+	}
+	inbuf->inPipe = false;
+	if (--fInReadsInPipe == 0 && fUtilSampler) {
+		clock_get_uptime(&fInIdleSince);
+	}
+}
+
+static uint64_t absToUs(uint64_t abstime) {
+	uint64_t ns;
+	absolutetime_to_nanoseconds(abstime, &ns);
+	return ns / 1000;
+}
+
+void HoRNDIS::utilTimeout(OSObject *owner, IOTimerEventSource *sender) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	uint64_t now;
+	clock_get_uptime(&now);
+	util_sample s;
+	s.stampUs = absToUs(now);
+	s.txBytes = me->fTxBytes;
+	s.txFrames = me->fTxFrames;
+	s.rxBytes = me->fRxBytes;
+	s.rxFrames = me->fRxFrames;
+	s.outBusyUs = absToUs(me->fTxBusyTime);
+	s.inIdleUs = absToUs(me->fInIdleTime + (me->fInReadsInPipe == 0 ?
+		now - me->fInIdleSince : 0));
+	utilAdd(&me->fUtilHistory, &s);
+	me->publishThroughput();
+	sender->setTimeoutMS(UTIL_SAMPLE_MS);
+}
+
+void HoRNDIS::publishThroughput() {
+	static const struct {
+		const char *name;
+		uint32_t intervals;
+	} windows[] = {
+		{ "1s", 1000 / UTIL_SAMPLE_MS },
+		{ "10s", 10000 / UTIL_SAMPLE_MS },
+		{ "60s", 60000 / UTIL_SAMPLE_MS },
+	};
+	OSDictionary *dict = OSDictionary::withCapacity(3);
+	if (!dict) {
+		return;
+	}
+	for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+		util_rates r;
+		if (!utilRates(&fUtilHistory, windows[i].intervals, &r)) {
+			continue;  // Not before the second sample.
+		}
+		OSDictionary *winDict = OSDictionary::withCapacity(7);
+		if (!winDict) {
+			continue;
+		}
+		setDictNumber(winDict, "SpanMs", r.spanUs / 1000);
+		setDictNumber(winDict, "TxBitsPerSec", r.txBitsPerSec);
+		setDictNumber(winDict, "RxBitsPerSec", r.rxBitsPerSec);
+		setDictNumber(winDict, "TxPacketsPerSec", r.txFramesPerSec);
+		setDictNumber(winDict, "RxPacketsPerSec", r.rxFramesPerSec);
+		setDictNumber(winDict, "OutBufsInFlightMilli", r.outBufsInFlightMilli);
+		setDictNumber(winDict, "InPipeIdlePermille", r.inIdlePermille);
+		dict->setObject(windows[i].name, winDict);
+		winDict->release();
+	}
+	setProperty(kHoRNDISThroughputKey, dict);
+	dict->release();
+}
+
+void HoRNDIS::publishStats() {
+	OSDictionary *dict = OSDictionary::withCapacity(4);
+	if (!dict) {
+		return;
+	}
+	setDictNumber(dict, "TxTransfers", fTxTransfers);
+	setDictNumber(dict, "TxFrames", fTxFrames);
+	setDictNumber(dict, "TxMaxFramesPerTransfer", fTxMaxFramesPerTransfer);
+	setDictNumber(dict, "TxBytes", fTxBytes);
+	setDictNumber(dict, "TxTransferBytes", fTxTransferBytes);
+	setDictNumber(dict, "TxOutOfBuffers", fTxOutOfBuffers);
+	setDictNumber(dict, "TxCopyFrames", fTxFrames - fTxZeroCopyFrames);
+	setDictNumber(dict, "TxZeroCopyFrames", fTxZeroCopyFrames);
+	setDictNumber(dict, "TxZeroCopyFallbacks", fTxZeroCopyFallbacks);
+	setDictNumber(dict, "TxCoalesceFlushes", fTxCoalesceFlushes);
+	setDictNumber(dict, "TxTsoPackets", fTxTsoPackets);
+	setDictNumber(dict, "TxTsoSegments", fTxTsoSegments);
+	setDictNumber(dict, "TxTsoErrors", fTxTsoErrors);
+	setDictNumber(dict, "TxCodelDrops", fTxCodelDrops);
+	setDictNumber(dict, "TxCodelMarks", fTxCodelMarks);
+	setDictNumber(dict, "TxFqNewFlows", fTxFqNewFlows);
+	setDictNumber(dict, "TxBqlLimit", fTxDql.limit);
+	setDictNumber(dict, "TxBqlMaxInflight", fTxBqlMaxInflight);
+	setDictNumber(dict, "TxBqlStalls", fTxBqlStalls);
+	setDictNumber(dict, "TxQueueStalls", fTxQueueStalls);
+	setDictNumber(dict, "TxQueueResumes", fTxQueueResumes);
+	setDictNumber(dict, "TxQueueStalledUs", fTxQueueStalledUs);
+	setDictNumber(dict, "ControlCommands", fCtrlCommands);
+	setDictNumber(dict, "ControlNotifications", fCtrlNotifications);
+	setDictNumber(dict, "ControlLastLatencyUs", fCtrlLastLatencyUs);
+	setDictNumber(dict, "ControlMaxLatencyUs", fCtrlMaxLatencyUs);
+	setDictNumber(dict, "IndicateMediaConnect", fIndicateConnect);
+	setDictNumber(dict, "IndicateMediaDisconnect", fIndicateDisconnect);
+	setDictNumber(dict, "IndicateOther", fIndicateOther);
+	setDictNumber(dict, "Keepalives", fKeepalives);
+	setDictNumber(dict, "PoolAllocations", fPoolAllocations);
+	setDictNumber(dict, "PoolReuses", fPoolReuses);
+	setDictNumber(dict, "PoolTrims", fPoolTrims);
+	setDictNumber(dict, "RxTransfers", fRxTransfers);
+	setDictNumber(dict, "RxFrames", fRxFrames);
+	setDictNumber(dict, "RxMaxFramesPerTransfer", fRxMaxFramesPerTransfer);
+	setDictNumber(dict, "RxBytes", fRxBytes);
+	setDictNumber(dict, "RxTransferBytes", fRxTransferBytes);
+	setDictNumber(dict, "RxBatchFlushes", fRxBatchFlushes);
+	setDictNumber(dict, "RxBatchMaxFrames", fRxBatchMaxFrames);
+	setDictNumber(dict, "RxZeroCopyTransfers", fRxZeroCopyTransfers);
+	setDictNumber(dict, "RxZeroCopyFrames", fRxZeroCopyFrames);
+	setDictNumber(dict, "RxPoolExhausted", fRxPoolExhausted);
+	for (int i = 0; i < TX_NUM_CLASSES; i++) {
+		const txclass_t &cls = fTxClasses[i];
+		OSDictionary *classDict = OSDictionary::withCapacity(6);
+		if (!classDict) {
+			continue;
+		}
+		setDictNumber(classDict, "Frames", cls.frames);
+		setDictNumber(classDict, "Bytes", cls.bytes);
+		setDictNumber(classDict, "Drops", cls.drops);
+		setDictNumber(classDict, "Queued", cls.count);
+		setDictNumber(classDict, "QueueDelayAvgUs",
+			cls.frames ? cls.delaySumUs / cls.frames : 0);
+		setDictNumber(classDict, "QueueDelayMaxUs", cls.delayMaxUs);
+		dict->setObject(cls.name, classDict);
+		classDict->release();
+	}
+	OSDictionary *rxErrDict = OSDictionary::withCapacity(7);
+	if (rxErrDict) {
+		// By cause: see 'rndisParseData', then the mbufs in 'receivePacket'.
+		setDictNumber(rxErrDict, "Short", fRxParseErrors[RNDIS_PARSE_SHORT]);
+		setDictNumber(rxErrDict, "NotPacket",
+			fRxParseErrors[RNDIS_PARSE_NOT_PACKET]);
+		setDictNumber(rxErrDict, "BadMsgLen",
+			fRxParseErrors[RNDIS_PARSE_BAD_MSG_LEN]);
+		setDictNumber(rxErrDict, "BadData", fRxParseErrors[RNDIS_PARSE_BAD_DATA]);
+		setDictNumber(rxErrDict, "AllocFailed", fRxAllocFailures);
+		setDictNumber(rxErrDict, "WrapFailed", fRxWrapFailures);
+		setDictNumber(rxErrDict, "CopyFailed", fRxCopyFailures);
+		dict->setObject("RxErrors", rxErrDict);
+		rxErrDict->release();
+	}
+	const stallrec_t *const stallRecs[] = { &fInStall, &fOutStall };
+	const usberrs_t *const pipeErrs[] = { &fInErrors, &fOutErrors };
+	for (int i = 0; i < 2; i++) {
+		const stallrec_t *rec = stallRecs[i];
+		const usberrs_t *errs = pipeErrs[i];
+		OSDictionary *pipeDict = OSDictionary::withCapacity(6);
+		if (!pipeDict) {
+			continue;
+		}
+		setDictNumber(pipeDict, "Stalls", rec->stalls);
+		setDictNumber(pipeDict, "ClearAttempts", rec->clearAttempts);
+		setDictNumber(pipeDict, "Recoveries", rec->recoveries);
+		setDictNumber(pipeDict, "RecoveryFailures", rec->failures);
+		setDictNumber(pipeDict, "LastRecoveryUs", rec->lastRecoveryUs);
+		setDictNumber(pipeDict, "MaxRecoveryUs", rec->maxRecoveryUs);
+		OSDictionary *errDict = OSDictionary::withCapacity(USB_ERROR_CODES + 1);
+		if (errDict) {
+			// Keyed by the IOReturn, in hex as in "IOReturn.h":
+			for (int j = 0; j < USB_ERROR_CODES && errs->counts[j]; j++) {
+				char key[16];
+				snprintf(key, sizeof(key), "0x%08x", errs->codes[j]);
+				setDictNumber(errDict, key, errs->counts[j]);
+			}
+			setDictNumber(errDict, "Other", errs->other);
+			pipeDict->setObject("IOErrors", errDict);
+			errDict->release();
+		}
+		dict->setObject(rec->name, pipeDict);
+		pipeDict->release();
+	}
+	if (fLatHist) {
+		publishLatency(dict);
+	}
+	setProperty(kHoRNDISStatsKey, dict);
+	dict->release();
+}
+
+bool HoRNDIS::serializeProperties(OSSerialize *s) const {
+	// The hot path only bumps plain counters: the statistics dictionary is
+	// refreshed just before someone (e.g. 'ioreg') reads the properties.
+	const_cast<HoRNDIS *>(this)->publishStats();
+	if (fTraceOn) {
+		const_cast<HoRNDIS *>(this)->publishTrace();
+	}
+	return super::serializeProperties(s);
+}
+
+IOReturn HoRNDIS::setProperties(OSObject *properties) {
+	// Only the run-time tunables can be set, see 'kTxCoalesceUsecKey' and
+	// 'kTraceKey', and the latency histograms cleared, see 'kResetLatencyKey':
+	OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+	uint32_t usec, reset = 0, traceOn;
+	const bool setCoalesce = dict &&
+		configNumber(dict->getObject(kTxCoalesceUsecKey), &usec);
+	const bool resetLatency = dict &&
+		configNumber(dict->getObject(kResetLatencyKey), &reset) && reset;
+	const bool setTrace = dict &&
+		configNumber(dict->getObject(kTraceKey), &traceOn);
+	if (!setCoalesce && !resetLatency && !setTrace) {
+		return kIOReturnUnsupported;
+	}
+	if (IOUserClient::clientHasPrivilege(current_task(),
+			kIOClientPrivilegeAdministrator) != kIOReturnSuccess) {
+		return kIOReturnNotPrivileged;
+	}
+	if (setCoalesce) {
+		// Read by the data path as it goes: no need to synchronize.
+		fTxCoalesceUs = min(usec, MAX_TX_COALESCE_USEC);
+		setProperty(kTxCoalesceUsecKey, fTxCoalesceUs, 32);
+		LOG(V_NOTE, "Transmit coalescing set to %d us", fTxCoalesceUs);
+	}
+	if (resetLatency) {
+		// Not while the data work loop is adding to them. Nothing holds
+		// the gates here, see "DATA WORK LOOP" for the lock order.
+		fDataGate->runAction(latResetAction);
+		LOG(V_NOTE, "Latency histograms cleared");
+	}
+	if (setTrace) {
+		// The ring is allocated in the data gate, for the same reason:
+		IOReturn rc = fDataGate->runAction(traceSwitchAction,
+			(void *)(uintptr_t)(traceOn != 0));
+		if (rc != kIOReturnSuccess) {
+			return rc;
+		}
+		setProperty(kTraceKey, fTraceOn ? kOSBooleanTrue : kOSBooleanFalse);
+		LOG(V_NOTE, "Event trace switched %s", fTraceOn ? "on" : "off");
+		if (!fTraceOn) {
+			publishTrace();  // The last one, see "EVENT TRACE".
+		}
+	}
+	return kIOReturnSuccess;
+}
+
+bool HoRNDIS::configureInterface(IONetworkInterface *netif) {
+	LOG(V_DEBUG, ">");
+	IONetworkData *nd;
+	
+	if (super::configureInterface(netif) == false) {
+		LOG(V_ERROR, "super failed");
+		return false;
+	}
+	
+	nd = netif->getNetworkData(kIONetworkStatsKey);
+	if (!nd || !(fpNetStats = (IONetworkStats *)nd->getBuffer())) {
+		LOG(V_ERROR, "network statistics buffer unavailable?");
+		return false;
+	}
+	
+	LOG(V_PTR, "fpNetStats: %p", fpNetStats);
+	
 	return true;
 }
 
@@ -995,16 +2366,29 @@ IOReturn HoRNDIS::getPacketFilters(const OSSymbol *group, UInt32 *filters) const
 }
 
 IOReturn HoRNDIS::getMaxPacketSize(UInt32 *maxSize) const {
-	IOReturn rc = super::getMaxPacketSize(maxSize);
-	if (rc != kIOReturnSuccess) {
-		return rc;
-	}
-	// The max packet size is limited by RNDIS max transfer size:
-	*maxSize = min(*maxSize, maxOutTransferSize - sizeof(rndis_data_hdr));
+	// As IOKit counts it, with the header and the CRC. Above the standard
+	// frame, it lets the interface take an MTU up to 'fMaxMtu':
+	*maxSize = fMaxMtu + ETHERNET_HDR_SIZE + ETHERNET_CRC_SIZE;
 	LOG(V_DEBUG, "returning %d", *maxSize);
 	return kIOReturnSuccess;
 }
 
+IOReturn HoRNDIS::setMaxPacketSize(UInt32 maxSize) {
+	// The interface calls this for an MTU above ETHERNET_MTU. The buffers
+	// already take the largest frame: nothing to change.
+	if (maxSize > fMaxMtu + ETHERNET_HDR_SIZE + ETHERNET_CRC_SIZE) {
+		return kIOReturnBadArgument;
+	}
+	LOG(V_NOTE, "MTU set to %d", maxSize - ETHERNET_HDR_SIZE - ETHERNET_CRC_SIZE);
+	return kIOReturnSuccess;
+}
+
+UInt32 HoRNDIS::getFeatures() const {
+	// The interface asks once, as it's created: 'fTxTso' is set by then.
+	return super::getFeatures() | (fTxTso ?
+		kIONetworkFeatureTSOIPv4 | kIONetworkFeatureTSOIPv6 : 0);
+}
+
 IOReturn HoRNDIS::selectMedium(const IONetworkMedium *medium) {
 	LOG(V_DEBUG, ">");
 	setSelectedMedium(medium);
@@ -1061,27 +2445,944 @@ IOReturn HoRNDIS::setMulticastList(IOEthernetAddress *addrs,
 	return kIOReturnSuccess;
 }
 
-IOReturn HoRNDIS::setPromiscuousMode(bool active) {
-	// Similar to 'setMulticastMode'.
-	// XXX This actually needs to get passed down to support 'real'
-	//  RNDIS devices, but it will work okay for Android devices.
-	return kIOReturnSuccess;
+IOReturn HoRNDIS::setPromiscuousMode(bool active) {
+	// Similar to 'setMulticastMode'.
+	// XXX This actually needs to get passed down to support 'real'
+	//  RNDIS devices, but it will work okay for Android devices.
+	return kIOReturnSuccess;
+}
+
+/***** Packet transmit logic *****/
+
+static inline bool isTransferStopStatus(IOReturn rc) {
+	// IOReturn indicating that we need to stop transfers:
+	return rc == kIOReturnAborted || rc == kIOReturnNotResponding;
+}
+
+/*
+===============================
+||  TRANSMIT AGGREGATION
+===============================
+RNDIS allows the host to pack several REMOTE_NDIS_PACKET_MSG messages into a
+single USB transfer, up to the "max_packets_per_transfer" and
+"max_transfer_size" the device reports in its REMOTE_NDIS_INITIALIZE_CMPLT.
+Every message after the first shall start at a "packet_alignment" boundary;
+the padding is accounted for in the 'msg_len' of the preceding message.
+
+We keep one "open" output buffer: 'outputPacket' appends frames to it, and
+it gets submitted when either:
+ - it is full (by size or message count);
+ - there are no more packets waiting in the output queue;
+ - no other transfers are in flight, i.e. the USB pipe is idle.
+Since the open buffer is only held while other transfers are in flight,
+'dataWriteComplete' also submits it, so frames never linger. The idle-pipe
+and empty-queue rules ensure we don't add latency when the link is quiet.
+*/
+
+/*
+===============================
+||  TRANSMIT COALESCING
+===============================
+The rules above send the open buffer as soon as the pipe is idle, or the
+queue is empty: that's every frame in a transfer of its own, when a chatty
+flow sends small packets a few at a time. With 'kTxCoalesceUsecKey', the
+open buffer is only sent once it's full, or when 'fTxCoalesceTimer' fires:
+it's armed for 'fTxCoalesceUs' when the first frame goes into the buffer,
+so that's as long as any frame waits. The large frames that go out on their
+own (see "SCATTER-GATHER TRANSMIT") are not held.
+
+The interactive flows can turn it off by setting the property to 0: the
+timer still sends the buffer that's being held.
+With the non-gated queue, the timer would race the transmit for the open
+buffer: there, coalescing is off.
+*/
+
+void HoRNDIS::txCoalesceTimeout(OSObject *owner, IOTimerEventSource *sender) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	me->fTxCoalesceArmed = false;
+	if (!me->fReadyToTransfer || me->fTxOpenIndx < 0) {
+		return;
+	}
+	me->fTxCoalesceFlushes++;
+	me->txSubmitOpenBuffer();
+}
+
+bool HoRNDIS::txOpenBufferHasRoom(uint32_t msgLen) const {
+	return fTxOpenFrames < maxOutPktsPerTransfer &&
+		txAlign(fTxOpenLen) + msgLen <= (uint32_t)maxOutTransferSize;
+}
+
+void HoRNDIS::txOpenBuffer(int poolIndx) {
+	fTxOpenIndx = poolIndx;
+	fTxOpenLen = 0;
+	fTxOpenFrames = 0;
+	fTxOpenBytes = 0;
+	fTxOpenStamp = latStamp();
+}
+
+void HoRNDIS::txAppendPacket(mbuf_t packet, uint32_t pktlen) {
+	uint8_t *const base = (uint8_t *)outbufs[fTxOpenIndx].mdp->getBytesNoCopy();
+	// Pads the previous message, so this one starts properly aligned:
+	const uint32_t offset = rndisAppendDataHdr(base, fTxOpenLen, fTxLastMsgOfs,
+		outPktAlignMask, pktlen);
+	mbuf_copydata(packet, 0, pktlen, base + offset + sizeof(rndis_data_hdr));
+
+	fTxLastMsgOfs = offset;
+	fTxOpenLen = offset + (uint32_t)(pktlen + sizeof(rndis_data_hdr));
+	fTxOpenFrames++;
+	fTxOpenBytes += pktlen;
+}
+
+IOReturn HoRNDIS::txSubmitOpenBuffer() {
+	const int poolIndx = fTxOpenIndx;
+	const uint32_t transmitLength = fTxOpenLen;
+	const uint32_t frames = fTxOpenFrames;
+	const uint32_t bytes = fTxOpenBytes;
+	latSince(LAT_TX_HOLD, fTxOpenStamp);
+	if (fTxCoalesceArmed) {
+		fTxCoalesceTimer->cancelTimeout();
+		fTxCoalesceArmed = false;
+	}
+	fTxOpenIndx = -1;
+	fTxOpenLen = 0;
+	fTxOpenFrames = 0;
+
+	pipebuf_t &outbuf = outbufs[poolIndx];
+	outbuf.mdp->setLength(transmitLength);
+
+	// Now, fire it off!
+	IOUSBHostCompletion *const comp = &outbuf.comp;
+	comp->owner     = this;
+	comp->parameter = (void *)(uintptr_t)poolIndx;
+	comp->action    = dataWriteDone;
+
+	IOReturn ior = txPostWrite(poolIndx, outbuf.mdp, transmitLength);
+	if (ior != kIOReturnSuccess) {
+		if (isTransferStopStatus(ior)) {
+			LOG(V_DEBUG, "WRITER: The device was possibly disconnected: ignoring the error");
+		} else {
+			LOG(V_ERROR, "write failed: %08x", ior);
+			fpNetStats->outputErrors += frames;
+		}
+		// The buffer never left: put it back where we took it from.
+		txUntakeFreeBuf(poolIndx);
+		return ior;
+	}
+	// Only here - when 'fOutPipe->io' has fired - we mark the buffer in-use:
+	OSIncrementAtomic(&fCallbackCount);
+	txBqlQueued(poolIndx, transmitLength);
+	fpNetStats->outputPackets += frames;
+	fTxTransfers++;
+	fTxFrames += frames;
+	fTxMaxFramesPerTransfer = max(fTxMaxFramesPerTransfer, frames);
+	fTxBytes += bytes;
+	fTxTransferBytes += transmitLength;
+	LOG(V_PACKET, "Sent %d frames, %d bytes", frames, transmitLength);
+	return kIOReturnSuccess;
+}
+
+/*
+===============================
+||  SCATTER-GATHER TRANSMIT
+===============================
+With 'kTxZeroCopyKey' enabled, a large frame that is going to be sent in a
+USB transfer of its own is not copied into the output buffer. Instead, we
+build an IOMultiMemoryDescriptor out of the slot's small header buffer and
+the mbuf segments, and hold on to the mbuf until 'dataWriteComplete'. The
+descriptor is prepared (the mbuf pages wired for the transfer) before it's
+posted, and completed when the mbuf is let go.
+Aggregated transfers, small frames and very fragmented chains still take
+the copy path: for these, the copy is cheaper than the descriptors.
+*/
+
+void HoRNDIS::txReleaseScatterGather(int poolIndx) {
+	txsg_t &sg = fTxSg[poolIndx];
+	if (sg.desc) {
+		sg.desc->complete(kIODirectionOut);
+	}
+	OSSafeReleaseNULL(sg.desc);
+	if (sg.packet) {
+		freePacket(sg.packet);
+		sg.packet = NULL;
+	}
+}
+
+bool HoRNDIS::txSubmitScatterGather(mbuf_t packet, uint32_t pktlen,
+	IOReturn *ior) {
+	// Returns false if the packet shall be copied instead. Otherwise, the
+	// packet is consumed, and '*ior' is the result of submitting it.
+	IOMemoryDescriptor *descs[MAX_TX_SG_SEGS + 1];
+	UInt32 numDescs = 0;
+	bool success = true;
+	int poolIndx;
+	if (!txTakeFreeBuf(&poolIndx)) {
+		return false;  // The caller has checked: we must never be here.
+	}
+	txsg_t &sg = fTxSg[poolIndx];
+
+	rndisWriteDataHdr(sg.hdr->getBytesNoCopy(), pktlen);
+	descs[numDescs++] = sg.hdr;
+
+	for (mbuf_t m = packet; m && success; m = mbuf_next(m)) {
+		if (mbuf_len(m) == 0) {
+			continue;
+		}
+		IOMemoryDescriptor *seg = IOMemoryDescriptor::withAddressRange(
+			(mach_vm_address_t)mbuf_data(m), mbuf_len(m), kIODirectionOut,
+			kernel_task);
+		success = seg != NULL;
+		if (success) {
+			descs[numDescs++] = seg;
+		}
+	}
+	if (success) {
+		// The multi-descriptor retains the ranges it's made of:
+		sg.desc = IOMultiMemoryDescriptor::withDescriptors(descs, numDescs,
+			kIODirectionOut, false);
+		success = sg.desc != NULL;
+	}
+	if (success && sg.desc->prepare(kIODirectionOut) != kIOReturnSuccess) {
+		// Unlike the output buffers, the mbuf pages are not wired for the
+		// transfer until we do:
+		OSSafeReleaseNULL(sg.desc);
+		success = false;
+	}
+	for (UInt32 i = 1; i < numDescs; i++) {
+		descs[i]->release();
+	}
+	if (!success) {
+		LOG(V_ERROR, "Cannot prepare scatter-gather descriptors: copying");
+		txUntakeFreeBuf(poolIndx);
+		return false;
+	}
+
+	const uint32_t transmitLength = (uint32_t)(pktlen + sizeof(rndis_data_hdr));
+	IOUSBHostCompletion *const comp = &outbufs[poolIndx].comp;
+	comp->owner     = this;
+	comp->parameter = (void *)(uintptr_t)poolIndx;
+	comp->action    = dataWriteDone;
+	sg.packet = packet;
+
+	*ior = txPostWrite(poolIndx, sg.desc, transmitLength);
+	if (*ior != kIOReturnSuccess) {
+		if (isTransferStopStatus(*ior)) {
+			LOG(V_DEBUG, "WRITER: The device was possibly disconnected: ignoring the error");
+		} else {
+			LOG(V_ERROR, "write failed: %08x", *ior);
+			fpNetStats->outputErrors++;
+		}
+		txReleaseScatterGather(poolIndx);  // Completes, and frees the packet.
+		txUntakeFreeBuf(poolIndx);
+		return true;
+	}
+	OSIncrementAtomic(&fCallbackCount);
+	txBqlQueued(poolIndx, transmitLength);
+	fpNetStats->outputPackets++;
+	fTxTransfers++;
+	fTxFrames++;
+	fTxZeroCopyFrames++;
+	fTxMaxFramesPerTransfer = max(fTxMaxFramesPerTransfer, 1);
+	fTxBytes += pktlen;
+	fTxTransferBytes += transmitLength;
+	LOG(V_PACKET, "Sent %d bytes (scatter-gather)", transmitLength);
+	return true;
+}
+
+/*
+===============================
+||  TCP SEGMENTATION OFFLOAD
+===============================
+With 'kTxTsoKey', 'getFeatures' offers TSO for IPv4 and IPv6: TCP hands us
+"super-packets" of up to 64K, with the MSS to cut them at. We cut them right
+into the open buffer: each segment gets the super-packet's headers, fixed
+up by "TxSegment.h" (lengths, IPv4 ID and checksum, sequence number, flags),
+its slice of the payload, and a TCP checksum computed over the lot. The
+segments pack into aggregated transfers like any other frames.
+
+Four output buffers don't always hold a super-packet: the one being cut is
+kept in 'fTxTsoPacket', and continued by the completions as the buffers come
+back, or by the next 'txSendPacket', which waits for it. Its segments take
+whatever buffers are free, regardless of the watermarks and the byte queue
+limit: they were accepted already. That's why the non-gated transmit, which
+runs concurrently with the completions, does not offer TSO.
+*/
+
+bool HoRNDIS::txTsoStart(mbuf_t packet, uint32_t pktlen, uint32_t mss) {
+	// Takes the super-packet, or drops it and returns false.
+	const uint32_t caplen = min(pktlen, (uint32_t)TX_TSO_MAX_HDR_LEN);
+	mbuf_copydata(packet, 0, caplen, fTxTsoHdr);
+	tx_tso &t = fTxTsoInfo;
+	const bool parsed = txTsoParse(fTxTsoHdr, caplen, pktlen, mss, &t);
+	// Every segment shall be a frame we can send:
+	const uint32_t maxPayload = min(mss, t.payloadLen);
+	if (!parsed || t.hdrLen - t.l3ofs + maxPayload > fMaxMtu ||
+			t.hdrLen + maxPayload + sizeof(rndis_data_hdr) >
+				(uint32_t)maxOutTransferSize) {
+		LOG(V_ERROR, "Cannot segment a %d-byte packet at MSS %d: dropping",
+			pktlen, mss);
+		fTxTsoErrors++;
+		fpNetStats->outputErrors++;
+		freePacket(packet);
+		return false;
+	}
+	LOG(V_PACKET, "Segmenting %d bytes at MSS %d", pktlen, mss);
+	fTxTsoPacket = packet;
+	fTxTsoNext = 0;
+	fTxTsoPackets++;
+	return true;
+}
+
+bool HoRNDIS::txTsoContinue(IOReturn *ior) {
+	// Cuts the segments left into the open buffer, sending it when it's
+	// full. Returns false if it runs out of buffers first. Otherwise, the
+	// super-packet is done with, and '*ior' is the result of sending it:
+	// if a transfer fails, the segments left are dropped.
+	const tx_tso &t = fTxTsoInfo;
+	const uint32_t numSegs = txTsoSegments(&t);
+	*ior = kIOReturnSuccess;
+	while (fTxTsoNext < numSegs) {
+		const uint32_t msgLen = (uint32_t)(t.hdrLen +
+			txTsoSegmentLen(&t, fTxTsoNext) + sizeof(rndis_data_hdr));
+		if (fTxOpenIndx >= 0 && !txOpenBufferHasRoom(msgLen) &&
+				(*ior = txSubmitOpenBuffer()) != kIOReturnSuccess) {
+			break;  // The rest would not go either.
+		}
+		if (fTxOpenIndx < 0) {
+			int poolIndx;
+			if (!txTakeFreeBuf(&poolIndx)) {
+				LOG(V_PACKET, "Ran out of buffers, %d segments left",
+					numSegs - fTxTsoNext);
+				fTxOutOfBuffers++;
+				return false;
+			}
+			txOpenBuffer(poolIndx);
+		}
+		txTsoAppendSegment(fTxTsoNext++);
+		if (!fTxAggregation &&
+				(*ior = txSubmitOpenBuffer()) != kIOReturnSuccess) {
+			break;
+		}
+	}
+	if (*ior != kIOReturnSuccess) {
+		// 'txSubmitOpenBuffer' counted the segments that were in the buffer:
+		const uint32_t dropped = numSegs - fTxTsoNext;
+		LOG(V_ERROR, "Cannot send the super-packet: dropping %d segments",
+			dropped);
+		fTxTsoErrors += dropped;
+		fpNetStats->outputErrors += dropped;
+	}
+	freePacket(fTxTsoPacket);
+	fTxTsoPacket = NULL;
+	return true;
+}
+
+void HoRNDIS::txTsoAppendSegment(uint32_t seg) {
+	const tx_tso &t = fTxTsoInfo;
+	const uint32_t payloadLen = txTsoSegmentLen(&t, seg);
+	const uint32_t frameLen = t.hdrLen + payloadLen;
+	uint8_t *const base = (uint8_t *)outbufs[fTxOpenIndx].mdp->getBytesNoCopy();
+	// As in 'txAppendPacket':
+	const uint32_t offset = rndisAppendDataHdr(base, fTxOpenLen, fTxLastMsgOfs,
+		outPktAlignMask, frameLen);
+	uint8_t *const frame = base + offset + sizeof(rndis_data_hdr);
+	txTsoWriteHeaders(&t, fTxTsoHdr, seg, frame);
+	mbuf_copydata(fTxTsoPacket, t.hdrLen + seg * t.mss, payloadLen,
+		frame + t.hdrLen);
+	txTsoChecksum(&t, frame, payloadLen);
+
+	fTxLastMsgOfs = offset;
+	fTxOpenLen = offset + (uint32_t)(frameLen + sizeof(rndis_data_hdr));
+	fTxOpenFrames++;
+	fTxOpenBytes += frameLen;
+	fTxTsoSegments++;
+}
+
+void HoRNDIS::txTsoFlush() {
+	// Drops the super-packet being cut, with the rest of the transmit state:
+	if (fTxTsoPacket) {
+		freePacket(fTxTsoPacket);
+		fTxTsoPacket = NULL;
+	}
+}
+
+/*
+===============================
+||  NON-GATED TRANSMIT
+===============================
+With 'kTxNonGatedQueueKey', 'createOutputQueue' makes an IOBasicOutputQueue
+instead of the IOGatedOutputQueue: 'outputPacket' runs on the thread that
+enqueues the packet (or on the queue's thread call), without taking the
+data gate. With the gated queue, it waits for every completion and stall
+recovery step, see "DATA WORK LOOP".
+
+The queue still serializes the 'outputPacket' calls, and 'disable' stops it
+before touching the transmit state. What 'outputPacket' shares with the
+completions:
+ * The free output buffers: a single-producer, single-consumer ring of the
+   'outbufs' indices. 'dataWriteComplete' puts them back at the tail, the
+   transmit takes them at the head. Each side only moves its own index, with
+   a barrier between the slot and the index.
+ * 'fCallbackCount': updated atomically. The transmit only increments it;
+   'callbackExit', and the 'disable' that waits for it, stay in the data gate.
+ * The OUT pipe stall recovery: 'fOutStall.recovering' and 'fTxDeferred' are
+   guarded by 'fOutStall.lock', which is never held across a USB call.
+The open aggregation buffer belongs to 'outputPacket' alone: the completions
+do not submit it. It is only held while more packets are queued, so the next
+'outputPacket' call is coming anyway. To unstall the queue, the completions
+service it asynchronously, so the transmit stays off the data work loop.
+
+With the gated queue, the same code runs, merely uncontended.
+*/
+
+// The ring indices are free-running, and wrap around at 2^32:
+static_assert((N_OUT_BUFS & (N_OUT_BUFS - 1)) == 0,
+	"N_OUT_BUFS must be a power of 2");
+
+bool HoRNDIS::txTakeFreeBuf(int *poolIndx) {
+	// The consumer side: the transmit.
+	const UInt32 head = fTxFreeHead;
+	if (head == fTxFreeTail) {
+		return false;
+	}
+	OSMemoryBarrier();  // Read the slot after the tail that covers it.
+	*poolIndx = fTxFreeRing[head % N_OUT_BUFS];
+	OSMemoryBarrier();  // ... and before the producer may reuse it.
+	fTxFreeHead = head + 1;
+	return true;
+}
+
+void HoRNDIS::txUntakeFreeBuf(int poolIndx) {
+	// Gives back the buffer the transmit has just taken, when it could not
+	// send it. The producer cannot reach that slot: this buffer, and the one
+	// being put back, are both outside of the ring.
+	const UInt32 head = fTxFreeHead - 1;
+	fTxFreeRing[head % N_OUT_BUFS] = poolIndx;
+	OSMemoryBarrier();
+	fTxFreeHead = head;
+}
+
+int HoRNDIS::txPutFreeBuf(int poolIndx) {
+	// The producer side: the completions. Returns the number of free buffers
+	// it makes, as far as the consumer has taken them.
+	const UInt32 tail = fTxFreeTail;
+	const int numFree = (int)(tail + 1 - fTxFreeHead);
+	fTxFreeRing[tail % N_OUT_BUFS] = poolIndx;
+	OSMemoryBarrier();  // The slot is written before the consumer can see it.
+	fTxFreeTail = tail + 1;
+	return numFree;
+}
+
+void HoRNDIS::txResetFreeBufs(int numFree) {
+	// No transmit, no completions: 'numFree' buffers, in index order.
+	for (int i = 0; i < N_OUT_BUFS; i++) {
+		fTxFreeRing[i] = i;
+	}
+	fTxFreeHead = 0;
+	fTxFreeTail = numFree;
+}
+
+/*
+===============================
+||  OUTPUT QUEUE STALLS
+===============================
+The transmit stalls the output queue once the free output buffers are down
+to 'fTxStallWater', and the completions service it again once they are back
+up to 'fTxResumeWater'. The defaults, 0 and 1, stall it when the buffers
+run out, and resume it as soon as one is back: under load, that's a stall
+and a service round trip for every completion. A higher resume watermark
+('kTxResumeHighWaterKey') lets more of them complete in the meantime, so
+that the queue gets to fill more than one transfer each time it's serviced;
+a higher stall watermark keeps buffers free for the frames that are already
+being aggregated.
+
+With the gated queue, 'fTxQueueStalled' tells the completions whether it's
+stalled. The non-gated transmit runs concurrently with them: there, the
+completion that takes the free buffers across the resume watermark services
+the queue, which can only be stalled with fewer. If the transmit is stalling
+it at that very moment, the queue remembers that a service was requested:
+this is how it worked with the 0->1 transition, too. The flag is then only
+for the statistics.
+*/
+
+bool HoRNDIS::txShouldStall() const {
+	// Down to the low watermark, or over the byte queue limit: the output
+	// queue shall wait for the completions.
+	return numFreeOutBufs() <= fTxStallWater ||
+		(fTxBql && txDqlAvail(&fTxDql) < 0);
+}
+
+void HoRNDIS::txQueueStalled() {
+	if (fTxQueueStalled) {
+		return;
+	}
+	fTxQueueStalled = true;
+	fTxQueueStalls++;
+	if (numFreeOutBufs() > fTxStallWater) {
+		fTxBqlStalls++;  // It's the byte queue limit.
+	}
+	clock_get_uptime(&fTxStalledSince);
+}
+
+bool HoRNDIS::txShouldResume(int numFree) {
+	// Called by the completion that made 'numFree' buffers free.
+	if (fTxNonGated) {
+		if (numFree != fTxResumeWater) {
+			return false;
+		}
+	} else if (!fTxQueueStalled || numFree < fTxResumeWater ||
+			(fTxBql && txDqlAvail(&fTxDql) < 0)) {
+		return false;
+	}
+	if (fTxQueueStalled) {
+		uint32_t stalledUs;
+		elapsedMs(fTxStalledSince, &stalledUs);
+		fTxQueueStalled = false;
+		fTxQueueResumes++;
+		fTxQueueStalledUs += stalledUs;
+	}
+	return true;
+}
+
+/*
+===============================
+||  BYTE QUEUE LIMITS
+===============================
+The output buffers would hold N_OUT_BUFS full transfers in flight: far more
+than the device needs to stay busy, and every frame queued after them waits
+for all of it, where neither the output queue nor the class queues can do
+anything about it. With 'kTxByteQueueLimitKey', 'fTxDql' limits the bytes
+in flight instead, to what the device completes between two of our
+transmits (see 'txDqlCompleted' in "TxSched.h"): a new output buffer is
+only opened below the limit. Above it, the output queue is stalled, as if
+the buffers had run out, and 'dataWriteComplete' unstalls it once the
+completions bring the bytes in flight back under the limit (and the free
+buffers up to the resume watermark); 'txKick' leaves the frames in the class
+queues.
+The open buffer still takes frames up to its size: the limit may be passed
+by one transfer.
+*/
+
+void HoRNDIS::txBqlReset() {
+	// Nothing is in flight. The limit starts from one transfer, and
+	// the most it can be is all of the buffers:
+	uint64_t now, hold;
+	clock_get_uptime(&now);
+	nanoseconds_to_absolutetime(TX_BQL_HOLD_MS * NSEC_PER_MSEC, &hold);
+	txDqlInit(&fTxDql, (uint32_t)maxOutTransferSize,
+		(uint32_t)(N_OUT_BUFS * maxOutTransferSize), hold, now);
+	fTxQueueStalled = false;
+}
+
+void HoRNDIS::txBqlQueued(int poolIndx, uint32_t len) {
+	if (!fTxBql) {
+		return;
+	}
+	fTxPostedLen[poolIndx] = len;
+	txDqlQueued(&fTxDql, len);
+	fTxBqlMaxInflight = max(fTxBqlMaxInflight, txDqlInflight(&fTxDql));
+}
+
+/*
+===============================
+||  TRANSMIT PRIORITY
+===============================
+With 'kTxPriorityKey', the output queue does not hold the frames until we
+have an output buffer for them: it's a FIFO, where a TCP ACK or a DNS query
+would wait behind the bulk upload. Instead, 'outputPacket' takes every frame
+off it right away, and files it into one of the class queues, as decided by
+'txClassifyFrame'. 'txKick' then moves the frames into the output buffers
+for as long as there are free ones: the priority class first, but no more
+than TX_PRIO_QUANTUM frames in a row while the bulk one waits, so a flood
+of small packets cannot starve it. 'dataWriteComplete' kicks it again.
+When a class queue is full, its new frames are dropped, as the output queue
+would do.
+
+The class queues are linked lists of 'fTxSlots', and the slots remember when
+the frame came in: the queueing delay is measured per class. 'txBacklog'
+counts them along with the output queue, for the aggregation rules, and
+along with 'fTxHeldSlot': the frame taken off the queues, for which there
+turned out to be no room. With 'kTxFqCodelKey' alone, the same queues are
+used, all of the frames are bulk, and the bulk class is FQ-CoDel, see
+"TRANSMIT AQM".
+All of it only runs in the data gate: with the non-gated queue, the
+completions could not drain the class queues, so it's off.
+*/
+
+void HoRNDIS::txQueueReset() {
+	// Empties the queues (not their statistics): the mbufs are not touched.
+	static const char *const names[TX_NUM_CLASSES] = {
+		"TxClassPriority", "TxClassBulk" };
+	for (int i = 0; i < TX_NUM_CLASSES; i++) {
+		txclass_t &cls = fTxClasses[i];
+		cls.name = names[i];
+		cls.head = cls.tail = -1;
+		cls.count = 0;
+	}
+	// With FQ-CoDel alone, every frame is bulk:
+	const uint32_t prioLen = fTxPriority ? TX_PRIO_QUEUE_LEN : 0;
+	fTxClasses[TX_CLASS_PRIORITY].limit = prioLen;
+	fTxClasses[TX_CLASS_BULK].limit = TRANSMIT_QUEUE_SIZE - prioLen;
+	for (int i = 0; i < TRANSMIT_QUEUE_SIZE; i++) {
+		fTxSlots[i].packet = NULL;
+		fTxSlots[i].next = (int16_t)(i + 1 < TRANSMIT_QUEUE_SIZE ? i + 1 : -1);
+	}
+	fTxFreeSlot = 0;
+	fTxQueued = 0;
+	fTxPrioRun = 0;
+	fTxHeldSlot = -1;
+
+	for (int i = 0; i < TX_FQ_FLOWS; i++) {
+		txflow_t &flow = fTxFlows[i];
+		bzero(&flow, sizeof(flow));
+		flow.head = flow.tail = flow.nextFlow = -1;
+	}
+	fTxNewFlows.head = fTxNewFlows.tail = -1;
+	fTxOldFlows.head = fTxOldFlows.tail = -1;
+}
+
+void HoRNDIS::txFreeSlot(int16_t indx) {
+	txslot_t &slot = fTxSlots[indx];
+	slot.packet = NULL;
+	slot.next = fTxFreeSlot;
+	fTxFreeSlot = indx;
+}
+
+bool HoRNDIS::txEnqueue(mbuf_t packet) {
+	// Returns false if the class queue is full: the caller drops the packet.
+	uint8_t hdr[TX_CLASSIFY_HDR_LEN];
+	const uint32_t len = (uint32_t)mbuf_pkthdr_len(packet);
+	const uint32_t caplen = min(len, TX_CLASSIFY_HDR_LEN);
+	if (mbuf_copydata(packet, 0, caplen, hdr) != 0) {
+		return false;
+	}
+	tx_frame_info info;
+	txParseFrame(hdr, caplen, &info);
+	const int clsIndx = fTxPriority ? txClassifyFrame(&info) : TX_CLASS_BULK;
+	txclass_t &cls = fTxClasses[clsIndx];
+	const bool fq = fTxFqCodel && clsIndx == TX_CLASS_BULK;
+	if (fq && (cls.count >= cls.limit || fTxFreeSlot < 0)) {
+		txFqDropFattest();
+	}
+	if (cls.count >= cls.limit || fTxFreeSlot < 0) {
+		cls.drops++;
+		return false;
+	}
+
+	const int16_t indx = fTxFreeSlot;
+	txslot_t &slot = fTxSlots[indx];
+	fTxFreeSlot = slot.next;
+	slot.packet = packet;
+	slot.len = len;
+	slot.next = -1;
+	slot.cls = (uint8_t)clsIndx;
+	slot.l3ofs = (uint8_t)info.l3ofs;
+	slot.ipVersion = info.ipVersion;
+	clock_get_uptime(&slot.stamp);
+	if (fq) {
+		slot.flow = (uint8_t)(txFlowHash(hdr, &info, fTxFlowPerturb)
+			% TX_FQ_FLOWS);
+		txFqEnqueue(indx);
+	} else {
+		if (cls.tail >= 0) {
+			fTxSlots[cls.tail].next = indx;
+		} else {
+			cls.head = indx;
+		}
+		cls.tail = indx;
+	}
+	cls.count++;
+	fTxQueued++;
+	return true;
+}
+
+int16_t HoRNDIS::txDequeue() {
+	// Takes the next frame off the queues, and returns its slot, or -1.
+	txclass_t &prio = fTxClasses[TX_CLASS_PRIORITY];
+	txclass_t &bulk = fTxClasses[TX_CLASS_BULK];
+	const bool takePrio = prio.count > 0 &&
+		(bulk.count == 0 || fTxPrioRun < TX_PRIO_QUANTUM);
+	fTxPrioRun = takePrio ? fTxPrioRun + 1 : 0;
+	if (!takePrio && fTxFqCodel) {
+		const int16_t indx = txFqDequeue();
+		if (indx >= 0 || prio.count == 0) {
+			return indx;
+		}
+		// CoDel has dropped the rest of the bulk.
+	}
+
+	txclass_t &cls = (takePrio || fTxFqCodel) ? prio : bulk;
+	const int16_t indx = cls.head;
+	if (indx < 0) {
+		return -1;
+	}
+	cls.head = fTxSlots[indx].next;
+	if (cls.head < 0) {
+		cls.tail = -1;
+	}
+	cls.count--;
+	fTxQueued--;
+	return indx;
+}
+
+void HoRNDIS::txKick() {
+	// 'fTxQueued' includes the held frame.
+	while (fTxQueued > 0 && fReadyToTransfer &&
+			(fTxOpenIndx >= 0 || txCanOpenBuffer())) {
+		int16_t indx = fTxHeldSlot;
+		if (indx >= 0) {
+			fTxHeldSlot = -1;
+			fTxQueued--;
+		} else if ((indx = txDequeue()) < 0) {
+			break;
+		}
+		// It's no longer part of the 'txBacklog':
+		const txslot_t &slot = fTxSlots[indx];
+		const UInt32 status = txSendPacket(slot.packet);
+		if ((status & kIOOutputStatusMask) == kIOOutputStatusRetry) {
+			// The open buffer was full, and there's no other: keep the frame.
+			fTxHeldSlot = indx;
+			fTxQueued++;
+			break;
+		}
+		// Sent, or dropped (and freed) by 'txSendPacket':
+		uint32_t delayUs;
+		elapsedMs(slot.stamp, &delayUs);
+		latAdd(LAT_TX_QUEUE, delayUs);
+		txclass_t &cls = fTxClasses[slot.cls];
+		cls.frames++;
+		cls.bytes += slot.len;
+		cls.delaySumUs += delayUs;
+		cls.delayMaxUs = max(cls.delayMaxUs, delayUs);
+		txFreeSlot(indx);
+	}
+	// Still frames to send, and out of buffers: they wait for the completions.
+	// A frame that just got 'kIOOutputStatusRetry' was counted as it did.
+	if (fTxQueued > 0 && fTxHeldSlot < 0 && fReadyToTransfer &&
+			fTxOpenIndx < 0 && numFreeOutBufs() == 0) {
+		fTxOutOfBuffers++;
+	}
+}
+
+void HoRNDIS::txQueueFlush() {
+	// Whatever list they are in:
+	for (int i = 0; i < TRANSMIT_QUEUE_SIZE; i++) {
+		if (fTxSlots[i].packet) {
+			freePacket(fTxSlots[i].packet);
+		}
+	}
+	txQueueReset();
+}
+
+/*
+===============================
+||  TRANSMIT AQM
+===============================
+With 'kTxFqCodelKey', the bulk class is not one FIFO, but FQ-CoDel (RFC 8290):
+the frames are hashed by their flow (addresses, protocol and ports, with
+'fTxFlowPerturb' as the salt) into one of TX_FQ_FLOWS queues. The active flows
+take turns in deficit round robin, TX_FQ_QUANTUM bytes at a time, and a flow
+that just became active ("new") goes ahead of the others ("old") for its
+first quantum: a DNS lookup or an SSH keystroke, alone in its flow, does not
+wait behind the uploads, even without 'kTxPriorityKey'.
+
+Each flow runs CoDel (RFC 8289) as its frames are taken off: once they have
+waited longer than the target ('kTxCodelTargetUsecKey') for a whole interval,
+it drops one, then more and more often (the control law, in "TxSched.h"),
+until the waiting time is back under the target. The ECN-capable frames are
+marked instead, with 'kTxCodelEcnKey'; the 'mbuf_copyback' writes the IP
+header in place, as the packet filters do. This keeps the standing queue
+short for the TCP flows, which would otherwise fill all of the slots and
+the device's buffers behind them.
+
+When the slots run out, the head of the flow that has the most bytes queued
+is dropped, rather than the new frame: counted as the class 'Drops'. The CoDel
+drops and marks are 'TxCodelDrops' and 'TxCodelMarks'.
+*/
+
+void HoRNDIS::txFlowListAppend(txflowlist_t *list, int16_t flow) {
+	fTxFlows[flow].nextFlow = -1;
+	if (list->tail >= 0) {
+		fTxFlows[list->tail].nextFlow = flow;
+	} else {
+		list->head = flow;
+	}
+	list->tail = flow;
+}
+
+void HoRNDIS::txFqEnqueue(int16_t indx) {
+	txslot_t &slot = fTxSlots[indx];
+	txflow_t &flow = fTxFlows[slot.flow];
+	if (flow.tail >= 0) {
+		fTxSlots[flow.tail].next = indx;
+	} else {
+		flow.head = indx;
+	}
+	flow.tail = indx;
+	flow.bytes += slot.len;
+	if (!flow.active) {
+		flow.active = true;
+		flow.deficit = TX_FQ_QUANTUM;
+		txFlowListAppend(&fTxNewFlows, slot.flow);
+		fTxFqNewFlows++;
+	}
+}
+
+int16_t HoRNDIS::txFlowPop(int16_t flowIndx) {
+	// Takes the head off the flow, or returns -1 if it's empty.
+	txflow_t &flow = fTxFlows[flowIndx];
+	const int16_t indx = flow.head;
+	if (indx < 0) {
+		return -1;
+	}
+	flow.head = fTxSlots[indx].next;
+	if (flow.head < 0) {
+		flow.tail = -1;
+	}
+	flow.bytes -= fTxSlots[indx].len;
+	fTxClasses[TX_CLASS_BULK].count--;
+	fTxQueued--;
+	return indx;
+}
+
+void HoRNDIS::txFqDropFattest() {
+	int16_t fattest = -1;
+	uint32_t maxBytes = 0;
+	for (int16_t i = 0; i < TX_FQ_FLOWS; i++) {
+		if (fTxFlows[i].bytes > maxBytes) {
+			maxBytes = fTxFlows[i].bytes;
+			fattest = i;
+		}
+	}
+	if (fattest < 0) {
+		return;  // The slots are held by the priority class.
+	}
+	const int16_t indx = txFlowPop(fattest);
+	freePacket(fTxSlots[indx].packet);
+	txFreeSlot(indx);
+	fTxClasses[TX_CLASS_BULK].drops++;
+}
+
+int16_t HoRNDIS::txFqDequeue() {
+	uint64_t now;
+	clock_get_uptime(&now);
+	for (;;) {
+		txflowlist_t *list = fTxNewFlows.head >= 0 ? &fTxNewFlows : &fTxOldFlows;
+		const int16_t flowIndx = list->head;
+		if (flowIndx < 0) {
+			return -1;
+		}
+		txflow_t &flow = fTxFlows[flowIndx];
+		if (flow.deficit <= 0) {
+			// Its turn is over: to the back of the old flows.
+			flow.deficit += TX_FQ_QUANTUM;
+			list->head = flow.nextFlow;
+			if (list->head < 0) {
+				list->tail = -1;
+			}
+			txFlowListAppend(&fTxOldFlows, flowIndx);
+			continue;
+		}
+
+		const int16_t indx = txCodelDequeue(flowIndx, now);
+		if (indx >= 0) {
+			flow.deficit -= fTxSlots[indx].len;
+			return indx;
+		}
+		list->head = flow.nextFlow;
+		if (list->head < 0) {
+			list->tail = -1;
+		}
+		if (list == &fTxNewFlows && fTxOldFlows.head >= 0) {
+			// An emptied new flow waits for a round of the old ones, before it
+			// can be new again: otherwise, a flow that keeps only one frame
+			// queued would always go first.
+			txFlowListAppend(&fTxOldFlows, flowIndx);
+		} else {
+			flow.active = false;
+		}
+	}
+}
+
+bool HoRNDIS::txCodelShouldDrop(int16_t flowIndx, int16_t indx, uint64_t now) {
+	txflow_t &flow = fTxFlows[flowIndx];
+	if (indx < 0) {
+		flow.codel.firstAboveTime = 0;
+		return false;
+	}
+	return txCodelOkToDrop(&flow.codel, &fTxCodelParams, now,
+		now - fTxSlots[indx].stamp, flow.bytes);
+}
+
+int16_t HoRNDIS::txCodelDequeue(int16_t flowIndx, uint64_t now) {
+	// The dequeue of RFC 8289, on one flow: returns the frame to send, or -1
+	// if the flow is empty, or CoDel has dropped the rest of it.
+	tx_codel &c = fTxFlows[flowIndx].codel;
+	const uint64_t interval = fTxCodelParams.interval;
+	int16_t indx = txFlowPop(flowIndx);
+	const bool drop = txCodelShouldDrop(flowIndx, indx, now);
+	if (indx < 0) {
+		c.dropping = false;
+		return -1;
+	}
+
+	if (c.dropping) {
+		if (!drop) {
+			c.dropping = false;
+		}
+		while (c.dropping && (int64_t)(now - c.dropNext) >= 0) {
+			c.count++;
+			if (txCodelMark(indx)) {
+				c.dropNext = txCodelControlLaw(c.dropNext, interval, c.count);
+				break;
+			}
+			txCodelDrop(indx);
+			indx = txFlowPop(flowIndx);
+			if (!txCodelShouldDrop(flowIndx, indx, now)) {
+				c.dropping = false;
+			} else {
+				c.dropNext = txCodelControlLaw(c.dropNext, interval, c.count);
+			}
+		}
+	} else if (drop) {
+		if (!txCodelMark(indx)) {
+			txCodelDrop(indx);
+			indx = txFlowPop(flowIndx);
+			txCodelShouldDrop(flowIndx, indx, now);
+		}
+		txCodelStartDropping(&c, &fTxCodelParams, now);
+	}
+	return indx;
+}
+
+bool HoRNDIS::txCodelMark(int16_t indx) {
+	// Sets CE, if ECN is on and the sender is ECN-capable.
+	const txslot_t &slot = fTxSlots[indx];
+	if (!fTxCodelEcn || slot.ipVersion == 0) {
+		return false;
+	}
+	uint8_t ip[20];
+	const size_t len = slot.ipVersion == 4 ? 20 : 2;
+	if (mbuf_copydata(slot.packet, slot.l3ofs, len, ip) != 0 ||
+			!txSetCE(ip, slot.ipVersion) ||
+			mbuf_copyback(slot.packet, slot.l3ofs, len, ip,
+				MBUF_DONTWAIT) != 0) {
+		return false;
+	}
+	fTxCodelMarks++;
+	return true;
 }
 
-/***** Packet transmit logic *****/
-
-static inline bool isTransferStopStatus(IOReturn rc) {
-	// IOReturn indicating that we need to stop transfers:
-	return rc == kIOReturnAborted || rc == kIOReturnNotResponding;
+void HoRNDIS::txCodelDrop(int16_t indx) {
+	freePacket(fTxSlots[indx].packet);
+	txFreeSlot(indx);
+	fTxCodelDrops++;
 }
 
 UInt32 HoRNDIS::outputPacket(mbuf_t packet, void *param) {
-	IOReturn ior = kIOReturnSuccess;
-	int poolIndx = N_OUT_BUFS;
-
 	// Note, this function MAY or MAY NOT be protected by the IOCommandGate,
-	// depending on the kind of OutputQueue used.
-	// Here, we assume that IOCommandGate is used: no need to lock.
+	// depending on the kind of OutputQueue used. Either way, the calls are
+	// serialized; for what is shared with the completions, see
+	// "NON-GATED TRANSMIT".
 
 	if (!fReadyToTransfer) {
 		// Technically, we must never be here, because we always disable the
@@ -1092,18 +3393,71 @@ UInt32 HoRNDIS::outputPacket(mbuf_t packet, void *param) {
 		freePacket(packet);
 		return kIOReturnOutputDropped;
 	}
-	
+
+	const uint64_t start = latStamp();
+	// The packet may be gone by the time we trace it:
+	const uint32_t pktlen = fTraceOn ? (uint32_t)mbuf_pkthdr_len(packet) : 0;
+	UInt32 status = kIOReturnOutputSuccess;
+	if (txQueueing()) {
+		// See "TRANSMIT PRIORITY": the output queue is never stalled.
+		if (txEnqueue(packet)) {
+			txKick();
+		} else {
+			freePacket(packet);
+			status = kIOReturnOutputDropped;
+		}
+	} else {
+		status = txSendPacket(packet);
+		if ((status & kIOOutputCommandMask) == kIOOutputCommandStall) {
+			txQueueStalled();
+		}
+	}
+	latSince(LAT_TX_OUTPUT, start);
+	trace(TRACE_TX_OUTPUT, pktlen, status, fTxQueued, numFreeOutBufs());
+	return status;
+}
+
+UInt32 HoRNDIS::txSendPacket(mbuf_t packet) {
+	// Sends the packet, or keeps it in the open buffer. Returns the status
+	// for the output queue: 'kIOOutputStatusRetry' if there's no buffer.
+
+	// The super-packet before this one goes first, see
+	// "TCP SEGMENTATION OFFLOAD":
+	IOReturn ior;
+	if (fTxTsoPacket && !txTsoContinue(&ior)) {
+		return kIOOutputStatusRetry | kIOOutputCommandStall;
+	}
+
 	// Count the total size of this packet
 	size_t pktlen = 0;
+	int numSegs = 0;
 	for (mbuf_t m = packet; m; m = mbuf_next(m)) {
 		pktlen += mbuf_len(m);
+		numSegs += mbuf_len(m) != 0;
 	}
 	
 	LOG(V_PACKET, "%ld bytes", pktlen);
 
-	const uint32_t transmitLength = (uint32_t)(pktlen + sizeof(rndis_data_hdr));
+	mbuf_tso_request_flags_t tsoRequest;
+	uint32_t mss;
+	if (fTxTso && mbuf_get_tso_requested(packet, &tsoRequest, &mss) == 0 &&
+			(tsoRequest & (MBUF_TSO_IPV4 | MBUF_TSO_IPV6))) {
+		if (!txTsoStart(packet, (uint32_t)pktlen, mss)) {
+			return kIOReturnOutputDropped;  // Packet was already freed.
+		}
+		if (!txTsoContinue(&ior)) {
+			// We own it now: the rest goes out as the buffers come back.
+			return kIOOutputStatusAccepted | kIOOutputCommandStall;
+		}
+		if (ior != kIOReturnSuccess) {
+			return kIOReturnOutputDropped;  // Packet was already freed.
+		}
+		return txSubmitOrHold();
+	}
+
+	const uint32_t msgLen = (uint32_t)(pktlen + sizeof(rndis_data_hdr));
 	
-	if (transmitLength > maxOutTransferSize) {
+	if (msgLen > (uint32_t)maxOutTransferSize) {
 		LOG(V_ERROR, "packet too large (%ld bytes, maximum can transmit %ld)",
 			pktlen, maxOutTransferSize - sizeof(rndis_data_hdr));
 		fpNetStats->outputErrors++;
@@ -1111,62 +3465,85 @@ UInt32 HoRNDIS::outputPacket(mbuf_t packet, void *param) {
 		return kIOReturnOutputDropped;
 	}
 
-	if (numFreeOutBufs <= 0) {
-		LOG(V_ERROR, "BUG: Ran out of buffers - stall did not work!");
-		// Stall the queue and re-try the same packet later: don't release:
-		return kIOOutputStatusRetry | kIOOutputCommandStall;
+	// If the packet does not fit into the open buffer, send that one first:
+	if (fTxOpenIndx >= 0 && !txOpenBufferHasRoom(msgLen)) {
+		txSubmitOpenBuffer();
 	}
 
-	// Note, we don't decrement 'numFreeOutBufs' (commit to using that buffer)
-	// until everything is successful.
-	poolIndx = outbufStack[numFreeOutBufs - 1];
-	if (poolIndx < 0 || poolIndx >= N_OUT_BUFS) {
-		LOG(V_ERROR, "BUG: poolIndex out-of-bounds");
-		freePacket(packet);
-		return kIOReturnOutputDropped;
+	// Would this frame go out in a transfer of its own? If so, and it's large
+	// enough, try sending it without copying, see "SCATTER-GATHER TRANSMIT":
+	if (fTxZeroCopy && pktlen >= TX_SG_MIN_FRAME && fTxOpenIndx < 0
+			&& txCanOpenBuffer() && (!fTxAggregation
+				|| maxOutPktsPerTransfer <= 1 || numOutBufsInFlight() == 0
+				|| txBacklog() == 0)) {
+		ior = kIOReturnSuccess;
+		if (numSegs <= MAX_TX_SG_SEGS &&
+				txSubmitScatterGather(packet, (uint32_t)pktlen, &ior)) {
+			if (ior != kIOReturnSuccess) {
+				return kIOReturnOutputDropped;  // Packet was already freed.
+			}
+			return kIOOutputStatusAccepted |
+				(txShouldStall() ? kIOOutputCommandStall : kIOOutputCommandNone);
+		}
+		fTxZeroCopyFallbacks++;
 	}
 
-	// Start filling in the send buffer
-	struct rndis_data_hdr *hdr;
-	hdr = (struct rndis_data_hdr *)outbufs[poolIndx].mdp->getBytesNoCopy();
+	if (fTxOpenIndx < 0) {
+		int poolIndx;
+		if (txShouldStall()) {
+			// At the low watermark, or over the byte queue limit: same as out
+			// of buffers.
+			return kIOOutputStatusRetry | kIOOutputCommandStall;
+		}
+		if (!txTakeFreeBuf(&poolIndx)) {
+			// We can get here after submitting a full open buffer.
+			LOG(V_PACKET, "Ran out of buffers, stalling the queue");
+			fTxOutOfBuffers++;
+			// Stall the queue and re-try the same packet later: don't release:
+			return kIOOutputStatusRetry | kIOOutputCommandStall;
+		}
+		if (poolIndx < 0 || poolIndx >= N_OUT_BUFS) {
+			LOG(V_ERROR, "BUG: poolIndex out-of-bounds");
+			freePacket(packet);
+			return kIOReturnOutputDropped;
+		}
+		txOpenBuffer(poolIndx);
+	}
 
-	outbufs[poolIndx].mdp->setLength(transmitLength);
-	
-	memset(hdr, 0, sizeof *hdr);
-	hdr->msg_type = RNDIS_MSG_PACKET;
-	hdr->msg_len = cpu_to_le32(pktlen + sizeof *hdr);
-	hdr->data_offset = cpu_to_le32(sizeof(*hdr) - 8);
-	hdr->data_len = cpu_to_le32(pktlen);
-	mbuf_copydata(packet, 0, pktlen, hdr + 1);
-	
+	txAppendPacket(packet, (uint32_t)pktlen);
 	freePacket(packet);
 	packet = NULL;
-	
-	// Now, fire it off!
-	IOUSBHostCompletion *const comp = &outbufs[poolIndx].comp;
-	comp->owner     = this;
-	comp->parameter = (void *)(uintptr_t)poolIndx;
-	comp->action    = dataWriteComplete;
-	
-	ior = robustIO(fOutPipe, &outbufs[poolIndx], transmitLength);
-	if (ior != kIOReturnSuccess) {
-		if (isTransferStopStatus(ior)) {
-			LOG(V_DEBUG, "WRITER: The device was possibly disconnected: ignoring the error");
-		} else {
-			LOG(V_ERROR, "write failed: %08x", ior);
-			fpNetStats->outputErrors++;
+	return txSubmitOrHold();
+}
+
+UInt32 HoRNDIS::txSubmitOrHold() {
+	// Called with frames just appended to the open buffer: sends it, or
+	// keeps it for more. Returns the status for the output queue. The last
+	// segment of a super-packet may have already sent it.
+
+	// Decide if we should wait for more packets, see "TRANSMIT AGGREGATION"
+	// and "TRANSMIT COALESCING":
+	const bool coalesce = txCoalescing();
+	const bool submitNow = !fTxAggregation
+		|| fTxOpenFrames >= maxOutPktsPerTransfer
+		|| (!coalesce && (numOutBufsInFlight() == 0 || txBacklog() == 0));
+	if (fTxOpenIndx < 0) {
+		// Nothing left to send.
+	} else if (submitNow) {
+		if (txSubmitOpenBuffer() != kIOReturnSuccess) {
+			// Packet was already freed: just quit:
+			return kIOReturnOutputDropped;
 		}
-		// Packet was already freed: just quit:
-		return kIOReturnOutputDropped;
+	} else if (coalesce && !fTxCoalesceArmed) {
+		fTxCoalesceArmed = true;
+		fTxCoalesceTimer->setTimeoutUS(fTxCoalesceUs);
 	}
-	// Only here - when 'fOutPipe->io' has fired - we mark the buffer in-use:
-	numFreeOutBufs--;
-	fCallbackCount++;
-	fpNetStats->outputPackets++;
+
 	// If we ran out of free buffers, issue a stall command to the queue.
 	// Note, this would be "we accept this packet, but don't give us more yet",
 	// which is NOT the same as 'kIOReturnOutputStall'.
-	const bool stallQueue = (numFreeOutBufs == 0);
+	// While a buffer is still open, we can accept more packets into it.
+	const bool stallQueue = (fTxOpenIndx < 0 && txShouldStall());
 	if (stallQueue) {
 		LOG(V_PACKET, "Issuing stall command to the output queue");
 	}
@@ -1175,11 +3552,11 @@ UInt32 HoRNDIS::outputPacket(mbuf_t packet, void *param) {
 }
 
 void HoRNDIS::callbackExit() {
-	fCallbackCount--;
-	// Notify the 'disable' that may be waiting for callback count to reach 0:
-	if (fCallbackCount <= 0) {
+	// Only called within the data work loop. Notify the 'disable' that may
+	// be waiting for callback count to reach 0:
+	if (OSDecrementAtomic(&fCallbackCount) <= 1) {
 		LOG(V_DEBUG, "Notifying last callback exited");
-		getCommandGate()->commandWakeup(&fCallbackCount);
+		fDataGate->commandWakeup((void *)&fCallbackCount);
 	}
 }
 
@@ -1190,6 +3567,19 @@ void HoRNDIS::dataWriteComplete(void *obj, void *param, IOReturn rc, UInt32 tran
 	poolIndx = (unsigned long)param;
 
 	LOG(V_PACKET, "(rc %08x, poolIndx %ld)", rc, poolIndx);
+	me->trace(TRACE_TX_COMPLETE, (uint32_t)poolIndx, rc, transferred,
+		me->numFreeOutBufs());
+	if (rc != kIOReturnSuccess) {
+		countUsbError(&me->fOutErrors, rc);
+	}
+	if (me->fUtilSampler) {
+		uint64_t now;
+		clock_get_uptime(&now);
+		me->fTxBusyTime += now - me->fTxPostStamp[poolIndx];
+	}
+	// A scatter-gather transfer holds the packet: let go of it, whatever
+	// happened to the transfer.
+	me->txReleaseScatterGather((int)poolIndx);
 	// Callback completed. We don't know when/if we launch another one:
 	me->callbackExit();
 
@@ -1201,23 +3591,51 @@ void HoRNDIS::dataWriteComplete(void *obj, void *param, IOReturn rc, UInt32 tran
 	}
 
 	if (rc != kIOReturnSuccess) {
-		// Write error. In case of pipe stall,
-		// we shall clear it on the next transmit.
+		// Write error. In case of pipe stall, the following transfers wait
+		// for the recovery, see "STALL RECOVERY":
 		LOG(V_ERROR, "I/O error: %08x", rc);
+		if (rc == kUSBHostReturnPipeStalled) {
+			me->stallBegin(&me->fOutStall);
+		}
 	}
 
-	// Free the buffer: put the index back onto the stack:
-	if (me->numFreeOutBufs >= N_OUT_BUFS) {
+	// Free the buffer: put the index back into the ring:
+	if (me->numFreeOutBufs() >= N_OUT_BUFS) {
 		LOG(V_ERROR, "BUG: more free buffers than was allocated");
 		return;
 	}
 
-	me->outbufStack[me->numFreeOutBufs] = poolIndx;
-	me->numFreeOutBufs++;
-	// Unstall the queue whenever the number of free buffers goes 0->1.
-	// I.e. we unstall it the moment we're able to write something into it:
-	if (me->numFreeOutBufs == 1) {
-		me->getOutputQueue()->service();
+	if (me->fTxBql) {
+		uint64_t now;
+		clock_get_uptime(&now);
+		txDqlCompleted(&me->fTxDql, me->fTxPostedLen[poolIndx], now);
+	}
+	const bool resume = me->txShouldResume(me->txPutFreeBuf((int)poolIndx));
+	// The super-packet being cut goes before anything else, see
+	// "TCP SEGMENTATION OFFLOAD":
+	IOReturn ior;
+	if (me->fTxTsoPacket && me->txTsoContinue(&ior) &&
+			ior == kIOReturnSuccess) {
+		me->txSubmitOrHold();
+	}
+	// The frames in the class queues are waiting for this buffer:
+	if (me->txQueueing()) {
+		me->txKick();
+	}
+	// The open buffer was waiting for the in-flight transfers, see
+	// "TRANSMIT AGGREGATION". Nothing is more in-flight than this one.
+	// The non-gated transmit owns the open buffer: it gets submitted there.
+	// With coalescing, it's up to the timer.
+	if (!me->fTxNonGated && !me->txCoalescing() && me->fTxOpenIndx >= 0) {
+		me->txSubmitOpenBuffer();
+	}
+	// Unstall the queue once the free buffers are back up to the resume
+	// watermark, see "OUTPUT QUEUE STALLS". By default, that's the moment
+	// we're able to write something into it.
+	// The non-gated queue transmits on its own thread, not in our completion:
+	if (resume) {
+		me->getOutputQueue()->service(me->fTxNonGated ?
+			IOOutputQueue::kServiceAsync : 0);
 	}
 }
 
@@ -1225,95 +3643,291 @@ void HoRNDIS::dataWriteComplete(void *obj, void *param, IOReturn rc, UInt32 tran
 /***** Packet receive logic *****/
 void HoRNDIS::dataReadComplete(void *obj, void *param, IOReturn rc, UInt32 transferred) {
 	HoRNDIS	*me = (HoRNDIS *)obj;
-	pipebuf_t *inbuf = (pipebuf_t *)param;
-	IOReturn ior;
+	inbuf_t *inbuf = (inbuf_t *)param;
+	me->trace(TRACE_RX_COMPLETE, (uint32_t)(inbuf - me->inbufs), rc,
+		transferred, me->fInRingHead);
+	if (rc != kIOReturnSuccess) {
+		countUsbError(&me->fInErrors, rc);
+	}
+	me->utilReadDone(inbuf);
 
 	// Stop conditions. Not separating them out, since reacting to individual
 	// ones would be very timing-sansitive.
 	if (isTransferStopStatus(rc) || !me->fReadyToTransfer) {
 		LOG(V_DEBUG, "READER STOPPED: USB device aborted or not responding, "
 			"or 'fReadyToTransfer' flag is cleared.");
+		inbuf->posted = false;
 		me->callbackExit();
 		return;
 	}
-	
-	if (rc == kIOReturnSuccess) {
-		// Got one?  Hand it to the back end.
-		LOG(V_PACKET, "Reader(%ld), tid=%lld: %d bytes", inbuf - me->inbufs,
-			thread_tid(current_thread()), transferred);
-		me->receivePacket(inbuf->mdp->getBytesNoCopy(), transferred);
-	} else {
-		LOG(V_ERROR, "dataReadComplete: I/O error: %08x", rc);
+
+	// With multiple reads in flight, we process the completions strictly in
+	// the order the reads were posted, so the packets are delivered in order.
+	// Normally, the IN pipe completes them in that order anyway.
+	inbuf->rc = rc;
+	inbuf->transferred = transferred;
+	inbuf->completed = true;
+	if (inbuf != &me->inbufs[me->fInRingHead]) {
+		LOG(V_DEBUG, "Reader(%ld) completed ahead of Reader(%d)",
+			inbuf - me->inbufs, me->fInRingHead);
 	}
-	
-	// Queue the next one up.
-	ior = robustIO(me->fInPipe, inbuf, (uint32_t)inbuf->mdp->getLength());
-	if (ior == kIOReturnSuccess) {
-		return;  // Callback is in-progress.
+	me->processInRing();
+}
+
+void HoRNDIS::processInRing() {
+	// Process the completed reads from the head of the ring, skipping over
+	// readers that have stopped:
+	for (int n = 0; n < fNumInBufs; n++) {
+		inbuf_t *inbuf = &inbufs[fInRingHead];
+		if (inbuf->posted && !inbuf->completed) {
+			break;  // Not there yet: wait for its callback.
+		}
+		fInRingHead = (fInRingHead + 1) % fNumInBufs;
+		if (!inbuf->completed) {
+			continue;  // That reader has stopped.
+		}
+		inbuf->completed = false;
+
+		if (inbuf->rc == kIOReturnSuccess) {
+			const uint64_t start = latStamp();
+			const uint64_t framesBefore = fRxFrames;
+			fRxTransfers++;
+			fRxTransferBytes += inbuf->transferred;
+			// Got one?  Hand it to the back end.
+			LOG(V_PACKET, "Reader(%ld), tid=%lld: %d bytes", inbuf - inbufs,
+				thread_tid(current_thread()), inbuf->transferred);
+			// With zero-copy receive, this swaps in a spare buffer for
+			// the next read, if we have one:
+			rxbuf_t *lentBuf = fRxZeroCopy ? rxLendInBuf(inbuf) : NULL;
+			if (lentBuf) {
+				receivePacket(lentBuf->mdp->getBytesNoCopy(),
+					inbuf->transferred, lentBuf);
+				flushRxBatch();
+				rxBufRelease(lentBuf);  // Drops the lending reference.
+			} else {
+				receivePacket(inbuf->buf.mdp->getBytesNoCopy(),
+					inbuf->transferred, NULL);
+				flushRxBatch();
+			}
+			fRxMaxFramesPerTransfer = max(fRxMaxFramesPerTransfer,
+				(uint32_t)(fRxFrames - framesBefore));
+			latSince(LAT_RX_PROCESS, start);
+		} else {
+			LOG(V_ERROR, "dataReadComplete: I/O error: %08x", inbuf->rc);
+			if (inbuf->rc == kUSBHostReturnPipeStalled) {
+				stallBegin(&fInStall);  // The read below waits for it.
+			}
+		}
+
+		// Queue the next one up, it goes to the tail of the ring.
+		rxPostRead(inbuf);
 	}
+}
 
-	LOG(V_ERROR, "READER STOPPED: USB failure trying to read: %08x", ior);
-	me->callbackExit();
-	me->fDataDead = true;
+/*
+===============================
+||  ZERO-COPY RECEIVE
+===============================
+When enabled, 'receivePacket' does not copy the Ethernet frames: each frame
+becomes an mbuf whose external storage is the frame's slice of the IN buffer
+(via 'mbuf_attachcluster'). Such a buffer is "lent" to the network stack
+and must not be reused until the stack frees every mbuf pointing into it.
+
+Instead of waiting, we swap the lent buffer out of the ring with an idle one
+from 'fRxSpares', and post the read with that. Lent buffers land in
+'fRxSpares', becoming usable again once idle. The pool is bounded: if
+every spare is still lent out (slow consumer), the transfer is copied as
+usual, so the reader never starves.
+
+Lifetime: see 'rxbuf_t'. Every mbuf holds a reference, released by
+'rxBufExtFree' from whatever thread frees the mbuf; the driver holds
+RXBUF_POOL_REF. A buffer still lent when resources are released is freed by
+its last mbuf. Each lent buffer also retains the driver instance, so the
+kext cannot go away while the stack holds on to our 'extfree' callback.
+
+NOTE: the IP header ends up 2-byte aligned (44-byte RNDIS header + 14-byte
+Ethernet header), which the stack tolerates on Intel Macs.
+*/
+
+rxbuf_t *HoRNDIS::allocateRxBuf() {
+	rxbuf_t *rx = (rxbuf_t *)IOMalloc(sizeof(rxbuf_t));
+	if (!rx) {
+		return NULL;
+	}
+	rx->mdp = IOBufferMemoryDescriptor::withCapacity(IN_BUF_SIZE, kIODirectionIn);
+	if (!rx->mdp) {
+		IOFree(rx, sizeof(rxbuf_t));
+		return NULL;
+	}
+	rx->mdp->setLength(IN_BUF_SIZE);
+	rx->owner = this;
+	rx->refs = RXBUF_POOL_REF;
+	return rx;
+}
+
+void HoRNDIS::freeRxBuf(rxbuf_t *rx) {
+	// Drops the driver's reference. If the buffer is still lent to the
+	// network stack, 'rxBufRelease' frees it once the last mbuf is gone.
+	const SInt32 refs = OSAddAtomic(-RXBUF_POOL_REF, &rx->refs) - RXBUF_POOL_REF;
+	if (refs == 0) {
+		rx->mdp->release();
+		IOFree(rx, sizeof(rxbuf_t));
+	}
+}
+
+void HoRNDIS::rxBufRelease(rxbuf_t *rx) {
+	// Drops a lent reference (an mbuf, or the one taken by 'rxLendInBuf').
+	// Note, 'rx' may be gone right after the decrement:
+	HoRNDIS *owner = rx->owner;
+	const SInt32 refs = OSDecrementAtomic(&rx->refs) - 1;
+	if (refs == 0) {
+		rx->mdp->release();
+		IOFree(rx, sizeof(rxbuf_t));
+	}
+	if (refs == 0 || refs == RXBUF_POOL_REF) {
+		// Nothing is lent anymore: matches the 'retain' in 'rxLendInBuf'.
+		owner->release();
+	}
+}
+
+void HoRNDIS::rxBufExtFree(caddr_t extbuf, u_int extsize, caddr_t extarg) {
+	// Called by the network stack, on any thread, when an mbuf is freed:
+	rxBufRelease((rxbuf_t *)extarg);
+}
+
+rxbuf_t *HoRNDIS::rxLendInBuf(inbuf_t *inbuf) {
+	// Find an idle spare buffer to take the place of the one we lend out:
+	for (int i = 0; i < fNumRxSpares; i++) {
+		rxbuf_t *spare = fRxSpares[i];
+		if (spare->refs != RXBUF_POOL_REF) {
+			continue;  // Still lent to the network stack.
+		}
+		rxbuf_t *lentBuf = inbuf->rx;
+		fRxSpares[i] = lentBuf;
+		inbuf->rx = spare;
+		inbuf->buf.mdp = spare->mdp;
+
+		// The lending reference keeps the buffer from looking idle while
+		// we are creating the mbufs; the caller releases it when done.
+		retain();
+		OSIncrementAtomic(&lentBuf->refs);
+		fRxZeroCopyTransfers++;
+		return lentBuf;
+	}
+	LOG(V_PACKET, "No idle spare input buffers: copying");
+	fRxPoolExhausted++;
+	return NULL;
+}
+
+mbuf_t HoRNDIS::rxWrapSlice(rxbuf_t *rx, void *data, uint32_t len) {
+	mbuf_t m = NULL;
+	OSIncrementAtomic(&rx->refs);  // Owned by the mbuf from now on.
+	if (mbuf_attachcluster(MBUF_DONTWAIT, MBUF_TYPE_DATA, &m, (caddr_t)data,
+			rxBufExtFree, len, (caddr_t)rx) != 0) {
+		rxBufRelease(rx);
+		return NULL;
+	}
+	mbuf_setlen(m, len);
+	mbuf_pkthdr_setlen(m, len);
+	fRxZeroCopyFrames++;
+	return m;
+}
+
+void HoRNDIS::flushRxBatch() {
+	if (fRxQueued == 0) {
+		return;
+	}
+	fNetworkInterface->flushInputQueue();
+	fRxBatchFlushes++;
+	fRxBatchMaxFrames = max(fRxBatchMaxFrames, fRxQueued);
+	fRxQueued = 0;
 }
 
 /*!
  * Transfer the packet we've received to the MAC OS Network stack.
+ * If 'lentBuf' is set, the frames are passed as external mbufs pointing into
+ * that buffer (see "ZERO-COPY RECEIVE"), otherwise they are copied.
  */
-void HoRNDIS::receivePacket(void *packet, UInt32 size) {
+void HoRNDIS::receivePacket(void *packet, UInt32 size, rxbuf_t *lentBuf) {
 	mbuf_t m;
-	UInt32 submit;
 	IOReturn rv;
 	
 	LOG(V_PACKET, "packet sz %d", (int)size);
 	
 	while (size) {
-		struct rndis_data_hdr *hdr = (struct rndis_data_hdr *)packet;
-		uint32_t msg_len, data_ofs, data_len;
-		
-		if (size <= sizeof(struct rndis_data_hdr)) {
+		rndis_rx_frame frame;
+		const int parsed = rndisParseDataMsg(packet, size, &frame);
+		if (parsed != RNDIS_PARSE_OK) {
+			trace(TRACE_RX_ERROR, parsed, size);
+			fRxParseErrors[parsed]++;
+		}
+		switch (parsed) {
+		case RNDIS_PARSE_OK:
+			break;
+		case RNDIS_PARSE_SHORT:
 			LOG(V_ERROR, "receivePacket() on too small packet? (size %d)", size);
 			return;
-		}
-		
-		msg_len = le32_to_cpu(hdr->msg_len);
-		data_ofs = le32_to_cpu(hdr->data_offset);
-		data_len = le32_to_cpu(hdr->data_len);
-		
-		if (hdr->msg_type != RNDIS_MSG_PACKET) { // both are LE, so that's okay
-			LOG(V_ERROR, "non-PACKET over data channel? (msg_type %08x)", hdr->msg_type);
+		case RNDIS_PARSE_NOT_PACKET:
+			LOG(V_ERROR, "non-PACKET over data channel? (msg_type %08x)",
+				((rndis_data_hdr *)packet)->msg_type);
 			return;
-		}
-		
-		if (msg_len > size) {
-			LOG(V_ERROR, "msg_len too big?");
+		case RNDIS_PARSE_BAD_MSG_LEN:
+			LOG(V_ERROR, "msg_len too big (or too small)?");
 			return;
-		}
-		
-		if ((data_ofs + data_len + 8) > msg_len) {
+		default:
 			LOG(V_ERROR, "data bigger than msg?");
 			return;
 		}
+		const uint32_t msg_len = frame.msg_len;
+		const uint32_t data_len = frame.data_len;
+		char *const data = (char *)packet + frame.data_ofs;
 	
-		m = allocatePacket(data_len);
-		if (!m) {
-			LOG(V_ERROR, "allocatePacket for data_len %d failed", data_len);
-			fpNetStats->inputErrors++;
-			return;
-		}
-		LOG(V_PTR, "PTR: mbuf: %p", m);
-		
-		rv = mbuf_copyback(m, 0, data_len, (char *)packet + data_ofs + 8, MBUF_WAITOK);
-		if (rv) {
-			LOG(V_ERROR, "mbuf_copyback failed, rv %08x", rv);
-			fpNetStats->inputErrors++;
-			freePacket(m);
-			return;
+		if (lentBuf) {
+			m = rxWrapSlice(lentBuf, data, data_len);
+			if (!m) {
+				LOG(V_ERROR, "mbuf_attachcluster for data_len %d failed", data_len);
+				fpNetStats->inputErrors++;
+				fRxWrapFailures++;
+				return;
+			}
+			LOG(V_PTR, "PTR: external mbuf: %p", m);
+		} else {
+			m = allocatePacket(data_len);
+			if (!m) {
+				LOG(V_ERROR, "allocatePacket for data_len %d failed", data_len);
+				fpNetStats->inputErrors++;
+				fRxAllocFailures++;
+				return;
+			}
+			LOG(V_PTR, "PTR: mbuf: %p", m);
+
+			rv = mbuf_copyback(m, 0, data_len, data, MBUF_WAITOK);
+			if (rv) {
+				LOG(V_ERROR, "mbuf_copyback failed, rv %08x", rv);
+				fpNetStats->inputErrors++;
+				fRxCopyFailures++;
+				freePacket(m);
+				return;
+			}
 		}
 
-		submit = fNetworkInterface->inputPacket(m, data_len);
+		if (fRxBatchSize > 1) {
+			// Queued: handed to the stack by 'flushRxBatch', once per
+			// transfer, or when the batch fills up:
+			fNetworkInterface->inputPacket(m, data_len,
+				IONetworkInterface::kInputOptionQueuePacket);
+			if (++fRxQueued >= fRxBatchSize) {
+				flushRxBatch();
+			}
+		} else {
+			fNetworkInterface->inputPacket(m, data_len);
+		}
 		LOG(V_PACKET, "submitted pkt sz %d", data_len);
+		trace(TRACE_RX_FRAME, data_len, lentBuf != NULL, fRxQueued,
+			size - msg_len);
 		fpNetStats->inputPackets++;
+		fRxFrames++;
+		fRxBytes += data_len;
 		
 		size -= msg_len;
 		packet = (char *)packet + msg_len;
@@ -1323,7 +3937,245 @@ void HoRNDIS::receivePacket(void *packet, UInt32 size) {
 
 /***** RNDIS command logic *****/
 
+bool HoRNDIS::startNotifyRead() {
+	if (!fNotifyBuf.mdp) {
+		fNotifyBuf.mdp = IOBufferMemoryDescriptor::withCapacity(
+			RNDIS_NOTIFY_BUF_SZ, kIODirectionIn);
+		if (!fNotifyBuf.mdp) {
+			return false;
+		}
+		fNotifyBuf.mdp->setLength(RNDIS_NOTIFY_BUF_SZ);
+	}
+	fNotifyBuf.comp.owner = this;
+	fNotifyBuf.comp.action = notifyReadComplete;
+	fNotifyBuf.comp.parameter = NULL;
+	IOReturn rc = fCommPipe->io(fNotifyBuf.mdp, RNDIS_NOTIFY_BUF_SZ,
+		&fNotifyBuf.comp);
+	if (rc != kIOReturnSuccess) {
+		LOG(V_ERROR, "Notification read failed: %08x", rc);
+		return false;
+	}
+	fNotifyPosted = true;
+	return true;
+}
+
+void HoRNDIS::notifyReadComplete(void *obj, void *param, IOReturn rc,
+	UInt32 transferred) {
+	HoRNDIS	*me = (HoRNDIS *)obj;
+	me->fNotifyPosted = false;
+
+	// The interrupt pipe is aborted when the control interface is closed:
+	if (isTransferStopStatus(rc) || !me->fCommPipe) {
+		LOG(V_DEBUG, "Notification reader stopped: %08x", rc);
+		me->getCommandGate()->commandWakeup(&me->fResponsesAvailable);
+		return;
+	}
+
+	if (rc == kIOReturnSuccess && transferred >= 4 &&
+			*(uint32_t *)me->fNotifyBuf.mdp->getBytesNoCopy() ==
+				RNDIS_NOTIFY_RESPONSE_AVAILABLE) {
+		LOG(V_DEBUG, "RESPONSE_AVAILABLE");
+		me->fCtrlNotifications++;
+		me->fResponsesAvailable++;
+		me->getCommandGate()->commandWakeup(&me->fResponsesAvailable);
+		if (!me->fCtrlCmdInProgress) {
+			// Nobody is waiting for it: the device has a status message.
+			me->scheduleStatusFetch();
+		}
+	} else if (rc != kIOReturnSuccess) {
+		LOG(V_ERROR, "Notification read error: %08x", rc);
+	} else {
+		LOG(V_DEBUG, "Ignoring notification: %d bytes", transferred);
+	}
+
+	if (!me->startNotifyRead()) {
+		// 'rndisCommand' falls back to polling:
+		me->getCommandGate()->commandWakeup(&me->fResponsesAvailable);
+	}
+}
+
+IOReturn HoRNDIS::waitResponseAction(OSObject *owner, void *arg0, void *arg1,
+	void *arg2, void *arg3) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	const uint32_t timeoutMs = (uint32_t)(uintptr_t)arg0;
+	uint64_t deadline;
+	clock_interval_to_deadline(timeoutMs, kMillisecondScale, &deadline);
+	while (me->fResponsesAvailable == 0 && me->fNotifyPosted) {
+		IOReturn rc = me->getCommandGate()->commandSleep(
+			&me->fResponsesAvailable, deadline, THREAD_UNINT);
+		if (rc == THREAD_TIMED_OUT) {
+			LOG(V_DEBUG, "No RESPONSE_AVAILABLE after %d ms", timeoutMs);
+			break;
+		}
+	}
+	if (me->fResponsesAvailable > 0) {
+		me->fResponsesAvailable--;
+	}
+	return kIOReturnSuccess;
+}
+
+void HoRNDIS::waitResponseAvailable(uint32_t timeoutMs) {
+	// 'rndisCommand' is not always called within the command gate (e.g. from
+	// 'start'), but 'commandSleep' needs it. The gate is re-entrant.
+	getCommandGate()->runAction(waitResponseAction,
+		(void *)(uintptr_t)timeoutMs);
+}
+
+/*
+===============================
+||  STATUS MESSAGES
+===============================
+Besides the replies to our commands, the device can send messages on its
+own: REMOTE_NDIS_INDICATE_STATUS_MSG (e.g. the cable got plugged or
+unplugged) and REMOTE_NDIS_KEEPALIVE_MSG, that needs a KEEPALIVE_C reply.
+Both are fetched with GET_ENCAPSULATED_RESPONSE, like the command replies.
+
+There are two ways we receive them:
+ 1. 'rndisCommand' gets a message that is not the reply it waits for:
+    it passes the message to 'handleStatusMessage' and keeps waiting.
+ 2. A RESPONSE_AVAILABLE notification comes while no command is in
+    progress. The notification completes on the USB callback thread,
+    where we should not do synchronous control transfers, so it schedules
+    'fStatusThreadCall'. The thread call fetches the messages within the
+    command gate, which serializes it with 'rndisCommand', 'enable' and
+    'disable'.
+
+Without the interrupt endpoint, we only see the messages that arrive
+while a command is in progress: there's no point in polling for them.
+*/
+
+void HoRNDIS::scheduleStatusFetch() {
+	// The pending call holds a reference, dropped by 'statusThreadEntry':
+	retain();
+	if (thread_call_enter(fStatusThreadCall)) {
+		release();  // Was already pending.
+	}
+}
+
+void HoRNDIS::statusThreadEntry(thread_call_param_t param0,
+	thread_call_param_t param1) {
+	HoRNDIS *me = (HoRNDIS *)param0;
+	IOCommandGate *gate = me->getCommandGate();
+	if (gate) {
+		gate->runAction(fetchStatusAction);
+	}
+	me->release();
+}
+
+IOReturn HoRNDIS::fetchStatusAction(OSObject *owner, void *arg0, void *arg1,
+	void *arg2, void *arg3) {
+	HoRNDIS *me = (HoRNDIS *)owner;
+	// 'rndisCommand' fetches (and dispatches) the messages itself:
+	if (me->fCtrlCmdInProgress || !me->fCommInterface) {
+		return kIOReturnSuccess;
+	}
+	const uint8_t ifNum =
+		me->fCommInterface->getInterfaceDescriptor()->bInterfaceNumber;
+
+	void *buf = IOMallocAligned(RNDIS_CMD_BUF_SZ, sizeof(void *));
+	if (!buf) {
+		return kIOReturnNoMemory;
+	}
+	while (me->fResponsesAvailable > 0 && me->fCommInterface) {
+		me->fResponsesAvailable--;
+
+		DeviceRequest rq;
+		rq.bmRequestType = kDeviceRequestDirectionIn |
+			kDeviceRequestTypeClass | kDeviceRequestRecipientInterface;
+		rq.bRequest = USB_CDC_GET_ENCAPSULATED_RESPONSE;
+		rq.wValue = 0;
+		rq.wIndex = ifNum;
+		rq.wLength = RNDIS_CMD_BUF_SZ;
+
+		uint32_t bytes_transferred;
+		IOReturn rc = me->fCommInterface->deviceRequest(rq, buf,
+			bytes_transferred);
+		if (rc != kIOReturnSuccess) {
+			LOG(V_ERROR, "Cannot fetch the status message: %08x", rc);
+			break;
+		}
+		// One byte reply (0x00) means: nothing to fetch.
+		if (bytes_transferred >= sizeof(rndis_msg_hdr) - 4) {
+			me->handleStatusMessage((rndis_msg_hdr *)buf, bytes_transferred);
+		}
+	}
+	IOFreeAligned(buf, RNDIS_CMD_BUF_SZ);
+	return kIOReturnSuccess;
+}
+
+void HoRNDIS::handleStatusMessage(const rndis_msg_hdr *buf, uint32_t len) {
+	if (buf->msg_type == RNDIS_MSG_INDICATE) {
+		uint32_t status;
+		if (!rndisDecodeIndicate(buf, len, &status)) {
+			LOG(V_ERROR, "Short RNDIS_MSG_INDICATE: %d bytes", len);
+			return;
+		}
+		if (status == RNDIS_STATUS_MEDIA_CONNECT) {
+			LOG(V_NOTE, "Device reports media connect");
+			fIndicateConnect++;
+			// Before 'enable' and after 'disable', the link is down anyway:
+			if (fNetifEnabled) {
+				setLinkStatus(kIONetworkLinkActive | kIONetworkLinkValid,
+					getCurrentMedium());
+			}
+		} else if (status == RNDIS_STATUS_MEDIA_DISCONNECT) {
+			LOG(V_NOTE, "Device reports media disconnect");
+			fIndicateDisconnect++;
+			if (fNetifEnabled) {
+				setLinkStatus(kIONetworkLinkValid, 0);
+			}
+		} else {
+			LOG(V_DEBUG, "Ignoring status indication %08x",
+				le32_to_cpu(status));
+			fIndicateOther++;
+		}
+	} else if (buf->msg_type == RNDIS_MSG_KEEPALIVE) {
+		LOG(V_DEBUG, "RNDIS_MSG_KEEPALIVE, xid %d",
+			le32_to_cpu(buf->request_id));
+		fKeepalives++;
+		rndisSendKeepaliveCompletion(buf->request_id);
+	} else {
+		LOG(V_ERROR, "unexpected msg type %08x, msg_len %08x",
+			le32_to_cpu(buf->msg_type), le32_to_cpu(buf->msg_len));
+	}
+}
+
+void HoRNDIS::rndisSendKeepaliveCompletion(uint32_t request_id) {
+	if (!fCommInterface) {
+		return;
+	}
+	rndis_msg_hdr reply;
+	rndisEncodeKeepaliveC(&reply, request_id);  // Already little-endian.
+
+	DeviceRequest rq;
+	rq.bmRequestType = kDeviceRequestDirectionOut |
+		kDeviceRequestTypeClass | kDeviceRequestRecipientInterface;
+	rq.bRequest = USB_CDC_SEND_ENCAPSULATED_COMMAND;
+	rq.wValue = 0;
+	rq.wIndex = fCommInterface->getInterfaceDescriptor()->bInterfaceNumber;
+	rq.wLength = sizeof(reply);
+
+	uint32_t bytes_transferred;
+	IOReturn rc = fCommInterface->deviceRequest(rq, &reply, bytes_transferred);
+	if (rc != kIOReturnSuccess) {
+		LOG(V_ERROR, "Cannot send KEEPALIVE_C: %08x", rc);
+	}
+}
+
 IOReturn HoRNDIS::rndisCommand(struct rndis_msg_hdr *buf, int buflen) {
+	// While the flag is set, the status messages are ours to dispatch,
+	// see "STATUS MESSAGES" above.
+	fCtrlCmdInProgress = true;
+	IOReturn rc = rndisCommandImpl(buf, buflen);
+	fCtrlCmdInProgress = false;
+	if (fResponsesAvailable > 0 && fNotifyPosted) {
+		// The device notified us about something we did not fetch:
+		scheduleStatusFetch();
+	}
+	return rc;
+}
+
+IOReturn HoRNDIS::rndisCommandImpl(struct rndis_msg_hdr *buf, int buflen) {
 	int rc = kIOReturnSuccess;
 	if (!fCommInterface) {  // Safety: make sure 'fCommInterface' is valid.
 		LOG(V_ERROR, "fCommInterface is NULL, bailing out");
@@ -1343,6 +4195,8 @@ IOReturn HoRNDIS::rndisCommand(struct rndis_msg_hdr *buf, int buflen) {
 	}
 	const uint32_t old_msg_type = buf->msg_type;
 	const uint32_t old_request_id = buf->request_id;
+	uint64_t startTime;
+	clock_get_uptime(&startTime);
 	
 	{
 		DeviceRequest rq;
@@ -1368,25 +4222,40 @@ IOReturn HoRNDIS::rndisCommand(struct rndis_msg_hdr *buf, int buflen) {
 	// transfers on the device's default endpoint. Per [MSDN-RNDISUSB], if
 	// a device is not ready (for some reason) to reply with the actual data,
 	// it shall send a one-byte reply indicating an error, rather than stall
-	// the control pipe. The retry loop below is a hackish way of waiting
-	// for the reply.
+	// the control pipe.
 	//
 	// Per [MSDN-RNDISUSB], once the driver sends a OUT device transfer, it
 	// should wait for a notification on the interrupt endpoint from
 	// fCommInterface, and only then perform a device request to retrieve
-	// the result. Whether Android does that correctly is something I need to
-	// investigate.
+	// the result. That's what we do, when the device has the interrupt
+	// endpoint: we retrieve the result the moment the device says it's
+	// ready. Without the notification (or if it's late), the retry loop
+	// below falls back to polling every RNDIS_CMD_POLL_MS.
 	//
 	// Also, RNDIS specifies that the device may be sending
-	// REMOTE_NDIS_INDICATE_STATUS_MSG on its own. How much this applies to
-	// Android or embedded Linux devices needs to be investigated.
+	// REMOTE_NDIS_INDICATE_STATUS_MSG on its own: such messages may come
+	// before the reply, and we dispatch them as we go.
 	//
 	// Reference:
 	// https://docs.microsoft.com/en-us/windows-hardware/drivers/network/control-channel-characteristics
 
 	// Now we wait around a while for the device to get back to us.
+	// A status message does not use up an attempt, and the next fetch does
+	// not wait: without the notifications, a device that sends keepalives
+	// faster than we poll would otherwise bury the reply behind them. Up to
+	// RNDIS_CMD_ATTEMPTS of them, so that a chatty device can't keep us here.
 	int count;
-	for (count = 0; count < 10; count++) {
+	int statusMsgs = 0;
+	bool fetchNow = true;
+	for (count = 0; count < RNDIS_CMD_ATTEMPTS; count++) {
+		if (fNotifyPosted) {
+			// Returns as soon as the device notifies us:
+			waitResponseAvailable(RNDIS_CMD_POLL_MS);
+		} else if (!fetchNow) {
+			IOSleep(RNDIS_CMD_POLL_MS);
+		}
+		fetchNow = false;
+
 		DeviceRequest rq;
 		rq.bmRequestType = kDeviceRequestDirectionIn |
 			kDeviceRequestTypeClass | kDeviceRequestRecipientInterface;
@@ -1408,7 +4277,6 @@ IOReturn HoRNDIS::rndisCommand(struct rndis_msg_hdr *buf, int buflen) {
 
 		if (bytes_transferred < 12) {
 			LOG(V_ERROR, "short read on control request?");
-			IOSleep(20);
 			continue;
 		}
 		
@@ -1437,23 +4305,30 @@ IOReturn HoRNDIS::rndisCommand(struct rndis_msg_hdr *buf, int buflen) {
 				LOG(V_ERROR, "RNDIS return had incorrect xid?");
 			}
 		} else {
-			if (buf->msg_type == RNDIS_MSG_INDICATE) {
-				LOG(V_ERROR, "unsupported: RNDIS_MSG_INDICATE");	
-			} else if (buf->msg_type == RNDIS_MSG_INDICATE) {
-				LOG(V_ERROR, "unsupported: RNDIS_MSG_KEEPALIVE");
-			} else {
-				LOG(V_ERROR, "unexpected msg type %08x, msg_len %08x",
-					le32_to_cpu(buf->msg_type), le32_to_cpu(buf->msg_len));
+			// Not a reply: RNDIS_MSG_INDICATE, RNDIS_MSG_KEEPALIVE or junk.
+			handleStatusMessage(buf, bytes_transferred);
+			if (statusMsgs < RNDIS_CMD_ATTEMPTS) {
+				statusMsgs++;
+				count--;
+				fetchNow = true;
 			}
 		}
-		
-		IOSleep(20);
 	}
-	if (count == 10) {
+	if (count == RNDIS_CMD_ATTEMPTS) {
 		LOG(V_ERROR, "command timed out?");
 		return kIOReturnTimeout;
 	}
 
+	{
+		uint64_t now, elapsedNs;
+		clock_get_uptime(&now);
+		absolutetime_to_nanoseconds(now - startTime, &elapsedNs);
+		fCtrlCommands++;
+		fCtrlLastLatencyUs = (uint32_t)(elapsedNs / 1000);
+		fCtrlMaxLatencyUs = max(fCtrlMaxLatencyUs, fCtrlLastLatencyUs);
+		LOG(V_DEBUG, "Response after %d us", fCtrlLastLatencyUs);
+	}
+
 	return rc;
 }
 
@@ -1466,16 +4341,12 @@ int HoRNDIS::rndisQuery(void *buf, uint32_t oid, uint32_t in_len, void **reply,
 		struct rndis_query *get;
 		struct rndis_query_c *get_c;
 	} u;
-	uint32_t off, len;
+	const void *info;
+	uint32_t len;
 	
 	u.buf = buf;
 	
-	memset(u.get, 0, sizeof(*u.get) + in_len);
-	u.get->msg_type = RNDIS_MSG_QUERY;
-	u.get->msg_len = cpu_to_le32(sizeof(*u.get) + in_len);
-	u.get->oid = oid;
-	u.get->len = cpu_to_le32(in_len);
-	u.get->offset = cpu_to_le32(20);
+	rndisEncodeQuery(u.get, oid, in_len);
 	
 	rc = rndisCommand(u.hdr, RNDIS_CMD_BUF_SZ);
 	if (rc != kIOReturnSuccess) {
@@ -1483,18 +4354,18 @@ int HoRNDIS::rndisQuery(void *buf, uint32_t oid, uint32_t in_len, void **reply,
 		return rc;
 	}
 	
-	off = le32_to_cpu(u.get_c->offset);
-	len = le32_to_cpu(u.get_c->len);
 	LOG(V_DEBUG, "RNDIS query completed");
 	
-	if ((8 + off + len) > RNDIS_CMD_BUF_SZ) {
+	// 'rndisCommand' has checked 'msg_len' against the bytes received:
+	if (!rndisDecodeQueryC(u.get_c, le32_to_cpu(u.get_c->msg_len),
+			&info, &len)) {
 		goto fmterr;
 	}
-	if (*reply_len != -1 && len != *reply_len) {
+	if (*reply_len != -1 && len != (uint32_t)*reply_len) {
 		goto fmterr;
 	}
 	
-	*reply = ((unsigned char *) &u.get_c->request_id) + off;
+	*reply = (void *)info;
 	*reply_len = len;
 	
 	return 0;
@@ -1518,12 +4389,8 @@ bool HoRNDIS::rndisInit() {
 		return false;
 	}
 	
-	u.init->msg_type = RNDIS_MSG_INIT;
-	u.init->msg_len = cpu_to_le32(sizeof *u.init);
-	u.init->major_version = cpu_to_le32(1);
-	u.init->minor_version = cpu_to_le32(0);
 	// This is the maximum USB transfer the device is allowed to make to host:
-	u.init->max_transfer_size = IN_BUF_SIZE;
+	rndisEncodeInit(u.init, IN_BUF_SIZE);
 	rc = rndisCommand(u.hdr, RNDIS_CMD_BUF_SZ);
 	if (rc != kIOReturnSuccess) {
 		LOG(V_ERROR, "INIT not successful?");
@@ -1531,29 +4398,88 @@ bool HoRNDIS::rndisInit() {
 		return false;
 	}
 
+	rndis_init_params params;
+	if (!rndisDecodeInitC(u.init_c, le32_to_cpu(u.init_c->msg_len), &params)) {
+		LOG(V_ERROR, "INIT reply too short?");
+		IOFreeAligned(u.hdr, RNDIS_CMD_BUF_SZ);
+		return false;
+	}
+
 	if (fCommInterface) {  // Safety: don't accesss 'fCommInterface if NULL.
 		LOG(V_NOTE, "'%s': ver=%d.%d, max_packets_per_transfer=%d, "
 			"max_transfer_size=%d, packet_alignment=2^%d",
 			fCommInterface->getDevice()->getName(),
-			le32_to_cpu(u.init_c->major_version),
-			le32_to_cpu(u.init_c->minor_version),
-			le32_to_cpu(u.init_c->max_packets_per_transfer),
-			le32_to_cpu(u.init_c->max_transfer_size),
-			le32_to_cpu(u.init_c->packet_alignment));
-	}
-
-	maxOutTransferSize = le32_to_cpu(u.init_c->max_transfer_size);
-	// For now, let's limit the maxOutTransferSize by the Output Buffer size.
-	// If we implement transmitting multiple PDUs in a single USB transfer,
-	// we may want to size the output buffers based on
-	// "u.init_c->max_transfer_size".
-	maxOutTransferSize = min(maxOutTransferSize, OUT_BUF_SIZE);
-	
+			params.major_version, params.minor_version,
+			params.max_packets_per_transfer, params.max_transfer_size,
+			params.packet_alignment);
+	}
+
+	// Now that the device is initialized, it takes the queries:
+	const uint32_t devMtu = rndisQueryMaxFrameSize(u.hdr);
+	{
+		const uint32_t devMaxTransfer = params.max_transfer_size;
+		uint32_t outTransferSize = devMaxTransfer;
+		if (outTransferSize < MIN_OUT_TRANSFER_SIZE) {
+			LOG(V_NOTE, "Device reported max_transfer_size=%d, using %d instead",
+				devMaxTransfer, OUT_BUF_SIZE);
+			outTransferSize = OUT_BUF_SIZE;
+		}
+		// The output buffers are allocated with this size:
+		maxOutTransferSize = min(outTransferSize, fOutTransferSizeLimit);
+	}
+	// The largest frame that fits in a transfer, either way:
+	fMaxMtu = min(devMtu, maxOutTransferSize - sizeof(rndis_data_hdr) -
+		ETHERNET_HDR_SIZE);
+	fMaxMtu = min(fMaxMtu, IN_BUF_SIZE - sizeof(rndis_data_hdr) -
+		ETHERNET_HDR_SIZE);
+	if (fMaxMtu != ETHERNET_MTU) {
+		LOG(V_NOTE, "Device takes frames up to an MTU of %d, advertising %d",
+			devMtu, fMaxMtu);
+	}
+	maxOutPktsPerTransfer = max(params.max_packets_per_transfer, 1);
+	{
+		const uint32_t alignShift = params.packet_alignment;
+		if (alignShift > MAX_OUT_PKT_ALIGN_SHIFT) {
+			LOG(V_ERROR, "Unreasonable packet_alignment=2^%d: "
+				"not aggregating transmitted packets", alignShift);
+			maxOutPktsPerTransfer = 1;
+			outPktAlignMask = 0;
+		} else {
+			outPktAlignMask = (1u << alignShift) - 1;
+		}
+	}
+	LOG(V_DEBUG, "Output transfer size: %d", maxOutTransferSize);
+
 	IOFreeAligned(u.hdr, RNDIS_CMD_BUF_SZ);
 	
 	return true;
 }
 
+uint32_t HoRNDIS::rndisQueryMaxFrameSize(void *buf) {
+	// [MS-RNDIS] points to NDIS for the OIDs: OID_GEN_MAXIMUM_FRAME_SIZE is
+	// "the maximum network packet size, in bytes, that the NIC supports.
+	// This specification does not include a header." The MTU, that is.
+	// Returns ETHERNET_MTU if the device does not say, or not sensibly.
+	void *reply;
+	int replyLen = sizeof(uint32_t);
+	if (rndisQuery(buf, OID_GEN_MAXIMUM_FRAME_SIZE, sizeof(uint32_t), &reply,
+			&replyLen) != 0) {
+		LOG(V_NOTE, "No OID_GEN_MAXIMUM_FRAME_SIZE: using an MTU of %d",
+			ETHERNET_MTU);
+		return ETHERNET_MTU;
+	}
+	uint32_t frameSize;
+	memcpy(&frameSize, reply, sizeof(frameSize));
+	frameSize = le32_to_cpu(frameSize);
+	LOG(V_DEBUG, "OID_GEN_MAXIMUM_FRAME_SIZE: %d", frameSize);
+	if (frameSize < MIN_MTU) {
+		LOG(V_ERROR, "Unreasonable maximum frame size %d: using an MTU of %d",
+			frameSize, ETHERNET_MTU);
+		return ETHERNET_MTU;
+	}
+	return min(frameSize, fMtuLimit);
+}
+
 bool HoRNDIS::rndisSetPacketFilter(uint32_t filter) {
 	union {
 		struct rndis_msg_hdr *hdr;
@@ -1568,13 +4494,7 @@ bool HoRNDIS::rndisSetPacketFilter(uint32_t filter) {
 		return false;;
 	}
 	
-	memset(u.set, 0, sizeof *u.set);
-	u.set->msg_type = RNDIS_MSG_SET;
-	u.set->msg_len = cpu_to_le32(4 + sizeof *u.set);
-	u.set->oid = OID_GEN_CURRENT_PACKET_FILTER;
-	u.set->len = cpu_to_le32(4);
-	u.set->offset = cpu_to_le32((sizeof *u.set) - 8);
-	*(uint32_t *)(u.set + 1) = filter;
+	rndisEncodeSet(u.set, OID_GEN_CURRENT_PACKET_FILTER, &filter, sizeof filter);
 	
 	rc = rndisCommand(u.hdr, RNDIS_CMD_BUF_SZ);
 	if (rc != kIOReturnSuccess) {
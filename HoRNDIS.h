@@ -35,6 +35,7 @@
 #include <IOKit/network/IOEthernetInterface.h>
 
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/assert.h>
 #include <IOKit/IOLib.h>
 #include <IOKit/IOService.h>
@@ -48,6 +49,7 @@ extern "C"
 {
 	#include <sys/param.h>
 	#include <sys/mbuf.h>
+	#include <kern/thread_call.h>
 }
 
 #define cpu_to_le32(x) OSSwapHostToLittleInt32(x)
@@ -62,7 +64,14 @@ extern "C"
 //   https://docs.microsoft.com/en-us/windows-hardware/drivers/network/remote-ndis-to-usb-mapping
 
 #define TRANSMIT_QUEUE_SIZE     256
+
+// The output buffers are sized by the "max_transfer_size" the device returns
+// in REMOTE_NDIS_INITIALIZE_CMPLT, limited by 'kMaxOutTransferSizeKey'.
+// If the device reports less than MIN_OUT_TRANSFER_SIZE (e.g. zero), it's
+// likely not filling in the field: we fall back to OUT_BUF_SIZE.
 #define OUT_BUF_SIZE            4096
+#define MIN_OUT_TRANSFER_SIZE   (sizeof(rndis_data_hdr) + 60)
+#define MAX_OUT_BUF_SIZE        65536
 
 // Per [MS-RNDIS], description of REMOTE_NDIS_INITIALIZE_MSG:
 //    "MaxTransferSize (4 bytes): ... It SHOULD be set to 0x00004000"
@@ -72,176 +81,399 @@ extern "C"
 // 16K regardless.
 #define IN_BUF_SIZE             16384
 
+// A power of 2: the free-buffer ring indices wrap around.
 #define N_OUT_BUFS              4
-// The N_IN_BUFS value should either be 1 or 2.
-// 2 - double-buffering enabled, 1 - double-buffering disabled: single reader.
-// NOTE: surprisingly, single-buffer overall performs better, probably due to
-// less contention on the USB2 bus, which is half-duplex.
-#define N_IN_BUFS               1
+// The number of concurrent reads on the IN pipe is set by 'kInBufCountKey',
+// up to MAX_IN_BUFS. 1 - single reader, 2 - double-buffering, etc.
+// NOTE: surprisingly, single-buffer overall performs better on some setups,
+// probably due to less contention on the USB2 bus, which is half-duplex.
+// Hence, the default stays at 1.
+#define MAX_IN_BUFS             8
+#define DEFAULT_IN_BUFS         1
+// Received frames are handed to the network stack in batches of up to
+// 'kRxBatchSizeKey' frames, at most MAX_RX_BATCH.
+#define MAX_RX_BATCH            256
+#define DEFAULT_RX_BATCH        32
+
+// Zero-copy receive: number of spare input buffers that can replace the ones
+// lent to the network stack. See "ZERO-COPY RECEIVE" in HoRNDIS.cpp.
+#define MAX_RX_SPARE_BUFS       32
+#define DEFAULT_RX_SPARE_BUFS   8
 
 // Maximum payload size in a standard (non-jumbo) Ethernet frame.
 #define ETHERNET_MTU            1500
-
-/***** RNDIS definitions -- from linux/include/linux/usb/rndis_host.h ****/
-
-// Per [MSDN-RNDISUSB], "Control Channel Characteristics", it's the minumim
-// buffer size the host should support (and it's way bigger than we need).
-#define RNDIS_CMD_BUF_SZ		0x400
-
-struct rndis_msg_hdr {
-	uint32_t msg_type;
-	uint32_t msg_len;
-	uint32_t request_id;
-	uint32_t status;
-} __attribute__((packed));
-
-struct rndis_data_hdr {
-	uint32_t msg_type;
-	uint32_t msg_len;
-	uint32_t data_offset;
-	uint32_t data_len;
-	
-	uint32_t oob_data_offset;
-	uint32_t oob_data_len;
-	uint32_t num_oob;
-	uint32_t packet_data_offset;
-	
-	uint32_t packet_data_len;
-	uint32_t vc_handle;
-	uint32_t reserved;
-} __attribute__((packed));
-
-struct rndis_query {
-	uint32_t msg_type;
-	uint32_t msg_len;
-	uint32_t request_id;
-	uint32_t oid;
-	uint32_t len;
-	uint32_t offset;
-	uint32_t handle;
-} __attribute__((packed));
-
-struct rndis_query_c {
-	uint32_t msg_type;
-	uint32_t msg_len;
-	uint32_t request_id;
-	uint32_t status;
-	uint32_t len;
-	uint32_t offset;
-} __attribute__((packed));
-
-struct rndis_init {
-	uint32_t msg_type;
-	uint32_t msg_len;
-	uint32_t request_id;
-	uint32_t major_version;
-	uint32_t minor_version;
-	uint32_t max_transfer_size;
-} __attribute__((packed));
-
-struct rndis_init_c {
-	uint32_t msg_type;
-	uint32_t msg_len;
-	uint32_t request_id;
-	uint32_t status;
-	uint32_t major_version;
-	uint32_t minor_version;
-	uint32_t device_flags;
-	uint32_t medium;
-	uint32_t max_packets_per_transfer;
-	uint32_t max_transfer_size;
-	uint32_t packet_alignment;
-	uint32_t af_list_offset;
-	uint32_t af_list_size;
-} __attribute__((packed));
-
-struct rndis_set {
-	uint32_t msg_type;
-	uint32_t msg_len;
-	uint32_t request_id;
-	uint32_t oid;
-	uint32_t len;
-	uint32_t offset;
-	uint32_t handle;
-} __attribute__((packed));
-
-struct rndis_set_c {
-	uint32_t msg_type;
-	uint32_t msg_len;
-	uint32_t request_id;
-	uint32_t status;
-} __attribute__((packed));
-
-#define RNDIS_MSG_COMPLETION                    cpu_to_le32(0x80000000)
-#define RNDIS_MSG_PACKET                        cpu_to_le32(0x00000001) /* 1-N packets */
-#define RNDIS_MSG_INIT                          cpu_to_le32(0x00000002)
-#define RNDIS_MSG_INIT_C                        (RNDIS_MSG_INIT|RNDIS_MSG_COMPLETION)
-#define RNDIS_MSG_HALT                          cpu_to_le32(0x00000003)
-#define RNDIS_MSG_QUERY                         cpu_to_le32(0x00000004)
-#define RNDIS_MSG_QUERY_C                       (RNDIS_MSG_QUERY|RNDIS_MSG_COMPLETION)
-#define RNDIS_MSG_SET                           cpu_to_le32(0x00000005)
-#define RNDIS_MSG_SET_C                         (RNDIS_MSG_SET|RNDIS_MSG_COMPLETION)
-#define RNDIS_MSG_RESET                         cpu_to_le32(0x00000006)
-#define RNDIS_MSG_RESET_C                       (RNDIS_MSG_RESET|RNDIS_MSG_COMPLETION)
-#define RNDIS_MSG_INDICATE                      cpu_to_le32(0x00000007)
-#define RNDIS_MSG_KEEPALIVE                     cpu_to_le32(0x00000008)
-#define RNDIS_MSG_KEEPALIVE_C                   (RNDIS_MSG_KEEPALIVE|RNDIS_MSG_COMPLETION)
-
-#define RNDIS_STATUS_SUCCESS                    cpu_to_le32(0x00000000)
-#define RNDIS_STATUS_FAILURE                    cpu_to_le32(0xc0000001)
-#define RNDIS_STATUS_INVALID_DATA               cpu_to_le32(0xc0010015)
-#define RNDIS_STATUS_NOT_SUPPORTED              cpu_to_le32(0xc00000bb)
-#define RNDIS_STATUS_MEDIA_CONNECT              cpu_to_le32(0x4001000b)
-#define RNDIS_STATUS_MEDIA_DISCONNECT           cpu_to_le32(0x4001000c)
-#define RNDIS_STATUS_MEDIA_SPECIFIC_INDICATION  cpu_to_le32(0x40010012)
-
-#define RNDIS_PHYSICAL_MEDIUM_UNSPECIFIED       cpu_to_le32(0x00000000)
-#define RNDIS_PHYSICAL_MEDIUM_WIRELESS_LAN      cpu_to_le32(0x00000001)
-#define RNDIS_PHYSICAL_MEDIUM_CABLE_MODEM       cpu_to_le32(0x00000002)
-#define RNDIS_PHYSICAL_MEDIUM_PHONE_LINE        cpu_to_le32(0x00000003)
-#define RNDIS_PHYSICAL_MEDIUM_POWER_LINE        cpu_to_le32(0x00000004)
-#define RNDIS_PHYSICAL_MEDIUM_DSL               cpu_to_le32(0x00000005)
-#define RNDIS_PHYSICAL_MEDIUM_FIBRE_CHANNEL     cpu_to_le32(0x00000006)
-#define RNDIS_PHYSICAL_MEDIUM_1394              cpu_to_le32(0x00000007)
-#define RNDIS_PHYSICAL_MEDIUM_WIRELESS_WAN      cpu_to_le32(0x00000008)
-#define RNDIS_PHYSICAL_MEDIUM_MAX               cpu_to_le32(0x00000009)
-
-#define OID_802_3_PERMANENT_ADDRESS             cpu_to_le32(0x01010101)
-#define OID_GEN_MAXIMUM_FRAME_SIZE              cpu_to_le32(0x00010106)
-#define OID_GEN_CURRENT_PACKET_FILTER           cpu_to_le32(0x0001010e)
-#define OID_GEN_PHYSICAL_MEDIUM                 cpu_to_le32(0x00010202)
-
-/* packet filter bits used by OID_GEN_CURRENT_PACKET_FILTER */
-#define RNDIS_PACKET_TYPE_DIRECTED              cpu_to_le32(0x00000001)
-#define RNDIS_PACKET_TYPE_MULTICAST             cpu_to_le32(0x00000002)
-#define RNDIS_PACKET_TYPE_ALL_MULTICAST         cpu_to_le32(0x00000004)
-#define RNDIS_PACKET_TYPE_BROADCAST             cpu_to_le32(0x00000008)
-#define RNDIS_PACKET_TYPE_SOURCE_ROUTING        cpu_to_le32(0x00000010)
-#define RNDIS_PACKET_TYPE_PROMISCUOUS           cpu_to_le32(0x00000020)
-#define RNDIS_PACKET_TYPE_SMT                   cpu_to_le32(0x00000040)
-#define RNDIS_PACKET_TYPE_ALL_LOCAL             cpu_to_le32(0x00000080)
-#define RNDIS_PACKET_TYPE_GROUP                 cpu_to_le32(0x00001000)
-#define RNDIS_PACKET_TYPE_ALL_FUNCTIONAL        cpu_to_le32(0x00002000)
-#define RNDIS_PACKET_TYPE_FUNCTIONAL            cpu_to_le32(0x00004000)
-#define RNDIS_PACKET_TYPE_MAC_FRAME             cpu_to_le32(0x00008000)
-
-/* default filter used with RNDIS devices */
-#define RNDIS_DEFAULT_FILTER ( \
-        RNDIS_PACKET_TYPE_DIRECTED | \
-        RNDIS_PACKET_TYPE_BROADCAST | \
-        RNDIS_PACKET_TYPE_ALL_MULTICAST | \
-        RNDIS_PACKET_TYPE_PROMISCUOUS)
+// The Ethernet header (without a VLAN tag), and the frame check sequence.
+#define ETHERNET_HDR_SIZE       14
+#define ETHERNET_CRC_SIZE       4
+// The device's OID_GEN_MAXIMUM_FRAME_SIZE is the MTU we advertise, within
+// MIN_MTU and 'kMaxMtuKey', and as far as a frame fits in the transfers:
+// the IN buffers take a 16K one. A device that reports less than MIN_MTU
+// is not taken at its word.
+#define MIN_MTU                 576
+#define MAX_JUMBO_MTU           9000
+
+// Scatter-gather transmit (see 'kTxZeroCopyKey'): frames smaller than this
+// are cheaper to copy, and mbuf chains with more segments are copied too.
+#define TX_SG_MIN_FRAME         512
+#define MAX_TX_SG_SEGS          8
+
+// Largest "packet_alignment" exponent we accept from the device when packing
+// multiple messages into a single transfer (2^8 = 256 bytes). The devices
+// I've seen report 0 (no alignment) or 2 (4 bytes).
+#define MAX_OUT_PKT_ALIGN_SHIFT 8
+
+// Priority transmit (see 'kTxPriorityKey'): the frames wait in the driver's
+// class queues, with room for TX_PRIO_QUEUE_LEN of them in the priority
+// class, and the rest of TRANSMIT_QUEUE_SIZE for the bulk. The priority
+// class sends up to TX_PRIO_QUANTUM frames in a row while bulk ones wait.
+#define TX_PRIO_QUEUE_LEN       64
+#define TX_PRIO_QUANTUM         16
+
+// FQ-CoDel (see 'kTxFqCodelKey'): the bulk frames are hashed into this many
+// flow queues, served round robin with a quantum of TX_FQ_QUANTUM bytes.
+#define TX_FQ_FLOWS             64
+#define TX_FQ_QUANTUM           1514
+
+/***** Optional tunables *****/
+// These may be added to the driver's IOKitPersonalities entries (Info.plist)
+// and are read once when the driver starts.
+
+// Boolean: pack multiple outgoing Ethernet frames into a single USB transfer,
+// as allowed by the device's "max_packets_per_transfer". Default: true.
+#define kTxAggregationKey       "TxAggregation"
+
+// Number: upper bound on the size of the output buffers (and USB OUT
+// transfers), in bytes. It is further clamped to MAX_OUT_BUF_SIZE.
+// Default: 16384, as recommended by [MS-RNDIS] for "MaxTransferSize".
+#define kMaxOutTransferSizeKey  "MaxOutTransferSize"
+#define DEFAULT_MAX_OUT_TRANSFER_SIZE 16384
+
+// Number: how many bulk IN reads are kept in flight, 1 to MAX_IN_BUFS.
+// Default: DEFAULT_IN_BUFS.
+#define kInBufCountKey          "InBufCount"
+
+// Number: how many received frames may be queued to the network stack
+// before flushing them, 1 to MAX_RX_BATCH. The queue is flushed at least once
+// per USB transfer. 1 delivers every frame immediately.
+// Default: DEFAULT_RX_BATCH.
+#define kRxBatchSizeKey         "RxBatchSize"
+
+// Boolean: deliver received frames to the network stack as mbufs pointing
+// directly into the input buffers, instead of copying them. Default: false.
+#define kRxZeroCopyKey          "RxZeroCopy"
+
+// Number: how many spare input buffers the zero-copy receive may use,
+// 1 to MAX_RX_SPARE_BUFS. Default: DEFAULT_RX_SPARE_BUFS.
+#define kRxZeroCopyPoolSizeKey  "RxZeroCopyPoolSize"
+
+// Boolean: transmit large frames straight out of their mbufs, with the RNDIS
+// header in a separate small buffer, instead of copying them into the output
+// buffer. Only applies to frames sent in a transfer of their own, i.e. when
+// not aggregating. Default: false.
+#define kTxZeroCopyKey          "TxZeroCopy"
+
+// Boolean: keep the USB buffers allocated while the device is attached,
+// instead of releasing them on every interface 'disable' and reallocating
+// them on 'enable'. Default: false.
+#define kPersistentBuffersKey   "PersistentBuffers"
+
+// Number: with 'kPersistentBuffersKey', release the buffers anyway once the
+// interface has been down for this many seconds; 0 keeps them until the
+// device is detached. Clamped to MAX_POOL_IDLE_TRIM_SEC, a day, so that the
+// timeout in milliseconds fits in 32 bits. Default: DEFAULT_POOL_IDLE_TRIM_SEC.
+#define kPoolIdleTrimSecKey     "PoolIdleTrimSec"
+#define DEFAULT_POOL_IDLE_TRIM_SEC  300
+#define MAX_POOL_IDLE_TRIM_SEC  86400
+
+// Boolean: transmit without taking the data work loop gate, so
+// 'outputPacket' does not wait for the USB completions and the stall
+// recovery, see "NON-GATED TRANSMIT" in HoRNDIS.cpp. Default: false.
+#define kTxNonGatedQueueKey     "TxNonGatedQueue"
+
+// Number: hold a partly filled output transfer for up to this many
+// microseconds, for more frames to join it, rather than sending it as soon
+// as the USB pipe is idle or the output queue is empty; it's sent right away
+// once it's full. See "TRANSMIT COALESCING" in HoRNDIS.cpp. 0 turns it off.
+// Clamped to MAX_TX_COALESCE_USEC. Unlike the other tunables, it can also be
+// changed at run time, through the registry ('setProperties'). Has no effect
+// without 'kTxAggregationKey', or with 'kTxNonGatedQueueKey'. Default: 0.
+#define kTxCoalesceUsecKey      "TxCoalesceUsec"
+#define MAX_TX_COALESCE_USEC    2000
+
+// Boolean: let the small control and interactive frames (TCP segments
+// without payload, DNS, DHCP, ICMP, ARP, and the latency-sensitive DSCPs)
+// go out ahead of the bulk data, see "TRANSMIT PRIORITY" in HoRNDIS.cpp.
+// Has no effect with 'kTxNonGatedQueueKey'. Default: false.
+#define kTxPriorityKey          "TxPriority"
+
+// Boolean: active queue management of the bulk frames waiting in the driver,
+// per flow (FQ-CoDel, RFC 8290): the flows take turns, and a flow whose
+// frames keep waiting longer than the CoDel target gets them dropped, or
+// ECN-marked, see "TRANSMIT AQM" in HoRNDIS.cpp. Works with or without
+// 'kTxPriorityKey'. Has no effect with 'kTxNonGatedQueueKey'. Default: false.
+#define kTxFqCodelKey           "TxFqCodel"
+// Numbers: the CoDel target (acceptable standing queue delay) and interval
+// (the time it may be exceeded for), in microseconds. Default: 5 and 100 ms.
+#define kTxCodelTargetUsecKey   "TxCodelTargetUsec"
+#define kTxCodelIntervalUsecKey "TxCodelIntervalUsec"
+#define DEFAULT_CODEL_TARGET_USEC   5000
+#define DEFAULT_CODEL_INTERVAL_USEC 100000
+// Boolean: mark the ECN-capable frames rather than dropping them.
+// Default: true.
+#define kTxCodelEcnKey          "TxCodelEcn"
+
+// Boolean: limit the bytes in flight to the device to what it completes
+// between our transmits, as the Linux BQL does, rather than using all of the
+// output buffers: the frames wait above the driver, where they can still be
+// reordered or dropped, see "BYTE QUEUE LIMITS" in HoRNDIS.cpp. Has no effect
+// with 'kTxNonGatedQueueKey'. Default: false.
+#define kTxByteQueueLimitKey    "TxByteQueueLimit"
+// How long the limit must have had slack before it's lowered, in milliseconds.
+#define TX_BQL_HOLD_MS          100
+
+// Numbers: stall the output queue when the free output buffers are down to
+// 'kTxStallLowWaterKey', and resume it when they are back up to
+// 'kTxResumeHighWaterKey', see "OUTPUT QUEUE STALLS" in HoRNDIS.cpp.
+// They are clamped to 0 ... N_OUT_BUFS - 1, and the low one + 1 ... N_OUT_BUFS.
+// Default: 0 and 1, i.e. stall when they run out, resume on the first one.
+#define kTxStallLowWaterKey     "TxStallLowWater"
+#define kTxResumeHighWaterKey   "TxResumeHighWater"
+
+// Boolean: timestamp the frames and transfers at each stage of the data path,
+// and keep log-scale histograms of the time spent in each, published with the
+// statistics, see "LATENCY HISTOGRAMS" in HoRNDIS.cpp. Default: false.
+#define kLatencyHistogramsKey   "LatencyHistograms"
+// Set through the registry ('setProperties'), to any true value: clears the
+// latency histograms. Not a tunable: it's never read from the properties.
+#define kResetLatencyKey        "ResetLatencyHistograms"
+
+// Boolean: record the data path's events (frames sent and received, transfer
+// completions) into a binary ring of TRACE_RING_RECS records, published under
+// 'kHoRNDISTraceKey', see "EVENT TRACE" in HoRNDIS.cpp. Like
+// 'kTxCoalesceUsecKey', it can also be switched at run time, through the
+// registry ('setProperties'). Default: false.
+#define kTraceKey               "Trace"
+#define TRACE_RING_RECS         2048  // A power of two.
+
+// Boolean: every UTIL_SAMPLE_MS, sample the throughput and the utilization
+// of the bulk pipes, and publish their rolling averages over the last 1, 10
+// and 60 seconds under 'kHoRNDISThroughputKey', see "THROUGHPUT SAMPLER" in
+// HoRNDIS.cpp. Default: true.
+#define kThroughputSamplerKey   "ThroughputSampler"
+#define UTIL_SAMPLE_MS          1000
+
+// Number: upper bound on the MTU advertised to the network stack, from the
+// device's maximum frame size, see MAX_JUMBO_MTU. Setting it to ETHERNET_MTU
+// keeps the standard frames with a device that takes larger ones.
+// Default: MAX_JUMBO_MTU.
+#define kMaxMtuKey              "MaxMTU"
+
+// Boolean: offer TCP segmentation offload (TSO) to the network stack, for
+// IPv4 and IPv6: TCP then hands us up to 64K at a time, which we cut into
+// segments of the size it asks for, right into the output transfers, see
+// "TCP SEGMENTATION OFFLOAD" in HoRNDIS.cpp. Has no effect with
+// 'kTxNonGatedQueueKey'. Default: false.
+#define kTxTsoKey               "TxTSO"
+
+// The statistics dictionary published on the HoRNDIS service:
+#define kHoRNDISStatsKey        "HoRNDISStats"
+// The event trace's dump, see "TraceRing.h" for the format:
+#define kHoRNDISTraceKey        "HoRNDISTrace"
+// The throughput and the utilization, see "UtilSampler.h":
+#define kHoRNDISThroughputKey   "HoRNDISThroughput"
+
+/***** RNDIS definitions *****/
+
+// The RNDIS messages, and their encoding and decoding:
+#include "RNDISCodec.h"
+// The classification of the outgoing frames:
+#include "TxSched.h"
+// The TCP segmentation offload:
+#include "TxSegment.h"
+// The per-stage latency histograms:
+#include "LatencyHist.h"
+// The event trace:
+#include "TraceRing.h"
+// The rolling throughput and utilization:
+#include "UtilSampler.h"
 
 #define USB_CDC_SEND_ENCAPSULATED_COMMAND       0x00
 #define USB_CDC_GET_ENCAPSULATED_RESPONSE       0x01
 
+// Per [MSDN-RNDISUSB], the device signals that a response is ready by sending
+// this 8-byte notification on the communication interface's interrupt
+// endpoint: RESPONSE_AVAILABLE (0x00000001), followed by 0x00000000.
+#define RNDIS_NOTIFY_RESPONSE_AVAILABLE         cpu_to_le32(0x00000001)
+// Some devices send a longer CDC-style notification: read up to the
+// full-speed interrupt endpoint's maximum packet size.
+#define RNDIS_NOTIFY_BUF_SZ                     64
+
+// The number of attempts to get the response to an RNDIS command, and how
+// long we wait for RESPONSE_AVAILABLE (or poll without it) between them.
+#define RNDIS_CMD_ATTEMPTS                      10
+#define RNDIS_CMD_POLL_MS                       20
+
 /***** Actual class definitions *****/
 
+struct pipebuf;
+
+// A bulk pipe completion, waiting to be dispatched on the data work loop,
+// see "DATA WORK LOOP" in HoRNDIS.cpp. It's kept in the transfer's own
+// 'pipebuf_t': every posted transfer completes once, and is not posted again
+// until it's dispatched, so there's always room for it.
 typedef struct {
+	IOUSBHostCompletionAction action;  // 'dataReadComplete' or 'dataWriteComplete'.
+	void *param;
+	IOReturn rc;
+	uint32_t transferred;
+	uint64_t stamp;  // When it completed, for the latency histograms.
+	struct pipebuf *next;  // The next one to dispatch, in completion order.
+} datadone_t;
+
+typedef struct pipebuf {
 	IOBufferMemoryDescriptor *mdp;
 	IOUSBHostCompletion comp;
+	datadone_t done;  // Between the completion and its dispatch.
 } pipebuf_t;
 
+class HoRNDIS;
+
+// Scatter-gather transmit state of an output buffer slot: while the transfer
+// is in flight, the slot's 'mdp' is unused, and 'packet' is sent directly.
+typedef struct {
+	IOBufferMemoryDescriptor *hdr;  // Holds just the 'rndis_data_hdr'.
+	IOMemoryDescriptor *desc;  // Header + mbuf segments; NULL if not in use.
+	mbuf_t packet;
+} txsg_t;
+
+// Input buffer that may be lent to the network stack by the zero-copy receive.
+// The 'refs' is the number of mbufs pointing into the buffer, plus
+// RXBUF_POOL_REF while the driver holds on to it: the buffer is idle when
+// 'refs == RXBUF_POOL_REF', and it's freed when 'refs' drops to zero.
+typedef struct {
+	IOBufferMemoryDescriptor *mdp;
+	HoRNDIS *owner;
+	volatile SInt32 refs;
+} rxbuf_t;
+#define RXBUF_POOL_REF          0x10000
+
+// The input buffers form a ring: reads are posted to the IN pipe in ring
+// order, and their completions are processed in that same order.
+typedef struct {
+	pipebuf_t buf;  // With zero-copy receive, 'buf.mdp' is 'rx->mdp'.
+	rxbuf_t *rx;  // Only used by the zero-copy receive.
+	IOReturn rc;  // Saved completion status, valid when 'completed' is set.
+	uint32_t transferred;
+	bool posted;  // The read was posted, and not yet processed.
+	bool completed;  // The read has completed, waiting for its turn.
+	bool deferred;  // Posted, but waits for the stall recovery to be issued.
+	bool inPipe;  // Submitted to the IN pipe, and not completed yet.
+} inbuf_t;
+
+// An output transfer that waits for the OUT pipe stall recovery.
+typedef struct {
+	int poolIndx;
+	IOMemoryDescriptor *mdp;  // The buffer or the scatter-gather descriptor.
+	uint32_t len;
+} txdefer_t;
+
+// A frame waiting in the driver's transmit queues, see "TRANSMIT PRIORITY"
+// in HoRNDIS.cpp. The slots are linked into the class queues, the flow
+// queues, or the free list.
+typedef struct {
+	mbuf_t packet;
+	uint64_t stamp;  // Enqueued at, in absolute time.
+	uint32_t len;
+	int16_t next;  // The next slot in the same list, or -1.
+	uint8_t cls;  // TX_CLASS_xxx.
+	uint8_t flow;  // Index into 'fTxFlows', for the bulk with FQ-CoDel.
+	uint8_t l3ofs;  // Of the IP header, for the ECN marking.
+	uint8_t ipVersion;  // 4 or 6, or 0 if it's not IP.
+} txslot_t;
+
+// A flow queue of FQ-CoDel, see "TRANSMIT AQM" in HoRNDIS.cpp.
+typedef struct {
+	int16_t head;  // The FIFO of 'txslot_t', -1 if empty.
+	int16_t tail;
+	uint32_t bytes;
+	int32_t deficit;  // Bytes it may still send in this round.
+	int16_t nextFlow;  // In the new or the old flows list, or -1.
+	bool active;  // In one of these lists.
+	tx_codel codel;
+} txflow_t;
+
+typedef struct {
+	int16_t head;  // Index into 'fTxFlows', -1 if empty.
+	int16_t tail;
+} txflowlist_t;
+
+// A transmit class: a FIFO of 'txslot_t', and its statistics.
+typedef struct {
+	const char *name;  // For the statistics.
+	int16_t head;  // -1 if the queue is empty.
+	int16_t tail;
+	uint32_t count;
+	uint32_t limit;
+	uint64_t frames;  // Dequeued and handed to the transmit.
+	uint64_t bytes;
+	uint64_t drops;  // Refused: the queue was full.
+	uint64_t delaySumUs;  // Of the dequeued frames.
+	uint32_t delayMaxUs;
+} txclass_t;
+
+
+// The stages of the data path that have a latency histogram,
+// see "LATENCY HISTOGRAMS" in HoRNDIS.cpp:
+enum {
+	LAT_TX_QUEUE = 0,  // Waiting in the driver's queues.
+	LAT_TX_OUTPUT,  // An 'outputPacket' call.
+	LAT_TX_HOLD,  // The open buffer, from its first frame until it's sent.
+	LAT_TX_SUBMIT,  // The OUT pipe's 'io' call.
+	LAT_TX_USB,  // From the submit until the transfer completes.
+	LAT_TX_DISPATCH,  // From the completion until 'dataWriteComplete'.
+	LAT_RX_DISPATCH,  // From the completion until 'dataReadComplete'.
+	LAT_RX_PROCESS,  // Decoding a transfer, and passing its frames up.
+	LAT_RX_SUBMIT,  // The IN pipe's 'io' call.
+	LAT_NUM_STAGES
+};
+
+// The USB I/O errors of a bulk pipe, failed submits and completions, by
+// their IOReturn: the first USB_ERROR_CODES different codes are counted
+// each on its own, the ones after that together.
+#define USB_ERROR_CODES         8
+typedef struct {
+	IOReturn codes[USB_ERROR_CODES];
+	uint64_t counts[USB_ERROR_CODES];
+	uint64_t other;
+} usberrs_t;
+
+// Stall recovery state and statistics of a bulk pipe,
+// see "STALL RECOVERY" in HoRNDIS.cpp.
+typedef struct {
+	const char *name;  // For the logs and the statistics.
+	IOTimerEventSource *timer;  // Paces the 'clearStall' attempts.
+	// Guards 'recovering' and the deferred transfers: the non-gated transmit
+	// defers its writes outside of the work loop.
+	IOSimpleLock *lock;
+	volatile bool recovering;  // New transfers are deferred until it's cleared.
+	uint32_t backoffMs;  // Delay before the next burst of attempts.
+	uint64_t startTime;  // Of the current recovery, in absolute time.
+	uint64_t stalls;  // Recoveries started.
+	uint64_t clearAttempts;  // 'clearStall' calls.
+	uint64_t recoveries;  // Recoveries that cleared the stall.
+	uint64_t failures;  // Recoveries that ran out of time or failed.
+	uint32_t lastRecoveryUs;
+	uint32_t maxRecoveryUs;
+} stallrec_t;
+
+// Stall recovery: 'clearStall' calls in one burst, the cap on the backoff
+// between the bursts, and how long we keep trying before giving up (in the
+// data path, and in 'enable').
+#define STALL_BURST_ATTEMPTS        8
+#define STALL_BACKOFF_MAX_MS        64
+#define STALL_RECOVERY_BUDGET_MS    2000
+#define STALL_ENABLE_BUDGET_MS      200
+
 class HoRNDIS : public IOEthernetController {
 	OSDeclareDefaultStructors(HoRNDIS);	// Constructor & Destructor stuff
 
@@ -292,10 +524,12 @@ private:
 
 	// fCallbackCount is the number of callbacks concurrently running
 	// (possibly offset by a certain value).
-	//  - Every successful async API call shall "fCallbackCount++".
+	//  - Every successful async API call shall increment it.
 	//  - Every time we exit the completion without making another call:
 	//    'callbackExit()'.
-	int fCallbackCount;
+	// It is updated atomically: the non-gated 'outputPacket' counts its
+	// transfers outside of the work loop.
+	volatile SInt32 fCallbackCount;
 	
 	// USB Communication:
 	IOUSBHostInterface *fCommInterface;
@@ -303,22 +537,357 @@ private:
 	
 	IOUSBHostPipe *fInPipe;
 	IOUSBHostPipe *fOutPipe;
+
+	// Interrupt IN pipe of the communication interface, if the device has
+	// one: delivers the RESPONSE_AVAILABLE notifications to 'rndisCommand'.
+	IOUSBHostPipe *fCommPipe;
+	pipebuf_t fNotifyBuf;
+	bool fNotifyPosted;  // The notification read is in flight.
+	uint32_t fResponsesAvailable;  // Notifications not yet consumed.
+	bool fCtrlCmdInProgress;  // 'rndisCommand' is fetching the responses.
+	// Fetches and dispatches the unsolicited status messages, see
+	// "STATUS MESSAGES" in HoRNDIS.cpp:
+	thread_call_t fStatusThreadCall;
 	
 	uint32_t rndisXid;  // RNDIS request_id count.
 	int32_t maxOutTransferSize;  // Set by 'rdisInit' from device reply.
+	uint32_t fOutTransferSizeLimit;  // From 'kMaxOutTransferSizeKey'.
+	uint32_t fMtuLimit;  // From 'kMaxMtuKey'.
+	uint32_t fMaxMtu;  // Set by 'rndisInit': what the interface can take.
+	// Also set by 'rndisInit' from the device reply:
+	uint32_t maxOutPktsPerTransfer;
+	uint32_t outPktAlignMask;  // "packet_alignment", converted to bit mask.
 
 	pipebuf_t outbufs[N_OUT_BUFS];
-	// Allow double-buffering to enable the best hardware utilization:
-	pipebuf_t inbufs[N_IN_BUFS];
-	uint16_t outbufStack[N_OUT_BUFS];
-	int numFreeOutBufs;
+	// Allow multiple reads to enable the best hardware utilization:
+	inbuf_t inbufs[MAX_IN_BUFS];
+	int fNumInBufs;  // Set from 'kInBufCountKey' property.
+	int fInRingHead;  // The oldest posted read: the next one to process.
+	uint32_t fRxBatchSize;  // Set from 'kRxBatchSizeKey' property.
+	uint32_t fRxQueued;  // Frames queued to the network stack, not flushed.
+
+	// Zero-copy receive, see "ZERO-COPY RECEIVE" in HoRNDIS.cpp:
+	bool fRxZeroCopy;  // Set from 'kRxZeroCopyKey' property.
+	rxbuf_t *fRxSpares[MAX_RX_SPARE_BUFS];
+	int fNumRxSpares;  // Set from 'kRxZeroCopyPoolSizeKey' property.
+	// The free 'outbufs' indices: a single-producer, single-consumer ring,
+	// see "NON-GATED TRANSMIT" in HoRNDIS.cpp. The transmit takes them at
+	// the head, 'dataWriteComplete' puts them back at the tail.
+	uint16_t fTxFreeRing[N_OUT_BUFS];
+	volatile UInt32 fTxFreeHead;
+	volatile UInt32 fTxFreeTail;
+
+	// Persistent buffers: 'disable' keeps the buffers allocated, and
+	// 'fPoolTrimTimer' releases them after the idle period.
+	bool fPersistentBuffers;  // Set from 'kPersistentBuffersKey' property.
+	uint32_t fPoolIdleTrimSec;  // Set from 'kPoolIdleTrimSecKey' property.
+	bool fResourcesAllocated;
+	IOTimerEventSource *fPoolTrimTimer;
+
+	// Transmit aggregation: the output buffer, taken off the 'fTxFreeRing',
+	// that is being filled with RNDIS packet messages, but not yet sent.
+	bool fTxAggregation;  // Set from 'kTxAggregationKey' property.
+	int fTxOpenIndx;  // Index into 'outbufs', or -1 if nothing is open.
+	uint32_t fTxOpenLen;  // Bytes written into the open buffer.
+	uint32_t fTxOpenFrames;  // Number of messages in the open buffer.
+	uint32_t fTxOpenBytes;  // Of the frames in these messages.
+	uint32_t fTxLastMsgOfs;  // Offset of the last message in the open buffer.
+
+	// Scatter-gather transmit:
+	bool fTxZeroCopy;  // Set from 'kTxZeroCopyKey' property.
+	txsg_t fTxSg[N_OUT_BUFS];
+
+	// Stall recovery of the data pipes, and the transfers waiting for it:
+	stallrec_t fInStall;
+	stallrec_t fOutStall;
+	txdefer_t fTxDeferred[N_OUT_BUFS];  // In submission order.
+	int fNumTxDeferred;
+
+	// Set from 'kTxNonGatedQueueKey', by 'createOutputQueue':
+	bool fTxNonGated;
+
+	// Priority transmit: the frames the output queue has handed over, until
+	// there's an output buffer for them.
+	bool fTxPriority;  // From 'kTxPriorityKey', unless non-gated.
+	txslot_t fTxSlots[TRANSMIT_QUEUE_SIZE];
+	int16_t fTxFreeSlot;  // The free list.
+	txclass_t fTxClasses[TX_NUM_CLASSES];
+	uint32_t fTxQueued;  // In all of the classes.
+	uint32_t fTxPrioRun;  // Priority frames sent in a row, while bulk waits.
+	int16_t fTxHeldSlot;  // Taken off the queues, waits for an output buffer.
+
+	// FQ-CoDel of the bulk class, in the same slots:
+	bool fTxFqCodel;  // From 'kTxFqCodelKey', unless non-gated.
+	bool fTxCodelEcn;  // From 'kTxCodelEcnKey'.
+	tx_codel_params fTxCodelParams;  // In absolute time.
+	uint32_t fTxFlowPerturb;
+	txflow_t fTxFlows[TX_FQ_FLOWS];
+	txflowlist_t fTxNewFlows;
+	txflowlist_t fTxOldFlows;
+
+	// Byte queue limits of the output transfers:
+	bool fTxBql;  // From 'kTxByteQueueLimitKey', unless non-gated.
+	tx_dql fTxDql;
+	uint32_t fTxPostedLen[N_OUT_BUFS];  // Of the transfers in flight.
+
+	// Output queue stalls, see "OUTPUT QUEUE STALLS" in HoRNDIS.cpp:
+	int fTxStallWater;  // From 'kTxStallLowWaterKey'.
+	int fTxResumeWater;  // From 'kTxResumeHighWaterKey'.
+	bool fTxQueueStalled;
+	uint64_t fTxStalledSince;  // In absolute time.
+
+	// Latency histograms, see "LATENCY HISTOGRAMS" in HoRNDIS.cpp:
+	bool fLatHist;  // From 'kLatencyHistogramsKey'.
+	lat_hist fLatStages[LAT_NUM_STAGES];
+	uint64_t fTxOpenStamp;  // The open buffer's first frame.
+	uint64_t fTxPostStamp[N_OUT_BUFS];  // Of the transfers in flight.
+
+	// Event trace, see "EVENT TRACE" in HoRNDIS.cpp:
+	volatile bool fTraceOn;  // From 'kTraceKey'.
+	trace_ring fTrace;  // Valid once 'fTraceRecs' is allocated.
+	trace_rec *fTraceRecs;  // Kept until 'free', once allocated.
+
+	// Throughput sampler, see "THROUGHPUT SAMPLER" in HoRNDIS.cpp:
+	bool fUtilSampler;  // From 'kThroughputSamplerKey'.
+	IOTimerEventSource *fUtilTimer;
+	util_history fUtilHistory;
+	uint64_t fTxBusyTime;  // The OUT transfers' times in flight, summed.
+	int fInReadsInPipe;  // The 'inbufs' that are 'inPipe'.
+	uint64_t fInIdleSince;  // When 'fInReadsInPipe' last dropped to 0.
+	uint64_t fInIdleTime;  // The idle time before 'fInIdleSince'.
+
+	// TCP segmentation offload, see "TCP SEGMENTATION OFFLOAD" in HoRNDIS.cpp:
+	bool fTxTso;  // From 'kTxTsoKey', unless non-gated.
+	mbuf_t fTxTsoPacket;  // The super-packet being cut, if any.
+	tx_tso fTxTsoInfo;  // Of 'fTxTsoPacket'.
+	uint32_t fTxTsoNext;  // Its next segment.
+	uint8_t fTxTsoHdr[TX_TSO_MAX_HDR_LEN];  // Its headers, as TCP made them.
+
+	// Transmit coalescing: 'fTxCoalesceTimer' sends the open buffer, once
+	// it's been held for 'fTxCoalesceUs'.
+	volatile uint32_t fTxCoalesceUs;  // From 'kTxCoalesceUsecKey'.
+	IOTimerEventSource *fTxCoalesceTimer;
+	bool fTxCoalesceArmed;
+
+	// The data path's own work loop, see "DATA WORK LOOP" in HoRNDIS.cpp:
+	IOWorkLoop *fDataWorkLoop;
+	IOCommandGate *fDataGate;
+	IOInterruptEventSource *fDataEvent;  // Dispatches 'fDataDone'.
+	IOSimpleLock *fDataDoneLock;  // Guards the 'fDataDone' list.
+	pipebuf_t *fDataDone;  // The completed transfers, in completion order.
+	pipebuf_t **fDataDoneTail;  // Where the next one is linked.
+	// Runs 'fDataAction' in the data gate, for 'runDataAction':
+	thread_call_t fDataThreadCall;
+	IOCommandGate::Action fDataAction;
+	IOReturn fDataActionResult;
+	bool fDataActionDone;
+
+	// Statistics, published under 'kHoRNDISStatsKey':
+	uint64_t fTxTransfers;  // Successfully submitted USB OUT transfers.
+	uint64_t fTxFrames;  // Ethernet frames in these transfers.
+	uint32_t fTxMaxFramesPerTransfer;
+	uint64_t fTxBytes;  // Of these frames.
+	uint64_t fTxTransferBytes;  // Of the transfers: with the RNDIS headers.
+	uint64_t fTxOutOfBuffers;  // Frames that waited for an output buffer.
+	uint64_t fTxZeroCopyFrames;  // Frames sent by scatter-gather.
+	uint64_t fTxZeroCopyFallbacks;  // Too fragmented or no memory: copied.
+	uint64_t fTxCoalesceFlushes;  // Transfers sent by 'fTxCoalesceTimer'.
+	uint64_t fTxTsoPackets;  // TSO super-packets taken.
+	uint64_t fTxTsoSegments;  // The frames they were cut into.
+	uint64_t fTxTsoErrors;  // Uncuttable packets, unsent segments: dropped.
+	uint64_t fTxCodelDrops;  // Dropped by CoDel, for their sojourn time.
+	uint64_t fTxCodelMarks;  // ECN-marked instead.
+	uint64_t fTxFqNewFlows;  // Flows that became active.
+	uint64_t fTxBqlStalls;  // Output queue stalls for the byte queue limit.
+	uint32_t fTxBqlMaxInflight;  // Bytes.
+	uint64_t fTxQueueStalls;  // Output queue stalls, for any reason.
+	uint64_t fTxQueueResumes;
+	uint64_t fTxQueueStalledUs;  // Time spent stalled.
+	uint64_t fCtrlCommands;  // RNDIS control messages that got a response.
+	uint64_t fCtrlNotifications;  // RESPONSE_AVAILABLE notifications.
+	uint32_t fCtrlLastLatencyUs;  // Of the last command, in microseconds.
+	uint32_t fCtrlMaxLatencyUs;
+	uint64_t fIndicateConnect;  // RNDIS_STATUS_MEDIA_CONNECT indications.
+	uint64_t fIndicateDisconnect;  // RNDIS_STATUS_MEDIA_DISCONNECT.
+	uint64_t fIndicateOther;  // Other status indications: ignored.
+	uint64_t fKeepalives;  // KEEPALIVE messages that we have answered.
+	uint64_t fRxTransfers;  // Successful USB IN transfers.
+	uint64_t fRxFrames;  // Ethernet frames passed to the network stack.
+	uint32_t fRxMaxFramesPerTransfer;
+	uint64_t fRxBytes;  // Of these frames.
+	uint64_t fRxTransferBytes;  // Of the transfers: with the RNDIS headers.
+	// 'receivePacket' gave up on the rest of a transfer: indexed by the
+	// 'rndisParseDataMsg' result, and for the lack of an mbuf.
+	uint64_t fRxParseErrors[RNDIS_PARSE_BAD_DATA + 1];
+	uint64_t fRxAllocFailures;  // 'allocatePacket' failed.
+	uint64_t fRxWrapFailures;  // 'rxWrapSlice' failed.
+	uint64_t fRxCopyFailures;  // 'mbuf_copyback' failed.
+	usberrs_t fInErrors;
+	usberrs_t fOutErrors;
+	uint64_t fRxBatchFlushes;  // 'flushInputQueue' calls that passed frames.
+	uint32_t fRxBatchMaxFrames;
+	uint64_t fRxZeroCopyTransfers;  // IN transfers lent to the network stack.
+	uint64_t fRxZeroCopyFrames;
+	uint64_t fRxPoolExhausted;  // No spare buffer: the transfer was copied.
+	uint64_t fPoolAllocations;  // 'allocateResources' that allocated.
+	uint64_t fPoolReuses;  // 'allocateResources' that kept the buffers.
+	uint64_t fPoolTrims;  // Releases by the idle timer.
 
 	void callbackExit();
+	void resetResources();
+	static void poolTrimTimeout(OSObject *owner, IOTimerEventSource *sender);
+	int numFreeOutBufs() const {
+		return (int)(fTxFreeTail - fTxFreeHead);
+	}
+	int numOutBufsInFlight() const {
+		return N_OUT_BUFS - numFreeOutBufs() - (fTxOpenIndx >= 0 ? 1 : 0);
+	}
+	bool txTakeFreeBuf(int *poolIndx);
+	void txUntakeFreeBuf(int poolIndx);
+	int txPutFreeBuf(int poolIndx);
+	void txResetFreeBufs(int numFree);
+	bool txCanOpenBuffer() const {
+		// There's an output buffer, and the byte queue limit lets us use it:
+		return numFreeOutBufs() > 0 && (!fTxBql || txDqlAvail(&fTxDql) >= 0);
+	}
+	bool txShouldStall() const;
+	void txQueueStalled();
+	bool txShouldResume(int numFree);
+	void txBqlReset();
+	void txBqlQueued(int poolIndx, uint32_t len);
+	uint32_t txAlign(uint32_t len) const {
+		return rndisAlign(len, outPktAlignMask);
+	}
+	bool txOpenBufferHasRoom(uint32_t msgLen) const;
+	bool txCoalescing() const {
+		return fTxCoalesceUs > 0 && fTxAggregation && !fTxNonGated;
+	}
+	static void txCoalesceTimeout(OSObject *owner, IOTimerEventSource *sender);
+	void txOpenBuffer(int poolIndx);
+	void txAppendPacket(mbuf_t packet, uint32_t pktlen);
+	IOReturn txSubmitOpenBuffer();
+	bool txSubmitScatterGather(mbuf_t packet, uint32_t pktlen, IOReturn *ior);
+	void txReleaseScatterGather(int poolIndx);
+	UInt32 txSendPacket(mbuf_t packet);
+	UInt32 txSubmitOrHold();
+	bool txTsoStart(mbuf_t packet, uint32_t pktlen, uint32_t mss);
+	bool txTsoContinue(IOReturn *ior);
+	void txTsoAppendSegment(uint32_t seg);
+	void txTsoFlush();
+	uint32_t txBacklog() const {
+		return getOutputQueue()->getSize() + fTxQueued;
+	}
+	bool txQueueing() const {
+		// The frames wait in the driver's queues: 'fTxSlots'.
+		return fTxPriority || fTxFqCodel;
+	}
+	void txQueueReset();
+	bool txEnqueue(mbuf_t packet);
+	int16_t txDequeue();
+	void txKick();
+	void txQueueFlush();
+	void txFreeSlot(int16_t indx);
+	void txFlowListAppend(txflowlist_t *list, int16_t flow);
+	int16_t txFlowPop(int16_t flow);
+	void txFqEnqueue(int16_t indx);
+	void txFqDropFattest();
+	int16_t txFqDequeue();
+	int16_t txCodelDequeue(int16_t flow, uint64_t now);
+	bool txCodelShouldDrop(int16_t flow, int16_t indx, uint64_t now);
+	bool txCodelMark(int16_t indx);
+	void txCodelDrop(int16_t indx);
+	uint64_t latStamp() const {
+		// 0 if the histograms are off: no need for the time, then.
+		uint64_t now = 0;
+		if (fLatHist) {
+			clock_get_uptime(&now);
+		}
+		return now;
+	}
+	void latAdd(int stage, uint32_t us) {
+		if (fLatHist) {
+			latHistAdd(&fLatStages[stage], us);
+		}
+	}
+	void latSince(int stage, uint64_t since, uint64_t now = 0);
+	static IOReturn latResetAction(OSObject *owner, void *arg0, void *arg1,
+		void *arg2, void *arg3);
+	void publishLatency(OSDictionary *dict);
+	void trace(uint16_t event, uint32_t a0, uint32_t a1 = 0, uint32_t a2 = 0,
+		uint32_t a3 = 0) {
+		if (fTraceOn) {
+			uint64_t now;
+			clock_get_uptime(&now);
+			traceAdd(&fTrace, now, event, a0, a1, a2, a3);
+		}
+	}
+	static IOReturn traceSwitchAction(OSObject *owner, void *arg0, void *arg1,
+		void *arg2, void *arg3);
+	void publishTrace();
+	uint64_t utilStamp() const {
+		// Like 'latStamp', for the OUT transfers' times in flight:
+		uint64_t now = 0;
+		if (fUtilSampler || fLatHist) {
+			clock_get_uptime(&now);
+		}
+		return now;
+	}
+	void utilReadPosted(inbuf_t *inbuf);
+	void utilReadDone(inbuf_t *inbuf);
+	static void utilTimeout(OSObject *owner, IOTimerEventSource *sender);
+	void publishThroughput();
+	void publishStats();
 	static void dataWriteComplete(void *obj, void *param, IOReturn ior, UInt32 transferred);
 	static void dataReadComplete(void *obj, void *param, IOReturn ior, UInt32 transferred);
+	static void dataReadDone(void *obj, void *param, IOReturn ior, UInt32 transferred);
+	static void dataWriteDone(void *obj, void *param, IOReturn ior, UInt32 transferred);
+	void queueDataDone(pipebuf_t *pb, IOUSBHostCompletionAction action,
+		void *param,
+		IOReturn ior, UInt32 transferred);
+	static void dataEventAction(OSObject *owner, IOInterruptEventSource *sender,
+		int count);
+	bool createDataWorkLoop();
+	IOReturn runDataAction(IOCommandGate::Action action);
+	static void dataThreadEntry(thread_call_param_t param0,
+		thread_call_param_t param1);
+	static IOReturn dataActionDoneAction(OSObject *owner, void *arg0,
+		void *arg1, void *arg2, void *arg3);
+	static IOReturn dataStartAction(OSObject *owner, void *arg0, void *arg1,
+		void *arg2, void *arg3);
+	static IOReturn dataStopAction(OSObject *owner, void *arg0, void *arg1,
+		void *arg2, void *arg3);
+	void processInRing();
+	bool rxPostRead(inbuf_t *inbuf);
+	IOReturn txPostWrite(int poolIndx, IOMemoryDescriptor *mdp, uint32_t len);
+
+	IOReturn clearStallBurst(IOUSBHostPipe *pipe, stallrec_t *rec);
+	bool clearStallSync(IOUSBHostPipe *pipe, stallrec_t *rec, uint32_t budgetMs);
+	void stallBegin(stallrec_t *rec);
+	void stallStart(stallrec_t *rec);
+	void stallEnd(stallrec_t *rec, bool recovered);
+	static void stallTimeout(OSObject *owner, IOTimerEventSource *sender);
+	void stallReissueDeferred(stallrec_t *rec, bool recovered);
+	void stallCancel();
+	void txFailDeferred(IOReturn status);
+
+	bool startNotifyRead();
+	static void notifyReadComplete(void *obj, void *param, IOReturn ior, UInt32 transferred);
+	static IOReturn waitResponseAction(OSObject *owner, void *arg0, void *arg1,
+		void *arg2, void *arg3);
+	void waitResponseAvailable(uint32_t timeoutMs);
+
+	static void statusThreadEntry(thread_call_param_t param0,
+		thread_call_param_t param1);
+	static IOReturn fetchStatusAction(OSObject *owner, void *arg0, void *arg1,
+		void *arg2, void *arg3);
+	void scheduleStatusFetch();
+	void handleStatusMessage(const struct rndis_msg_hdr *buf, uint32_t len);
+	void rndisSendKeepaliveCompletion(uint32_t request_id);
 
 	bool rndisInit();
+	uint32_t rndisQueryMaxFrameSize(void *buf);
 	IOReturn rndisCommand(struct rndis_msg_hdr *buf, int buflen);
+	IOReturn rndisCommandImpl(struct rndis_msg_hdr *buf, int buflen);
 	int rndisQuery(void *buf, uint32_t oid, uint32_t in_len, void **reply, int *reply_len);
 	bool rndisSetPacketFilter(uint32_t filter);
 
@@ -334,7 +903,15 @@ private:
 	void releaseResources(void);
 	bool createNetworkInterface(void);
 
-	void receivePacket(void *packet, UInt32 size);
+	rxbuf_t *allocateRxBuf();
+	static void freeRxBuf(rxbuf_t *rx);
+	static void rxBufRelease(rxbuf_t *rx);
+	static void rxBufExtFree(caddr_t extbuf, u_int extsize, caddr_t extarg);
+	rxbuf_t *rxLendInBuf(inbuf_t *inbuf);
+	mbuf_t rxWrapSlice(rxbuf_t *rx, void *data, uint32_t len);
+
+	void receivePacket(void *packet, UInt32 size, rxbuf_t *lentBuf);
+	void flushRxBatch();
 
 public:
 	// IOKit overrides
@@ -344,11 +921,15 @@ public:
 	virtual bool start(IOService *provider) override;
 	virtual bool willTerminate(IOService *provider, IOOptionBits options) override;
 	virtual void stop(IOService *provider) override;
+	virtual bool serializeProperties(OSSerialize *s) const override;
+	virtual IOReturn setProperties(OSObject *properties) override;
 
 	// IOEthernetController overrides
 	virtual IOOutputQueue *createOutputQueue(void) override;
 	virtual IOReturn getHardwareAddress(IOEthernetAddress *addr) override;
 	virtual IOReturn getMaxPacketSize(UInt32 *maxSize) const override;
+	virtual IOReturn setMaxPacketSize(UInt32 maxSize) override;
+	virtual UInt32 getFeatures() const override;
 	virtual IOReturn getPacketFilters(const OSSymbol *group,
 									  UInt32 *filters ) const  override;
 	virtual IONetworkInterface *createInterface() override;
@@ -366,8 +947,8 @@ public:
 
 class HoRNDISInterface : public IOEthernetInterface {
 	OSDeclareDefaultStructors(HoRNDISInterface);
-	int maxmtu;
+	UInt32 maxmtu;
 public:
-	virtual bool init(IONetworkController *controller, int mtu);
+	virtual bool init(IONetworkController *controller, int mtu, int maxMtu);
 	virtual bool setMaxTransferUnit(UInt32 mtu) override;
 };
@@ -0,0 +1,91 @@
+/* LatencyHist.h
+ * Log-scale latency histograms, for the per-stage latencies of the data path
+ * HoRNDIS, a RNDIS driver for Mac OS X
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// The samples are in microseconds; taking the timestamps is up to the
+// caller.
+
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Bucket 0 counts the samples under 1 us, bucket i > 0 the samples in
+// [2^(i-1), 2^i) us. The last bucket also takes everything above, from
+// about 4 seconds up.
+#define LAT_HIST_BUCKETS        24
+
+struct lat_hist {
+	uint64_t count;
+	uint64_t sumUs;
+	uint32_t maxUs;
+	uint32_t buckets[LAT_HIST_BUCKETS];
+};
+
+static inline int latHistBucket(uint32_t us) {
+	if (us == 0) {
+		return 0;
+	}
+	const int bucket = 32 - __builtin_clz(us);
+	return bucket < LAT_HIST_BUCKETS ? bucket : LAT_HIST_BUCKETS - 1;
+}
+
+// The largest sample that can fall into 'bucket'.
+static inline uint32_t latHistBucketMaxUs(int bucket) {
+	return bucket == 0 ? 0 : (uint32_t)((1ULL << bucket) - 1);
+}
+
+static inline void latHistAdd(struct lat_hist *h, uint32_t us) {
+	h->count++;
+	h->sumUs += us;
+	if (us > h->maxUs) {
+		h->maxUs = us;
+	}
+	h->buckets[latHistBucket(us)]++;
+}
+
+// An upper bound of the 'permille'/1000 quantile: the top of the bucket it
+// falls into, but no more than the largest sample. 0 if there are none.
+static inline uint32_t latHistPercentile(const struct lat_hist *h,
+	uint32_t permille) {
+	if (h->count == 0) {
+		return 0;
+	}
+	// The rank of the sample, counting from 1, rounded up:
+	uint64_t rank = (h->count * permille + 999) / 1000;
+	if (rank == 0) {
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			const uint32_t top = latHistBucketMaxUs(i);
+			return top < h->maxUs ? top : h->maxUs;
+		}
+	}
+	// The buckets are updated without a lock, and may lag the count:
+	return h->maxUs;
+}
+
+static inline void latHistReset(struct lat_hist *h) {
+	memset(h, 0, sizeof(*h));
+}
+
+#endif /* LATENCY_HIST_H */
@@ -0,0 +1,396 @@
+/* RNDISCodec.h
+ * RNDIS message definitions, encoding and decoding
+ * HoRNDIS, a RNDIS driver for Mac OS X
+ *
+ *   Copyright (c) 2012 Joshua Wise.
+ *   Copyright (c) 2018 Mikhail Iakhiaev
+ *
+ * RNDIS logic is from linux/drivers/net/usb/rndis_host.c, which is:
+ *
+ *   Copyright (c) 2005 David Brownell.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// This header is shared by the kext and the userspace tests under "test/":
+// it must not depend on IOKit, or on anything else from the kernel. The
+// same goes for the other headers the tests include (see "test/Makefile").
+// Everything here works on plain byte buffers, in the wire (little-endian)
+// format. As in the rest of HoRNDIS, the RNDIS_xxx and OID_xxx constants
+// are already little-endian: compare them against the raw message fields.
+
+#ifndef RNDIS_CODEC_H
+#define RNDIS_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+// The kext defines these with 'OSSwap' functions, before including us:
+#ifndef cpu_to_le32
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define cpu_to_le32(x) __builtin_bswap32(x)
+#else
+#define cpu_to_le32(x) ((uint32_t)(x))
+#endif
+#endif
+#ifndef le32_to_cpu
+#define le32_to_cpu(x) cpu_to_le32(x)
+#endif
+
+/***** RNDIS definitions -- from linux/include/linux/usb/rndis_host.h ****/
+
+// Per [MSDN-RNDISUSB], "Control Channel Characteristics", it's the minumim
+// buffer size the host should support (and it's way bigger than we need).
+#define RNDIS_CMD_BUF_SZ		0x400
+
+struct rndis_msg_hdr {
+	uint32_t msg_type;
+	uint32_t msg_len;
+	uint32_t request_id;
+	uint32_t status;
+} __attribute__((packed));
+
+struct rndis_data_hdr {
+	uint32_t msg_type;
+	uint32_t msg_len;
+	uint32_t data_offset;
+	uint32_t data_len;
+
+	uint32_t oob_data_offset;
+	uint32_t oob_data_len;
+	uint32_t num_oob;
+	uint32_t packet_data_offset;
+
+	uint32_t packet_data_len;
+	uint32_t vc_handle;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct rndis_query {
+	uint32_t msg_type;
+	uint32_t msg_len;
+	uint32_t request_id;
+	uint32_t oid;
+	uint32_t len;
+	uint32_t offset;
+	uint32_t handle;
+} __attribute__((packed));
+
+struct rndis_query_c {
+	uint32_t msg_type;
+	uint32_t msg_len;
+	uint32_t request_id;
+	uint32_t status;
+	uint32_t len;
+	uint32_t offset;
+} __attribute__((packed));
+
+struct rndis_init {
+	uint32_t msg_type;
+	uint32_t msg_len;
+	uint32_t request_id;
+	uint32_t major_version;
+	uint32_t minor_version;
+	uint32_t max_transfer_size;
+} __attribute__((packed));
+
+struct rndis_init_c {
+	uint32_t msg_type;
+	uint32_t msg_len;
+	uint32_t request_id;
+	uint32_t status;
+	uint32_t major_version;
+	uint32_t minor_version;
+	uint32_t device_flags;
+	uint32_t medium;
+	uint32_t max_packets_per_transfer;
+	uint32_t max_transfer_size;
+	uint32_t packet_alignment;
+	uint32_t af_list_offset;
+	uint32_t af_list_size;
+} __attribute__((packed));
+
+struct rndis_set {
+	uint32_t msg_type;
+	uint32_t msg_len;
+	uint32_t request_id;
+	uint32_t oid;
+	uint32_t len;
+	uint32_t offset;
+	uint32_t handle;
+} __attribute__((packed));
+
+struct rndis_set_c {
+	uint32_t msg_type;
+	uint32_t msg_len;
+	uint32_t request_id;
+	uint32_t status;
+} __attribute__((packed));
+
+// REMOTE_NDIS_INDICATE_STATUS_MSG: sent by the device on its own.
+struct rndis_indicate {
+	uint32_t msg_type;
+	uint32_t msg_len;
+	uint32_t status;
+	uint32_t length;  // Of the status buffer.
+	uint32_t offset;  // Of the status buffer, from 'status'.
+} __attribute__((packed));
+
+// REMOTE_NDIS_KEEPALIVE_MSG is 'rndis_msg_hdr' without 'status'.
+// Its completion message is 'rndis_msg_hdr' with the request_id echoed back.
+
+#define RNDIS_MSG_COMPLETION                    cpu_to_le32(0x80000000)
+#define RNDIS_MSG_PACKET                        cpu_to_le32(0x00000001) /* 1-N packets */
+#define RNDIS_MSG_INIT                          cpu_to_le32(0x00000002)
+#define RNDIS_MSG_INIT_C                        (RNDIS_MSG_INIT|RNDIS_MSG_COMPLETION)
+#define RNDIS_MSG_HALT                          cpu_to_le32(0x00000003)
+#define RNDIS_MSG_QUERY                         cpu_to_le32(0x00000004)
+#define RNDIS_MSG_QUERY_C                       (RNDIS_MSG_QUERY|RNDIS_MSG_COMPLETION)
+#define RNDIS_MSG_SET                           cpu_to_le32(0x00000005)
+#define RNDIS_MSG_SET_C                         (RNDIS_MSG_SET|RNDIS_MSG_COMPLETION)
+#define RNDIS_MSG_RESET                         cpu_to_le32(0x00000006)
+#define RNDIS_MSG_RESET_C                       (RNDIS_MSG_RESET|RNDIS_MSG_COMPLETION)
+#define RNDIS_MSG_INDICATE                      cpu_to_le32(0x00000007)
+#define RNDIS_MSG_KEEPALIVE                     cpu_to_le32(0x00000008)
+#define RNDIS_MSG_KEEPALIVE_C                   (RNDIS_MSG_KEEPALIVE|RNDIS_MSG_COMPLETION)
+
+#define RNDIS_STATUS_SUCCESS                    cpu_to_le32(0x00000000)
+#define RNDIS_STATUS_FAILURE                    cpu_to_le32(0xc0000001)
+#define RNDIS_STATUS_INVALID_DATA               cpu_to_le32(0xc0010015)
+#define RNDIS_STATUS_NOT_SUPPORTED              cpu_to_le32(0xc00000bb)
+#define RNDIS_STATUS_MEDIA_CONNECT              cpu_to_le32(0x4001000b)
+#define RNDIS_STATUS_MEDIA_DISCONNECT           cpu_to_le32(0x4001000c)
+#define RNDIS_STATUS_MEDIA_SPECIFIC_INDICATION  cpu_to_le32(0x40010012)
+
+#define RNDIS_PHYSICAL_MEDIUM_UNSPECIFIED       cpu_to_le32(0x00000000)
+#define RNDIS_PHYSICAL_MEDIUM_WIRELESS_LAN      cpu_to_le32(0x00000001)
+#define RNDIS_PHYSICAL_MEDIUM_CABLE_MODEM       cpu_to_le32(0x00000002)
+#define RNDIS_PHYSICAL_MEDIUM_PHONE_LINE        cpu_to_le32(0x00000003)
+#define RNDIS_PHYSICAL_MEDIUM_POWER_LINE        cpu_to_le32(0x00000004)
+#define RNDIS_PHYSICAL_MEDIUM_DSL               cpu_to_le32(0x00000005)
+#define RNDIS_PHYSICAL_MEDIUM_FIBRE_CHANNEL     cpu_to_le32(0x00000006)
+#define RNDIS_PHYSICAL_MEDIUM_1394              cpu_to_le32(0x00000007)
+#define RNDIS_PHYSICAL_MEDIUM_WIRELESS_WAN      cpu_to_le32(0x00000008)
+#define RNDIS_PHYSICAL_MEDIUM_MAX               cpu_to_le32(0x00000009)
+
+#define OID_802_3_PERMANENT_ADDRESS             cpu_to_le32(0x01010101)
+#define OID_GEN_MAXIMUM_FRAME_SIZE              cpu_to_le32(0x00010106)
+#define OID_GEN_CURRENT_PACKET_FILTER           cpu_to_le32(0x0001010e)
+#define OID_GEN_PHYSICAL_MEDIUM                 cpu_to_le32(0x00010202)
+
+/* packet filter bits used by OID_GEN_CURRENT_PACKET_FILTER */
+#define RNDIS_PACKET_TYPE_DIRECTED              cpu_to_le32(0x00000001)
+#define RNDIS_PACKET_TYPE_MULTICAST             cpu_to_le32(0x00000002)
+#define RNDIS_PACKET_TYPE_ALL_MULTICAST         cpu_to_le32(0x00000004)
+#define RNDIS_PACKET_TYPE_BROADCAST             cpu_to_le32(0x00000008)
+#define RNDIS_PACKET_TYPE_SOURCE_ROUTING        cpu_to_le32(0x00000010)
+#define RNDIS_PACKET_TYPE_PROMISCUOUS           cpu_to_le32(0x00000020)
+#define RNDIS_PACKET_TYPE_SMT                   cpu_to_le32(0x00000040)
+#define RNDIS_PACKET_TYPE_ALL_LOCAL             cpu_to_le32(0x00000080)
+#define RNDIS_PACKET_TYPE_GROUP                 cpu_to_le32(0x00001000)
+#define RNDIS_PACKET_TYPE_ALL_FUNCTIONAL        cpu_to_le32(0x00002000)
+#define RNDIS_PACKET_TYPE_FUNCTIONAL            cpu_to_le32(0x00004000)
+#define RNDIS_PACKET_TYPE_MAC_FRAME             cpu_to_le32(0x00008000)
+
+/* default filter used with RNDIS devices */
+#define RNDIS_DEFAULT_FILTER ( \
+        RNDIS_PACKET_TYPE_DIRECTED | \
+        RNDIS_PACKET_TYPE_BROADCAST | \
+        RNDIS_PACKET_TYPE_ALL_MULTICAST | \
+        RNDIS_PACKET_TYPE_PROMISCUOUS)
+
+/***** Data messages *****/
+
+// Rounds 'len' up to the 'packet_alignment', given as the bit mask.
+static inline uint32_t rndisAlign(uint32_t len, uint32_t alignMask) {
+	return (len + alignMask) & ~alignMask;
+}
+
+// Writes the REMOTE_NDIS_PACKET_MSG header for a 'pktlen'-byte frame.
+// The frame itself goes right after the header.
+static inline void rndisWriteDataHdr(void *buf, uint32_t pktlen) {
+	struct rndis_data_hdr *hdr = (struct rndis_data_hdr *)buf;
+	memset(hdr, 0, sizeof *hdr);
+	hdr->msg_type = RNDIS_MSG_PACKET;
+	hdr->msg_len = cpu_to_le32(pktlen + sizeof *hdr);
+	hdr->data_offset = cpu_to_le32(sizeof(*hdr) - 8);
+	hdr->data_len = cpu_to_le32(pktlen);
+}
+
+// Appends the header of the next packet message to the 'len' bytes of
+// messages already in the transfer buffer 'base'. The new message starts
+// at the next 'alignMask' boundary: the padding is zeroed, and counted in
+// the 'msg_len' of the previous message, at 'lastMsgOfs'.
+// Returns the offset of the new message.
+static inline uint32_t rndisAppendDataHdr(uint8_t *base, uint32_t len,
+	uint32_t lastMsgOfs, uint32_t alignMask, uint32_t pktlen) {
+	const uint32_t offset = rndisAlign(len, alignMask);
+	if (offset != len) {
+		struct rndis_data_hdr *prev = (struct rndis_data_hdr *)(base + lastMsgOfs);
+		prev->msg_len = cpu_to_le32(offset - lastMsgOfs);
+		memset(base + len, 0, offset - len);
+	}
+	rndisWriteDataHdr(base + offset, pktlen);
+	return offset;
+}
+
+enum {
+	RNDIS_PARSE_OK = 0,
+	RNDIS_PARSE_SHORT,  // Not even a header left in the transfer.
+	RNDIS_PARSE_NOT_PACKET,  // The message is not REMOTE_NDIS_PACKET_MSG.
+	RNDIS_PARSE_BAD_MSG_LEN,  // 'msg_len' is past the transfer, or too small.
+	RNDIS_PARSE_BAD_DATA,  // The frame is not within the message.
+};
+
+// A frame found by 'rndisParseDataMsg'.
+struct rndis_rx_frame {
+	uint32_t msg_len;  // The next message starts this far from this one.
+	uint32_t data_ofs;  // Of the frame, from the start of the message.
+	uint32_t data_len;
+};
+
+// Parses the packet message at the start of the 'size' remaining bytes of
+// a received transfer. Returns one of RNDIS_PARSE_xxx.
+static inline int rndisParseDataMsg(const void *buf, uint32_t size,
+	struct rndis_rx_frame *frame) {
+	const struct rndis_data_hdr *hdr = (const struct rndis_data_hdr *)buf;
+	if (size <= sizeof(struct rndis_data_hdr)) {
+		return RNDIS_PARSE_SHORT;
+	}
+	if (hdr->msg_type != RNDIS_MSG_PACKET) {  // both are LE, so that's okay
+		return RNDIS_PARSE_NOT_PACKET;
+	}
+	const uint32_t msg_len = le32_to_cpu(hdr->msg_len);
+	const uint32_t data_ofs = le32_to_cpu(hdr->data_offset);
+	const uint32_t data_len = le32_to_cpu(hdr->data_len);
+	// Too small 'msg_len' would never get us to the next message:
+	if (msg_len > size || msg_len < sizeof(struct rndis_data_hdr)) {
+		return RNDIS_PARSE_BAD_MSG_LEN;
+	}
+	if ((uint64_t)data_ofs + data_len + 8 > msg_len) {
+		return RNDIS_PARSE_BAD_DATA;
+	}
+	frame->msg_len = msg_len;
+	frame->data_ofs = data_ofs + 8;
+	frame->data_len = data_len;
+	return RNDIS_PARSE_OK;
+}
+
+/***** Control messages *****/
+// The encoders leave 'request_id' to 'rndisCommand', and return 'msg_len'.
+
+static inline uint32_t rndisEncodeInit(void *buf, uint32_t maxTransferSize) {
+	struct rndis_init *init = (struct rndis_init *)buf;
+	memset(init, 0, sizeof *init);
+	init->msg_type = RNDIS_MSG_INIT;
+	init->msg_len = cpu_to_le32(sizeof *init);
+	init->major_version = cpu_to_le32(1);
+	init->minor_version = cpu_to_le32(0);
+	// This is the maximum USB transfer the device is allowed to make to host:
+	init->max_transfer_size = cpu_to_le32(maxTransferSize);
+	return sizeof *init;
+}
+
+// The REMOTE_NDIS_INITIALIZE_CMPLT fields we care about, in host order.
+struct rndis_init_params {
+	uint32_t major_version;
+	uint32_t minor_version;
+	uint32_t max_packets_per_transfer;
+	uint32_t max_transfer_size;
+	uint32_t packet_alignment;  // Power of 2 exponent.
+};
+
+static inline bool rndisDecodeInitC(const void *buf, uint32_t len,
+	struct rndis_init_params *params) {
+	const struct rndis_init_c *init_c = (const struct rndis_init_c *)buf;
+	if (len < sizeof *init_c || init_c->msg_type != RNDIS_MSG_INIT_C) {
+		return false;
+	}
+	params->major_version = le32_to_cpu(init_c->major_version);
+	params->minor_version = le32_to_cpu(init_c->minor_version);
+	params->max_packets_per_transfer =
+		le32_to_cpu(init_c->max_packets_per_transfer);
+	params->max_transfer_size = le32_to_cpu(init_c->max_transfer_size);
+	params->packet_alignment = le32_to_cpu(init_c->packet_alignment);
+	return true;
+}
+
+// The 'in_len' bytes of the query input buffer are zeroed.
+static inline uint32_t rndisEncodeQuery(void *buf, uint32_t oid,
+	uint32_t in_len) {
+	struct rndis_query *get = (struct rndis_query *)buf;
+	memset(get, 0, sizeof(*get) + in_len);
+	get->msg_type = RNDIS_MSG_QUERY;
+	get->msg_len = cpu_to_le32(sizeof(*get) + in_len);
+	get->oid = oid;
+	get->len = cpu_to_le32(in_len);
+	get->offset = cpu_to_le32(sizeof(*get) - 8);
+	return sizeof(*get) + in_len;
+}
+
+// Finds the information buffer of the 'len'-byte REMOTE_NDIS_QUERY_CMPLT.
+static inline bool rndisDecodeQueryC(const void *buf, uint32_t len,
+	const void **reply, uint32_t *reply_len) {
+	const struct rndis_query_c *get_c = (const struct rndis_query_c *)buf;
+	if (len < sizeof *get_c) {
+		return false;
+	}
+	const uint32_t off = le32_to_cpu(get_c->offset);
+	const uint32_t infoLen = le32_to_cpu(get_c->len);
+	// The offset is counted from 'request_id':
+	if (8 + (uint64_t)off + infoLen > len) {
+		return false;
+	}
+	*reply = (const uint8_t *)&get_c->request_id + off;
+	*reply_len = infoLen;
+	return true;
+}
+
+static inline uint32_t rndisEncodeSet(void *buf, uint32_t oid,
+	const void *data, uint32_t data_len) {
+	struct rndis_set *set = (struct rndis_set *)buf;
+	memset(set, 0, sizeof *set);
+	set->msg_type = RNDIS_MSG_SET;
+	set->msg_len = cpu_to_le32(data_len + sizeof *set);
+	set->oid = oid;
+	set->len = cpu_to_le32(data_len);
+	set->offset = cpu_to_le32((sizeof *set) - 8);
+	memcpy(set + 1, data, data_len);
+	return data_len + sizeof *set;
+}
+
+// The reply to REMOTE_NDIS_KEEPALIVE_MSG; 'request_id' is echoed as is.
+static inline uint32_t rndisEncodeKeepaliveC(void *buf, uint32_t request_id) {
+	struct rndis_msg_hdr *reply = (struct rndis_msg_hdr *)buf;
+	reply->msg_type = RNDIS_MSG_KEEPALIVE_C;
+	reply->msg_len = cpu_to_le32(sizeof *reply);
+	reply->request_id = request_id;
+	reply->status = RNDIS_STATUS_SUCCESS;
+	return sizeof *reply;
+}
+
+// Gets the (little-endian) status of REMOTE_NDIS_INDICATE_STATUS_MSG.
+static inline bool rndisDecodeIndicate(const void *buf, uint32_t len,
+	uint32_t *status) {
+	const struct rndis_indicate *ind = (const struct rndis_indicate *)buf;
+	if (len < sizeof *ind || ind->msg_type != RNDIS_MSG_INDICATE) {
+		return false;
+	}
+	*status = ind->status;
+	return true;
+}
+
+#endif  // RNDIS_CODEC_H
@@ -0,0 +1,171 @@
+/* TraceRing.h
+ * A binary event trace of the data path: the ring, and its dump format
+ * HoRNDIS, a RNDIS driver for Mac OS X
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// The kext writes the ring and dumps it, the "TraceDecode" tool under
+// "test/" reads the dump. The timestamps are in whatever unit the writer
+// uses, and the dump says how many make a second.
+// All the fields are in the host's byte order: decode on a machine of the
+// same endianness (any Mac, or x86 and ARM Linux).
+
+#ifndef TRACE_RING_H
+#define TRACE_RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+// The events, and what their arguments are:
+enum {
+	TRACE_TX_OUTPUT = 1,  // 'outputPacket': length, status, queued, free bufs.
+	TRACE_TX_COMPLETE,  // 'dataWriteComplete': buf, status, bytes, free bufs.
+	TRACE_RX_COMPLETE,  // 'dataReadComplete': buf, status, bytes, ring head.
+	TRACE_RX_FRAME,  // 'receivePacket', per frame: length, lent, batched, left.
+	TRACE_RX_ERROR,  // 'receivePacket' gave up: parse result, bytes left.
+	TRACE_NUM_EVENTS
+};
+
+// A record. 'seq' numbers them in the order they were reserved (the low bits
+// of the ring's 'head', at the time). A writer
+// invalidates it first, and sets it last: so a dump taken while the ring is
+// being written can tell the records rewritten meanwhile, see 'traceDump'.
+struct trace_rec {
+	uint64_t stamp;
+	uint32_t seq;
+	uint16_t event;
+	uint16_t reserved;
+	uint32_t args[4];
+};
+
+// The ring: a power of two of records. Any number of writers may add to it
+// at once, without a lock: each one reserves its record with an atomic
+// increment of 'head'.
+struct trace_ring {
+	volatile uint64_t head;  // Records ever reserved: it never wraps.
+	uint32_t mask;  // Number of records - 1.
+	struct trace_rec *recs;
+};
+
+static inline void traceInit(struct trace_ring *ring, struct trace_rec *recs,
+	uint32_t numRecs) {
+	ring->head = 0;
+	ring->mask = numRecs - 1;
+	ring->recs = recs;
+	memset(recs, 0, numRecs * sizeof(struct trace_rec));
+	// Never a 'seq' that goes into that record:
+	for (uint32_t i = 0; i < numRecs; i++) {
+		recs[i].seq = i + 1;
+	}
+}
+
+static inline void traceAdd(struct trace_ring *ring, uint64_t stamp,
+	uint16_t event, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3) {
+	const uint32_t seq = (uint32_t)__atomic_fetch_add(&ring->head, 1,
+		__ATOMIC_RELAXED);
+	struct trace_rec *r = &ring->recs[seq & ring->mask];
+	// Same as in 'traceInit', before the rest changes:
+	__atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->stamp = stamp;
+	r->event = event;
+	r->reserved = 0;
+	r->args[0] = a0;
+	r->args[1] = a1;
+	r->args[2] = a2;
+	r->args[3] = a3;
+	__atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+}
+
+/***** The dump *****/
+
+// The dump is this header, then the records, oldest first.
+#define TRACE_DUMP_MAGIC        0x52544e48  // "HNTR", little-endian.
+#define TRACE_DUMP_VERSION      1
+
+struct trace_dump_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t recSize;  // sizeof(struct trace_rec).
+	uint32_t numRecs;  // Records that follow.
+	uint32_t lost;  // Written, but not in the dump: overwritten, or torn.
+	uint64_t ticksPerSec;  // Of the records' 'stamp'.
+};
+
+static inline uint32_t traceDumpSize(const struct trace_ring *ring) {
+	return (uint32_t)(sizeof(struct trace_dump_hdr) +
+		(ring->mask + 1) * sizeof(struct trace_rec));
+}
+
+// Dumps the ring into 'buf', of at least 'traceDumpSize' bytes. Returns the
+// bytes used. Only the records of the last lap, that were not being
+// rewritten as we went, are kept.
+static inline uint32_t traceDump(const struct trace_ring *ring, void *buf,
+	uint64_t ticksPerSec) {
+	struct trace_dump_hdr *hdr = (struct trace_dump_hdr *)buf;
+	struct trace_rec *out = (struct trace_rec *)(hdr + 1);
+	const uint32_t numRecs = ring->mask + 1;
+	const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	const uint32_t written = head < numRecs ? (uint32_t)head : numRecs;
+	const uint32_t last = (uint32_t)head;
+	uint32_t kept = 0;
+	for (uint32_t seq = last - written; seq != last; seq++) {
+		const struct trace_rec *r = &ring->recs[seq & ring->mask];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq) {
+			continue;  // Still being written, or already rewritten.
+		}
+		out[kept] = *r;
+		// Rewritten while we were copying it?
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq ||
+				out[kept].seq != seq) {
+			continue;
+		}
+		kept++;
+	}
+	hdr->magic = TRACE_DUMP_MAGIC;
+	hdr->version = TRACE_DUMP_VERSION;
+	hdr->recSize = sizeof(struct trace_rec);
+	hdr->numRecs = kept;
+	hdr->lost = head - kept < UINT32_MAX ? (uint32_t)(head - kept) :
+		UINT32_MAX;
+	hdr->ticksPerSec = ticksPerSec;
+	return (uint32_t)(sizeof(*hdr) + kept * sizeof(struct trace_rec));
+}
+
+// Checks a dump of 'len' bytes: returns its records, or NULL if it's not one.
+static inline const struct trace_rec *traceDumpRecords(const void *buf,
+	uint32_t len, const struct trace_dump_hdr **hdrOut) {
+	const struct trace_dump_hdr *hdr = (const struct trace_dump_hdr *)buf;
+	if (len < sizeof(*hdr) || hdr->magic != TRACE_DUMP_MAGIC ||
+			hdr->version != TRACE_DUMP_VERSION ||
+			hdr->recSize != sizeof(struct trace_rec) ||
+			hdr->numRecs > (len - sizeof(*hdr)) / sizeof(struct trace_rec)) {
+		return NULL;
+	}
+	*hdrOut = hdr;
+	return (const struct trace_rec *)(hdr + 1);
+}
+
+static inline const char *traceEventName(uint16_t event) {
+	static const char *const names[TRACE_NUM_EVENTS] = {
+		NULL, "tx-output", "tx-complete", "rx-complete", "rx-frame",
+		"rx-error"
+	};
+	return event < TRACE_NUM_EVENTS ? names[event] : NULL;
+}
+
+#endif /* TRACE_RING_H */
@@ -0,0 +1,450 @@
+/* TxSched.h
+ * Transmit scheduling: classification and flow hashing of the outgoing
+ * frames, the CoDel queue management, and the byte queue limits
+ * HoRNDIS, a RNDIS driver for Mac OS X
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// This works on the first bytes of an Ethernet frame, copied out of the
+// mbuf chain by the caller, and on times in whatever unit the caller uses.
+
+#ifndef TX_SCHED_H
+#define TX_SCHED_H
+
+#include <stdint.h>
+#include <string.h>
+
+// The transmit classes, in the order they are served, see
+// "TRANSMIT PRIORITY" in HoRNDIS.cpp:
+enum {
+	TX_CLASS_PRIORITY = 0,  // Small control and interactive frames.
+	TX_CLASS_BULK,  // Everything else.
+	TX_NUM_CLASSES
+};
+
+// How much of the frame 'txClassifyFrame' looks at: an Ethernet header with
+// a VLAN tag, an IPv4 header with all of the options, and the start of the
+// TCP header (up to the flags).
+#define TX_CLASSIFY_HDR_LEN     96
+
+#define TX_ETHERTYPE_IP         0x0800
+#define TX_ETHERTYPE_ARP        0x0806
+#define TX_ETHERTYPE_VLAN       0x8100
+#define TX_ETHERTYPE_IPV6       0x86dd
+#define TX_ETHERTYPE_EAPOL      0x888e
+
+#define TX_IPPROTO_ICMP         1
+#define TX_IPPROTO_TCP          6
+#define TX_IPPROTO_UDP          17
+#define TX_IPPROTO_ICMPV6       58
+
+static inline uint16_t txReadBE16(const uint8_t *p) {
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t txReadBE32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void txWriteBE16(uint8_t *p, uint16_t val) {
+	p[0] = (uint8_t)(val >> 8);
+	p[1] = (uint8_t)val;
+}
+
+static inline void txWriteBE32(uint8_t *p, uint32_t val) {
+	txWriteBE16(p, (uint16_t)(val >> 16));
+	txWriteBE16(p + 2, (uint16_t)val);
+}
+
+// What 'txParseFrame' finds in the first bytes of a frame.
+struct tx_frame_info {
+	uint16_t etherType;  // After the VLAN tag, if any.
+	uint32_t l3ofs;  // Of the network header: 14, or 18 with a VLAN tag.
+	uint8_t ipVersion;  // 4 or 6; 0 if it's not IP, or the header is cut.
+	uint8_t tos;  // The IPv4 TOS, or the IPv6 traffic class.
+	uint8_t proto;  // The IPv4 protocol, or the IPv6 next header.
+	// The transport header, if it's there: not in the IPv4 fragments after
+	// the first one, and not after the IPv6 extension headers (which are not
+	// followed: their 'proto' is the extension's).
+	const uint8_t *l4;
+	uint32_t l4caplen;  // Bytes of it that were copied.
+	uint32_t l4len;  // The transport header and payload, per the IP header.
+};
+
+// Parses the Ethernet, VLAN and IP headers in the 'caplen' bytes at 'frame'
+// (up to TX_CLASSIFY_HDR_LEN of them). Whatever is missing is left at zero.
+static inline void txParseFrame(const uint8_t *frame, uint32_t caplen,
+	struct tx_frame_info *info) {
+	memset(info, 0, sizeof *info);
+	if (caplen < 14) {
+		return;
+	}
+	info->etherType = txReadBE16(frame + 12);
+	info->l3ofs = 14;
+	if (info->etherType == TX_ETHERTYPE_VLAN) {
+		if (caplen < 18) {
+			info->etherType = 0;
+			return;
+		}
+		info->etherType = txReadBE16(frame + 16);
+		info->l3ofs = 18;
+	}
+	const uint8_t *ip = frame + info->l3ofs;
+	const uint32_t iplen = caplen - info->l3ofs;
+
+	if (info->etherType == TX_ETHERTYPE_IP) {
+		if (iplen < 20 || (ip[0] >> 4) != 4) {
+			return;
+		}
+		info->ipVersion = 4;
+		info->tos = ip[1];
+		info->proto = ip[9];
+		const uint32_t ihl = (ip[0] & 0x0f) * 4;
+		const uint32_t totalLen = txReadBE16(ip + 2);
+		if (ihl >= 20 && ihl <= iplen && totalLen >= ihl &&
+				(txReadBE16(ip + 6) & 0x1fff) == 0) {
+			info->l4 = ip + ihl;
+			info->l4caplen = iplen - ihl;
+			info->l4len = totalLen - ihl;
+		}
+	} else if (info->etherType == TX_ETHERTYPE_IPV6) {
+		if (iplen < 40 || (ip[0] >> 4) != 6) {
+			return;
+		}
+		info->ipVersion = 6;
+		info->tos = (uint8_t)((ip[0] << 4) | (ip[1] >> 4));
+		info->proto = ip[6];
+		info->l4 = ip + 40;
+		info->l4caplen = iplen - 40;
+		info->l4len = txReadBE16(ip + 4);
+	}
+}
+
+/***** Classification *****/
+
+// The IPv4 TOS / IPv6 traffic class octet of the latency-sensitive traffic:
+// the DSCPs from CS4 up (real-time, voice, network control), AF21 (the
+// low-latency data class of RFC 4594, used by OpenSSH for the interactive
+// sessions), and the legacy IPTOS_LOWDELAY.
+static inline bool txIsPriorityTos(uint8_t tos) {
+	const uint8_t dscp = tos >> 2;
+	return dscp >= 32 || dscp == 18 || (tos & 0xfc) == 0x10;
+}
+
+// 'l4' points at the transport header: 'caplen' bytes of it were copied,
+// and the whole datagram (header and payload) is 'l4len' bytes long.
+static inline int txClassifyTransport(uint8_t proto, const uint8_t *l4,
+	uint32_t caplen, uint32_t l4len) {
+	switch (proto) {
+	case TX_IPPROTO_ICMP:
+	case TX_IPPROTO_ICMPV6:
+		return TX_CLASS_PRIORITY;
+	case TX_IPPROTO_TCP: {
+		// Segments without payload: pure ACKs, SYN, FIN, RST. They never
+		// overtake the data of their own flow, so there's nothing to reorder.
+		if (caplen < 14) {
+			return TX_CLASS_BULK;
+		}
+		const uint32_t doff = (l4[12] >> 4) * 4;
+		return doff >= 20 && l4len == doff ? TX_CLASS_PRIORITY : TX_CLASS_BULK;
+	}
+	case TX_IPPROTO_UDP: {
+		// DNS, DHCP and DHCPv6, either way:
+		if (caplen < 4) {
+			return TX_CLASS_BULK;
+		}
+		const uint16_t ports[2] = { txReadBE16(l4), txReadBE16(l4 + 2) };
+		for (int i = 0; i < 2; i++) {
+			switch (ports[i]) {
+			case 53: case 67: case 68: case 546: case 547:
+				return TX_CLASS_PRIORITY;
+			}
+		}
+		return TX_CLASS_BULK;
+	}
+	default:
+		return TX_CLASS_BULK;
+	}
+}
+
+// Returns the TX_CLASS_xxx of a parsed frame. Anything it cannot make sense
+// of is bulk.
+static inline int txClassifyFrame(const struct tx_frame_info *info) {
+	if (info->etherType == TX_ETHERTYPE_ARP ||
+			info->etherType == TX_ETHERTYPE_EAPOL) {
+		return TX_CLASS_PRIORITY;
+	}
+	if (info->ipVersion == 0) {
+		return TX_CLASS_BULK;
+	}
+	if (txIsPriorityTos(info->tos)) {
+		return TX_CLASS_PRIORITY;
+	}
+	if (!info->l4) {
+		return TX_CLASS_BULK;
+	}
+	return txClassifyTransport(info->proto, info->l4, info->l4caplen,
+		info->l4len);
+}
+
+/***** Flow hashing *****/
+
+static inline uint32_t txHashBytes(uint32_t hash, const uint8_t *p,
+	uint32_t len) {
+	// FNV-1a:
+	for (uint32_t i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Hashes the flow a parsed frame belongs to: the IP addresses and protocol
+// and, for TCP and UDP, the ports. The frames that are not IP hash by their
+// Ethernet addresses and EtherType. 'perturb' picks one of the hash
+// functions, so that the collisions cannot be arranged from the outside.
+static inline uint32_t txFlowHash(const uint8_t *frame,
+	const struct tx_frame_info *info, uint32_t perturb) {
+	uint32_t hash = txHashBytes(2166136261u, (const uint8_t *)&perturb,
+		sizeof perturb);
+	const uint8_t *ip = frame + info->l3ofs;
+	if (info->ipVersion == 4) {
+		hash = txHashBytes(hash, ip + 12, 8);
+	} else if (info->ipVersion == 6) {
+		hash = txHashBytes(hash, ip + 8, 32);
+	} else {
+		const uint8_t type[2] = { (uint8_t)(info->etherType >> 8),
+			(uint8_t)info->etherType };
+		return txHashBytes(txHashBytes(hash, frame, 12), type, 2);
+	}
+	hash = txHashBytes(hash, &info->proto, 1);
+	if (info->l4 && info->l4caplen >= 4 &&
+			(info->proto == TX_IPPROTO_TCP || info->proto == TX_IPPROTO_UDP)) {
+		hash = txHashBytes(hash, info->l4, 4);
+	}
+	return hash;
+}
+
+/***** ECN *****/
+
+#define TX_ECN_MASK             0x03
+#define TX_ECN_CE               0x03
+
+// Marks "Congestion Experienced" in the IP header at 'ip': the first 20
+// bytes of IPv4 (the checksum is updated), or the first 2 of IPv6.
+// Returns false, and leaves it alone, if the sender is not ECN-capable.
+static inline bool txSetCE(uint8_t *ip, uint8_t ipVersion) {
+	if (ipVersion == 4) {
+		if ((ip[1] & TX_ECN_MASK) == 0) {
+			return false;
+		}
+		// RFC 1624: HC' = ~(~HC + ~m + m'), on the first 16-bit word.
+		const uint16_t old = txReadBE16(ip);
+		ip[1] |= TX_ECN_CE;
+		uint32_t sum = (uint16_t)~txReadBE16(ip + 10) + (uint16_t)~old +
+			txReadBE16(ip);
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+		ip[10] = (uint8_t)(~sum >> 8);
+		ip[11] = (uint8_t)~sum;
+		return true;
+	}
+	if (ipVersion == 6) {
+		// The ECN bits are the low two of the traffic class, which starts
+		// at the fifth bit:
+		if ((ip[1] & (TX_ECN_MASK << 4)) == 0) {
+			return false;
+		}
+		ip[1] |= TX_ECN_CE << 4;
+		return true;
+	}
+	return false;
+}
+
+/***** CoDel *****/
+// Per RFC 8289: the state of one queue, and its parameters.
+
+struct tx_codel {
+	uint64_t firstAboveTime;  // 0: the sojourn time is below the target.
+	uint64_t dropNext;  // The next drop, while dropping.
+	uint32_t count;  // Drops since entering the dropping state.
+	uint32_t lastCount;
+	bool dropping;
+};
+
+struct tx_codel_params {
+	uint64_t target;
+	uint64_t interval;
+	uint32_t mtu;  // No drops while the backlog is at most this, in bytes.
+};
+
+static inline uint64_t txIsqrt64(uint64_t x) {
+	uint64_t root = 0;
+	for (uint64_t bit = 1ULL << 62; bit; bit >>= 2) {
+		if (x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+	}
+	return root;
+}
+
+// The time of the next drop: 't + interval / sqrt(count)', in integers.
+// 'sqrt(count << 32)' is 'sqrt(count) << 16'.
+static inline uint64_t txCodelControlLaw(uint64_t t, uint64_t interval,
+	uint32_t count) {
+	return t + (interval << 16) / txIsqrt64((uint64_t)(count ? count : 1) << 32);
+}
+
+// Tracks the sojourn time of the packet just taken off the queue, leaving
+// 'backlog' bytes behind. Returns true once it's been above the target for
+// a whole interval: the packet may be dropped.
+static inline bool txCodelOkToDrop(struct tx_codel *c,
+	const struct tx_codel_params *p, uint64_t now, uint64_t sojourn,
+	uint32_t backlog) {
+	if (sojourn < p->target || backlog <= p->mtu) {
+		c->firstAboveTime = 0;
+		return false;
+	}
+	if (c->firstAboveTime == 0) {
+		c->firstAboveTime = now + p->interval;
+		return false;
+	}
+	return now >= c->firstAboveTime;
+}
+
+// Enters the dropping state, after the first drop (or mark): if it's soon
+// after the last time, resumes at the drop rate it had then.
+static inline void txCodelStartDropping(struct tx_codel *c,
+	const struct tx_codel_params *p, uint64_t now) {
+	const uint32_t delta = c->count - c->lastCount;
+	c->dropping = true;
+	c->count = (delta > 1 &&
+		(int64_t)(now - c->dropNext) < (int64_t)(16 * p->interval)) ? delta : 1;
+	c->lastCount = c->count;
+	c->dropNext = txCodelControlLaw(now, p->interval, c->count);
+}
+
+/***** Byte queue limits *****/
+// The dynamic queue limits of Linux ("lib/dynamic_queue_limits.c"): how many
+// bytes may be in flight to the device, for it to never run out of work, but
+// no more. The limit grows when the device did run out (all that was queued
+// completed, while more was held back), and it shrinks by the smallest slack
+// seen over 'holdTime': the bytes in flight it did not need.
+// The totals wrap around: only their differences matter.
+
+struct tx_dql {
+	uint32_t limit;
+	uint32_t minLimit;
+	uint32_t maxLimit;
+	uint64_t holdTime;
+	uint32_t numQueued;  // Total bytes handed to the device.
+	uint32_t numCompleted;  // ... and completed.
+	uint32_t adjLimit;  // 'limit + numCompleted': the 'numQueued' to stop at.
+	uint32_t lastObjCnt;  // Bytes in the last 'txDqlQueued'.
+	uint32_t prevLastObjCnt;
+	uint32_t prevOvlimit;  // Over the limit, at the last completion.
+	uint32_t prevNumQueued;
+	uint32_t lowestSlack;
+	uint64_t slackStartTime;
+};
+
+#define TX_DQL_POSDIFF(a, b)  ((int32_t)((a) - (b)) > 0 ? (a) - (b) : 0)
+
+static inline void txDqlReset(struct tx_dql *d, uint64_t now) {
+	d->limit = d->minLimit;
+	d->numQueued = d->numCompleted = 0;
+	d->adjLimit = d->limit;
+	d->lastObjCnt = d->prevLastObjCnt = 0;
+	d->prevOvlimit = d->prevNumQueued = 0;
+	d->lowestSlack = UINT32_MAX;
+	d->slackStartTime = now;
+}
+
+static inline void txDqlInit(struct tx_dql *d, uint32_t minLimit,
+	uint32_t maxLimit, uint64_t holdTime, uint64_t now) {
+	d->minLimit = minLimit;
+	d->maxLimit = maxLimit;
+	d->holdTime = holdTime;
+	txDqlReset(d, now);
+}
+
+// Bytes that may still be queued: when negative, stop until a completion.
+static inline int32_t txDqlAvail(const struct tx_dql *d) {
+	return (int32_t)(d->adjLimit - d->numQueued);
+}
+
+static inline uint32_t txDqlInflight(const struct tx_dql *d) {
+	return d->numQueued - d->numCompleted;
+}
+
+static inline void txDqlQueued(struct tx_dql *d, uint32_t count) {
+	d->lastObjCnt = count;
+	d->numQueued += count;
+}
+
+static inline void txDqlCompleted(struct tx_dql *d, uint32_t count,
+	uint64_t now) {
+	const uint32_t numQueued = d->numQueued;
+	const uint32_t completed = d->numCompleted + count;
+	uint32_t limit = d->limit;
+	uint32_t ovlimit = TX_DQL_POSDIFF(numQueued - d->numCompleted, limit);
+	const uint32_t inprogress = numQueued - completed;
+	const uint32_t prevInprogress = d->prevNumQueued - d->numCompleted;
+	const bool allPrevCompleted = (int32_t)(completed - d->prevNumQueued) >= 0;
+
+	if ((ovlimit && !inprogress) || (d->prevOvlimit && allPrevCompleted)) {
+		// Starved: everything that was queued, and allowed to be, completed
+		// while more was waiting. Grow by what it could have taken.
+		limit += TX_DQL_POSDIFF(completed, d->prevNumQueued) + d->prevOvlimit;
+		d->slackStartTime = now;
+		d->lowestSlack = UINT32_MAX;
+	} else if (inprogress && prevInprogress && !allPrevCompleted) {
+		// Not starved: what it did not need of the limit is slack. Twice
+		// the completed bytes, as the limit is checked before queueing.
+		uint32_t slack = TX_DQL_POSDIFF(limit + d->prevOvlimit,
+			2 * (completed - d->numCompleted));
+		const uint32_t slackLastObjs = d->prevOvlimit ?
+			TX_DQL_POSDIFF(d->prevLastObjCnt, d->prevOvlimit) : 0;
+		if (slackLastObjs > slack) {
+			slack = slackLastObjs;
+		}
+		if (slack < d->lowestSlack) {
+			d->lowestSlack = slack;
+		}
+		if (now - d->slackStartTime > d->holdTime) {
+			limit = TX_DQL_POSDIFF(limit, d->lowestSlack);
+			d->slackStartTime = now;
+			d->lowestSlack = UINT32_MAX;
+		}
+	}
+
+	limit = limit < d->minLimit ? d->minLimit :
+		limit > d->maxLimit ? d->maxLimit : limit;
+	if (limit != d->limit) {
+		d->limit = limit;
+		ovlimit = 0;
+	}
+	d->adjLimit = limit + completed;
+	d->prevOvlimit = ovlimit;
+	d->prevLastObjCnt = d->lastObjCnt;
+	d->numCompleted = completed;
+	d->prevNumQueued = numQueued;
+}
+
+#endif /* TX_SCHED_H */
@@ -0,0 +1,165 @@
+/* TxSegment.h
+ * TCP segmentation offload: cutting a TCP super-packet into segments
+ * HoRNDIS, a RNDIS driver for Mac OS X
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// The caller copies the headers of the super-packet out of the mbuf chain;
+// for each segment, it has them rewritten into the segment's frame, copies
+// the segment's slice of the payload after them, and has the TCP checksum
+// computed over the lot.
+
+#ifndef TX_SEGMENT_H
+#define TX_SEGMENT_H
+
+#include "TxSched.h"
+
+// The headers every segment starts with, at most: Ethernet with a VLAN tag,
+// IPv4 with all of the options (more than IPv6's 40 bytes), and TCP with
+// all of the options.
+#define TX_TSO_MAX_HDR_LEN      (18 + 60 + 60)
+
+// The TCP flags that only go with the first or the last segment:
+#define TX_TCP_FIN              0x01
+#define TX_TCP_PSH              0x08
+#define TX_TCP_CWR              0x80
+
+/***** Internet checksum *****/
+
+// Adds 'len' bytes at 'p' to the running sum, as big-endian 16-bit words
+// (RFC 1071). Only the last call may have an odd 'len'.
+static inline uint32_t txCsumAdd(uint32_t sum, const uint8_t *p, uint32_t len) {
+	uint64_t acc = sum;
+	for (; len >= 2; p += 2, len -= 2) {
+		acc += txReadBE16(p);
+	}
+	if (len) {
+		acc += (uint32_t)p[0] << 8;
+	}
+	while (acc >> 32) {
+		acc = (acc & 0xffffffff) + (acc >> 32);
+	}
+	return (uint32_t)acc;
+}
+
+// The checksum to store: the complement of the folded sum.
+static inline uint16_t txCsumFold(uint32_t sum) {
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+/***** Segmentation *****/
+
+// A super-packet, as 'txTsoParse' finds it.
+struct tx_tso {
+	uint32_t l3ofs;  // Of the IP header.
+	uint32_t l4ofs;  // Of the TCP header.
+	uint32_t hdrLen;  // Up to the end of the TCP header.
+	uint32_t payloadLen;  // The TCP payload, to be cut.
+	uint32_t mss;
+	uint8_t ipVersion;
+};
+
+// Parses the super-packet of 'pktLen' bytes, whose first 'caplen' are at
+// 'hdr' (TX_TSO_MAX_HDR_LEN, or all of it, whichever is less), to be cut
+// into segments of 'mss' bytes of payload. Returns false if it's not one we
+// can cut: TCP over IPv4 (not fragmented), or over IPv6 without extension
+// headers, with the IP length covering the rest of the packet.
+static inline bool txTsoParse(const uint8_t *hdr, uint32_t caplen,
+	uint32_t pktLen, uint32_t mss, struct tx_tso *t) {
+	memset(t, 0, sizeof(*t));
+	struct tx_frame_info info;
+	txParseFrame(hdr, caplen, &info);
+	if (!info.l4 || info.proto != TX_IPPROTO_TCP || info.l4caplen < 20 ||
+			mss == 0) {
+		return false;
+	}
+	const uint32_t tcpHdrLen = (info.l4[12] >> 4) * 4;
+	t->l3ofs = info.l3ofs;
+	t->l4ofs = (uint32_t)(info.l4 - hdr);
+	t->hdrLen = t->l4ofs + tcpHdrLen;
+	if (tcpHdrLen < 20 || tcpHdrLen > info.l4caplen ||
+			t->l4ofs + info.l4len != pktLen) {
+		return false;
+	}
+	// Nor the first fragment: the segments would not be.
+	if (info.ipVersion == 4 && (txReadBE16(hdr + t->l3ofs + 6) & 0x2000)) {
+		return false;
+	}
+	t->payloadLen = pktLen - t->hdrLen;
+	t->mss = mss;
+	t->ipVersion = info.ipVersion;
+	return true;
+}
+
+static inline uint32_t txTsoSegments(const struct tx_tso *t) {
+	// A packet without payload still goes out, as is:
+	return t->payloadLen ? (t->payloadLen + t->mss - 1) / t->mss : 1;
+}
+
+// The payload of segment 'seg':
+static inline uint32_t txTsoSegmentLen(const struct tx_tso *t, uint32_t seg) {
+	const uint32_t left = t->payloadLen - seg * t->mss;
+	return left < t->mss ? left : t->mss;
+}
+
+// Writes the headers of segment 'seg' into 'frame', out of the super-packet's
+// at 'hdr': the IP length and, for IPv4, the ID (one more per segment) and
+// the header checksum; the TCP sequence number, and the flags (FIN and PSH
+// on the last segment only, CWR on the first). The TCP checksum is left at
+// zero, for 'txTsoChecksum', once the payload is in.
+static inline void txTsoWriteHeaders(const struct tx_tso *t,
+	const uint8_t *hdr, uint32_t seg, uint8_t *frame) {
+	const uint32_t payloadLen = txTsoSegmentLen(t, seg);
+	memcpy(frame, hdr, t->hdrLen);
+	uint8_t *ip = frame + t->l3ofs;
+	if (t->ipVersion == 4) {
+		const uint32_t ihl = t->l4ofs - t->l3ofs;
+		txWriteBE16(ip + 2, (uint16_t)(t->hdrLen - t->l3ofs + payloadLen));
+		txWriteBE16(ip + 4, (uint16_t)(txReadBE16(ip + 4) + seg));
+		txWriteBE16(ip + 10, 0);
+		txWriteBE16(ip + 10, txCsumFold(txCsumAdd(0, ip, ihl)));
+	} else {
+		txWriteBE16(ip + 4, (uint16_t)(t->hdrLen - t->l4ofs + payloadLen));
+	}
+	uint8_t *tcp = frame + t->l4ofs;
+	txWriteBE32(tcp + 4, txReadBE32(tcp + 4) + seg * t->mss);
+	if (seg + 1 < txTsoSegments(t)) {
+		tcp[13] &= ~(TX_TCP_FIN | TX_TCP_PSH);
+	}
+	if (seg > 0) {
+		tcp[13] &= ~TX_TCP_CWR;
+	}
+	txWriteBE16(tcp + 16, 0);
+}
+
+// Computes the TCP checksum of the segment at 'frame', headers written and
+// 'payloadLen' bytes of payload copied after them, and stores it.
+static inline void txTsoChecksum(const struct tx_tso *t, uint8_t *frame,
+	uint32_t payloadLen) {
+	const uint8_t *ip = frame + t->l3ofs;
+	uint8_t *tcp = frame + t->l4ofs;
+	const uint32_t tcpLen = t->hdrLen - t->l4ofs + payloadLen;
+	// The pseudo-header: the addresses, the protocol and the TCP length.
+	uint32_t sum = t->ipVersion == 4 ? txCsumAdd(0, ip + 12, 8) :
+		txCsumAdd(0, ip + 8, 32);
+	sum += TX_IPPROTO_TCP + (tcpLen >> 16) + (tcpLen & 0xffff);
+	sum = txCsumAdd(sum, tcp, tcpLen);
+	txWriteBE16(tcp + 16, txCsumFold(sum));
+}
+
+#endif /* TX_SEGMENT_H */
@@ -0,0 +1,111 @@
+/* UtilSampler.h
+ * Rolling throughput and utilization over the last seconds and minute
+ * HoRNDIS, a RNDIS driver for Mac OS X
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// The caller takes a sample of its cumulative counters at a regular
+// interval; the rates over a window are the differences between the last
+// sample and an older one. All in integers: no floating point in the kernel.
+
+#ifndef UTIL_SAMPLER_H
+#define UTIL_SAMPLER_H
+
+#include <stdint.h>
+#include <string.h>
+
+// The samples kept: a minute's worth at one a second, plus the one the
+// minute starts at.
+#define UTIL_HISTORY            61
+
+// The cumulative counters, as of 'stampUs'. Only their differences count.
+struct util_sample {
+	uint64_t stampUs;
+	uint64_t txBytes, txFrames;
+	uint64_t rxBytes, rxFrames;
+	uint64_t outBusyUs;  // The sum of the OUT transfers' times in flight.
+	uint64_t inIdleUs;  // The time the IN pipe had no read posted.
+};
+
+struct util_history {
+	struct util_sample samples[UTIL_HISTORY];
+	uint32_t count;  // Valid samples, up to UTIL_HISTORY.
+	uint32_t next;  // Where the next one goes.
+};
+
+// Over a window:
+struct util_rates {
+	uint64_t spanUs;  // The time actually covered: less, early on.
+	uint64_t txBitsPerSec, rxBitsPerSec;
+	uint64_t txFramesPerSec, rxFramesPerSec;
+	uint32_t outBufsInFlightMilli;  // The average, in thousandths.
+	uint32_t inIdlePermille;
+};
+
+static inline void utilReset(struct util_history *h) {
+	memset(h, 0, sizeof(*h));
+}
+
+static inline void utilAdd(struct util_history *h,
+	const struct util_sample *s) {
+	h->samples[h->next] = *s;
+	h->next = (h->next + 1) % UTIL_HISTORY;
+	if (h->count < UTIL_HISTORY) {
+		h->count++;
+	}
+}
+
+// Per second, of 'a' counted over 'us' microseconds. Good for up to 2 TB
+// in the window, in bits: more than a minute of any USB link.
+static inline uint64_t utilPerSec(uint64_t a, uint64_t us) {
+	return us ? a * 1000000 / us : 0;
+}
+
+// The rates over the last 'intervals' sampling intervals, or over all the
+// samples kept if there are not that many yet. Returns 0, and all zero
+// rates, with less than two samples, or no time between them.
+static inline int utilRates(const struct util_history *h, uint32_t intervals,
+	struct util_rates *r) {
+	memset(r, 0, sizeof(*r));
+	if (h->count < 2) {
+		return 0;
+	}
+	if (intervals > h->count - 1) {
+		intervals = h->count - 1;
+	}
+	const struct util_sample *last =
+		&h->samples[(h->next + UTIL_HISTORY - 1) % UTIL_HISTORY];
+	const struct util_sample *first =
+		&h->samples[(h->next + UTIL_HISTORY - 1 - intervals) % UTIL_HISTORY];
+	const uint64_t us = last->stampUs - first->stampUs;
+	if (us == 0) {
+		return 0;
+	}
+	r->spanUs = us;
+	r->txBitsPerSec = utilPerSec((last->txBytes - first->txBytes) * 8, us);
+	r->rxBitsPerSec = utilPerSec((last->rxBytes - first->rxBytes) * 8, us);
+	r->txFramesPerSec = utilPerSec(last->txFrames - first->txFrames, us);
+	r->rxFramesPerSec = utilPerSec(last->rxFrames - first->rxFrames, us);
+	// Little's law: the time spent in flight, over the time, is the number
+	// in flight on average.
+	r->outBufsInFlightMilli = (uint32_t)((last->outBusyUs - first->outBusyUs) *
+		1000 / us);
+	const uint64_t idleUs = last->inIdleUs - first->inIdleUs;
+	r->inIdlePermille = (uint32_t)((idleUs < us ? idleUs : us) * 1000 / us);
+	return 1;
+}
+
+#endif /* UTIL_SAMPLER_H */
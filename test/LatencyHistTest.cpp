@@ -0,0 +1,79 @@
+/* LatencyHistTest.cpp
+ * Unit tests for the log-scale latency histograms (LatencyHist.h).
+ * Builds and runs on Linux or Mac OS userspace: "make test".
+ */
+
+#include "LatencyHist.h"
+#include "TestUtil.h"
+
+static void testBuckets() {
+	CHECK_EQ(latHistBucket(0), 0);
+	CHECK_EQ(latHistBucket(1), 1);
+	CHECK_EQ(latHistBucket(2), 2);
+	CHECK_EQ(latHistBucket(3), 2);
+	CHECK_EQ(latHistBucket(4), 3);
+	CHECK_EQ(latHistBucket(1023), 10);
+	CHECK_EQ(latHistBucket(1024), 11);
+	CHECK_EQ(latHistBucket((1 << 22) - 1), 22);
+	CHECK_EQ(latHistBucket(1 << 22), 23);
+	CHECK_EQ(latHistBucket(0xffffffff), LAT_HIST_BUCKETS - 1);
+
+	// Every bucket's maximum is in the bucket, one more is in the next:
+	for (int i = 0; i < LAT_HIST_BUCKETS - 1; i++) {
+		CHECK_EQ(latHistBucket(latHistBucketMaxUs(i)), i);
+		CHECK_EQ(latHistBucket(latHistBucketMaxUs(i) + 1), i + 1);
+	}
+}
+
+static void testPercentiles() {
+	struct lat_hist h;
+	latHistReset(&h);
+	CHECK_EQ(latHistPercentile(&h, 500), 0);
+
+	// 90 samples of 10 us, 9 of 100 us, and one of 5000 us:
+	for (int i = 0; i < 90; i++) {
+		latHistAdd(&h, 10);
+	}
+	for (int i = 0; i < 9; i++) {
+		latHistAdd(&h, 100);
+	}
+	latHistAdd(&h, 5000);
+	CHECK_EQ(h.count, 100);
+	CHECK_EQ(h.sumUs, 900 + 900 + 5000);
+	CHECK_EQ(h.maxUs, 5000);
+	CHECK_EQ(h.buckets[4], 90);
+	CHECK_EQ(h.buckets[7], 9);
+	CHECK_EQ(h.buckets[13], 1);
+
+	// The top of the bucket: [8, 16) for the 10s, [64, 128) for the 100s.
+	CHECK_EQ(latHistPercentile(&h, 0), 15);
+	CHECK_EQ(latHistPercentile(&h, 500), 15);
+	CHECK_EQ(latHistPercentile(&h, 900), 15);
+	CHECK_EQ(latHistPercentile(&h, 901), 127);
+	CHECK_EQ(latHistPercentile(&h, 990), 127);
+	// Clamped to the largest sample:
+	CHECK_EQ(latHistPercentile(&h, 999), 5000);
+	CHECK_EQ(latHistPercentile(&h, 1000), 5000);
+
+	// A single sample is every percentile, exactly:
+	latHistReset(&h);
+	latHistAdd(&h, 300);
+	CHECK_EQ(latHistPercentile(&h, 10), 300);
+	CHECK_EQ(latHistPercentile(&h, 990), 300);
+
+	// Zeroes stay zero:
+	latHistReset(&h);
+	latHistAdd(&h, 0);
+	latHistAdd(&h, 0);
+	CHECK_EQ(h.buckets[0], 2);
+	CHECK_EQ(latHistPercentile(&h, 500), 0);
+	latHistAdd(&h, 1);
+	CHECK_EQ(latHistPercentile(&h, 1000), 1);
+}
+
+int main() {
+	testBuckets();
+	testPercentiles();
+
+	return testReport("LatencyHistTest");
+}
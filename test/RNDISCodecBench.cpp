@@ -0,0 +1,155 @@
+/* RNDISCodecBench.cpp
+ * Throughput microbenchmarks for the RNDIS data message encoding and
+ * decoding (RNDISCodec.h): "make bench".
+ *
+ * Encoding packs the frames into transfers the way the kext's transmit
+ * aggregation does: header, then the frame copied in. Decoding walks the
+ * transfers the way 'receivePacket' does, copying each frame out (as the
+ * default, non zero-copy, receive path).
+ */
+
+#include "RNDISCodec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+// Mirrors the kext defaults: 16K transfers, Linux gadget's 2^2 alignment.
+static const uint32_t kTransferSize = 16384;
+static const uint32_t kMaxPktsPerTransfer = 64;
+static const uint32_t kAlignMask = 3;
+static const double kSecondsPerRun = 0.5;
+
+struct FrameMix {
+	const char *name;
+	std::vector<uint32_t> sizes;  // Repeated in this order.
+};
+
+static std::vector<FrameMix> makeMixes() {
+	std::vector<FrameMix> mixes;
+	FrameMix small = { "60B", std::vector<uint32_t>(1, 60) };
+	FrameMix medium = { "576B", std::vector<uint32_t>(1, 576) };
+	FrameMix large = { "1514B", std::vector<uint32_t>(1, 1514) };
+	// Simple IMIX: 7:4:1 small, medium and large frames.
+	FrameMix imix = { "IMIX", std::vector<uint32_t>() };
+	for (int i = 0; i < 7; i++) imix.sizes.push_back(60);
+	for (int i = 0; i < 4; i++) imix.sizes.push_back(576);
+	imix.sizes.push_back(1514);
+	// TCP bulk download: MSS-sized frames and their ACKs.
+	FrameMix tcp = { "TCP", std::vector<uint32_t>() };
+	tcp.sizes.push_back(1514);
+	tcp.sizes.push_back(1514);
+	tcp.sizes.push_back(60);
+	mixes.push_back(small);
+	mixes.push_back(medium);
+	mixes.push_back(large);
+	mixes.push_back(imix);
+	mixes.push_back(tcp);
+	return mixes;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Packs frames into a transfer buffer until it is full; returns its length.
+static uint32_t encodeTransfer(uint8_t *xfer, const FrameMix &mix,
+	size_t *mixPos, const uint8_t *payload, uint64_t *frames,
+	uint64_t *bytes) {
+	uint32_t len = 0, lastMsgOfs = 0, n = 0;
+	while (n < kMaxPktsPerTransfer) {
+		const uint32_t pktlen = mix.sizes[*mixPos];
+		if (rndisAlign(len, kAlignMask) + sizeof(rndis_data_hdr) + pktlen >
+				kTransferSize) {
+			break;
+		}
+		const uint32_t ofs = rndisAppendDataHdr(xfer, len, lastMsgOfs,
+			kAlignMask, pktlen);
+		memcpy(xfer + ofs + sizeof(rndis_data_hdr), payload, pktlen);
+		lastMsgOfs = ofs;
+		len = ofs + sizeof(rndis_data_hdr) + pktlen;
+		*mixPos = (*mixPos + 1) % mix.sizes.size();
+		*bytes += pktlen;
+		n++;
+	}
+	*frames += n;
+	return len;
+}
+
+static void benchEncode(const FrameMix &mix) {
+	std::vector<uint8_t> xfer(kTransferSize);
+	std::vector<uint8_t> payload(2048, 0x5A);
+	uint64_t frames = 0, bytes = 0;
+	size_t mixPos = 0;
+	uint32_t sink = 0;
+	const Clock::time_point start = Clock::now();
+	double elapsed;
+	do {
+		for (int i = 0; i < 256; i++) {
+			sink += encodeTransfer(&xfer[0], mix, &mixPos, &payload[0],
+				&frames, &bytes);
+		}
+	} while ((elapsed = secondsSince(start)) < kSecondsPerRun);
+	printf("  encode %-6s %8.2f Mframes/s %8.1f MB/s%s\n", mix.name,
+		frames / elapsed / 1e6, bytes / elapsed / 1e6, sink ? "" : " ");
+}
+
+static void benchDecode(const FrameMix &mix) {
+	// Pre-encode a set of transfers, then decode them over and over:
+	const int kNumTransfers = 64;
+	std::vector<std::vector<uint8_t> > xfers(kNumTransfers);
+	std::vector<uint8_t> payload(2048, 0x5A);
+	size_t mixPos = 0;
+	uint64_t unused = 0;
+	for (int i = 0; i < kNumTransfers; i++) {
+		xfers[i].resize(kTransferSize);
+		xfers[i].resize(encodeTransfer(&xfers[i][0], mix, &mixPos,
+			&payload[0], &unused, &unused));
+	}
+
+	std::vector<uint8_t> frameBuf(2048);
+	uint64_t frames = 0, bytes = 0, errors = 0;
+	const Clock::time_point start = Clock::now();
+	double elapsed;
+	do {
+		for (int i = 0; i < kNumTransfers; i++) {
+			const uint8_t *p = &xfers[i][0];
+			uint32_t size = (uint32_t)xfers[i].size();
+			while (size) {
+				rndis_rx_frame frame;
+				if (rndisParseDataMsg(p, size, &frame) != RNDIS_PARSE_OK) {
+					errors++;
+					break;
+				}
+				memcpy(&frameBuf[0], p + frame.data_ofs, frame.data_len);
+				frames++;
+				bytes += frame.data_len;
+				p += frame.msg_len;
+				size -= frame.msg_len;
+			}
+		}
+	} while ((elapsed = secondsSince(start)) < kSecondsPerRun);
+	if (errors) {
+		fprintf(stderr, "decode %s: %llu parse errors\n", mix.name,
+			(unsigned long long)errors);
+		exit(1);
+	}
+	printf("  decode %-6s %8.2f Mframes/s %8.1f MB/s\n", mix.name,
+		frames / elapsed / 1e6, bytes / elapsed / 1e6);
+}
+
+int main() {
+	const std::vector<FrameMix> mixes = makeMixes();
+	printf("RNDISCodecBench: %u-byte transfers, alignment %u\n",
+		kTransferSize, kAlignMask + 1);
+	for (size_t i = 0; i < mixes.size(); i++) {
+		benchEncode(mixes[i]);
+	}
+	for (size_t i = 0; i < mixes.size(); i++) {
+		benchDecode(mixes[i]);
+	}
+	return 0;
+}
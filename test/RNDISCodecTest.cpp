@@ -0,0 +1,251 @@
+/* RNDISCodecTest.cpp
+ * Unit tests for the RNDIS message encoding and decoding (RNDISCodec.h).
+ * Builds and runs on Linux or Mac OS userspace: "make test".
+ */
+
+#include "RNDISCodec.h"
+#include "TestUtil.h"
+
+#include <vector>
+
+// Reads a little-endian 32-bit field at 'ofs', independently of the codec.
+static uint32_t rd32(const uint8_t *buf, uint32_t ofs) {
+	return buf[ofs] | (buf[ofs + 1] << 8) | (buf[ofs + 2] << 16) |
+		((uint32_t)buf[ofs + 3] << 24);
+}
+
+static void wr32(uint8_t *buf, uint32_t ofs, uint32_t val) {
+	buf[ofs] = val & 0xff;
+	buf[ofs + 1] = (val >> 8) & 0xff;
+	buf[ofs + 2] = (val >> 16) & 0xff;
+	buf[ofs + 3] = val >> 24;
+}
+
+static void testStructSizes() {
+	CHECK_EQ(sizeof(rndis_msg_hdr), 16);
+	CHECK_EQ(sizeof(rndis_data_hdr), 44);
+	CHECK_EQ(sizeof(rndis_query), 28);
+	CHECK_EQ(sizeof(rndis_query_c), 24);
+	CHECK_EQ(sizeof(rndis_init), 24);
+	CHECK_EQ(sizeof(rndis_init_c), 52);
+	CHECK_EQ(sizeof(rndis_set), 28);
+	CHECK_EQ(sizeof(rndis_indicate), 20);
+}
+
+static void testAlign() {
+	CHECK_EQ(rndisAlign(0, 0), 0);
+	CHECK_EQ(rndisAlign(61, 0), 61);
+	CHECK_EQ(rndisAlign(61, 7), 64);
+	CHECK_EQ(rndisAlign(64, 7), 64);
+	CHECK_EQ(rndisAlign(1, 255), 256);
+}
+
+static void testWriteDataHdr() {
+	uint8_t buf[64];
+	memset(buf, 0xAA, sizeof buf);
+	rndisWriteDataHdr(buf, 20);
+	CHECK_EQ(rd32(buf, 0), 1);  // REMOTE_NDIS_PACKET_MSG
+	CHECK_EQ(rd32(buf, 4), 64);  // msg_len
+	CHECK_EQ(rd32(buf, 8), 36);  // data_offset, from 'data_offset' field
+	CHECK_EQ(rd32(buf, 12), 20);  // data_len
+	for (uint32_t ofs = 16; ofs < 44; ofs += 4) {
+		CHECK_EQ(rd32(buf, ofs), 0);
+	}
+}
+
+// Builds a transfer out of frames of the given sizes, filled with a pattern.
+static std::vector<uint8_t> buildTransfer(const std::vector<uint32_t> &sizes,
+	uint32_t alignMask) {
+	std::vector<uint8_t> buf(65536);
+	uint32_t len = 0, lastMsgOfs = 0;
+	for (size_t i = 0; i < sizes.size(); i++) {
+		const uint32_t ofs = rndisAppendDataHdr(&buf[0], len, lastMsgOfs,
+			alignMask, sizes[i]);
+		CHECK_EQ(ofs & alignMask, 0);
+		memset(&buf[ofs + sizeof(rndis_data_hdr)], (int)(i + 1), sizes[i]);
+		lastMsgOfs = ofs;
+		len = ofs + sizeof(rndis_data_hdr) + sizes[i];
+	}
+	buf.resize(len);
+	return buf;
+}
+
+static void testAggregationRoundTrip() {
+	const uint32_t masks[] = { 0, 3, 7, 63 };
+	std::vector<uint32_t> sizes;
+	sizes.push_back(60);
+	sizes.push_back(1514);
+	sizes.push_back(61);
+	sizes.push_back(1);
+	sizes.push_back(577);
+	for (size_t m = 0; m < sizeof masks / sizeof masks[0]; m++) {
+		std::vector<uint8_t> xfer = buildTransfer(sizes, masks[m]);
+		uint32_t ofs = 0;
+		size_t n = 0;
+		while (ofs < xfer.size()) {
+			rndis_rx_frame frame;
+			const int rc = rndisParseDataMsg(&xfer[ofs],
+				(uint32_t)xfer.size() - ofs, &frame);
+			CHECK_EQ(rc, RNDIS_PARSE_OK);
+			if (rc != RNDIS_PARSE_OK) {
+				break;
+			}
+			CHECK(n < sizes.size());
+			CHECK_EQ(frame.data_len, sizes[n]);
+			CHECK_EQ(frame.data_ofs, sizeof(rndis_data_hdr));
+			// The padding is counted in the message, but not in the frame:
+			CHECK_EQ(frame.msg_len, n + 1 < sizes.size() ?
+				rndisAlign(sizeof(rndis_data_hdr) + sizes[n], masks[m]) :
+				sizeof(rndis_data_hdr) + sizes[n]);
+			CHECK_EQ(xfer[ofs + frame.data_ofs], n + 1);
+			CHECK_EQ(xfer[ofs + frame.data_ofs + frame.data_len - 1], n + 1);
+			ofs += frame.msg_len;
+			n++;
+		}
+		CHECK_EQ(n, sizes.size());
+		CHECK_EQ(ofs, xfer.size());
+	}
+}
+
+static void testParseMalformed() {
+	std::vector<uint32_t> sizes(1, 100);
+	std::vector<uint8_t> good = buildTransfer(sizes, 0);
+	rndis_rx_frame frame;
+
+	CHECK_EQ(rndisParseDataMsg(&good[0], sizeof(rndis_data_hdr), &frame),
+		RNDIS_PARSE_SHORT);
+
+	std::vector<uint8_t> bad = good;
+	wr32(&bad[0], 0, 2);  // INIT over the data channel?
+	CHECK_EQ(rndisParseDataMsg(&bad[0], (uint32_t)bad.size(), &frame),
+		RNDIS_PARSE_NOT_PACKET);
+
+	bad = good;
+	wr32(&bad[0], 4, (uint32_t)bad.size() + 1);
+	CHECK_EQ(rndisParseDataMsg(&bad[0], (uint32_t)bad.size(), &frame),
+		RNDIS_PARSE_BAD_MSG_LEN);
+
+	// Would have the receive loop spin forever:
+	bad = good;
+	wr32(&bad[0], 4, 0);
+	CHECK_EQ(rndisParseDataMsg(&bad[0], (uint32_t)bad.size(), &frame),
+		RNDIS_PARSE_BAD_MSG_LEN);
+
+	bad = good;
+	wr32(&bad[0], 12, 101);  // data_len
+	CHECK_EQ(rndisParseDataMsg(&bad[0], (uint32_t)bad.size(), &frame),
+		RNDIS_PARSE_BAD_DATA);
+
+	bad = good;
+	wr32(&bad[0], 8, 0xFFFFFFF0);  // data_offset: overflows in 32 bits.
+	CHECK_EQ(rndisParseDataMsg(&bad[0], (uint32_t)bad.size(), &frame),
+		RNDIS_PARSE_BAD_DATA);
+}
+
+static void testInit() {
+	uint8_t buf[RNDIS_CMD_BUF_SZ];
+	CHECK_EQ(rndisEncodeInit(buf, 16384), 24);
+	CHECK_EQ(rd32(buf, 0), 2);
+	CHECK_EQ(rd32(buf, 4), 24);
+	CHECK_EQ(rd32(buf, 12), 1);
+	CHECK_EQ(rd32(buf, 16), 0);
+	CHECK_EQ(rd32(buf, 20), 16384);
+
+	// A reply, as sent by the Linux f_rndis gadget:
+	memset(buf, 0, sizeof buf);
+	wr32(buf, 0, 0x80000002);
+	wr32(buf, 4, 52);
+	wr32(buf, 8, 7);
+	wr32(buf, 16, 1);  // major_version
+	wr32(buf, 32, 10);  // max_packets_per_transfer
+	wr32(buf, 36, 9592);  // max_transfer_size
+	wr32(buf, 40, 2);  // packet_alignment
+	rndis_init_params params;
+	CHECK(rndisDecodeInitC(buf, 52, &params));
+	CHECK_EQ(params.major_version, 1);
+	CHECK_EQ(params.minor_version, 0);
+	CHECK_EQ(params.max_packets_per_transfer, 10);
+	CHECK_EQ(params.max_transfer_size, 9592);
+	CHECK_EQ(params.packet_alignment, 2);
+
+	CHECK(!rndisDecodeInitC(buf, 51, &params));
+	wr32(buf, 0, 0x80000004);
+	CHECK(!rndisDecodeInitC(buf, 52, &params));
+}
+
+static void testQuery() {
+	uint8_t buf[RNDIS_CMD_BUF_SZ];
+	memset(buf, 0xAA, sizeof buf);
+	CHECK_EQ(rndisEncodeQuery(buf, OID_802_3_PERMANENT_ADDRESS, 48), 28 + 48);
+	CHECK_EQ(rd32(buf, 0), 4);
+	CHECK_EQ(rd32(buf, 4), 28 + 48);
+	CHECK_EQ(rd32(buf, 12), 0x01010101);
+	CHECK_EQ(rd32(buf, 16), 48);
+	CHECK_EQ(rd32(buf, 20), 20);
+	CHECK_EQ(buf[28 + 47], 0);  // Input buffer is zeroed.
+	CHECK_EQ(buf[28 + 48], 0xAA);  // Nothing past it.
+
+	// The reply: 6-byte MAC address right after the header.
+	memset(buf, 0, sizeof buf);
+	wr32(buf, 0, 0x80000004);
+	wr32(buf, 4, 30);
+	wr32(buf, 16, 6);  // len
+	wr32(buf, 20, 16);  // offset, from 'request_id'
+	memcpy(buf + 24, "\x02\x11\x22\x33\x44\x55", 6);
+	const void *reply;
+	uint32_t replyLen;
+	CHECK(rndisDecodeQueryC(buf, 30, &reply, &replyLen));
+	CHECK_EQ(replyLen, 6);
+	CHECK(reply == buf + 24);
+
+	CHECK(!rndisDecodeQueryC(buf, 29, &reply, &replyLen));
+	wr32(buf, 20, 0xFFFFFFFC);  // Overflows in 32 bits.
+	CHECK(!rndisDecodeQueryC(buf, 30, &reply, &replyLen));
+}
+
+static void testSet() {
+	uint8_t buf[RNDIS_CMD_BUF_SZ];
+	const uint32_t filter = RNDIS_DEFAULT_FILTER;
+	CHECK_EQ(rndisEncodeSet(buf, OID_GEN_CURRENT_PACKET_FILTER, &filter,
+		sizeof filter), 32);
+	CHECK_EQ(rd32(buf, 0), 5);
+	CHECK_EQ(rd32(buf, 4), 32);
+	CHECK_EQ(rd32(buf, 12), 0x0001010e);
+	CHECK_EQ(rd32(buf, 16), 4);
+	CHECK_EQ(rd32(buf, 20), 20);
+	CHECK_EQ(rd32(buf, 28), 0x2d);
+}
+
+static void testKeepaliveAndIndicate() {
+	uint8_t buf[RNDIS_CMD_BUF_SZ];
+	CHECK_EQ(rndisEncodeKeepaliveC(buf, cpu_to_le32(0x1234)), 16);
+	CHECK_EQ(rd32(buf, 0), 0x80000008);
+	CHECK_EQ(rd32(buf, 4), 16);
+	CHECK_EQ(rd32(buf, 8), 0x1234);
+	CHECK_EQ(rd32(buf, 12), 0);
+
+	memset(buf, 0, sizeof buf);
+	wr32(buf, 0, 7);
+	wr32(buf, 4, 20);
+	wr32(buf, 8, 0x4001000c);
+	uint32_t status;
+	CHECK(rndisDecodeIndicate(buf, 20, &status));
+	CHECK(status == RNDIS_STATUS_MEDIA_DISCONNECT);
+	CHECK(!rndisDecodeIndicate(buf, 19, &status));
+	wr32(buf, 0, 8);
+	CHECK(!rndisDecodeIndicate(buf, 20, &status));
+}
+
+int main() {
+	testStructSizes();
+	testAlign();
+	testWriteDataHdr();
+	testAggregationRoundTrip();
+	testParseMalformed();
+	testInit();
+	testQuery();
+	testSet();
+	testKeepaliveAndIndicate();
+
+	return testReport("RNDISCodecTest");
+}
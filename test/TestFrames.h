@@ -0,0 +1,55 @@
+/* TestFrames.h
+ * Builds the Ethernet, IPv4 and IPv6 frames the transmit tests feed to
+ * TxSched.h and TxSegment.h. The headers carry their lengths, types and
+ * protocols (and VLAN 42, if tagged); the rest is zero, for the test to
+ * fill in.
+ */
+
+#ifndef TEST_FRAMES_H
+#define TEST_FRAMES_H
+
+#include "TxSched.h"
+
+#include <vector>
+
+// Builds an Ethernet frame of the given EtherType, 'vlan' tagged or not,
+// with 'l3len' bytes of zeroes after the header. Returns the L3 offset.
+static inline uint32_t buildEthernet(std::vector<uint8_t> &frame,
+	uint16_t type, uint32_t l3len, bool vlan = false) {
+	const uint32_t ofs = vlan ? 18 : 14;
+	frame.assign(ofs + l3len, 0);
+	if (vlan) {
+		txWriteBE16(&frame[12], TX_ETHERTYPE_VLAN);
+		txWriteBE16(&frame[14], 42);
+	}
+	txWriteBE16(&frame[ofs - 2], type);
+	return ofs;
+}
+
+// An IPv4 datagram: 'ihl' bytes of header, then 'l4len' bytes of transport.
+// Returns the L4 offset.
+static inline uint32_t buildIPv4(std::vector<uint8_t> &frame, uint8_t proto,
+	uint8_t tos, uint32_t l4len, uint32_t ihl = 20, bool vlan = false) {
+	const uint32_t ofs = buildEthernet(frame, TX_ETHERTYPE_IP, ihl + l4len,
+		vlan);
+	uint8_t *ip = &frame[ofs];
+	ip[0] = (uint8_t)(0x40 | (ihl / 4));
+	ip[1] = tos;
+	txWriteBE16(ip + 2, (uint16_t)(ihl + l4len));
+	ip[9] = proto;
+	return ofs + ihl;
+}
+
+static inline uint32_t buildIPv6(std::vector<uint8_t> &frame, uint8_t nextHdr,
+	uint8_t tclass, uint32_t l4len, bool vlan = false) {
+	const uint32_t ofs = buildEthernet(frame, TX_ETHERTYPE_IPV6, 40 + l4len,
+		vlan);
+	uint8_t *ip = &frame[ofs];
+	ip[0] = (uint8_t)(0x60 | (tclass >> 4));
+	ip[1] = (uint8_t)(tclass << 4);
+	txWriteBE16(ip + 4, (uint16_t)l4len);
+	ip[6] = nextHdr;
+	return ofs + 40;
+}
+
+#endif
@@ -0,0 +1,39 @@
+/* TestUtil.h
+ * The checks the unit tests count their failures with. Each test includes
+ * this once, and returns 'testReport' from main.
+ */
+
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stdio.h>
+
+static int gFailures = 0;
+static int gChecks = 0;
+
+#define CHECK(cond) do { \
+	gChecks++; \
+	if (!(cond)) { \
+		gFailures++; \
+		fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+	} \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+	gChecks++; \
+	const unsigned long long va = (unsigned long long)(a); \
+	const unsigned long long vb = (unsigned long long)(b); \
+	if (va != vb) { \
+		gFailures++; \
+		fprintf(stderr, "%s:%d: CHECK_EQ failed: %s (%llu) != %s (%llu)\n", \
+			__FILE__, __LINE__, #a, va, #b, vb); \
+	} \
+} while (0)
+
+// Prints the counts, and returns the test's exit status.
+static inline int testReport(const char *name) {
+	printf("%s: %d checks, %d failures\n", name, gChecks, gFailures);
+	return gFailures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,161 @@
+/* TraceDecode.cpp
+ * Turns a dump of the kext's event trace (TraceRing.h) into text, one event
+ * per line. Builds on Linux or Mac OS userspace: "make tools".
+ *
+ * Usage: TraceDecode [FILE]
+ * FILE (or the standard input) is either the raw dump, or the output of
+ * "ioreg -a -r -c HoRNDIS": the dump is then the "HoRNDISTrace" data, in
+ * base64. With several HoRNDIS devices, the first one's is decoded.
+ */
+
+#include "TraceRing.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// What the arguments of each event are, see the TRACE_* events:
+struct EventFormat {
+	const char *args[4];
+	bool hex[4];  // IOReturn codes.
+};
+
+static const EventFormat kFormats[TRACE_NUM_EVENTS] = {
+	{ { NULL }, { false } },
+	{ { "len", "status", "queued", "free" }, { false, true, false, false } },
+	{ { "buf", "rc", "bytes", "free" }, { false, true, false, false } },
+	{ { "buf", "rc", "bytes", "head" }, { false, true, false, false } },
+	{ { "len", "lent", "batched", "left" }, { false } },
+	{ { "parse", "left" }, { false } },
+};
+
+static bool readAll(FILE *f, std::vector<uint8_t> &data) {
+	uint8_t buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		data.insert(data.end(), buf, buf + n);
+	}
+	return !ferror(f);
+}
+
+static int base64Value(char c) {
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return -1;
+}
+
+// Decodes the base64 text, skipping the white space (and anything else that
+// is not base64), up to the padding.
+static std::vector<uint8_t> base64Decode(const std::string &text) {
+	std::vector<uint8_t> out;
+	uint32_t acc = 0;
+	int bits = 0;
+	for (size_t i = 0; i < text.size() && text[i] != '='; i++) {
+		const int v = base64Value(text[i]);
+		if (v < 0) {
+			continue;
+		}
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out.push_back((uint8_t)(acc >> bits));
+		}
+	}
+	return out;
+}
+
+// Finds the trace in the input: the raw dump, or the base64 <data> that
+// follows the "HoRNDISTrace" key of a property list.
+static bool extractDump(const std::vector<uint8_t> &input,
+	std::vector<uint8_t> &dump) {
+	if (input.size() >= sizeof(uint32_t)) {
+		uint32_t magic;
+		memcpy(&magic, input.data(), sizeof(magic));
+		if (magic == TRACE_DUMP_MAGIC) {
+			dump = input;
+			return true;
+		}
+	}
+	const std::string text(input.begin(), input.end());
+	const size_t key = text.find("<key>HoRNDISTrace</key>");
+	if (key == std::string::npos) {
+		return false;
+	}
+	const size_t start = text.find("<data>", key);
+	const size_t end = start == std::string::npos ? start :
+		text.find("</data>", start);
+	if (end == std::string::npos) {
+		return false;
+	}
+	dump = base64Decode(text.substr(start + 6, end - start - 6));
+	return true;
+}
+
+static void printRecord(const trace_rec &r, double seconds, double delta) {
+	printf("%12.6f %+10.6f  ", seconds, delta);
+	const char *name = traceEventName(r.event);
+	if (!name) {
+		printf("event-%-7u %u %u %u %u\n", r.event, r.args[0], r.args[1],
+			r.args[2], r.args[3]);
+		return;
+	}
+	printf("%-12s", name);
+	const EventFormat &fmt = kFormats[r.event];
+	for (int i = 0; i < 4 && fmt.args[i]; i++) {
+		printf(fmt.hex[i] ? " %s=%08x" : " %s=%u", fmt.args[i], r.args[i]);
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	if (argc > 2 || (argc == 2 && argv[1][0] == '-' && argv[1][1])) {
+		fprintf(stderr, "Usage: TraceDecode [FILE]\n");
+		return 2;
+	}
+	FILE *f = argc == 2 && strcmp(argv[1], "-") ? fopen(argv[1], "rb") : stdin;
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+	std::vector<uint8_t> input, dump;
+	const bool readOk = readAll(f, input);
+	if (f != stdin) {
+		fclose(f);
+	}
+	if (!readOk) {
+		fprintf(stderr, "TraceDecode: read error\n");
+		return 1;
+	}
+	const trace_dump_hdr *hdr = NULL;
+	const trace_rec *recs = NULL;
+	if (extractDump(input, dump)) {
+		recs = traceDumpRecords(dump.data(), (uint32_t)dump.size(), &hdr);
+	}
+	if (!recs) {
+		fprintf(stderr, "TraceDecode: no trace dump found (or not version %d)\n",
+			TRACE_DUMP_VERSION);
+		return 1;
+	}
+
+	printf("# %u events, %u lost, %llu ticks/s\n", hdr->numRecs, hdr->lost,
+		(unsigned long long)hdr->ticksPerSec);
+	const double tick = hdr->ticksPerSec ? 1.0 / hdr->ticksPerSec : 1e-9;
+	for (uint32_t i = 0; i < hdr->numRecs; i++) {
+		// Relative to the first one: the absolute time is since boot.
+		const trace_rec &r = recs[i];
+		const double seconds = (double)(int64_t)(r.stamp - recs[0].stamp) *
+			tick;
+		const double delta = i ? (double)(int64_t)(r.stamp -
+			recs[i - 1].stamp) * tick : 0;
+		if (i && r.seq != recs[i - 1].seq + 1) {
+			printf("# %u events missing\n", r.seq - recs[i - 1].seq - 1);
+		}
+		printRecord(r, seconds, delta);
+	}
+	return 0;
+}
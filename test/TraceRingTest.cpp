@@ -0,0 +1,143 @@
+/* TraceRingTest.cpp
+ * Unit tests for the event trace ring and its dump format (TraceRing.h).
+ * Builds and runs on Linux or Mac OS userspace: "make test".
+ */
+
+#include "TraceRing.h"
+#include "TestUtil.h"
+
+#include <vector>
+
+static const uint32_t kRecs = 8;
+
+// Dumps the ring, and checks the dump reads back.
+static const trace_rec *dump(const trace_ring &ring, std::vector<uint8_t> &buf,
+	const trace_dump_hdr **hdr) {
+	buf.assign(traceDumpSize(&ring), 0xcc);
+	const uint32_t len = traceDump(&ring, buf.data(), 1000000000);
+	const trace_rec *recs = traceDumpRecords(buf.data(), len, hdr);
+	CHECK_EQ(recs != NULL, true);
+	return recs;
+}
+
+static void testEmpty() {
+	trace_rec recs[kRecs];
+	trace_ring ring;
+	traceInit(&ring, recs, kRecs);
+	std::vector<uint8_t> buf;
+	const trace_dump_hdr *hdr = NULL;
+	dump(ring, buf, &hdr);
+	CHECK_EQ(hdr->numRecs, 0);
+	CHECK_EQ(hdr->lost, 0);
+	CHECK_EQ(hdr->ticksPerSec, 1000000000);
+}
+
+static void testFirstLap() {
+	trace_rec recs[kRecs];
+	trace_ring ring;
+	traceInit(&ring, recs, kRecs);
+	for (uint32_t i = 0; i < 3; i++) {
+		traceAdd(&ring, 100 + i, TRACE_TX_OUTPUT, i, 1, 2, 3);
+	}
+	std::vector<uint8_t> buf;
+	const trace_dump_hdr *hdr = NULL;
+	const trace_rec *out = dump(ring, buf, &hdr);
+	CHECK_EQ(hdr->numRecs, 3);
+	CHECK_EQ(hdr->lost, 0);
+	for (uint32_t i = 0; i < 3; i++) {
+		CHECK_EQ(out[i].seq, i);
+		CHECK_EQ(out[i].stamp, 100 + i);
+		CHECK_EQ(out[i].event, TRACE_TX_OUTPUT);
+		CHECK_EQ(out[i].args[0], i);
+		CHECK_EQ(out[i].args[3], 3);
+	}
+}
+
+static void testWrap() {
+	trace_rec recs[kRecs];
+	trace_ring ring;
+	traceInit(&ring, recs, kRecs);
+	for (uint32_t i = 0; i < 3 * kRecs + 5; i++) {
+		traceAdd(&ring, i, TRACE_RX_FRAME, i, 0, 0, 0);
+	}
+	std::vector<uint8_t> buf;
+	const trace_dump_hdr *hdr = NULL;
+	const trace_rec *out = dump(ring, buf, &hdr);
+	// The last lap, oldest first:
+	CHECK_EQ(hdr->numRecs, kRecs);
+	CHECK_EQ(hdr->lost, 2 * kRecs + 5);
+	for (uint32_t i = 0; i < kRecs; i++) {
+		CHECK_EQ(out[i].seq, 2 * kRecs + 5 + i);
+		CHECK_EQ(out[i].args[0], 2 * kRecs + 5 + i);
+	}
+
+	// Across the wrap of the sequence numbers:
+	traceInit(&ring, recs, kRecs);
+	ring.head = 0xfffffffeULL;
+	for (uint32_t i = 0; i < kRecs; i++) {
+		traceAdd(&ring, i, TRACE_RX_FRAME, i, 0, 0, 0);
+	}
+	out = dump(ring, buf, &hdr);
+	CHECK_EQ(hdr->numRecs, kRecs);
+	CHECK_EQ(out[0].seq, 0xfffffffe);
+	CHECK_EQ(out[2].seq, 0);
+	CHECK_EQ(out[kRecs - 1].args[0], kRecs - 1);
+}
+
+static void testTorn() {
+	trace_rec recs[kRecs];
+	trace_ring ring;
+	traceInit(&ring, recs, kRecs);
+	for (uint32_t i = 0; i < kRecs + 2; i++) {
+		traceAdd(&ring, i, TRACE_TX_COMPLETE, i, 0, 0, 0);
+	}
+	// A writer has reserved the next record (seq 10, in slot 2), and is
+	// rewriting it: the old one (seq 2) is no longer there. Neither is
+	// the one after it, that has not been written yet (seq 11).
+	ring.head += 2;
+	recs[2].seq = kRecs + 2 + 1;
+	std::vector<uint8_t> buf;
+	const trace_dump_hdr *hdr = NULL;
+	const trace_rec *out = dump(ring, buf, &hdr);
+	// Seq 4 ... 9 made it, 10 and 11 did not:
+	CHECK_EQ(hdr->numRecs, kRecs - 2);
+	CHECK_EQ(hdr->lost, 6);
+	CHECK_EQ(out[0].seq, 4);
+	CHECK_EQ(out[kRecs - 3].seq, kRecs + 1);
+}
+
+static void testDumpRecords() {
+	trace_rec recs[kRecs];
+	trace_ring ring;
+	traceInit(&ring, recs, kRecs);
+	traceAdd(&ring, 1, TRACE_RX_COMPLETE, 0, 0, 0, 0);
+	std::vector<uint8_t> buf(traceDumpSize(&ring));
+	const uint32_t len = traceDump(&ring, buf.data(), 1);
+	CHECK_EQ(len, sizeof(trace_dump_hdr) + sizeof(trace_rec));
+	const trace_dump_hdr *hdr = NULL;
+	// Truncated:
+	CHECK_EQ(traceDumpRecords(buf.data(), len - 1, &hdr) == NULL, true);
+	CHECK_EQ(traceDumpRecords(buf.data(), sizeof(trace_dump_hdr) - 1,
+		&hdr) == NULL, true);
+	// Not a dump, or not this version of it:
+	buf[0] ^= 1;
+	CHECK_EQ(traceDumpRecords(buf.data(), len, &hdr) == NULL, true);
+	buf[0] ^= 1;
+	((trace_dump_hdr *)buf.data())->version++;
+	CHECK_EQ(traceDumpRecords(buf.data(), len, &hdr) == NULL, true);
+
+	CHECK_EQ(strcmp(traceEventName(TRACE_TX_OUTPUT), "tx-output"), 0);
+	CHECK_EQ(strcmp(traceEventName(TRACE_RX_ERROR), "rx-error"), 0);
+	CHECK_EQ(traceEventName(0) == NULL, true);
+	CHECK_EQ(traceEventName(TRACE_NUM_EVENTS) == NULL, true);
+}
+
+int main() {
+	testEmpty();
+	testFirstLap();
+	testWrap();
+	testTorn();
+	testDumpRecords();
+
+	return testReport("TraceRingTest");
+}
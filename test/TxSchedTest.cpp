@@ -0,0 +1,348 @@
+/* TxSchedTest.cpp
+ * Unit tests for the transmit frame classification, the flow hashing, the
+ * ECN marking, CoDel and the byte queue limits (TxSched.h).
+ * Builds and runs on Linux or Mac OS userspace: "make test".
+ */
+
+#include "TxSched.h"
+#include "TestFrames.h"
+#include "TestUtil.h"
+
+#include <string.h>
+
+// Classifies what the driver would: at most TX_CLASSIFY_HDR_LEN bytes.
+static int classify(const std::vector<uint8_t> &frame,
+	uint32_t caplen = TX_CLASSIFY_HDR_LEN) {
+	tx_frame_info info;
+	txParseFrame(frame.data(), frame.size() < caplen ?
+		(uint32_t)frame.size() : caplen, &info);
+	return txClassifyFrame(&info);
+}
+
+static uint32_t flowHash(const std::vector<uint8_t> &frame,
+	uint32_t perturb = 0) {
+	tx_frame_info info;
+	txParseFrame(frame.data(), frame.size() < TX_CLASSIFY_HDR_LEN ?
+		(uint32_t)frame.size() : TX_CLASSIFY_HDR_LEN, &info);
+	return txFlowHash(frame.data(), &info, perturb);
+}
+
+// The ones' complement sum of the IPv4 header: 0xffff if the checksum is right.
+static uint16_t ipv4Sum(const uint8_t *ip) {
+	uint32_t sum = 0;
+	for (int i = 0; i < 20; i += 2) {
+		sum += txReadBE16(ip + i);
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return (uint16_t)sum;
+}
+
+static void testTcp() {
+	std::vector<uint8_t> frame;
+	// A pure ACK, with and without the timestamp option:
+	uint32_t l4 = buildIPv4(frame, TX_IPPROTO_TCP, 0, 20);
+	frame[l4 + 12] = 5 << 4;
+	frame[l4 + 13] = 0x10;
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	l4 = buildIPv4(frame, TX_IPPROTO_TCP, 0, 32);
+	frame[l4 + 12] = 8 << 4;
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	// Behind IPv4 options and a VLAN tag:
+	l4 = buildIPv4(frame, TX_IPPROTO_TCP, 0, 20, 40, true);
+	frame[l4 + 12] = 5 << 4;
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	// Data, even a single byte of it:
+	l4 = buildIPv4(frame, TX_IPPROTO_TCP, 0, 21);
+	frame[l4 + 12] = 5 << 4;
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+	l4 = buildIPv4(frame, TX_IPPROTO_TCP, 0, 1460);
+	frame[l4 + 12] = 5 << 4;
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+	// A bogus data offset:
+	l4 = buildIPv4(frame, TX_IPPROTO_TCP, 0, 8);
+	frame[l4 + 12] = 2 << 4;
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+	// IPv6:
+	l4 = buildIPv6(frame, TX_IPPROTO_TCP, 0, 20);
+	frame[l4 + 12] = 5 << 4;
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	l4 = buildIPv6(frame, TX_IPPROTO_TCP, 0, 1000);
+	frame[l4 + 12] = 5 << 4;
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+}
+
+static void testUdpAndIcmp() {
+	std::vector<uint8_t> frame;
+	uint32_t l4 = buildIPv4(frame, TX_IPPROTO_UDP, 0, 40);
+	txWriteBE16(&frame[l4], 51000);
+	txWriteBE16(&frame[l4 + 2], 53);
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	txWriteBE16(&frame[l4 + 2], 443);
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+	txWriteBE16(&frame[l4], 68);
+	txWriteBE16(&frame[l4 + 2], 67);
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	l4 = buildIPv6(frame, TX_IPPROTO_UDP, 0, 40);
+	txWriteBE16(&frame[l4], 546);
+	txWriteBE16(&frame[l4 + 2], 547);
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+
+	buildIPv4(frame, TX_IPPROTO_ICMP, 0, 64);
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	buildIPv6(frame, TX_IPPROTO_ICMPV6, 0, 24);
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	// Some other protocol, e.g. GRE:
+	buildIPv4(frame, 47, 0, 64);
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+}
+
+static void testDscp() {
+	std::vector<uint8_t> frame;
+	// EF, CS6, AF41 and AF21 go first, whatever they carry:
+	const uint8_t prioTos[] = { 46 << 2, 48 << 2, 34 << 2, 18 << 2, 0x10 };
+	for (size_t i = 0; i < sizeof(prioTos); i++) {
+		buildIPv4(frame, TX_IPPROTO_UDP, prioTos[i], 1000);
+		CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+		buildIPv6(frame, TX_IPPROTO_UDP, prioTos[i], 1000);
+		CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	}
+	// Best effort, CS1 (lower effort), AF11, and ECN bits alone:
+	const uint8_t bulkTos[] = { 0, 8 << 2, 10 << 2, 0x03 };
+	for (size_t i = 0; i < sizeof(bulkTos); i++) {
+		buildIPv4(frame, TX_IPPROTO_UDP, bulkTos[i], 1000);
+		CHECK_EQ(classify(frame), TX_CLASS_BULK);
+		buildIPv6(frame, TX_IPPROTO_UDP, bulkTos[i], 1000);
+		CHECK_EQ(classify(frame), TX_CLASS_BULK);
+	}
+}
+
+static void testOther() {
+	std::vector<uint8_t> frame;
+	buildEthernet(frame, TX_ETHERTYPE_ARP, 28);
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	buildEthernet(frame, TX_ETHERTYPE_EAPOL, 100, true);
+	CHECK_EQ(classify(frame), TX_CLASS_PRIORITY);
+	buildEthernet(frame, 0x88b5, 100);
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+
+	// A non-first fragment of a DNS response has no UDP header:
+	uint32_t l4 = buildIPv4(frame, TX_IPPROTO_UDP, 0, 40);
+	txWriteBE16(&frame[l4 + 2], 53);
+	txWriteBE16(&frame[l4 - 20 + 6], 185);
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+
+	// Truncated and malformed headers:
+	CHECK_EQ(classify(frame, 13), TX_CLASS_BULK);
+	CHECK_EQ(classify(frame, 14 + 19), TX_CLASS_BULK);
+	buildIPv4(frame, TX_IPPROTO_ICMP, 0, 64);
+	frame[14] = 0x44;  // IHL of 16 bytes.
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+	frame[14] = 0x65;  // Not version 4.
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+	l4 = buildIPv4(frame, TX_IPPROTO_UDP, 0, 40);
+	txWriteBE16(&frame[l4 + 2], 53);
+	CHECK_EQ(classify(frame, l4 + 3), TX_CLASS_BULK);
+	buildEthernet(frame, TX_ETHERTYPE_VLAN, 2);
+	CHECK_EQ(classify(frame), TX_CLASS_BULK);
+}
+
+static void testParse() {
+	std::vector<uint8_t> frame;
+	tx_frame_info info;
+	uint32_t l4 = buildIPv4(frame, TX_IPPROTO_TCP, 0x02, 100, 24, true);
+	txParseFrame(frame.data(), TX_CLASSIFY_HDR_LEN, &info);
+	CHECK_EQ(info.etherType, TX_ETHERTYPE_IP);
+	CHECK_EQ(info.l3ofs, 18);
+	CHECK_EQ(info.ipVersion, 4);
+	CHECK_EQ(info.tos, 0x02);
+	CHECK_EQ(info.proto, TX_IPPROTO_TCP);
+	CHECK_EQ(info.l4 - frame.data(), l4);
+	CHECK_EQ(info.l4caplen, TX_CLASSIFY_HDR_LEN - l4);
+	CHECK_EQ(info.l4len, 100);
+	buildEthernet(frame, TX_ETHERTYPE_ARP, 28);
+	txParseFrame(frame.data(), (uint32_t)frame.size(), &info);
+	CHECK_EQ(info.ipVersion, 0);
+	CHECK_EQ(info.l4 == NULL, true);
+}
+
+static void testFlowHash() {
+	std::vector<uint8_t> a, b;
+	// Same addresses and ports, different payloads: the same flow.
+	uint32_t l4 = buildIPv4(a, TX_IPPROTO_TCP, 0, 1000);
+	a[14 + 12] = 10; a[14 + 15] = 1; a[14 + 16] = 10; a[14 + 19] = 2;
+	txWriteBE16(&a[l4], 50000);
+	txWriteBE16(&a[l4 + 2], 443);
+	b = a;
+	b[l4 + 40] = 0xaa;
+	txWriteBE16(&b[14 + 2], 500);
+	CHECK_EQ(flowHash(a), flowHash(b));
+	// Another source port, another flow (for this hash, at least):
+	txWriteBE16(&b[l4], 50001);
+	CHECK_EQ(flowHash(a) != flowHash(b), true);
+	// ... and another perturbation, another hash function:
+	CHECK_EQ(flowHash(a, 1) != flowHash(a, 2), true);
+	// IPv6 addresses:
+	l4 = buildIPv6(a, TX_IPPROTO_UDP, 0, 100);
+	b = a;
+	b[14 + 8 + 15] = 1;
+	CHECK_EQ(flowHash(a) != flowHash(b), true);
+	// Not IP: by the Ethernet header.
+	buildEthernet(a, TX_ETHERTYPE_ARP, 28);
+	b = a;
+	b[11] = 1;
+	CHECK_EQ(flowHash(a) != flowHash(b), true);
+	b = a;
+	b[20] = 1;
+	CHECK_EQ(flowHash(a), flowHash(b));
+}
+
+static void testSetCE() {
+	std::vector<uint8_t> frame;
+	buildIPv4(frame, TX_IPPROTO_TCP, 0x02, 1000);  // ECT(0).
+	uint8_t *ip = &frame[14];
+	ip[8] = 64;
+	ip[12] = 192; ip[13] = 168; ip[15] = 1; ip[16] = 8; ip[17] = 8;
+	uint32_t sum = 0;
+	for (int i = 0; i < 20; i += 2) {
+		sum += txReadBE16(ip + i);
+	}
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	txWriteBE16(ip + 10, (uint16_t)~sum);
+	CHECK_EQ(ipv4Sum(ip), 0xffff);
+	CHECK_EQ(txSetCE(ip, 4), true);
+	CHECK_EQ(ip[1], 0x03);
+	CHECK_EQ(ipv4Sum(ip), 0xffff);
+	// Already CE: nothing changes.
+	CHECK_EQ(txSetCE(ip, 4), true);
+	CHECK_EQ(ipv4Sum(ip), 0xffff);
+	// Not-ECT is left alone:
+	ip[1] = 0x10;
+	CHECK_EQ(txSetCE(ip, 4), false);
+	CHECK_EQ(ip[1], 0x10);
+
+	buildIPv6(frame, TX_IPPROTO_TCP, 0xb9, 100);  // EF, ECT(1).
+	ip = &frame[14];
+	CHECK_EQ(txSetCE(ip, 6), true);
+	CHECK_EQ(ip[0], 0x6b);
+	CHECK_EQ(ip[1], 0xb0);
+	buildIPv6(frame, TX_IPPROTO_TCP, 0xb8, 100);
+	CHECK_EQ(txSetCE(&frame[14], 6), false);
+	CHECK_EQ(txSetCE(&frame[14], 0), false);
+}
+
+static void testCodel() {
+	CHECK_EQ(txIsqrt64(0), 0);
+	CHECK_EQ(txIsqrt64(15), 3);
+	CHECK_EQ(txIsqrt64(16), 4);
+	CHECK_EQ(txIsqrt64(1ULL << 32), 1ULL << 16);
+	CHECK_EQ(txIsqrt64(~0ULL), 0xffffffffULL);
+	// interval / sqrt(count):
+	CHECK_EQ(txCodelControlLaw(1000, 100000, 1), 101000);
+	CHECK_EQ(txCodelControlLaw(1000, 100000, 4), 51000);
+	CHECK_EQ(txCodelControlLaw(0, 100000, 2), 70711);
+
+	const tx_codel_params p = { 5, 100, 1514 };
+	tx_codel c;
+	memset(&c, 0, sizeof c);
+	// Below the target, or nothing behind: never.
+	CHECK_EQ(txCodelOkToDrop(&c, &p, 1000, 4, 100000), false);
+	CHECK_EQ(txCodelOkToDrop(&c, &p, 1000, 50, 1514), false);
+	CHECK_EQ(c.firstAboveTime, 0);
+	// Above it for a whole interval:
+	CHECK_EQ(txCodelOkToDrop(&c, &p, 1000, 50, 100000), false);
+	CHECK_EQ(c.firstAboveTime, 1100);
+	CHECK_EQ(txCodelOkToDrop(&c, &p, 1099, 50, 100000), false);
+	CHECK_EQ(txCodelOkToDrop(&c, &p, 1100, 50, 100000), true);
+	// ... and a dip resets it.
+	CHECK_EQ(txCodelOkToDrop(&c, &p, 1101, 4, 100000), false);
+	CHECK_EQ(txCodelOkToDrop(&c, &p, 1102, 50, 100000), false);
+
+	txCodelStartDropping(&c, &p, 2000);
+	CHECK_EQ(c.dropping, true);
+	CHECK_EQ(c.count, 1);
+	CHECK_EQ(c.dropNext, 2100);
+	// Leaves after 5 drops, and comes back soon: resumes at that rate.
+	c.count = 5;
+	c.dropping = false;
+	txCodelStartDropping(&c, &p, 2200);
+	CHECK_EQ(c.count, 4);
+	CHECK_EQ(c.dropNext, 2250);
+	// ... but not after 16 intervals.
+	c.count = 10;
+	c.dropping = false;
+	txCodelStartDropping(&c, &p, 2250 + 1600);
+	CHECK_EQ(c.count, 1);
+}
+
+static void testDql() {
+	tx_dql d;
+	txDqlInit(&d, 0, 4000, 100, 0);
+	CHECK_EQ(txDqlAvail(&d), 0);
+	// The first one always goes; it's over the limit, and completes while
+	// nothing else is in flight: starved, grow.
+	txDqlQueued(&d, 1000);
+	CHECK_EQ(txDqlAvail(&d), -1000);
+	CHECK_EQ(txDqlInflight(&d), 1000);
+	txDqlCompleted(&d, 1000, 1);
+	CHECK_EQ(d.limit, 1000);
+	CHECK_EQ(txDqlAvail(&d), 1000);
+	txDqlQueued(&d, 1000);
+	txDqlQueued(&d, 1000);
+	CHECK_EQ(txDqlAvail(&d), -1000);
+	txDqlCompleted(&d, 1000, 2);
+	CHECK_EQ(d.limit, 1000);
+	// All of what was over the limit completed: starved again.
+	txDqlCompleted(&d, 1000, 3);
+	CHECK_EQ(d.limit, 2000);
+	CHECK_EQ(txDqlInflight(&d), 0);
+	// Clamped to the maximum:
+	for (int i = 0; i < 10; i++) {
+		txDqlQueued(&d, 3000);
+		txDqlCompleted(&d, 3000, 4 + i);
+	}
+	CHECK_EQ(d.limit, 4000);
+
+	// A steady flow that keeps 1000 bytes completing per 3000 in flight:
+	// the slack is given back, once it's been there for the hold time.
+	txDqlInit(&d, 500, 100000, 100, 0);
+	d.limit = 10000;
+	d.adjLimit = 10000;
+	for (int i = 0; i < 3; i++) {
+		txDqlQueued(&d, 1000);
+	}
+	uint64_t now = 0;
+	for (int i = 0; i < 20; i++) {
+		now += 10;
+		txDqlCompleted(&d, 1000, now);
+		txDqlQueued(&d, 1000);
+	}
+	CHECK_EQ(d.limit, 2000);
+	CHECK_EQ(txDqlAvail(&d) >= 0, false);
+	// Never below the minimum:
+	for (int i = 0; i < 40; i++) {
+		now += 10;
+		txDqlCompleted(&d, 1000, now);
+		txDqlQueued(&d, 1000);
+	}
+	CHECK_EQ(d.limit >= 500, true);
+	txDqlReset(&d, now);
+	CHECK_EQ(d.limit, 500);
+	CHECK_EQ(txDqlInflight(&d), 0);
+}
+
+int main() {
+	testTcp();
+	testUdpAndIcmp();
+	testDscp();
+	testOther();
+	testParse();
+	testFlowHash();
+	testSetCE();
+	testCodel();
+	testDql();
+
+	return testReport("TxSchedTest");
+}
@@ -0,0 +1,230 @@
+/* TxSegmentTest.cpp
+ * Unit tests for the TCP segmentation offload (TxSegment.h).
+ * Builds and runs on Linux or Mac OS userspace: "make test".
+ */
+
+#include "TxSegment.h"
+#include "TestFrames.h"
+#include "TestUtil.h"
+
+#include <string.h>
+
+// The ones' complement sum, the slow way: 0xffff over data that includes
+// its right checksum.
+static uint16_t onesSum(const std::vector<uint8_t> &data) {
+	uint32_t sum = 0;
+	for (size_t i = 0; i < data.size(); i++) {
+		sum += i % 2 ? data[i] : data[i] << 8;
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return (uint16_t)sum;
+}
+
+static uint8_t payloadByte(uint32_t i) {
+	return (uint8_t)(i * 7 + (i >> 8));
+}
+
+struct Packet {
+	std::vector<uint8_t> bytes;
+	uint32_t l3ofs, l4ofs, hdrLen;
+};
+
+// A TCP super-packet: 'tcpHdrLen' bytes of TCP header (with NOP options),
+// then 'payloadLen' bytes of payload.
+static Packet buildTcp(int ipVersion, bool vlan, uint32_t tcpHdrLen,
+	uint32_t payloadLen, uint32_t seq, uint8_t flags) {
+	Packet p;
+	const uint32_t l4len = tcpHdrLen + payloadLen;
+	p.l4ofs = ipVersion == 4 ?
+		buildIPv4(p.bytes, TX_IPPROTO_TCP, 0, l4len, 20, vlan) :
+		buildIPv6(p.bytes, TX_IPPROTO_TCP, 0, l4len, vlan);
+	p.l3ofs = vlan ? 18 : 14;
+	p.hdrLen = p.l4ofs + tcpHdrLen;
+	uint8_t *b = p.bytes.data();
+	for (int i = 0; i < 12; i++) {
+		b[i] = (uint8_t)(0x20 + i);
+	}
+	uint8_t *ip = b + p.l3ofs;
+	if (ipVersion == 4) {
+		txWriteBE16(ip + 4, 0xfffe);  // The IDs wrap around.
+		txWriteBE16(ip + 6, 0x4000);  // Don't fragment.
+		ip[8] = 64;
+		txWriteBE32(ip + 12, 0xc0a80002);
+		txWriteBE32(ip + 16, 0x0a000001);
+	} else {
+		ip[7] = 64;
+		for (int i = 0; i < 32; i++) {
+			ip[8 + i] = (uint8_t)(0xf0 + i);
+		}
+	}
+	uint8_t *tcp = b + p.l4ofs;
+	txWriteBE16(tcp, 49152);
+	txWriteBE16(tcp + 2, 443);
+	txWriteBE32(tcp + 4, seq);
+	txWriteBE32(tcp + 8, 0x12345678);
+	tcp[12] = (uint8_t)((tcpHdrLen / 4) << 4);
+	tcp[13] = flags;
+	txWriteBE16(tcp + 14, 65535);
+	txWriteBE16(tcp + 16, 0xbeef);  // Whatever the stack left there.
+	memset(tcp + 20, 1, tcpHdrLen - 20);
+	for (uint32_t i = 0; i < payloadLen; i++) {
+		b[p.hdrLen + i] = payloadByte(i);
+	}
+	return p;
+}
+
+static bool parse(const Packet &p, uint32_t mss, tx_tso *t) {
+	const uint32_t caplen = p.bytes.size() < TX_TSO_MAX_HDR_LEN ?
+		(uint32_t)p.bytes.size() : TX_TSO_MAX_HDR_LEN;
+	return txTsoParse(p.bytes.data(), caplen, (uint32_t)p.bytes.size(), mss, t);
+}
+
+// Cuts the packet, as the driver does, and checks every segment.
+static void checkSegments(const Packet &p, uint32_t mss, uint32_t numSegs) {
+	tx_tso t;
+	CHECK_EQ(parse(p, mss, &t), true);
+	CHECK_EQ(t.hdrLen, p.hdrLen);
+	CHECK_EQ(txTsoSegments(&t), numSegs);
+	const bool v4 = t.ipVersion == 4;
+	const uint8_t *origIp = p.bytes.data() + p.l3ofs;
+	const uint8_t *origTcp = p.bytes.data() + p.l4ofs;
+	uint32_t ofs = 0;
+	for (uint32_t seg = 0; seg < txTsoSegments(&t); seg++) {
+		const uint32_t len = txTsoSegmentLen(&t, seg);
+		std::vector<uint8_t> frame(t.hdrLen + len, 0xaa);
+		txTsoWriteHeaders(&t, p.bytes.data(), seg, frame.data());
+		memcpy(&frame[t.hdrLen], &p.bytes[p.hdrLen + ofs], len);
+		txTsoChecksum(&t, frame.data(), len);
+
+		const uint8_t *ip = &frame[p.l3ofs];
+		const uint8_t *tcp = &frame[p.l4ofs];
+		CHECK_EQ(memcmp(frame.data(), p.bytes.data(), p.l3ofs), 0);
+		if (v4) {
+			CHECK_EQ(txReadBE16(ip + 2), frame.size() - p.l3ofs);
+			CHECK_EQ(txReadBE16(ip + 4), (uint16_t)(0xfffe + seg));
+			CHECK_EQ(onesSum(std::vector<uint8_t>(ip, ip + 20)), 0xffff);
+		} else {
+			CHECK_EQ(txReadBE16(ip + 4), frame.size() - p.l4ofs);
+		}
+		CHECK_EQ(txReadBE32(tcp + 4), txReadBE32(origTcp + 4) + ofs);
+		// The flags of the super-packet, less FIN and PSH until the last
+		// segment, and CWR after the first:
+		uint8_t flags = origTcp[13];
+		if (seg + 1 < numSegs) {
+			flags &= ~(TX_TCP_FIN | TX_TCP_PSH);
+		}
+		if (seg > 0) {
+			flags &= ~TX_TCP_CWR;
+		}
+		CHECK_EQ(tcp[13], flags);
+		CHECK_EQ(memcmp(tcp + 14, origTcp + 14, 2), 0);
+		CHECK_EQ(memcmp(tcp + 18, origTcp + 18, p.hdrLen - p.l4ofs - 18), 0);
+
+		// The TCP checksum, over the pseudo-header and the segment:
+		const uint32_t tcpLen = (uint32_t)frame.size() - p.l4ofs;
+		std::vector<uint8_t> pseudo;
+		if (v4) {
+			pseudo.assign(origIp + 12, origIp + 20);
+			pseudo.push_back(0);
+			pseudo.push_back(TX_IPPROTO_TCP);
+			pseudo.push_back((uint8_t)(tcpLen >> 8));
+			pseudo.push_back((uint8_t)tcpLen);
+		} else {
+			pseudo.assign(origIp + 8, origIp + 40);
+			const uint8_t tail[8] = { 0, 0, (uint8_t)(tcpLen >> 8),
+				(uint8_t)tcpLen, 0, 0, 0, TX_IPPROTO_TCP };
+			pseudo.insert(pseudo.end(), tail, tail + 8);
+		}
+		pseudo.insert(pseudo.end(), tcp, tcp + tcpLen);
+		CHECK_EQ(onesSum(pseudo), 0xffff);
+
+		CHECK_EQ(len <= mss, true);
+		CHECK_EQ(memcmp(&frame[t.hdrLen], &p.bytes[p.hdrLen + ofs], len), 0);
+		ofs += len;
+	}
+	CHECK_EQ(ofs, t.payloadLen);
+}
+
+static void testChecksum() {
+	// The example of RFC 1071, section 3:
+	const uint8_t data[] = { 0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7 };
+	CHECK_EQ(txCsumFold(txCsumAdd(0, data, sizeof(data))), (uint16_t)~0xddf2);
+	// An odd length counts the last byte as the high one:
+	CHECK_EQ(txCsumAdd(0, data, 3), 0x0001 + 0xf200);
+	// Carries are folded:
+	const uint8_t ones[] = { 0xff, 0xff, 0xff, 0xff, 0x00, 0x02 };
+	CHECK_EQ(txCsumFold(txCsumAdd(0, ones, sizeof(ones))), (uint16_t)~0x0002);
+}
+
+static void testIPv4() {
+	// 64K of bulk data, with the timestamp option, as TCP sends it:
+	checkSegments(buildTcp(4, false, 32, 65483, 1000, 0x18), 1448, 46);
+	// The sequence number wraps, the last segment is odd, and the flags of
+	// the last and first segments:
+	checkSegments(buildTcp(4, false, 20, 4001, 0xfffff000, 0x99), 1460, 3);
+	// A multiple of the MSS, behind a VLAN tag:
+	checkSegments(buildTcp(4, true, 20, 2920, 7, 0x10), 1460, 2);
+	// Less than the MSS, and no payload at all: a segment, as is.
+	checkSegments(buildTcp(4, false, 20, 100, 7, 0x18), 1460, 1);
+	checkSegments(buildTcp(4, false, 20, 0, 7, 0x11), 1460, 1);
+}
+
+static void testIPv6() {
+	checkSegments(buildTcp(6, false, 32, 30000, 1, 0x18), 1428, 22);
+	checkSegments(buildTcp(6, true, 20, 3001, 0xffffffff, 0x99), 1000, 4);
+}
+
+static void testParse() {
+	tx_tso t;
+	Packet p = buildTcp(4, false, 20, 3000, 1, 0x10);
+	CHECK_EQ(parse(p, 1460, &t), true);
+	CHECK_EQ(t.l3ofs, 14);
+	CHECK_EQ(t.l4ofs, 34);
+	CHECK_EQ(t.payloadLen, 3000);
+	CHECK_EQ(t.ipVersion, 4);
+	// No MSS:
+	CHECK_EQ(parse(p, 0, &t), false);
+	// Not TCP:
+	p.bytes[p.l3ofs + 9] = TX_IPPROTO_UDP;
+	CHECK_EQ(parse(p, 1460, &t), false);
+	// A fragment:
+	p = buildTcp(4, false, 20, 3000, 1, 0x10);
+	txWriteBE16(p.bytes.data() + p.l3ofs + 6, 0x2000);
+	CHECK_EQ(parse(p, 1460, &t), false);  // More fragments: the first one.
+	txWriteBE16(p.bytes.data() + p.l3ofs + 6, 0x0010);
+	CHECK_EQ(parse(p, 1460, &t), false);
+	// The IP length does not cover the packet, or goes beyond it:
+	p = buildTcp(4, false, 20, 3000, 1, 0x10);
+	txWriteBE16(p.bytes.data() + p.l3ofs + 2, 2000);
+	CHECK_EQ(parse(p, 1460, &t), false);
+	p = buildTcp(6, false, 20, 3000, 1, 0x10);
+	txWriteBE16(p.bytes.data() + p.l3ofs + 4, 3100);
+	CHECK_EQ(parse(p, 1460, &t), false);
+	// An IPv6 extension header (hop-by-hop):
+	p = buildTcp(6, false, 20, 3000, 1, 0x10);
+	p.bytes[p.l3ofs + 6] = 0;
+	CHECK_EQ(parse(p, 1460, &t), false);
+	// A bogus TCP data offset:
+	p = buildTcp(4, false, 20, 3000, 1, 0x10);
+	p.bytes[p.l4ofs + 12] = 4 << 4;
+	CHECK_EQ(parse(p, 1460, &t), false);
+	// The headers cut short:
+	p = buildTcp(4, false, 60, 3000, 1, 0x10);
+	CHECK_EQ(txTsoParse(p.bytes.data(), p.hdrLen - 1,
+		(uint32_t)p.bytes.size(), 1460, &t), false);
+	CHECK_EQ(txTsoParse(p.bytes.data(), p.hdrLen,
+		(uint32_t)p.bytes.size(), 1460, &t), true);
+	// Not IP:
+	p = buildTcp(4, false, 20, 3000, 1, 0x10);
+	txWriteBE16(p.bytes.data() + 12, TX_ETHERTYPE_ARP);
+	CHECK_EQ(parse(p, 1460, &t), false);
+}
+
+int main() {
+	testChecksum();
+	testIPv4();
+	testIPv6();
+	testParse();
+
+	return testReport("TxSegmentTest");
+}
@@ -0,0 +1,112 @@
+/* UtilSamplerTest.cpp
+ * Unit tests for the rolling throughput and utilization (UtilSampler.h).
+ * Builds and runs on Linux or Mac OS userspace: "make test".
+ */
+
+#include "UtilSampler.h"
+#include "TestUtil.h"
+
+static void testEmpty() {
+	struct util_history h;
+	struct util_rates r;
+	utilReset(&h);
+	CHECK_EQ(utilRates(&h, 1, &r), 0);
+
+	// One sample is not a rate yet:
+	struct util_sample s = {};
+	s.stampUs = 5000000;
+	s.txBytes = 1000;
+	utilAdd(&h, &s);
+	CHECK_EQ(utilRates(&h, 1, &r), 0);
+	CHECK_EQ(r.txBitsPerSec, 0);
+
+	// Nor two at the same time:
+	utilAdd(&h, &s);
+	CHECK_EQ(utilRates(&h, 1, &r), 0);
+}
+
+static void testSteady() {
+	struct util_history h;
+	struct util_rates r;
+	utilReset(&h);
+	// 1.25 MB/s (10 Mbit/s) of 1250-byte frames out, half as much in. Two
+	// OUT transfers in flight all along, the IN pipe idle 10% of the time:
+	struct util_sample s = {};
+	for (int i = 0; i <= 100; i++) {
+		s.stampUs = 1000000ULL * i;
+		s.txBytes = 1250000ULL * i;
+		s.txFrames = 1000ULL * i;
+		s.rxBytes = 625000ULL * i;
+		s.rxFrames = 500ULL * i;
+		s.outBusyUs = 2000000ULL * i;
+		s.inIdleUs = 100000ULL * i;
+		utilAdd(&h, &s);
+	}
+	CHECK_EQ(h.count, UTIL_HISTORY);
+	const uint32_t windows[] = { 1, 10, 60 };
+	for (int w = 0; w < 3; w++) {
+		CHECK_EQ(utilRates(&h, windows[w], &r), 1);
+		CHECK_EQ(r.spanUs, windows[w] * 1000000ULL);
+		CHECK_EQ(r.txBitsPerSec, 10000000);
+		CHECK_EQ(r.rxBitsPerSec, 5000000);
+		CHECK_EQ(r.txFramesPerSec, 1000);
+		CHECK_EQ(r.rxFramesPerSec, 500);
+		CHECK_EQ(r.outBufsInFlightMilli, 2000);
+		CHECK_EQ(r.inIdlePermille, 100);
+	}
+	// No more than the history holds:
+	CHECK_EQ(utilRates(&h, 1000, &r), 1);
+	CHECK_EQ(r.spanUs, (UTIL_HISTORY - 1) * 1000000ULL);
+}
+
+static void testWindows() {
+	struct util_history h;
+	struct util_rates r;
+	utilReset(&h);
+	// Idle for a minute, then a burst of 8 MB in the last second:
+	struct util_sample s = {};
+	for (int i = 0; i <= 60; i++) {
+		s.stampUs = 1000000ULL * i;
+		s.inIdleUs = s.stampUs;
+		utilAdd(&h, &s);
+	}
+	s.stampUs += 1000000;
+	s.rxBytes += 8000000;
+	s.rxFrames += 6000;
+	utilAdd(&h, &s);
+
+	CHECK_EQ(utilRates(&h, 1, &r), 1);
+	CHECK_EQ(r.rxBitsPerSec, 64000000);
+	CHECK_EQ(r.rxFramesPerSec, 6000);
+	CHECK_EQ(r.inIdlePermille, 0);
+	CHECK_EQ(utilRates(&h, 10, &r), 1);
+	CHECK_EQ(r.rxBitsPerSec, 6400000);
+	CHECK_EQ(r.rxFramesPerSec, 600);
+	CHECK_EQ(r.inIdlePermille, 900);
+	CHECK_EQ(utilRates(&h, 60, &r), 1);
+	CHECK_EQ(r.rxFramesPerSec, 100);
+	CHECK_EQ(r.inIdlePermille, 983);
+
+	// Early on, the windows cover what there is:
+	utilReset(&h);
+	s = util_sample();
+	utilAdd(&h, &s);
+	s.stampUs = 500000;
+	s.txFrames = 50;
+	s.outBusyUs = 250000;
+	s.inIdleUs = 600000;  // Counted up to a bit later: clamped.
+	utilAdd(&h, &s);
+	CHECK_EQ(utilRates(&h, 60, &r), 1);
+	CHECK_EQ(r.spanUs, 500000);
+	CHECK_EQ(r.txFramesPerSec, 100);
+	CHECK_EQ(r.outBufsInFlightMilli, 500);
+	CHECK_EQ(r.inIdlePermille, 1000);
+}
+
+int main() {
+	testEmpty();
+	testSteady();
+	testWindows();
+
+	return testReport("UtilSamplerTest");
+}
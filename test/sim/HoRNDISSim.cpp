@@ -0,0 +1,1131 @@
+/* HoRNDISSim.cpp
+ * Runs the driver (HoRNDIS.cpp, unmodified) against the simulated kernel
+ * and RNDIS device, pushes traffic through it, and reports the throughput,
+ * the latency distribution and the driver's own statistics.
+ *
+ * Everything runs in simulated time, in one thread, so the results are
+ * deterministic for a given seed. It's a model, not a Mac: use it to
+ * compare the driver's behaviour across changes and settings, and to catch
+ * protocol errors, lost or corrupted frames, and leaks.
+ *
+ *   HoRNDISSim [options]   - one run; see 'usage'
+ *   HoRNDISSim --smoke     - the fixed scenarios run by 'make test'
+ */
+
+#include "SimDevice.h"
+#include "HoRNDIS.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <utility>
+
+// The kext's own module info, normally generated by Xcode:
+kmod_info_t kmod_info = { "HoRNDIS", "sim" };
+
+namespace {
+
+enum Mode { kModeTx = 1, kModeRx = 2, kModeBidir = 3 };
+
+struct Options {
+	const char *name = "run";
+	int mode = kModeTx;
+	std::string mix = "1514";
+	double rateMbps = 0;  // Per direction; 0: as fast as it goes.
+	uint32_t durationMs = 200;
+	int segments = 1;  // Mbufs per transmitted frame.
+	double probeMbps = 0;  // Transmitted probe frames, see SimDevice.h.
+	uint32_t tsoMss = 1460;  // The "tso" mix's TCP MSS.
+	SimConfig device;
+	std::vector<std::pair<std::string, uint32_t> > tunables;
+	bool cycle = false;  // Disable and re-enable the interface halfway.
+	const char *traceFile = NULL;  // Where to save the event trace's dump.
+};
+
+// Frame sizes, drawn from a fixed size or a mix:
+class FrameMix {
+public:
+	FrameMix(const std::string &mix, uint64_t seed): rng(seed) {
+		if (mix == "imix") {  // The "simple IMIX", 7:4:1.
+			sizes = { 60, 60, 60, 60, 60, 60, 60, 576, 576, 576, 576, 1514 };
+		} else if (mix == "tcp") {  // Bulk data, with an ACK now and then.
+			sizes = { 1514, 1514, 1514, 1514, 1514, 1514, 1514, 60 };
+		} else if (mix == "tso") {  // TCP's super-packets, see SimDevice.h.
+			sizes = { 65000, 65000, 30000, 9000, 1514, 60 };
+		} else {
+			const uint32_t len = (uint32_t)atoi(mix.c_str());
+			if (len < SIM_FRAME_MIN_LEN || len > SIM_FRAME_MAX_LEN) {
+				fprintf(stderr, "Bad frame size '%s'\n", mix.c_str());
+				exit(2);
+			}
+			sizes = { len };
+		}
+	}
+	uint32_t next() {
+		return sizes[std::uniform_int_distribution<size_t>(
+			0, sizes.size() - 1)(rng)];
+	}
+private:
+	std::mt19937_64 rng;
+	std::vector<uint32_t> sizes;
+};
+
+const uint64_t kTopUpNs = 20 * NSEC_PER_USEC;  // Saturating: refill period.
+const uint32_t kTopUpFrames = 64;  // Saturating: keep this many queued.
+const uint64_t kDrainNs = 20 * NSEC_PER_MSEC;
+
+// Generates one direction of the traffic, either at a fixed rate, or by
+// keeping the queue in front of the bottleneck non-empty.
+class Generator {
+public:
+	Generator(const Options &opts, uint64_t seed,
+		std::function<bool(uint32_t len)> send,
+		std::function<uint32_t()> queued):
+		mix(opts.mix, seed), rateMbps(opts.rateMbps), send(send),
+		queued(queued) {}
+	~Generator() { stop(); }
+
+	void start() {
+		running = true;
+		tick();
+	}
+	void stop() {
+		running = false;
+		simCancel(event);
+		event = 0;
+	}
+	uint64_t drops = 0;  // Refused by the queue.
+
+private:
+	void tick() {
+		event = 0;
+		if (!running) {
+			return;
+		}
+		uint64_t next = simNow() + kTopUpNs;
+		if (rateMbps > 0) {
+			const uint32_t len = mix.next();
+			if (!send(len)) {
+				drops++;
+			}
+			next = simNow() + (uint64_t)(len * 8000.0 / rateMbps);
+		} else {
+			while (queued() < kTopUpFrames) {
+				if (!send(mix.next())) {
+					drops++;
+					break;
+				}
+			}
+		}
+		event = simSchedule(next, [this] { tick(); });
+	}
+
+	FrameMix mix;
+	const double rateMbps;
+	std::function<bool(uint32_t len)> send;
+	std::function<uint32_t()> queued;
+	bool running = false;
+	uint64_t event = 0;
+};
+
+// What the host stack receives from the driver:
+void rxHook(mbuf_t m, void *context) {
+	SimFrameSink *sink = (SimFrameSink *)context;
+	uint8_t frame[SIM_FRAME_MAX_LEN + 64];
+	const size_t len = mbuf_pkthdr_len(m);
+	if (len > sizeof(frame)) {
+		sink->corrupt++;
+	} else {
+		mbuf_copydata(m, 0, len, frame);
+		sink->receive(frame, (uint32_t)len);
+	}
+	mbuf_freem(m);
+}
+
+uint64_t statNumber(const OSDictionary *dict, const char *key) {
+	OSNumber *num = dict ? OSDynamicCast(OSNumber, dict->getObject(key)) : NULL;
+	return num ? num->unsigned64BitValue() : 0;
+}
+
+struct DirectionResult {
+	uint64_t frames = 0;
+	uint64_t bytes = 0;
+	double seconds = 0;
+	double framesPerTransfer = 0;
+	std::vector<uint32_t> latenciesNs;
+	std::vector<uint32_t> probeLatenciesNs;
+	uint64_t stalls = 0;
+	uint64_t lost = 0;
+	uint64_t drops = 0;  // Refused at the sending end's queue.
+	uint64_t driverDrops = 0;  // Taken, then dropped by the driver's queues.
+};
+
+// Sorts the latencies, and returns their p50, p90, p99 and p99.9.
+void latencyPercentiles(std::vector<uint32_t> &lat, double us[4]) {
+	std::sort(lat.begin(), lat.end());
+	const double pct[] = { 0.5, 0.9, 0.99, 0.999 };
+	for (int i = 0; i < 4; i++) {
+		us[i] = lat.empty() ? 0 : lat[std::min(lat.size() - 1,
+			(size_t)(pct[i] * lat.size()))] / 1000.0;
+	}
+}
+
+void printDirection(const char *name, DirectionResult &r) {
+	if (r.seconds <= 0) {
+		return;
+	}
+	double us[4];
+	latencyPercentiles(r.latenciesNs, us);
+	printf("  %s: %7.1f Mbit/s %7.1f kfps %5.2f frames/xfer | latency us "
+		"p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f | stalls %llu lost %llu "
+		"drops %llu\n", name, r.bytes * 8 / r.seconds / 1e6,
+		r.frames / r.seconds / 1e3, r.framesPerTransfer,
+		us[0], us[1], us[2], us[3], (unsigned long long)r.stalls,
+		(unsigned long long)r.lost, (unsigned long long)r.drops);
+	if (r.driverDrops) {
+		printf("    driver queue drops: %llu\n",
+			(unsigned long long)r.driverDrops);
+	}
+	if (!r.probeLatenciesNs.empty()) {
+		latencyPercentiles(r.probeLatenciesNs, us);
+		printf("    probes: latency us p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f\n",
+			us[0], us[1], us[2], us[3]);
+	}
+}
+
+bool check(bool ok, const char *scenario, const char *what) {
+	if (!ok) {
+		printf("  FAILED (%s): %s\n", scenario, what);
+	}
+	return ok;
+}
+
+struct ScenarioResult {
+	DirectionResult tx, rx;
+	SimDeviceStats device;
+	SimFrameSink txSink, rxSink;  // Without the latencies.
+	OSDictionary *driverStats = NULL;
+	uint64_t txCodelDrops = 0;
+	uint64_t txBqlStalls = 0;
+	uint64_t txBqlMaxInflight = 0;
+	uint64_t txQueueStalls = 0;
+	uint64_t txQueueResumes = 0;
+	uint64_t txQueueStalledUs = 0;
+	uint64_t txTsoPackets = 0, txTsoSegments = 0, txTsoErrors = 0;
+	uint32_t mtu = 0;  // The interface's, as the driver started it.
+	uint32_t maxMtu = 0;  // As far as the driver lets it go.
+	bool mtuSettable = false;  // Down, up to the most, and not beyond.
+	uint64_t txBytes = 0, rxBytes = 0;  // The driver's "TxBytes", "RxBytes".
+	uint64_t rxSinkBytes = 0;  // What had arrived by then: more may, after.
+	uint64_t ctrlMaxLatencyUs = 0;  // "ControlMaxLatencyUs".
+	uint64_t rxErrors = 0;  // All of "RxErrors".
+	uint64_t ioErrors = 0;  // All of the pipes' "IOErrors".
+	// From the "Latency" statistics, see "LATENCY HISTOGRAMS":
+	struct StageLatency {
+		const char *name;
+		uint64_t count, p50Us, p99Us, maxUs;
+	};
+	std::vector<StageLatency> latency;
+	bool latencyCleared = false;  // By 'kResetLatencyKey'.
+	// From the event trace's dump, see "EVENT TRACE":
+	bool traceValid = false;  // There's a dump, in order.
+	uint32_t traceRecs = 0;
+	uint64_t traceEvents[TRACE_NUM_EVENTS] = {};
+	bool traceSwitchedOff = false;  // Through 'setProperties'.
+	bool traceFrozen = false;  // Dumped then, and no longer on every read.
+	// The last second of the throughput sampler, see "THROUGHPUT SAMPLER":
+	bool sampled = false;
+	uint64_t sampledTxBps = 0, sampledRxBps = 0;
+	uint64_t sampledOutInFlightMilli = 0, sampledInIdlePermille = 0;
+	bool ok = true;
+};
+
+// The driver's LAT_* stages, as they are published:
+const char *const kLatencyStages[] = {
+	"TxQueue", "TxOutput", "TxHold", "TxSubmit", "TxUsb", "TxDispatch",
+	"RxDispatch", "RxProcess", "RxSubmit"
+};
+
+// Adds up the numbers of a dictionary of the statistics.
+uint64_t statSum(const OSDictionary *dict) {
+	uint64_t sum = 0;
+	OSCollectionIterator *it = dict ?
+		OSCollectionIterator::withCollection(dict) : NULL;
+	if (it) {
+		while (const OSSymbol *key = OSDynamicCast(OSSymbol, it->getNextObject())) {
+			sum += statNumber(dict, key->getCStringNoCopy());
+		}
+		it->release();
+	}
+	return sum;
+}
+
+// Reads the latency histograms' summary out of the statistics, and checks
+// that 'kResetLatencyKey' clears them.
+void readLatency(HoRNDIS *driver, ScenarioResult &res) {
+	const OSDictionary *latDict = OSDynamicCast(OSDictionary,
+		res.driverStats->getObject("Latency"));
+	if (!latDict) {
+		return;
+	}
+	for (size_t i = 0; i < sizeof(kLatencyStages) / sizeof(char *); i++) {
+		const OSDictionary *stage = OSDynamicCast(OSDictionary,
+			latDict->getObject(kLatencyStages[i]));
+		ScenarioResult::StageLatency l = { kLatencyStages[i],
+			statNumber(stage, "Count"), statNumber(stage, "P50Us"),
+			statNumber(stage, "P99Us"), statNumber(stage, "MaxUs") };
+		res.latency.push_back(l);
+	}
+
+	OSDictionary *props = OSDictionary::withCapacity(1);
+	props->setObject(kResetLatencyKey, kOSBooleanTrue);
+	const bool reset = driver->setProperties(props) == kIOReturnSuccess;
+	props->release();
+	driver->serializeProperties(NULL);
+	const OSDictionary *stats = OSDynamicCast(OSDictionary,
+		driver->getProperty(kHoRNDISStatsKey));
+	latDict = stats ? OSDynamicCast(OSDictionary, stats->getObject("Latency")) :
+		NULL;
+	res.latencyCleared = reset && latDict;
+	for (size_t i = 0; latDict && i < res.latency.size(); i++) {
+		res.latencyCleared &= statNumber(OSDynamicCast(OSDictionary,
+			latDict->getObject(res.latency[i].name)), "Count") == 0;
+	}
+}
+
+// The frames waiting in the driver's class queues, see "TRANSMIT PRIORITY":
+// the saturating generator counts them along with the output queue's.
+uint32_t driverQueued(HoRNDIS *driver) {
+	driver->serializeProperties(NULL);  // Refreshes the statistics.
+	OSDictionary *stats = OSDynamicCast(OSDictionary,
+		driver->getProperty(kHoRNDISStatsKey));
+	if (!stats) {
+		return 0;
+	}
+	return (uint32_t)(statNumber(OSDynamicCast(OSDictionary,
+		stats->getObject("TxClassPriority")), "Queued") +
+		statNumber(OSDynamicCast(OSDictionary,
+		stats->getObject("TxClassBulk")), "Queued"));
+}
+
+// Runs the traffic for 'durationNs', measuring after the first 10%. With
+// the "tso" mix, 'txSeq' is the TCP stream's offset.
+void runTraffic(const Options &opts, HoRNDIS *driver, SimDevice *device,
+	SimFrameSink &rxSink, uint64_t &txSeq, uint64_t &probeSeq,
+	uint64_t durationNs, DirectionResult &tx, DirectionResult &rx) {
+	IOOutputQueue *queue = driver->getOutputQueue();
+	std::vector<uint8_t> frame(SIM_TCP_MAX_LEN);
+	const bool tcp = opts.mix == "tso";
+	const bool tso = (driver->simInterface->simFeatures &
+		kIONetworkFeatureTSOIPv4) != 0;
+	Generator txGen(opts, opts.device.seed * 2 + 1, [&](uint32_t len) {
+		if (tcp && !tso) {
+			// Without TSO, TCP sends no more than the MSS at a time:
+			len = std::min<uint32_t>(len, SIM_TCP_HDR_LEN + opts.tsoMss);
+		}
+		const uint32_t payload = len - SIM_TCP_HDR_LEN;
+		if (tcp) {
+			simFillTcpFrame(frame.data(), len, (uint32_t)txSeq);
+		} else {
+			simFillFrame(frame.data(), len, txSeq, simNow());
+		}
+		mbuf_t m = simAllocPacket(frame.data(), len, opts.segments);
+		if (tcp && payload > opts.tsoMss) {
+			simSetTsoRequest(m, MBUF_TSO_IPV4, opts.tsoMss);
+		}
+		if (queue->enqueue(m, NULL) != 0) {
+			return false;  // The queue has freed it.
+		}
+		txSeq += tcp ? payload : 1;
+		return true;
+	}, [&] { return queue->getSize() + driverQueued(driver); });
+	Options probeOpts = opts;
+	probeOpts.mix = "60";
+	probeOpts.rateMbps = opts.probeMbps;
+	Generator probeGen(probeOpts, opts.device.seed * 2 + 3, [&](uint32_t len) {
+		simFillFrame(frame.data(), len, probeSeq, simNow(), true);
+		mbuf_t m = simAllocPacket(frame.data(), len, 1);
+		if (queue->enqueue(m, NULL) != 0) {
+			return false;
+		}
+		probeSeq++;
+		return true;
+	}, [&] { return 0; });
+	Generator rxGen(opts, opts.device.seed * 2 + 2, [&](uint32_t len) {
+		const uint64_t drops = device->stats.queueDrops;
+		device->sendFrame(len);
+		return device->stats.queueDrops == drops;
+	}, [&] { return device->queuedFrames(); });
+
+	if (opts.mode & kModeTx) {
+		txGen.start();
+		if (opts.probeMbps > 0) {
+			probeGen.start();
+		}
+	}
+	if (opts.mode & kModeRx) {
+		rxGen.start();
+	}
+	const uint64_t warmup = durationNs / 10;
+	simRunFor(warmup);
+	SimFrameSink &txSink = device->sink;
+	const uint64_t txFrames = txSink.frames, txBytes = txSink.bytes;
+	const uint64_t rxFrames = rxSink.frames, rxBytes = rxSink.bytes;
+	const uint64_t outXfers = device->stats.outTransfers;
+	const uint64_t inXfers = device->stats.inTransfers;
+	const uint64_t inFrames = device->stats.inFrames;
+	txSink.measureFrom = rxSink.measureFrom = simNow();
+	simRunFor(durationNs - warmup);
+
+	const double seconds = (durationNs - warmup) / 1e9;
+	if (opts.mode & kModeTx) {
+		tx.frames += txSink.frames - txFrames;
+		tx.bytes += txSink.bytes - txBytes;
+		tx.seconds += seconds;
+		tx.framesPerTransfer = (double)(txSink.frames - txFrames) /
+			std::max<uint64_t>(1, device->stats.outTransfers - outXfers);
+	}
+	if (opts.mode & kModeRx) {
+		rx.frames += rxSink.frames - rxFrames;
+		rx.bytes += rxSink.bytes - rxBytes;
+		rx.seconds += seconds;
+		rx.framesPerTransfer = (double)(device->stats.inFrames - inFrames) /
+			std::max<uint64_t>(1, device->stats.inTransfers - inXfers);
+	}
+	txSink.measureFrom = rxSink.measureFrom = UINT64_MAX;
+	tx.drops += txGen.drops;
+	rx.drops += rxGen.drops;
+	txGen.stop();
+	probeGen.stop();
+	rxGen.stop();
+	simRunFor(kDrainNs);
+}
+
+// Checks the event trace's dump, saves it to 'opts.traceFile', and switches
+// the trace off through the registry.
+void readTrace(HoRNDIS *driver, const Options &opts, ScenarioResult &res) {
+	const OSData *data = OSDynamicCast(OSData,
+		driver->getProperty(kHoRNDISTraceKey));
+	if (!data) {
+		return;
+	}
+	const trace_dump_hdr *hdr = NULL;
+	const trace_rec *recs = traceDumpRecords(data->getBytesNoCopy(),
+		data->getLength(), &hdr);
+	res.traceValid = recs != NULL;
+	for (uint32_t i = 0; recs && i < hdr->numRecs; i++) {
+		// One thread here: nothing is missing, or out of order.
+		res.traceValid &= i == 0 || (recs[i].seq == recs[i - 1].seq + 1 &&
+			recs[i].stamp >= recs[i - 1].stamp);
+		if (recs[i].event < TRACE_NUM_EVENTS) {
+			res.traceEvents[recs[i].event]++;
+		}
+	}
+	res.traceRecs = recs ? hdr->numRecs : 0;
+	if (opts.traceFile) {
+		FILE *f = fopen(opts.traceFile, "wb");
+		if (!f || fwrite(data->getBytesNoCopy(), data->getLength(), 1, f) != 1) {
+			perror(opts.traceFile);
+		}
+		if (f) {
+			fclose(f);
+		}
+	}
+
+	OSDictionary *props = OSDictionary::withCapacity(1);
+	props->setObject(kTraceKey, kOSBooleanFalse);
+	res.traceSwitchedOff = driver->setProperties(props) == kIOReturnSuccess &&
+		driver->getProperty(kTraceKey) == kOSBooleanFalse;
+	props->release();
+	// Held, so that a new dump cannot take its address:
+	OSObject *last = driver->getProperty(kHoRNDISTraceKey);
+	last->retain();
+	driver->serializeProperties(NULL);
+	res.traceFrozen = driver->getProperty(kHoRNDISTraceKey) == last;
+	last->release();
+}
+
+void runScenario(const Options &opts, ScenarioResult &res) {
+	const SimCounters baseline = gSimCounters;
+	SimDevice *device = SimDevice::create(opts.device);
+	SimFrameSink rxSink;
+	uint64_t txSeq = 0, probeSeq = 0;
+
+	OSDictionary *props = OSDictionary::withCapacity(8);
+	for (size_t i = 0; i < opts.tunables.size(); i++) {
+		OSNumber *num = OSNumber::withNumber(opts.tunables[i].second, 32);
+		props->setObject(opts.tunables[i].first.c_str(), num);
+		num->release();
+	}
+	HoRNDIS *driver = new HoRNDIS;
+	driver->init(props);
+	props->release();
+
+	SInt32 score = 0;
+	bool started = driver->probe(device, &score) == driver &&
+		driver->start(device);
+	IONetworkInterface *netif = driver->simInterface;
+	if (!check(started && netif, opts.name, "driver did not start")) {
+		exit(1);
+	}
+	netif->simInputHook = rxHook;
+	netif->simInputContext = &rxSink;
+	res.mtu = netif->getMaxTransferUnit();
+	UInt32 maxPacketSize = 0;
+	driver->getMaxPacketSize(&maxPacketSize);
+	res.maxMtu = maxPacketSize - ETHERNET_HDR_SIZE - ETHERNET_CRC_SIZE;
+	IOEthernetInterface *ethif = static_cast<IOEthernetInterface *>(netif);
+	res.mtuSettable = ethif->simSetMtu(1280) == 0 &&
+		ethif->simSetMtu(res.maxMtu) == 0 &&
+		ethif->simSetMtu(res.maxMtu + 1) == EINVAL &&
+		ethif->simSetMtu(res.mtu) == 0;
+	res.ok &= check(driver->enable(netif) == kIOReturnSuccess, opts.name,
+		"enable failed");
+
+	const uint64_t duration = opts.durationMs * NSEC_PER_MSEC;
+	if (opts.cycle) {
+		runTraffic(opts, driver, device, rxSink, txSeq, probeSeq, duration / 2,
+			res.tx, res.rx);
+		driver->disable(netif);
+		simRunFor(kDrainNs);
+		res.ok &= check(driver->enable(netif) == kIOReturnSuccess, opts.name,
+			"re-enable failed");
+		runTraffic(opts, driver, device, rxSink, txSeq, probeSeq, duration / 2,
+			res.tx, res.rx);
+	} else {
+		runTraffic(opts, driver, device, rxSink, txSeq, probeSeq, duration,
+			res.tx, res.rx);
+	}
+
+	driver->serializeProperties(NULL);  // Refreshes the statistics.
+	res.driverStats = OSDynamicCast(OSDictionary,
+		driver->getProperty(kHoRNDISStatsKey));
+	if (res.driverStats) {
+		res.driverStats->retain();
+		res.tx.stalls = statNumber(OSDynamicCast(OSDictionary,
+			res.driverStats->getObject("OutPipe")), "Stalls");
+		res.rx.stalls = statNumber(OSDynamicCast(OSDictionary,
+			res.driverStats->getObject("InPipe")), "Stalls");
+		res.txCodelDrops = statNumber(res.driverStats, "TxCodelDrops");
+		res.txBqlStalls = statNumber(res.driverStats, "TxBqlStalls");
+		res.txBqlMaxInflight = statNumber(res.driverStats, "TxBqlMaxInflight");
+		res.txQueueStalls = statNumber(res.driverStats, "TxQueueStalls");
+		res.txQueueResumes = statNumber(res.driverStats, "TxQueueResumes");
+		res.txQueueStalledUs = statNumber(res.driverStats, "TxQueueStalledUs");
+		res.txTsoPackets = statNumber(res.driverStats, "TxTsoPackets");
+		res.txTsoSegments = statNumber(res.driverStats, "TxTsoSegments");
+		res.txTsoErrors = statNumber(res.driverStats, "TxTsoErrors");
+		res.txBytes = statNumber(res.driverStats, "TxBytes");
+		res.rxBytes = statNumber(res.driverStats, "RxBytes");
+		res.rxSinkBytes = rxSink.bytes;
+		res.ctrlMaxLatencyUs = statNumber(res.driverStats,
+			"ControlMaxLatencyUs");
+		res.rxErrors = statSum(OSDynamicCast(OSDictionary,
+			res.driverStats->getObject("RxErrors")));
+		const char *const pipes[] = { "InPipe", "OutPipe" };
+		for (int i = 0; i < 2; i++) {
+			const OSDictionary *pipe = OSDynamicCast(OSDictionary,
+				res.driverStats->getObject(pipes[i]));
+			res.ioErrors += statSum(pipe ? OSDynamicCast(OSDictionary,
+				pipe->getObject("IOErrors")) : NULL);
+		}
+		res.tx.driverDrops = res.txCodelDrops + res.txTsoErrors +
+			statNumber(OSDynamicCast(OSDictionary,
+			res.driverStats->getObject("TxClassPriority")), "Drops") +
+			statNumber(OSDynamicCast(OSDictionary,
+			res.driverStats->getObject("TxClassBulk")), "Drops");
+		readLatency(driver, res);
+		readTrace(driver, opts, res);
+	}
+	const OSDictionary *throughput = OSDynamicCast(OSDictionary,
+		driver->getProperty(kHoRNDISThroughputKey));
+	const OSDictionary *lastSec = throughput ? OSDynamicCast(OSDictionary,
+		throughput->getObject("1s")) : NULL;
+	if (lastSec) {
+		res.sampled = true;
+		res.sampledTxBps = statNumber(lastSec, "TxBitsPerSec");
+		res.sampledRxBps = statNumber(lastSec, "RxBitsPerSec");
+		res.sampledOutInFlightMilli = statNumber(lastSec,
+			"OutBufsInFlightMilli");
+		res.sampledInIdlePermille = statNumber(lastSec, "InPipeIdlePermille");
+	}
+
+	res.device = device->stats;  // Before the teardown.
+	driver->disable(netif);
+	driver->willTerminate(device, 0);
+	driver->stop(device);
+	driver->release();
+	simRunFor(kDrainNs);
+
+	res.tx.latenciesNs.swap(device->sink.latenciesNs);
+	res.tx.probeLatenciesNs.swap(device->sink.probeLatenciesNs);
+	res.rx.latenciesNs.swap(rxSink.latenciesNs);
+	res.txSink = device->sink;
+	res.rxSink = rxSink;
+	res.tx.lost = res.txSink.lost;
+	res.rx.lost = res.rxSink.lost;
+	device->shutdown();
+	device->release();
+
+	if (res.driverStats) {
+		OSSafeReleaseNULL(res.driverStats);
+	}
+	res.ok &= check(gSimCounters.objects == baseline.objects, opts.name,
+		"leaked OSObjects");
+	res.ok &= check(gSimCounters.mbufs == baseline.mbufs, opts.name,
+		"leaked mbufs");
+	res.ok &= check(gSimCounters.prepares == baseline.prepares, opts.name,
+		"memory descriptors left prepared");
+	res.ok &= check(gSimCounters.allocations == baseline.allocations &&
+		gSimCounters.allocFreeMismatches == baseline.allocFreeMismatches,
+		opts.name, "leaked or mismatched IOMalloc");
+}
+
+void printScenario(const Options &opts, ScenarioResult &res) {
+	printf("%s:\n", opts.name);
+	printDirection("tx", res.tx);
+	printDirection("rx", res.rx);
+	const SimDeviceStats &d = res.device;
+	printf("  device: %llu commands, %llu notifications, %llu keepalives "
+		"(%llu answered), %llu/%llu stalls out/in, %llu clear-stalls, "
+		"%llu refused\n",
+		(unsigned long long)d.commands, (unsigned long long)d.notifications,
+		(unsigned long long)d.keepalivesSent,
+		(unsigned long long)d.keepalivesAnswered,
+		(unsigned long long)d.outStalls, (unsigned long long)d.inStalls,
+		(unsigned long long)d.clearStalls, (unsigned long long)d.outRefused);
+	for (size_t i = 0; i < res.latency.size(); i++) {
+		const ScenarioResult::StageLatency &l = res.latency[i];
+		printf("  %-10s %8llu samples, p50 %6llu us, p99 %6llu us, "
+			"max %6llu us\n", l.name, (unsigned long long)l.count,
+			(unsigned long long)l.p50Us, (unsigned long long)l.p99Us,
+			(unsigned long long)l.maxUs);
+	}
+	if (res.txTsoPackets) {
+		printf("  tso: %llu super-packets cut into %llu segments, "
+			"%llu errors, max payload %u\n",
+			(unsigned long long)res.txTsoPackets,
+			(unsigned long long)res.txTsoSegments,
+			(unsigned long long)res.txTsoErrors, res.txSink.tcpMaxPayload);
+	}
+	if (res.sampled) {
+		printf("  sampled, last second: tx %.1f Mbit/s, rx %.1f Mbit/s, "
+			"%.2f out bufs in flight, IN pipe idle %.1f%%\n",
+			res.sampledTxBps / 1e6, res.sampledRxBps / 1e6,
+			res.sampledOutInFlightMilli / 1000.0,
+			res.sampledInIdlePermille / 10.0);
+	}
+}
+
+// The most MTU the driver should allow: the device's, within the limits.
+uint32_t expectedMtu(const Options &opts) {
+	uint32_t mtu = opts.device.maxFrameSize >= MIN_MTU ?
+		opts.device.maxFrameSize : ETHERNET_MTU;
+	uint32_t limit = MAX_JUMBO_MTU;
+	for (size_t t = 0; t < opts.tunables.size(); t++) {
+		if (opts.tunables[t].first == kMaxMtuKey) {
+			limit = opts.tunables[t].second;
+		}
+	}
+	const uint32_t overhead = sizeof(rndis_data_hdr) + ETHERNET_HDR_SIZE;
+	mtu = std::min(mtu, limit);
+	mtu = std::min(mtu, std::min<uint32_t>(opts.device.maxTransfer,
+		DEFAULT_MAX_OUT_TRANSFER_SIZE) - overhead);
+	return std::min<uint32_t>(mtu, IN_BUF_SIZE - overhead);
+}
+
+// Delivery and protocol checks that hold for every run:
+bool checkDelivery(const Options &opts, const ScenarioResult &res) {
+	const SimDeviceStats &d = res.device;
+	bool ok = res.ok;
+	ok &= check(res.txSink.corrupt == 0 && res.rxSink.corrupt == 0,
+		opts.name, "corrupted frames");
+	ok &= check(res.txSink.reordered == 0 && res.rxSink.reordered == 0,
+		opts.name, "reordered frames");
+	// Frames in stalled or refused OUT transfers are gone, and so are the
+	// ones the driver dropped; the device keeps its own:
+	ok &= check(res.txSink.lost <= d.outStalledFrames + d.outRefusedFrames +
+		res.tx.driverDrops, opts.name, "lost transmitted frames");
+	ok &= check(res.rxSink.lost == 0, opts.name, "lost received frames");
+	ok &= check(d.protocolErrors == 0, opts.name, "malformed messages");
+	ok &= check(d.unwiredTransfers == 0, opts.name,
+		"transfers of memory that was not prepared");
+	ok &= check(d.limitViolations == 0, opts.name,
+		"transfers beyond the device's limits");
+	ok &= check(d.alignViolations == 0, opts.name, "misaligned messages");
+	ok &= check(res.mtu == std::min<uint32_t>(ETHERNET_MTU, expectedMtu(opts)),
+		opts.name, "MTU not the standard one at start");
+	ok &= check(res.maxMtu == expectedMtu(opts), opts.name,
+		"maximum MTU not the device's maximum frame size");
+	ok &= check(res.mtuSettable, opts.name, "MTU cannot be set");
+	// The driver's own count of the bytes: every frame it passed up arrived,
+	// and the device only got frames that the driver sent:
+	ok &= check(res.rxBytes == res.rxSinkBytes, opts.name,
+		"RxBytes does not match the frames received");
+	ok &= check(res.txBytes >= res.txSink.bytes, opts.name,
+		"TxBytes short of the frames transmitted");
+	ok &= check(res.rxErrors == 0, opts.name, "RxErrors on well-formed transfers");
+	// A stall or a refused transfer is also an I/O error, by its IOReturn:
+	ok &= check((res.ioErrors > 0) ==
+		(d.inStalls + d.outStalls + d.outRefused > 0),
+		opts.name, "IOErrors do not match the stalls");
+	if (opts.mode & kModeTx) {
+		ok &= check(res.tx.frames > 0, opts.name, "nothing transmitted");
+	}
+	if (opts.mode & kModeRx) {
+		ok &= check(res.rx.frames > 0, opts.name, "nothing received");
+	}
+	return ok;
+}
+
+int runSmoke() {
+	std::vector<Options> scenarios;
+	{
+		Options o;
+		o.name = "tx-1514";
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "rx-imix-zerocopy";
+		o.mode = kModeRx;
+		o.mix = "imix";
+		o.tunables.push_back(std::make_pair(kRxZeroCopyKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "bidir-stalls-tx-zerocopy";
+		o.mode = kModeBidir;
+		o.mix = "tcp";
+		o.segments = 3;
+		o.device.stallProb = 0.02;
+		o.device.stickyClears = 1;
+		o.tunables.push_back(std::make_pair(kTxZeroCopyKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "bidir-stalls-nongated";
+		o.mode = kModeBidir;
+		o.mix = "imix";
+		o.segments = 3;
+		o.device.stallProb = 0.02;
+		o.device.stickyClears = 2;
+		o.tunables.push_back(std::make_pair(kTxNonGatedQueueKey, 1));
+		o.tunables.push_back(std::make_pair(kTxZeroCopyKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "tx-small-coalesce";
+		o.mix = "60";
+		o.rateMbps = 5;
+		o.tunables.push_back(std::make_pair(kTxCoalesceUsecKey, 500));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "tx-priority";
+		o.mix = "tcp";
+		o.probeMbps = 1;
+		o.tunables.push_back(std::make_pair(kTxPriorityKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "tx-fq-codel";
+		o.mix = "1514";
+		o.rateMbps = 22;  // Over what the bus takes: a standing queue.
+		o.probeMbps = 1;
+		o.durationMs = 1000;
+		o.device.busMbps = 20;
+		o.tunables.push_back(std::make_pair(kTxFqCodelKey, 1));
+		// The generator does not slow down for the drops, as TCP would:
+		// CoDel needs the shorter interval to catch up within the run.
+		o.tunables.push_back(std::make_pair(kTxCodelIntervalUsecKey, 20000));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "tx-bql";
+		o.probeMbps = 1;
+		o.tunables.push_back(std::make_pair(kTxByteQueueLimitKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "tx-watermarks";
+		o.tunables.push_back(std::make_pair(kTxResumeHighWaterKey, 3));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "latency-histograms";
+		o.mode = kModeBidir;
+		o.mix = "imix";
+		o.tunables.push_back(std::make_pair(kLatencyHistogramsKey, 1));
+		// So that the frames also wait in the driver's queues:
+		o.tunables.push_back(std::make_pair(kTxPriorityKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "trace";
+		o.mode = kModeBidir;
+		o.mix = "imix";
+		o.tunables.push_back(std::make_pair(kTraceKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "throughput-sampler";
+		o.mode = kModeBidir;
+		o.mix = "imix";
+		o.rateMbps = 50;
+		o.durationMs = 2500;  // Samples at 1 s and 2 s.
+		o.tunables.push_back(std::make_pair(kThroughputSamplerKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "jumbo-frames";
+		o.mode = kModeBidir;
+		o.mix = "9014";
+		o.device.maxFrameSize = 9000;
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "jumbo-capped";
+		o.mix = "imix";
+		o.device.maxFrameSize = 4000;
+		o.tunables.push_back(std::make_pair(kMaxMtuKey, 3000));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "keepalive";
+		o.mode = kModeBidir;
+		o.mix = "576";
+		o.rateMbps = 20;
+		o.device.keepaliveMs = 5;
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "no-interrupt-ep";
+		o.mode = kModeBidir;
+		o.mix = "576";
+		o.rateMbps = 20;
+		o.device.keepaliveMs = 5;
+		o.device.interruptEp = false;
+		// The driver only sees the keepalives while it runs a command:
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "status-during-commands";
+		o.mode = kModeBidir;
+		o.mix = "576";
+		o.rateMbps = 20;
+		// Many keepalives queued ahead of every reply, faster than the
+		// driver polls:
+		o.device.keepaliveMs = 1;
+		o.device.interruptEp = false;
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "tx-tso";
+		o.mix = "tso";
+		o.segments = 3;
+		o.tunables.push_back(std::make_pair(kTxTsoKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "tx-tso-stalls-priority";
+		o.mix = "tso";
+		o.tsoMss = 536;
+		o.device.stallProb = 0.02;
+		o.device.stickyClears = 1;
+		o.tunables.push_back(std::make_pair(kTxTsoKey, 1));
+		// The super-packets wait in the class queues, see "TRANSMIT PRIORITY":
+		o.tunables.push_back(std::make_pair(kTxPriorityKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "tx-tso-refused";
+		o.mix = "tso";
+		o.device.refuseProb = 0.02;
+		o.tunables.push_back(std::make_pair(kTxTsoKey, 1));
+		scenarios.push_back(o);
+	}
+	{
+		Options o;
+		o.name = "cycle-persistent-buffers";
+		o.mode = kModeBidir;
+		o.mix = "imix";
+		o.cycle = true;
+		o.tunables.push_back(std::make_pair(kPersistentBuffersKey, 1));
+		scenarios.push_back(o);
+	}
+
+	int failures = 0;
+	for (size_t i = 0; i < scenarios.size(); i++) {
+		const Options &o = scenarios[i];
+		ScenarioResult res;
+		runScenario(o, res);
+		printScenario(o, res);
+		bool ok = checkDelivery(o, res);
+		if (o.device.keepaliveMs && o.device.interruptEp) {
+			// All but the ones still in flight at the end:
+			ok &= check(res.device.keepalivesSent > 0 &&
+				res.device.keepalivesAnswered + 2 >= res.device.keepalivesSent,
+				o.name, "keepalives not answered");
+		}
+		if (o.device.keepaliveMs && !o.device.interruptEp) {
+			// The status messages fetched while waiting for a reply do not
+			// use up the command's attempts, nor wait for the next poll:
+			ok &= check(res.device.keepalivesAnswered > 0 &&
+				res.ctrlMaxLatencyUs < RNDIS_CMD_ATTEMPTS * RNDIS_CMD_POLL_MS *
+					1000, o.name, "status messages delay the commands");
+		}
+		for (size_t t = 0; t < o.tunables.size(); t++) {
+			const std::string &key = o.tunables[t].first;
+			if (key == kTxCoalesceUsecKey) {
+				// A sparse flow still shares the transfers, and no frame
+				// waits for more than the timeout, plus the bus:
+				const std::vector<uint32_t> &lat = res.tx.latenciesNs;
+				const uint64_t maxNs = lat.empty() ? 0 :
+					*std::max_element(lat.begin(), lat.end());
+				ok &= check(res.tx.framesPerTransfer >= 2, o.name,
+					"frames not coalesced");
+				ok &= check(maxNs < (o.tunables[t].second + 500) * NSEC_PER_USEC,
+					o.name, "coalescing delay not bounded");
+			} else if (key == kTxPriorityKey && o.probeMbps > 0) {
+				// The probes only wait for the transfers already in flight,
+				// not behind the bulk queue:
+				double bulkUs[4], probeUs[4];
+				latencyPercentiles(res.tx.latenciesNs, bulkUs);
+				latencyPercentiles(res.tx.probeLatenciesNs, probeUs);
+				ok &= check(!res.tx.probeLatenciesNs.empty() &&
+					probeUs[2] * 2 < bulkUs[0], o.name,
+					"probes not prioritized");
+			} else if (key == kTxFqCodelKey) {
+				// The sparse probe flow goes ahead of the overloading one,
+				// and CoDel keeps that one's queue well below the slots:
+				double bulkUs[4], probeUs[4];
+				latencyPercentiles(res.tx.latenciesNs, bulkUs);
+				latencyPercentiles(res.tx.probeLatenciesNs, probeUs);
+				const double fullUs = TRANSMIT_QUEUE_SIZE * 1514 * 8 /
+					o.device.busMbps;
+				ok &= check(!res.tx.probeLatenciesNs.empty() &&
+					probeUs[2] < bulkUs[0], o.name,
+					"sparse flow not served first");
+				ok &= check(res.txCodelDrops > 0 && bulkUs[2] * 2 < fullUs,
+					o.name, "standing queue not controlled");
+			} else if (key == kTxByteQueueLimitKey) {
+				// Fewer bytes in flight than the buffers would take, but
+				// still enough to keep the bus busy:
+				const double mbps = res.tx.bytes * 8 / res.tx.seconds / 1e6;
+				ok &= check(res.txBqlStalls > 0 && res.txBqlMaxInflight <
+					(N_OUT_BUFS - 1) * o.device.maxTransfer, o.name,
+					"bytes in flight not limited");
+				ok &= check(mbps > o.device.busMbps * 0.9, o.name,
+					"byte queue limit starves the bus");
+			} else if (key == kTxResumeHighWaterKey) {
+				// Every stall is resumed, a few completions later: with the
+				// saturating load, the queue is stalled most of the time.
+				const double mbps = res.tx.bytes * 8 / res.tx.seconds / 1e6;
+				ok &= check(res.txQueueResumes > 0 &&
+					res.txQueueResumes == res.txQueueStalls &&
+					res.txQueueStalledUs > o.durationMs * 500, o.name,
+					"stalls not accounted for");
+				ok &= check(mbps > o.device.busMbps * 0.9, o.name,
+					"watermarks starve the bus");
+			} else if (key == kLatencyHistogramsKey) {
+				// Every stage has its samples, in order, and a transfer
+				// takes at least the device's latency:
+				bool sane = res.latency.size() ==
+					sizeof(kLatencyStages) / sizeof(char *);
+				for (size_t i = 0; sane && i < res.latency.size(); i++) {
+					const ScenarioResult::StageLatency &l = res.latency[i];
+					sane = l.count > 0 && l.p50Us <= l.p99Us &&
+						l.p99Us <= l.maxUs;
+					if (!strcmp(l.name, "TxUsb")) {
+						sane &= l.p50Us >= o.device.latencyUs;
+					}
+				}
+				ok &= check(sane, o.name, "latency histograms not sane");
+				ok &= check(res.latencyCleared, o.name,
+					"latency histograms not cleared");
+			} else if (key == kTraceKey) {
+				// The ring is full of the last events, of every kind:
+				ok &= check(res.traceValid &&
+					res.traceRecs == TRACE_RING_RECS, o.name,
+					"event trace not dumped");
+				ok &= check(res.traceEvents[TRACE_TX_OUTPUT] > 0 &&
+					res.traceEvents[TRACE_TX_COMPLETE] > 0 &&
+					res.traceEvents[TRACE_RX_COMPLETE] > 0 &&
+					res.traceEvents[TRACE_RX_FRAME] > 0 &&
+					res.traceEvents[TRACE_RX_ERROR] == 0, o.name,
+					"events not traced");
+				ok &= check(res.traceSwitchedOff, o.name,
+					"event trace not switched off");
+				ok &= check(res.traceFrozen, o.name,
+					"event trace still dumped once off");
+			} else if (key == kTxTsoKey) {
+				// Every super-packet cut at the MSS, and the segments packed
+				// into the transfers like any other frames. A refused
+				// transfer drops the segments left, and counts them:
+				ok &= check(res.txTsoPackets > 0 &&
+					(res.txTsoErrors > 0) == (o.device.refuseProb > 0) &&
+					res.txTsoSegments > res.txTsoPackets &&
+					res.txSink.tcpMaxPayload == o.tsoMss, o.name,
+					"super-packets not segmented");
+				ok &= check(res.tx.framesPerTransfer >= 4, o.name,
+					"segments not aggregated");
+			} else if (key == kThroughputSamplerKey) {
+				// The steady rates, as the sinks saw them over the run, and
+				// the pipes kept busy:
+				const double txBps = res.tx.bytes * 8 / res.tx.seconds;
+				const double rxBps = res.rx.bytes * 8 / res.rx.seconds;
+				ok &= check(res.sampled &&
+					std::fabs(res.sampledTxBps - txBps) < txBps * 0.1 &&
+					std::fabs(res.sampledRxBps - rxBps) < rxBps * 0.1, o.name,
+					"sampled throughput is off");
+				ok &= check(res.sampledOutInFlightMilli > 0 &&
+					res.sampledOutInFlightMilli <= N_OUT_BUFS * 1000 &&
+					res.sampledInIdlePermille < 100, o.name,
+					"sampled utilization is off");
+			}
+		}
+		failures += ok ? 0 : 1;
+	}
+	printf(failures ? "%d scenario(s) FAILED\n" : "OK\n", failures);
+	return failures ? 1 : 0;
+}
+
+void usage() {
+	fprintf(stderr,
+		"Usage: HoRNDISSim [options]\n"
+		"       HoRNDISSim --smoke\n"
+		"  --mode tx|rx|bidir     traffic direction (tx)\n"
+		"  --frames N|imix|tcp|tso  frame size, or a mix (1514)\n"
+		"  --mss N                the \"tso\" mix's TCP MSS (1460)\n"
+		"  --rate MBPS            offered load per direction; 0: saturate (0)\n"
+		"  --duration MS          simulated time (200)\n"
+		"  --segments N           mbufs per transmitted frame (1)\n"
+		"  --probe MBPS           also transmit 60-byte probe frames (0)\n"
+		"  --cycle                disable and re-enable halfway\n"
+		"  --bus MBPS             bus bandwidth (280)\n"
+		"  --latency US           transfer latency (50)\n"
+		"  --jitter US            mean extra completion delay (10)\n"
+		"  --stall-prob P         per-transfer pipe stall probability (0)\n"
+		"  --sticky-clears N      failing clearStall calls per stall (0)\n"
+		"  --refuse-prob P        per-transfer OUT refusal probability (0)\n"
+		"  --max-xfer N           device's max_transfer_size (16384)\n"
+		"  --max-pkts N           device's max_packets_per_transfer (8)\n"
+		"  --align N              device's packet_alignment exponent (2)\n"
+		"  --keepalive MS         device's keepalive period; 0: none (0)\n"
+		"  --no-interrupt-ep      no notification endpoint\n"
+		"  --set KEY=N            driver tunable, e.g. TxZeroCopy=1\n"
+		"  --trace FILE           save the event trace, for TraceDecode\n"
+		"  --seed N               random seed (1)\n"
+		"  -v                     print the driver's log\n");
+	exit(2);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+	Options opts;
+	bool smoke = false;
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+		bool used = true;
+		if (arg == "--smoke") {
+			smoke = true;
+			used = false;
+		} else if (arg == "-v") {
+			gSimVerbose = true;
+			used = false;
+		} else if (arg == "--cycle") {
+			opts.cycle = true;
+			used = false;
+		} else if (arg == "--no-interrupt-ep") {
+			opts.device.interruptEp = false;
+			used = false;
+		} else if (!val) {
+			usage();
+		} else if (arg == "--mode") {
+			const std::string mode = val;
+			opts.mode = mode == "tx" ? kModeTx : mode == "rx" ? kModeRx :
+				mode == "bidir" ? kModeBidir : 0;
+			if (!opts.mode) {
+				usage();
+			}
+		} else if (arg == "--frames") {
+			opts.mix = val;
+		} else if (arg == "--rate") {
+			opts.rateMbps = atof(val);
+		} else if (arg == "--duration") {
+			opts.durationMs = (uint32_t)atoi(val);
+		} else if (arg == "--mss") {
+			opts.tsoMss = std::max(1, atoi(val));
+		} else if (arg == "--segments") {
+			opts.segments = std::max(1, atoi(val));
+		} else if (arg == "--probe") {
+			opts.probeMbps = atof(val);
+		} else if (arg == "--bus") {
+			opts.device.busMbps = atof(val);
+		} else if (arg == "--latency") {
+			opts.device.latencyUs = (uint32_t)atoi(val);
+		} else if (arg == "--jitter") {
+			opts.device.jitterUs = (uint32_t)atoi(val);
+		} else if (arg == "--stall-prob") {
+			opts.device.stallProb = atof(val);
+		} else if (arg == "--refuse-prob") {
+			opts.device.refuseProb = atof(val);
+		} else if (arg == "--sticky-clears") {
+			opts.device.stickyClears = (uint32_t)atoi(val);
+		} else if (arg == "--max-xfer") {
+			opts.device.maxTransfer = (uint32_t)atoi(val);
+		} else if (arg == "--max-pkts") {
+			opts.device.maxPkts = (uint32_t)atoi(val);
+		} else if (arg == "--align") {
+			opts.device.alignShift = (uint32_t)atoi(val);
+		} else if (arg == "--keepalive") {
+			opts.device.keepaliveMs = (uint32_t)atoi(val);
+		} else if (arg == "--trace") {
+			opts.traceFile = val;
+			opts.tunables.push_back(std::make_pair(kTraceKey, 1));
+		} else if (arg == "--seed") {
+			opts.device.seed = strtoull(val, NULL, 0);
+		} else if (arg == "--set") {
+			const char *eq = strchr(val, '=');
+			if (!eq) {
+				usage();
+			}
+			opts.tunables.push_back(std::make_pair(
+				std::string(val, eq - val), (uint32_t)strtoul(eq + 1, NULL, 0)));
+		} else {
+			usage();
+		}
+		if (used) {
+			i++;
+		}
+	}
+
+	if (smoke) {
+		return runSmoke();
+	}
+	ScenarioResult res;
+	runScenario(opts, res);
+	printScenario(opts, res);
+	return checkDelivery(opts, res) ? 0 : 1;
+}
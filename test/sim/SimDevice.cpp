@@ -0,0 +1,861 @@
+/* SimDevice.cpp
+ * The simulated RNDIS gadget: USB descriptors, bulk and interrupt pipes on
+ * a shared bus, and the RNDIS control and data protocol. See SimDevice.h.
+ */
+
+#include "SimDevice.h"
+#include "RNDISCodec.h"
+
+#include <algorithm>
+
+#define USB_CDC_SEND_ENCAPSULATED_COMMAND   0x00
+#define USB_CDC_GET_ENCAPSULATED_RESPONSE   0x01
+
+/***** Test frames *****/
+
+namespace {
+
+struct FrameTag {
+	uint32_t magic;
+	uint32_t len;
+	uint64_t seq;
+	uint64_t stamp;
+} __attribute__((packed));
+
+const uint32_t kFrameMagic = 0x464d4953;  // "SIMF"
+const uint32_t kTagOfs = 14;  // Right after the Ethernet header.
+const uint8_t kProbeEtherType[2] = { 0x08, 0x06 };  // ARP.
+const uint32_t kPatternOfs = kTagOfs + sizeof(FrameTag);
+
+inline uint8_t patternByte(uint64_t seq, uint32_t i) {
+	return (uint8_t)(seq * 31 + i);
+}
+
+const uint8_t kIPv4EtherType[2] = { 0x08, 0x00 };
+const uint32_t kIPOfs = 14, kTcpOfs = kIPOfs + 20;
+
+inline uint8_t tcpPatternByte(uint32_t streamOfs) {
+	return (uint8_t)(streamOfs * 7 + (streamOfs >> 8));
+}
+
+inline uint16_t be16(const uint8_t *p) {
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+inline void putBe16(uint8_t *p, uint32_t val) {
+	p[0] = (uint8_t)(val >> 8);
+	p[1] = (uint8_t)val;
+}
+
+// The ones' complement sum, not yet folded, nor complemented:
+uint32_t inetSum(const uint8_t *p, uint32_t len, uint32_t sum = 0) {
+	for (uint32_t i = 0; i + 1 < len; i += 2) {
+		sum += be16(p + i);
+	}
+	if (len & 1) {
+		sum += p[len - 1] << 8;
+	}
+	return sum;
+}
+
+uint16_t inetFold(uint32_t sum) {
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return (uint16_t)sum;
+}
+
+// Over the TCP header and payload, with the pseudo-header: 0xffff if valid.
+uint16_t tcpSum(const uint8_t *frame, uint32_t len) {
+	const uint32_t tcpLen = len - kTcpOfs;
+	uint32_t sum = inetSum(frame + kIPOfs + 12, 8);
+	sum += 6 + tcpLen;
+	return inetFold(inetSum(frame + kTcpOfs, tcpLen, sum));
+}
+
+}  // namespace
+
+void simFillFrame(uint8_t *frame, uint32_t len, uint64_t seq, uint64_t stamp,
+	bool probe) {
+	static const uint8_t kHeader[kTagOfs] = {
+		0x02, 0, 0, 0, 0, 0x01,  // Destination.
+		0x02, 0, 0, 0, 0, 0x02,  // Source.
+		0x88, 0xb5,  // Local experimental EtherType.
+	};
+	memcpy(frame, kHeader, kTagOfs);
+	if (probe) {
+		memcpy(frame + 12, kProbeEtherType, 2);
+	}
+	const FrameTag tag = { kFrameMagic, len, seq, stamp };
+	memcpy(frame + kTagOfs, &tag, sizeof(tag));
+	for (uint32_t i = kPatternOfs; i < len; i++) {
+		frame[i] = patternByte(seq, i);
+	}
+}
+
+void simFillTcpFrame(uint8_t *frame, uint32_t len, uint32_t streamOfs) {
+	static const uint8_t kHeader[SIM_TCP_HDR_LEN] = {
+		0x02, 0, 0, 0, 0, 0x01,  // Destination.
+		0x02, 0, 0, 0, 0, 0x02,  // Source.
+		0x08, 0x00,  // IPv4.
+		0x45, 0, 0, 0,  // Version, IHL, TOS, total length.
+		0, 0, 0x40, 0,  // ID, don't fragment.
+		64, 6, 0, 0,  // TTL, TCP, header checksum.
+		10, 0, 0, 1,  // Source.
+		10, 0, 0, 2,  // Destination.
+		0xc0, 0x00, 0x00, 0x50,  // Ports.
+		0, 0, 0, 0,  // Sequence number.
+		0, 0, 0, 1,  // Acknowledgement number.
+		0x50, 0x18, 0xff, 0xff,  // Header length, ACK|PSH, window.
+		0, 0, 0, 0,  // Checksum, urgent pointer.
+	};
+	memcpy(frame, kHeader, SIM_TCP_HDR_LEN);
+	putBe16(frame + kIPOfs + 2, len - kIPOfs);
+	putBe16(frame + kIPOfs + 4, streamOfs >> 10);
+	putBe16(frame + kIPOfs + 10, ~inetFold(inetSum(frame + kIPOfs, 20)));
+	putBe16(frame + kTcpOfs + 4, streamOfs >> 16);
+	putBe16(frame + kTcpOfs + 6, streamOfs);
+	for (uint32_t i = SIM_TCP_HDR_LEN; i < len; i++) {
+		frame[i] = tcpPatternByte(streamOfs + i - SIM_TCP_HDR_LEN);
+	}
+	putBe16(frame + kTcpOfs + 16, ~tcpSum(frame, len));
+}
+
+bool simCheckFrame(const uint8_t *frame, uint32_t len, uint64_t *seq,
+	uint64_t *stamp) {
+	if (len < kPatternOfs) {
+		return false;
+	}
+	FrameTag tag;
+	memcpy(&tag, frame + kTagOfs, sizeof(tag));
+	if (tag.magic != kFrameMagic || tag.len != len) {
+		return false;
+	}
+	for (uint32_t i = kPatternOfs; i < len; i++) {
+		if (frame[i] != patternByte(tag.seq, i)) {
+			return false;
+		}
+	}
+	*seq = tag.seq;
+	*stamp = tag.stamp;
+	return true;
+}
+
+bool SimFrameSink::receiveTcp(const uint8_t *frame, uint32_t len) {
+	// Returns false if the segment is corrupt.
+	if (len < SIM_TCP_HDR_LEN || frame[kIPOfs] != 0x45 ||
+			be16(frame + kIPOfs + 2) != len - kIPOfs ||
+			inetFold(inetSum(frame + kIPOfs, 20)) != 0xffff ||
+			frame[kTcpOfs + 12] != 0x50 || tcpSum(frame, len) != 0xffff) {
+		return false;
+	}
+	const uint32_t ofs = (uint32_t)be16(frame + kTcpOfs + 4) << 16 |
+		be16(frame + kTcpOfs + 6);
+	for (uint32_t i = SIM_TCP_HDR_LEN; i < len; i++) {
+		if (frame[i] != tcpPatternByte(ofs + i - SIM_TCP_HDR_LEN)) {
+			return false;
+		}
+	}
+	const uint32_t payload = len - SIM_TCP_HDR_LEN;
+	tcpSegments++;
+	tcpMaxPayload = std::max(tcpMaxPayload, payload);
+	// The stream offsets wrap around at 4G, as TCP's do:
+	if ((int32_t)(ofs - tcpNextOfs) > 0) {
+		lost++;
+	} else if ((int32_t)(ofs - tcpNextOfs) < 0) {
+		reordered++;
+	}
+	if ((int32_t)(ofs + payload - tcpNextOfs) > 0) {
+		tcpNextOfs = ofs + payload;
+	}
+	return true;
+}
+
+void SimFrameSink::receive(const uint8_t *frame, uint32_t len) {
+	if (len >= kTcpOfs && memcmp(frame + 12, kIPv4EtherType, 2) == 0) {
+		if (receiveTcp(frame, len)) {
+			frames++;
+			bytes += len;
+		} else {
+			corrupt++;
+		}
+		return;
+	}
+	uint64_t seq, stamp;
+	if (!simCheckFrame(frame, len, &seq, &stamp)) {
+		corrupt++;
+		return;
+	}
+	const bool probe = memcmp(frame + 12, kProbeEtherType, 2) == 0;
+	uint64_t &next = probe ? nextProbeSeq : nextSeq;
+	frames++;
+	probeFrames += probe;
+	bytes += len;
+	if (seq > next) {
+		lost += seq - next;
+	} else if (seq < next) {
+		reordered++;
+	}
+	next = std::max(next, seq + 1);
+	if (stamp >= measureFrom) {
+		(probe ? probeLatenciesNs : latenciesNs).push_back(
+			(uint32_t)std::min<uint64_t>(simNow() - stamp, UINT32_MAX));
+	}
+}
+
+/***** Device *****/
+
+namespace {
+
+class SimIterator : public OSIterator {
+public:
+	std::vector<OSObject *> objects;
+	size_t next = 0;
+	virtual OSObject *getNextObject() override {
+		return next < objects.size() ? objects[next++] : NULL;
+	}
+};
+
+}  // namespace
+
+SimDevice *SimDevice::create(const SimConfig &config) {
+	SimDevice *dev = new SimDevice;
+	dev->init();
+	dev->config = config;
+	dev->rng.seed(config.seed);
+	dev->setName("SimRNDIS");
+	static const IOEthernetAddress kMac = {{ 0x02, 0x53, 0x49, 0x4d, 0, 1 }};
+	dev->macAddress = kMac;
+	dev->buildDescriptors();
+	return dev;
+}
+
+void SimDevice::buildDescriptors() {
+	memset(&deviceDesc, 0, sizeof(deviceDesc));
+	deviceDesc.bLength = sizeof(deviceDesc);
+	deviceDesc.bDescriptorType = 1;
+	deviceDesc.bcdUSB = 0x0200;
+	deviceDesc.bMaxPacketSize0 = 64;
+	deviceDesc.idVendor = 0x1d6b;  // Linux Foundation
+	deviceDesc.idProduct = 0x0104;  // Multifunction Composite Gadget
+	deviceDesc.bNumConfigurations = 1;
+
+	// Like f_rndis: IAD, the communication interface (2/2/255) with the
+	// CDC functional descriptors and the notification endpoint, then the
+	// data interface (10/0/0) with the bulk endpoints.
+	const uint8_t notifyEpCount = config.interruptEp ? 1 : 0;
+	const uint8_t desc[] = {
+		9, kDescriptorTypeConfiguration, 0, 0, 2, 1, 0, 0x80, 250,
+		8, 11, 0, 2, 2, 6, 0, 0,
+		9, kDescriptorTypeInterface, 0, 0, notifyEpCount, 2, 2, 255, 0,
+		5, 0x24, 0x00, 0x10, 0x01,
+		5, 0x24, 0x01, 0x00, 0x01,
+		4, 0x24, 0x02, 0x00,
+		5, 0x24, 0x06, 0x00, 0x01,
+		7, kDescriptorTypeEndpoint, 0x83, 3, 8, 0, 9,
+		9, kDescriptorTypeInterface, 1, 0, 2, 10, 0, 0, 0,
+		7, kDescriptorTypeEndpoint, 0x81, 2, 0x00, 0x02, 0,
+		7, kDescriptorTypeEndpoint, 0x02, 2, 0x00, 0x02, 0,
+	};
+	configDesc.assign(desc, desc + sizeof(desc));
+	if (!config.interruptEp) {
+		// Drop the notification endpoint descriptor:
+		const size_t ofs = 9 + 8 + 9 + 5 + 5 + 4 + 5;
+		configDesc.erase(configDesc.begin() + ofs,
+			configDesc.begin() + ofs + 7);
+	}
+	ConfigurationDescriptor *cd = (ConfigurationDescriptor *)&configDesc[0];
+	cd->wTotalLength = (uint16_t)configDesc.size();
+
+	const InterfaceDescriptor *commDesc =
+		StandardUSB::getNextInterfaceDescriptor(cd, NULL);
+	const InterfaceDescriptor *dataDesc =
+		StandardUSB::getNextInterfaceDescriptor(cd, commDesc);
+	commIf = new SimInterface(this, commDesc);
+	dataIf = new SimInterface(this, dataDesc);
+	if (config.interruptEp) {
+		notifyPipe = new SimPipe(this, SimPipe::kInterruptIn,
+			StandardUSB::getNextEndpointDescriptor(cd, commDesc, NULL));
+		commIf->addPipe(notifyPipe);
+	}
+	const EndpointDescriptor *ep1 =
+		StandardUSB::getNextEndpointDescriptor(cd, dataDesc, NULL);
+	const EndpointDescriptor *ep2 =
+		StandardUSB::getNextEndpointDescriptor(cd, dataDesc, ep1);
+	inPipe = new SimPipe(this, SimPipe::kBulkIn, ep1);
+	outPipe = new SimPipe(this, SimPipe::kBulkOut, ep2);
+	dataIf->addPipe(inPipe);
+	dataIf->addPipe(outPipe);
+}
+
+void SimDevice::shutdown() {
+	simCancel(keepaliveEvent);
+	simCancel(notifyEvent);
+	simCancel(inBusEvent);
+	keepaliveEvent = notifyEvent = inBusEvent = 0;
+	for (size_t i = 0; i < responseEvents.size(); i++) {
+		simCancel(responseEvents[i]);
+	}
+	responseEvents.clear();
+	SimPipe *const pipes[] = { inPipe, outPipe, notifyPipe };
+	for (int i = 0; i < 3; i++) {
+		if (pipes[i]) {
+			abort(pipes[i], kIOReturnNotResponding);
+		}
+	}
+	if (commIf) {
+		commIf->dropPipes();
+	}
+	if (dataIf) {
+		dataIf->dropPipes();
+	}
+	inPipe = outPipe = notifyPipe = NULL;
+	OSSafeReleaseNULL(commIf);
+	OSSafeReleaseNULL(dataIf);
+}
+
+void SimDevice::free() {
+	shutdown();
+	IOUSBHostDevice::free();
+}
+
+const ConfigurationDescriptor *SimDevice::getConfigurationDescriptor(
+	uint8_t index) {
+	return index == 0 ? (const ConfigurationDescriptor *)&configDesc[0] : NULL;
+}
+
+IOReturn SimDevice::setConfiguration(uint8_t bConfigurationValue,
+	bool matchInterfaces) {
+	return bConfigurationValue == 1 ? kIOReturnSuccess : kIOReturnBadArgument;
+}
+
+OSIterator *SimDevice::getChildIterator(const IORegistryPlane *plane) const {
+	SimIterator *it = new SimIterator;
+	it->objects.push_back(commIf);
+	it->objects.push_back(dataIf);
+	return it;
+}
+
+uint64_t SimDevice::bookBus(uint32_t len) {
+	const uint64_t start = std::max<uint64_t>(
+		simNow() + config.latencyUs * NSEC_PER_USEC, busFreeAt);
+	busFreeAt = start + (uint64_t)(len * 8000.0 / config.busMbps);
+	return busFreeAt;
+}
+
+uint64_t SimDevice::jitter() {
+	if (config.jitterUs == 0) {
+		return 0;
+	}
+	std::exponential_distribution<double> dist(1.0 /
+		(config.jitterUs * NSEC_PER_USEC));
+	return (uint64_t)dist(rng);
+}
+
+IOReturn SimDevice::submit(SimPipe *pipe, IOMemoryDescriptor *mdp,
+	uint32_t len, IOUSBHostCompletion *comp) {
+	if (pipe->halted) {
+		return kUSBHostReturnPipeStalled;
+	}
+	if (pipe->kind == SimPipe::kBulkOut && config.refuseProb > 0 &&
+			std::bernoulli_distribution(config.refuseProb)(rng)) {
+		std::vector<uint8_t> data(len);
+		data.resize(mdp->readBytes(0, data.data(), len));
+		rndis_rx_frame frame;
+		for (uint32_t ofs = 0; ofs < data.size() &&
+				rndisParseDataMsg(&data[ofs], (uint32_t)data.size() - ofs,
+					&frame) == RNDIS_PARSE_OK; ofs += frame.msg_len) {
+			stats.outRefusedFrames++;
+		}
+		stats.outRefused++;
+		return kIOReturnNoResources;
+	}
+	Transfer *t = new Transfer;
+	t->pipe = pipe;
+	t->mdp = mdp;
+	t->len = len;
+	t->comp = *comp;
+	t->event = 0;
+	t->stalled = false;
+	pipe->pending.push_back(t);
+
+	switch (pipe->kind) {
+	case SimPipe::kBulkOut: {
+		const uint64_t done = std::max(bookBus(len) + jitter(),
+			pipe->lastCompletion);
+		pipe->lastCompletion = done;
+		const bool stall =
+			std::bernoulli_distribution(config.stallProb)(rng);
+		t->event = simSchedule(done, [this, t, stall] {
+			t->event = 0;
+			if (stall) {
+				stats.outStalls++;
+				haltPipe(t->pipe);
+			}
+			finishOut(t);
+		});
+		if (stall) {
+			t->stalled = true;
+		}
+		break;
+	}
+	case SimPipe::kBulkIn:
+		kickIn();
+		break;
+	case SimPipe::kInterruptIn:
+		completeNotify();
+		break;
+	}
+	return kIOReturnSuccess;
+}
+
+void SimDevice::completeTransfer(Transfer *t, IOReturn status, uint32_t len) {
+	std::deque<Transfer *> &pending = t->pipe->pending;
+	pending.erase(std::find(pending.begin(), pending.end(), t));
+	const IOUSBHostCompletion comp = t->comp;
+	delete t;
+	comp.action(comp.owner, comp.parameter, status, len);
+}
+
+void SimDevice::haltPipe(SimPipe *pipe) {
+	pipe->halted = true;
+	pipe->failingClears = config.stickyClears;
+	// Whatever is queued behind the stalled transfer fails, too:
+	for (size_t i = 0; i < pipe->pending.size(); i++) {
+		Transfer *t = pipe->pending[i];
+		t->stalled = true;
+		if (pipe->kind == SimPipe::kBulkIn && t->event == 0) {
+			// Not on the bus: fails right away.
+			t->event = simSchedule(simNow() + config.latencyUs * NSEC_PER_USEC,
+				[this, t] {
+					t->event = 0;
+					completeTransfer(t, kUSBHostReturnPipeStalled, 0);
+				});
+		}
+	}
+}
+
+void SimDevice::finishOut(Transfer *t) {
+	std::vector<uint8_t> data(t->len);
+	data.resize(t->mdp->readBytes(0, data.data(), t->len));
+
+	// Walk the messages: to check them, or to count the lost frames.
+	const uint32_t alignMask = (1u << config.alignShift) - 1;
+	uint32_t ofs = 0, frames = 0;
+	while (ofs < data.size()) {
+		rndis_rx_frame frame;
+		if (rndisParseDataMsg(&data[ofs], (uint32_t)data.size() - ofs,
+				&frame) != RNDIS_PARSE_OK) {
+			stats.protocolErrors++;
+			break;
+		}
+		if (ofs & alignMask) {
+			stats.alignViolations++;
+		}
+		if (frame.data_len > 14 + std::max(config.maxFrameSize, 1500u)) {
+			stats.limitViolations++;  // Larger than the MTU we said.
+		}
+		if (!t->stalled) {
+			sink.receive(&data[ofs + frame.data_ofs], frame.data_len);
+		}
+		frames++;
+		ofs += frame.msg_len;
+	}
+
+	if (t->stalled) {
+		stats.outStalledFrames += frames;
+		completeTransfer(t, kUSBHostReturnPipeStalled, 0);
+		return;
+	}
+	stats.outTransfers++;
+	stats.outMaxFramesPerTransfer =
+		std::max<uint64_t>(stats.outMaxFramesPerTransfer, frames);
+	if (data.size() > config.maxTransfer || frames > config.maxPkts) {
+		stats.limitViolations++;
+	}
+	completeTransfer(t, kIOReturnSuccess, (uint32_t)data.size());
+}
+
+void SimDevice::sendFrame(uint32_t len) {
+	if (packetFilter == 0) {
+		return;  // Not initialized, or the host has stopped the traffic.
+	}
+	if (txQueue.size() >= config.devQueueLen) {
+		stats.queueDrops++;
+		return;
+	}
+	QueuedFrame f = { txSeq++, simNow(), len };
+	txQueue.push_back(f);
+	kickIn();
+}
+
+void SimDevice::kickIn() {
+	if (inBusy || !inPipe || inPipe->halted || txQueue.empty()) {
+		return;
+	}
+	Transfer *t = NULL;
+	for (size_t i = 0; i < inPipe->pending.size() && !t; i++) {
+		if (inPipe->pending[i]->event == 0) {
+			t = inPipe->pending[i];
+		}
+	}
+	if (!t) {
+		return;  // The host has no read posted.
+	}
+
+	inBusy = true;
+	if (std::bernoulli_distribution(config.stallProb)(rng)) {
+		stats.inStalls++;
+		t->event = simSchedule(simNow() + config.latencyUs * NSEC_PER_USEC,
+			[this, t] {
+				inBusy = false;
+				haltPipe(inPipe);  // Fails the reads behind this one.
+				t->event = 0;
+				completeTransfer(t, kUSBHostReturnPipeStalled, 0);
+			});
+		return;
+	}
+
+	// Pack what we have, up to the host's limits (f_rndis does not align):
+	const uint32_t maxLen = hostMaxTransfer ?
+		std::min(t->len, hostMaxTransfer) : t->len;
+	uint32_t frames = 0;
+	while (!txQueue.empty() && frames < config.maxPkts) {
+		const QueuedFrame &f = txQueue.front();
+		const uint32_t msgLen = sizeof(rndis_data_hdr) + f.len;
+		if (msgLen > maxLen) {
+			stats.queueDrops++;  // Can never send it.
+			txQueue.pop_front();
+			continue;
+		}
+		if (t->data.size() + msgLen > maxLen) {
+			break;
+		}
+		const size_t ofs = t->data.size();
+		t->data.resize(ofs + msgLen);
+		rndisWriteDataHdr(&t->data[ofs], f.len);
+		simFillFrame(&t->data[ofs + sizeof(rndis_data_hdr)], f.len, f.seq,
+			f.stamp);
+		txQueue.pop_front();
+		frames++;
+	}
+	if (frames == 0) {
+		inBusy = false;
+		return;
+	}
+	stats.inFrames += frames;
+
+	const uint64_t end = bookBus((uint32_t)t->data.size());
+	const uint64_t done = std::max(end + jitter(), inPipe->lastCompletion);
+	inPipe->lastCompletion = done;
+	inBusEvent = simSchedule(end, [this] {
+		inBusEvent = 0;
+		inBusy = false;
+		kickIn();
+	});
+	t->event = simSchedule(done, [this, t] { finishIn(t); });
+}
+
+void SimDevice::finishIn(Transfer *t) {
+	t->event = 0;
+	const uint32_t len = (uint32_t)t->mdp->writeBytes(0, t->data.data(),
+		t->data.size());
+	stats.inTransfers++;
+	completeTransfer(t, kIOReturnSuccess, len);
+}
+
+void SimDevice::abort(SimPipe *pipe, IOReturn status) {
+	std::deque<Transfer *> aborted;
+	aborted.swap(pipe->pending);
+	for (size_t i = 0; i < aborted.size(); i++) {
+		if (aborted[i]->event) {
+			simCancel(aborted[i]->event);
+		}
+	}
+	if (pipe == inPipe && inBusEvent) {
+		simCancel(inBusEvent);
+		inBusEvent = 0;
+		inBusy = false;
+	}
+	if (pipe == notifyPipe && notifyEvent) {
+		simCancel(notifyEvent);
+		notifyEvent = 0;
+	}
+	for (size_t i = 0; i < aborted.size(); i++) {
+		Transfer *t = aborted[i];
+		const IOUSBHostCompletion comp = t->comp;
+		delete t;
+		comp.action(comp.owner, comp.parameter, status, 0);
+	}
+}
+
+IOReturn SimDevice::clearStall(SimPipe *pipe) {
+	stats.clearStalls++;
+	if (!pipe->halted) {
+		return kIOReturnSuccess;
+	}
+	if (pipe->failingClears > 0) {
+		pipe->failingClears--;
+		return kUSBHostReturnPipeStalled;
+	}
+	pipe->halted = false;
+	if (pipe == inPipe) {
+		kickIn();
+	}
+	return kIOReturnSuccess;
+}
+
+/***** Control *****/
+
+IOReturn SimDevice::controlRequest(DeviceRequest &request, void *data,
+	uint32_t &bytesTransferred) {
+	// A synchronous transfer: the others go on meanwhile.
+	simRunFor(config.ctrlLatencyUs * NSEC_PER_USEC);
+
+	const bool in = (request.bmRequestType & kDeviceRequestDirectionIn) != 0;
+	if (!in && request.bRequest == USB_CDC_SEND_ENCAPSULATED_COMMAND) {
+		handleCommand((const uint8_t *)data, request.wLength);
+		bytesTransferred = request.wLength;
+		return kIOReturnSuccess;
+	}
+	if (in && request.bRequest == USB_CDC_GET_ENCAPSULATED_RESPONSE) {
+		if (responses.empty()) {
+			*(uint8_t *)data = 0;  // Nothing to send: one zero byte.
+			bytesTransferred = 1;
+		} else {
+			const std::vector<uint8_t> &resp = responses.front();
+			bytesTransferred = std::min<uint32_t>((uint32_t)resp.size(),
+				request.wLength);
+			memcpy(data, resp.data(), bytesTransferred);
+			responses.pop_front();
+		}
+		return kIOReturnSuccess;
+	}
+	return kUSBHostReturnPipeStalled;
+}
+
+void SimDevice::handleCommand(const uint8_t *msg, uint32_t len) {
+	const rndis_msg_hdr *hdr = (const rndis_msg_hdr *)msg;
+	if (len < 12 || le32_to_cpu(hdr->msg_len) > len) {
+		stats.protocolErrors++;
+		return;
+	}
+	stats.commands++;
+	const uint32_t type = hdr->msg_type;
+
+	if (type == RNDIS_MSG_INIT && len >= sizeof(rndis_init)) {
+		const rndis_init *init = (const rndis_init *)msg;
+		hostMaxTransfer = le32_to_cpu(init->max_transfer_size);
+		rndis_init_c reply;
+		memset(&reply, 0, sizeof(reply));
+		reply.msg_type = RNDIS_MSG_INIT_C;
+		reply.msg_len = cpu_to_le32(sizeof(reply));
+		reply.request_id = init->request_id;
+		reply.status = RNDIS_STATUS_SUCCESS;
+		reply.major_version = cpu_to_le32(1);
+		reply.minor_version = cpu_to_le32(0);
+		reply.device_flags = cpu_to_le32(1);  // Connectionless.
+		reply.medium = cpu_to_le32(0);  // 802.3
+		reply.max_packets_per_transfer = cpu_to_le32(config.maxPkts);
+		reply.max_transfer_size = cpu_to_le32(config.maxTransfer);
+		reply.packet_alignment = cpu_to_le32(config.alignShift);
+		queueResponse(&reply, sizeof(reply));
+		if (config.keepaliveMs && !keepaliveEvent) {
+			keepaliveTick();
+		}
+	} else if (type == RNDIS_MSG_QUERY && len >= sizeof(rndis_query)) {
+		const rndis_query *query = (const rndis_query *)msg;
+		uint8_t info[8];
+		uint32_t infoLen = 0;
+		if (query->oid == OID_802_3_PERMANENT_ADDRESS) {
+			memcpy(info, macAddress.bytes, 6);
+			infoLen = 6;
+		} else if (query->oid == OID_GEN_MAXIMUM_FRAME_SIZE &&
+				config.maxFrameSize) {
+			const uint32_t mtu = cpu_to_le32(config.maxFrameSize);
+			memcpy(info, &mtu, 4);
+			infoLen = 4;
+		} else if (query->oid == OID_GEN_PHYSICAL_MEDIUM) {
+			const uint32_t medium = RNDIS_PHYSICAL_MEDIUM_UNSPECIFIED;
+			memcpy(info, &medium, 4);
+			infoLen = 4;
+		}
+		std::vector<uint8_t> reply(sizeof(rndis_query_c) + infoLen);
+		rndis_query_c *qc = (rndis_query_c *)&reply[0];
+		qc->msg_type = RNDIS_MSG_QUERY_C;
+		qc->msg_len = cpu_to_le32((uint32_t)reply.size());
+		qc->request_id = query->request_id;
+		qc->status = infoLen ? RNDIS_STATUS_SUCCESS :
+			RNDIS_STATUS_NOT_SUPPORTED;
+		qc->len = cpu_to_le32(infoLen);
+		qc->offset = cpu_to_le32(infoLen ? sizeof(rndis_query_c) - 8 : 0);
+		memcpy(&reply[sizeof(rndis_query_c)], info, infoLen);
+		queueResponse(reply.data(), (uint32_t)reply.size());
+	} else if (type == RNDIS_MSG_SET && len >= sizeof(rndis_set)) {
+		const rndis_set *set = (const rndis_set *)msg;
+		const uint32_t valueOfs = 8 + le32_to_cpu(set->offset);
+		rndis_set_c reply;
+		reply.msg_type = RNDIS_MSG_SET_C;
+		reply.msg_len = cpu_to_le32(sizeof(reply));
+		reply.request_id = set->request_id;
+		reply.status = RNDIS_STATUS_NOT_SUPPORTED;
+		if (set->oid == OID_GEN_CURRENT_PACKET_FILTER &&
+				le32_to_cpu(set->len) >= 4 && valueOfs + 4 <= len) {
+			uint32_t filter;
+			memcpy(&filter, msg + valueOfs, 4);
+			packetFilter = le32_to_cpu(filter);
+			if (packetFilter == 0) {
+				txQueue.clear();  // Like f_rndis: the traffic stops.
+			}
+			reply.status = RNDIS_STATUS_SUCCESS;
+		}
+		queueResponse(&reply, sizeof(reply));
+	} else if (type == RNDIS_MSG_KEEPALIVE_C) {
+		stats.keepalivesAnswered++;
+	} else if (type == RNDIS_MSG_KEEPALIVE) {
+		rndis_msg_hdr reply;
+		rndisEncodeKeepaliveC(&reply, hdr->request_id);
+		queueResponse(&reply, sizeof(reply));
+	} else if (type != RNDIS_MSG_HALT) {
+		stats.protocolErrors++;
+	}
+}
+
+void SimDevice::queueResponse(const void *msg, uint32_t len) {
+	std::vector<uint8_t> resp((const uint8_t *)msg, (const uint8_t *)msg + len);
+	responseEvents.push_back(simSchedule(
+		simNow() + config.respDelayUs * NSEC_PER_USEC, [this, resp] {
+			responses.push_back(resp);
+			notifyHost();
+		}));
+}
+
+void SimDevice::notifyHost() {
+	if (!notifyPipe) {
+		return;  // The host has to poll.
+	}
+	notifyPending++;
+	completeNotify();
+}
+
+void SimDevice::completeNotify() {
+	if (notifyPending == 0 || notifyEvent || !notifyPipe ||
+			notifyPipe->pending.empty()) {
+		return;
+	}
+	notifyEvent = simSchedule(simNow() + config.latencyUs * NSEC_PER_USEC,
+		[this] {
+			notifyEvent = 0;
+			if (notifyPipe->pending.empty()) {
+				return;
+			}
+			Transfer *t = notifyPipe->pending.front();
+			static const uint32_t kResponseAvailable[2] = {
+				cpu_to_le32(1), 0
+			};
+			notifyPending--;
+			stats.notifications++;
+			const uint32_t len = (uint32_t)t->mdp->writeBytes(0,
+				kResponseAvailable, std::min<uint32_t>(t->len, 8));
+			completeTransfer(t, kIOReturnSuccess, len);
+			completeNotify();
+		});
+}
+
+void SimDevice::keepaliveTick() {
+	rndis_msg_hdr msg;
+	msg.msg_type = RNDIS_MSG_KEEPALIVE;
+	msg.msg_len = cpu_to_le32(12);
+	msg.request_id = cpu_to_le32(keepaliveXid++);
+	stats.keepalivesSent++;
+	queueResponse(&msg, 12);
+	keepaliveEvent = simSchedule(
+		simNow() + config.keepaliveMs * NSEC_PER_MSEC, [this] {
+			keepaliveEvent = 0;
+			keepaliveTick();
+		});
+}
+
+void SimDevice::indicateStatus(uint32_t status) {
+	rndis_indicate msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_type = RNDIS_MSG_INDICATE;
+	msg.msg_len = cpu_to_le32(sizeof(msg));
+	msg.status = status;
+	queueResponse(&msg, sizeof(msg));
+}
+
+/***** Pipes and interfaces *****/
+
+SimPipe::SimPipe(SimDevice *device, Kind kind,
+	const EndpointDescriptor *desc): device(device), kind(kind) {
+	this->desc = desc;
+}
+
+IOReturn SimPipe::io(IOMemoryDescriptor *dataBuffer, uint32_t dataBufferLength,
+	IOUSBHostCompletion *completion, uint32_t completionTimeoutMs) {
+	if (dataBufferLength > dataBuffer->getLength()) {
+		return kIOReturnBadArgument;
+	}
+	if (!dataBuffer->simWired()) {
+		device->stats.unwiredTransfers++;
+	}
+	return device->submit(this, dataBuffer, dataBufferLength, completion);
+}
+
+IOReturn SimPipe::clearStall(bool withRequest) {
+	return device->clearStall(this);
+}
+
+IOReturn SimPipe::abort(IOOptionBits options, IOReturn withError,
+	IOService *forClient) {
+	device->abort(this, withError);
+	return kIOReturnSuccess;
+}
+
+SimInterface::SimInterface(SimDevice *device,
+	const InterfaceDescriptor *desc): device(device), desc(desc) {
+	char name[32];
+	snprintf(name, sizeof(name), "SimRNDIS@%d", desc->bInterfaceNumber);
+	setName(name);
+}
+
+void SimInterface::free() {
+	dropPipes();
+	IOUSBHostInterface::free();
+}
+
+const ConfigurationDescriptor *SimInterface::getConfigurationDescriptor()
+	const {
+	return device->getConfigurationDescriptor(0);
+}
+
+IOUSBHostPipe *SimInterface::copyPipe(uint8_t address) {
+	for (size_t i = 0; i < pipes.size(); i++) {
+		if (pipes[i]->getEndpointDescriptor()->bEndpointAddress == address) {
+			pipes[i]->retain();
+			return pipes[i];
+		}
+	}
+	return NULL;
+}
+
+IOReturn SimInterface::deviceRequest(DeviceRequest &request, void *dataBuffer,
+	uint32_t &bytesTransferred, uint32_t completionTimeoutMs) {
+	return device->controlRequest(request, dataBuffer, bytesTransferred);
+}
+
+void SimInterface::close(IOService *forClient, IOOptionBits options) {
+	for (size_t i = 0; i < pipes.size(); i++) {
+		pipes[i]->abort(IOUSBHostIOSource::kAbortSynchronous,
+			kIOReturnAborted);
+	}
+	IOUSBHostInterface::close(forClient, options);
+}
+
+void SimInterface::dropPipes() {
+	for (size_t i = 0; i < pipes.size(); i++) {
+		pipes[i]->release();
+	}
+	pipes.clear();
+}
@@ -0,0 +1,254 @@
+/* SimDevice.h
+ * A simulated USB RNDIS device, behaving like a Linux f_rndis gadget as
+ * seen from the host: a communication interface (control requests and the
+ * interrupt notification endpoint) and a data interface (bulk IN and OUT).
+ *
+ * The bulk pipes share one half-duplex bus of the given bandwidth. Every
+ * transfer waits 'latencyUs' before it can use the bus, occupies it for its
+ * length, and completes 'jitterUs' (exponentially distributed) after that;
+ * completions on a pipe stay in order. The OUT transfers are booked when
+ * they're submitted, so the host can keep the bus busy by queueing several.
+ * The device sends one IN transfer at a time, packing whatever frames it has
+ * queued by then: like a gadget that resubmits its request on completion.
+ *
+ * A transfer may stall the pipe ('stallProb'): it and everything queued
+ * behind it completes with kUSBHostReturnPipeStalled, new transfers are
+ * refused until 'clearStall', and the first 'stickyClears' of those fail.
+ * The frames in a stalled OUT transfer are lost; the device keeps the ones
+ * it meant to send IN. An OUT transfer may also be refused outright
+ * ('refuseProb'), as by a host controller out of resources.
+ */
+
+#ifndef SIM_DEVICE_H
+#define SIM_DEVICE_H
+
+#include "SimKernel.h"
+
+#include <random>
+
+struct SimConfig {
+	double busMbps = 280;  // USB 2.0 high speed, after protocol overhead.
+	uint32_t latencyUs = 50;
+	uint32_t jitterUs = 10;
+	uint32_t ctrlLatencyUs = 250;  // Control transfer round trip.
+	uint32_t respDelayUs = 100;  // Command received to response available.
+	// The REMOTE_NDIS_INITIALIZE_CMPLT parameters:
+	uint32_t maxTransfer = 16384;
+	uint32_t maxPkts = 8;
+	uint32_t alignShift = 2;
+	// The OID_GEN_MAXIMUM_FRAME_SIZE reply, the MTU; 0: not supported.
+	uint32_t maxFrameSize = 1500;
+	double stallProb = 0;
+	uint32_t stickyClears = 0;
+	double refuseProb = 0;
+	uint32_t keepaliveMs = 0;  // REMOTE_NDIS_KEEPALIVE_MSG period; 0: none.
+	bool interruptEp = true;
+	uint32_t devQueueLen = 1000;  // Device's transmit queue, in frames.
+	uint64_t seed = 1;
+};
+
+// The test frames carry a tag right after the Ethernet header, and a
+// pattern derived from it, so the receiving end can check them.
+// The "probe" frames are a stream of their own, numbered separately: they
+// are sent with the ARP EtherType, so the priority transmit sees them as
+// control traffic.
+#define SIM_FRAME_MIN_LEN   60
+#define SIM_FRAME_MAX_LEN   (14 + 9000)
+void simFillFrame(uint8_t *frame, uint32_t len, uint64_t seq, uint64_t stamp,
+	bool probe = false);
+bool simCheckFrame(const uint8_t *frame, uint32_t len, uint64_t *seq,
+	uint64_t *stamp);
+// The "tso" traffic is one TCP stream over IPv4, with valid checksums: each
+// packet carries the bytes of the stream from 'streamOfs' on, in a pattern
+// derived from their offset. Up to a 64K super-packet, for TSO.
+#define SIM_TCP_HDR_LEN     (14 + 20 + 20)
+#define SIM_TCP_MAX_LEN     (14 + 65535)
+void simFillTcpFrame(uint8_t *frame, uint32_t len, uint32_t streamOfs);
+
+// Receives the frames that arrive at one end, checks their order, and
+// records their latencies.
+struct SimFrameSink {
+	uint64_t frames = 0;
+	uint64_t bytes = 0;
+	uint64_t corrupt = 0;
+	uint64_t lost = 0;  // Gaps in the sequence.
+	uint64_t reordered = 0;
+	uint64_t nextSeq = 0;
+	uint64_t probeFrames = 0;  // Also counted in 'frames'.
+	uint64_t nextProbeSeq = 0;
+	uint64_t measureFrom = 0;  // Latencies of frames stamped from then on.
+	std::vector<uint32_t> latenciesNs;
+	std::vector<uint32_t> probeLatenciesNs;
+	// The TCP segments, also counted in 'frames'. Lost and reordered ones
+	// count as the other frames do: they carry no time stamp.
+	uint64_t tcpSegments = 0;
+	uint32_t tcpNextOfs = 0;
+	uint32_t tcpMaxPayload = 0;
+
+	void receive(const uint8_t *frame, uint32_t len);
+	bool receiveTcp(const uint8_t *frame, uint32_t len);
+};
+
+struct SimDeviceStats {
+	uint64_t outTransfers = 0;
+	uint64_t outStalls = 0;
+	uint64_t outStalledFrames = 0;  // Lost in the stalled OUT transfers.
+	uint64_t outRefused = 0;
+	uint64_t outRefusedFrames = 0;  // Lost in the refused ones.
+	uint64_t outMaxFramesPerTransfer = 0;
+	uint64_t inTransfers = 0;
+	uint64_t inStalls = 0;
+	uint64_t inFrames = 0;
+	uint64_t clearStalls = 0;
+	uint64_t protocolErrors = 0;  // Malformed data messages from the host.
+	uint64_t limitViolations = 0;  // Beyond max_transfer_size/_packets.
+	uint64_t unwiredTransfers = 0;  // Of memory that was not prepared.
+	uint64_t alignViolations = 0;  // Messages not at 'packet_alignment'.
+	uint64_t queueDrops = 0;  // Generated frames the device had no room for.
+	uint64_t commands = 0;
+	uint64_t keepalivesSent = 0;
+	uint64_t keepalivesAnswered = 0;
+	uint64_t notifications = 0;
+};
+
+class SimPipe;
+class SimInterface;
+
+class SimDevice : public IOUSBHostDevice {
+public:
+	static SimDevice *create(const SimConfig &config);
+	// Cancels the device's own events, and drops the interfaces.
+	void shutdown();
+	virtual void free() override;
+
+	virtual const DeviceDescriptor *getDeviceDescriptor() const override {
+		return &deviceDesc;
+	}
+	virtual const ConfigurationDescriptor *getConfigurationDescriptor(
+		uint8_t index) override;
+	virtual IOReturn setConfiguration(uint8_t bConfigurationValue,
+		bool matchInterfaces = true) override;
+	virtual OSIterator *getChildIterator(const IORegistryPlane *plane)
+		const override;
+
+	// Traffic: queues a frame for the host, if the packet filter is set.
+	void sendFrame(uint32_t len);
+	uint32_t queuedFrames() const { return (uint32_t)txQueue.size(); }
+	// Sends REMOTE_NDIS_INDICATE_STATUS_MSG with the given status.
+	void indicateStatus(uint32_t status);
+
+	SimConfig config;
+	SimDeviceStats stats;
+	SimFrameSink sink;  // Frames the host has sent.
+	uint32_t packetFilter = 0;
+	IOEthernetAddress macAddress;
+
+	// Used by the pipes and interfaces:
+	struct Transfer {
+		SimPipe *pipe;
+		IOMemoryDescriptor *mdp;
+		uint32_t len;
+		IOUSBHostCompletion comp;
+		uint64_t event;  // Completion.
+		bool stalled;
+		std::vector<uint8_t> data;  // IN: the frames packed into it.
+	};
+	IOReturn submit(SimPipe *pipe, IOMemoryDescriptor *mdp, uint32_t len,
+		IOUSBHostCompletion *comp);
+	void abort(SimPipe *pipe, IOReturn status);
+	IOReturn clearStall(SimPipe *pipe);
+	IOReturn controlRequest(DeviceRequest &request, void *data,
+		uint32_t &bytesTransferred);
+
+private:
+	struct QueuedFrame {
+		uint64_t seq;
+		uint64_t stamp;
+		uint32_t len;
+	};
+
+	void buildDescriptors();
+	uint64_t bookBus(uint32_t len);
+	uint64_t jitter();
+	void completeTransfer(Transfer *t, IOReturn status, uint32_t len);
+	void haltPipe(SimPipe *pipe);
+	void finishOut(Transfer *t);
+	void kickIn();
+	void finishIn(Transfer *t);
+	void handleCommand(const uint8_t *msg, uint32_t len);
+	void queueResponse(const void *msg, uint32_t len);
+	void notifyHost();
+	void completeNotify();
+	void keepaliveTick();
+
+	DeviceDescriptor deviceDesc;
+	std::vector<uint8_t> configDesc;
+	SimInterface *commIf = NULL;
+	SimInterface *dataIf = NULL;
+	SimPipe *inPipe = NULL;
+	SimPipe *outPipe = NULL;
+	SimPipe *notifyPipe = NULL;
+
+	std::mt19937_64 rng;
+	uint64_t busFreeAt = 0;
+	bool inBusy = false;  // An IN transfer is on the bus.
+	uint64_t inBusEvent = 0;
+	std::deque<QueuedFrame> txQueue;
+	uint64_t txSeq = 0;
+	uint32_t hostMaxTransfer = 0;  // From REMOTE_NDIS_INITIALIZE_MSG.
+
+	std::deque<std::vector<uint8_t> > responses;
+	uint32_t notifyPending = 0;
+	uint64_t notifyEvent = 0;
+	uint64_t keepaliveEvent = 0;
+	uint32_t keepaliveXid = 0x1000;
+	std::vector<uint64_t> responseEvents;
+};
+
+class SimPipe : public IOUSBHostPipe {
+public:
+	enum Kind { kBulkIn, kBulkOut, kInterruptIn };
+	SimPipe(SimDevice *device, Kind kind, const EndpointDescriptor *desc);
+	virtual IOReturn io(IOMemoryDescriptor *dataBuffer,
+		uint32_t dataBufferLength, IOUSBHostCompletion *completion,
+		uint32_t completionTimeoutMs = 0) override;
+	virtual IOReturn clearStall(bool withRequest) override;
+	virtual IOReturn abort(IOOptionBits options = kAbortAsynchronous,
+		IOReturn withError = kIOReturnAborted,
+		IOService *forClient = NULL) override;
+
+	SimDevice *const device;
+	const Kind kind;
+	std::deque<SimDevice::Transfer *> pending;  // In submission order.
+	bool halted = false;
+	uint32_t failingClears = 0;
+	uint64_t lastCompletion = 0;
+};
+
+class SimInterface : public IOUSBHostInterface {
+public:
+	SimInterface(SimDevice *device, const InterfaceDescriptor *desc);
+	virtual void free() override;
+	virtual const InterfaceDescriptor *getInterfaceDescriptor() const override {
+		return desc;
+	}
+	virtual const ConfigurationDescriptor *getConfigurationDescriptor()
+		const override;
+	virtual IOUSBHostDevice *getDevice() const override { return device; }
+	virtual IOUSBHostPipe *copyPipe(uint8_t address) override;
+	virtual IOReturn deviceRequest(DeviceRequest &request, void *dataBuffer,
+		uint32_t &bytesTransferred, uint32_t completionTimeoutMs = 5000)
+		override;
+	// Closing the interface aborts its pipes:
+	virtual void close(IOService *forClient, IOOptionBits options = 0)
+		override;
+
+	void addPipe(SimPipe *pipe) { pipes.push_back(pipe); }
+	void dropPipes();
+private:
+	SimDevice *const device;
+	const InterfaceDescriptor *const desc;
+	std::vector<SimPipe *> pipes;
+};
+
+#endif /* SIM_DEVICE_H */
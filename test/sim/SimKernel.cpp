@@ -0,0 +1,1340 @@
+/* SimKernel.cpp
+ * The simulated kernel: event loop and clock, libkern containers, IOKit
+ * event sources, memory descriptors, mbufs and the networking family.
+ * See SimKernel.h.
+ */
+
+#include "SimKernel.h"
+
+#include <stdarg.h>
+#include <errno.h>
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+
+bool gSimVerbose = false;
+bool gSimClientIsAdmin = true;
+SimCounters gSimCounters;
+task_t kernel_task = (task_t)&kernel_task;
+
+void simPanic(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "SIM PANIC at %llu ns: ", (unsigned long long)simNow());
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	abort();
+}
+
+/***** Event loop *****/
+
+namespace {
+
+struct Event {
+	uint64_t when;
+	uint64_t id;  // Also the FIFO order of the events due at the same time.
+	std::function<void()> fn;
+};
+
+struct EventLater {
+	bool operator()(const Event &a, const Event &b) const {
+		return a.when != b.when ? a.when > b.when : a.id > b.id;
+	}
+};
+
+uint64_t sNow = 0;
+uint64_t sNextEventId = 1;
+std::priority_queue<Event, std::vector<Event>, EventLater> sEvents;
+std::unordered_set<uint64_t> sPending;  // Scheduled and not cancelled.
+
+// Runs the next event due by 'deadline'; false if there's none.
+bool runOneEvent(uint64_t deadline) {
+	while (!sEvents.empty()) {
+		if (sPending.count(sEvents.top().id) == 0) {
+			sEvents.pop();  // Cancelled.
+			continue;
+		}
+		if (sEvents.top().when > deadline) {
+			return false;
+		}
+		Event ev = sEvents.top();
+		sEvents.pop();
+		sPending.erase(ev.id);
+		if (ev.when > sNow) {
+			sNow = ev.when;
+		}
+		ev.fn();
+		return true;
+	}
+	return false;
+}
+
+}  // namespace
+
+uint64_t simNow() {
+	return sNow;
+}
+
+uint64_t simSchedule(uint64_t when, std::function<void()> fn) {
+	Event ev;
+	ev.when = when < sNow ? sNow : when;
+	ev.id = sNextEventId++;
+	ev.fn = fn;
+	sPending.insert(ev.id);
+	sEvents.push(ev);
+	return ev.id;
+}
+
+bool simCancel(uint64_t eventId) {
+	return sPending.erase(eventId) != 0;
+}
+
+bool simRun(const std::function<bool()> &until, uint64_t deadline) {
+	while (!until()) {
+		if (!runOneEvent(deadline)) {
+			if (deadline != UINT64_MAX && deadline > sNow) {
+				sNow = deadline;
+			}
+			return until();
+		}
+	}
+	return true;
+}
+
+void simRunFor(uint64_t ns) {
+	simRun([] { return false; }, sNow + ns);
+}
+
+/***** Kernel functions *****/
+
+void IOLog(const char *fmt, ...) {
+	if (!gSimVerbose) {
+		return;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "[%10.3f ms] ", sNow / 1e6);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+void IOSleep(unsigned ms) {
+	simRunFor(ms * NSEC_PER_MSEC);
+}
+
+void IODelay(unsigned us) {
+	// Busy-waits in the kernel: nothing else runs meanwhile.
+	sNow += us * NSEC_PER_USEC;
+}
+
+static std::unordered_map<void *, size_t> sAllocations;
+
+static void *trackAllocation(void *ptr, size_t size) {
+	if (ptr) {
+		sAllocations[ptr] = size;
+		gSimCounters.allocations++;
+		gSimCounters.allocationBytes += size;
+	}
+	return ptr;
+}
+
+static void untrackAllocation(void *ptr, size_t size) {
+	std::unordered_map<void *, size_t>::iterator it = sAllocations.find(ptr);
+	if (it == sAllocations.end()) {
+		simPanic("freeing %p, that was not allocated", ptr);
+	}
+	if (it->second != size) {
+		gSimCounters.allocFreeMismatches++;
+	}
+	gSimCounters.allocations--;
+	gSimCounters.allocationBytes -= it->second;
+	sAllocations.erase(it);
+}
+
+void *IOMalloc(size_t size) {
+	return trackAllocation(malloc(size), size);
+}
+
+void IOFree(void *ptr, size_t size) {
+	if (ptr) {
+		untrackAllocation(ptr, size);
+		free(ptr);
+	}
+}
+
+void *IOMallocAligned(size_t size, size_t alignment) {
+	void *ptr = NULL;
+	if (alignment < sizeof(void *)) {
+		alignment = sizeof(void *);
+	}
+	if (posix_memalign(&ptr, alignment, size) != 0) {
+		return NULL;
+	}
+	return trackAllocation(ptr, size);
+}
+
+void IOFreeAligned(void *ptr, size_t size) {
+	IOFree(ptr, size);
+}
+
+void clock_get_uptime(uint64_t *result) {
+	*result = sNow;
+}
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result) {
+	*result = abstime;
+}
+
+void nanoseconds_to_absolutetime(uint64_t nanosecs, uint64_t *result) {
+	*result = nanosecs;
+}
+
+void clock_interval_to_deadline(uint32_t interval, uint32_t scale,
+	uint64_t *result) {
+	*result = sNow + (uint64_t)interval * scale;
+}
+
+// Return the old value, like libkern:
+SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 *address) {
+	return __atomic_fetch_add(address, amount, __ATOMIC_SEQ_CST);
+}
+
+SInt32 OSIncrementAtomic(volatile SInt32 *address) {
+	return OSAddAtomic(1, address);
+}
+
+SInt32 OSDecrementAtomic(volatile SInt32 *address) {
+	return OSAddAtomic(-1, address);
+}
+
+void OSMemoryBarrier(void) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+struct IOSimpleLockSim {
+	bool held;
+};
+
+IOSimpleLock *IOSimpleLockAlloc(void) {
+	IOSimpleLock *lock = (IOSimpleLock *)IOMalloc(sizeof(IOSimpleLock));
+	if (lock) {
+		lock->held = false;
+	}
+	return lock;
+}
+
+void IOSimpleLockFree(IOSimpleLock *lock) {
+	if (lock->held) {
+		simPanic("freeing a held simple lock");
+	}
+	IOFree(lock, sizeof(IOSimpleLock));
+}
+
+void IOSimpleLockLock(IOSimpleLock *lock) {
+	if (lock->held) {
+		simPanic("simple lock taken twice: deadlock");
+	}
+	lock->held = true;
+}
+
+void IOSimpleLockUnlock(IOSimpleLock *lock) {
+	if (!lock->held) {
+		simPanic("unlocking a simple lock that is not held");
+	}
+	lock->held = false;
+}
+
+thread_t current_thread(void) {
+	return (thread_t)&sNow;
+}
+
+task_t current_task(void) {
+	return (task_t)&gSimClientIsAdmin;
+}
+
+IOReturn IOUserClient::clientHasPrivilege(void *securityToken,
+		const char *privilegeName) {
+	return gSimClientIsAdmin ? kIOReturnSuccess : kIOReturnNotPrivileged;
+}
+
+uint64_t thread_tid(thread_t thread) {
+	return 1;
+}
+
+/***** Thread calls *****/
+
+// The delay before a thread call runs: roughly a thread wake-up.
+static const uint64_t kThreadCallLatencyNs = 20 * NSEC_PER_USEC;
+
+struct thread_call {
+	thread_call_func_t func;
+	thread_call_param_t param0;
+	uint64_t pendingEvent;
+};
+
+thread_call_t thread_call_allocate(thread_call_func_t func,
+	thread_call_param_t param0) {
+	thread_call_t call = new thread_call;
+	call->func = func;
+	call->param0 = param0;
+	call->pendingEvent = 0;
+	return call;
+}
+
+bool thread_call_enter(thread_call_t call) {
+	if (call->pendingEvent) {
+		return true;  // Already pending.
+	}
+	call->pendingEvent = simSchedule(sNow + kThreadCallLatencyNs, [call] {
+		call->pendingEvent = 0;
+		call->func(call->param0, NULL);
+	});
+	return false;
+}
+
+bool thread_call_cancel(thread_call_t call) {
+	if (!call->pendingEvent) {
+		return false;
+	}
+	simCancel(call->pendingEvent);
+	call->pendingEvent = 0;
+	return true;
+}
+
+bool thread_call_free(thread_call_t call) {
+	if (call->pendingEvent) {
+		simPanic("freeing a pending thread call");
+	}
+	delete call;
+	return true;
+}
+
+/***** mbufs *****/
+
+struct mbuf {
+	mbuf *next;
+	uint8_t *data;
+	size_t len;
+	size_t pkthdrLen;
+	uint8_t *storage;  // Owned; NULL for external clusters.
+	void (*extfree)(caddr_t, u_int, caddr_t);
+	caddr_t extbuf;
+	u_int extsize;
+	caddr_t extarg;
+	mbuf_tso_request_flags_t tsoRequest;
+	uint32_t tsoMss;
+};
+
+static mbuf_t newMbuf() {
+	mbuf_t m = new mbuf;
+	memset(m, 0, sizeof(*m));
+	gSimCounters.mbufs++;
+	return m;
+}
+
+mbuf_t simAllocPacket(const void *data, size_t len, int segments) {
+	if (segments < 1) {
+		segments = 1;
+	}
+	mbuf_t head = NULL, *tail = &head;
+	size_t ofs = 0;
+	for (int i = 0; i < segments; i++) {
+		const size_t segLen = (i == segments - 1) ? len - ofs : len / segments;
+		mbuf_t m = newMbuf();
+		m->storage = new uint8_t[segLen ? segLen : 1];
+		m->data = m->storage;
+		m->len = segLen;
+		if (data) {
+			memcpy(m->data, (const uint8_t *)data + ofs, segLen);
+		}
+		ofs += segLen;
+		*tail = m;
+		tail = &m->next;
+	}
+	head->pkthdrLen = len;
+	return head;
+}
+
+void simSetTsoRequest(mbuf_t m, mbuf_tso_request_flags_t request,
+	uint32_t mss) {
+	m->tsoRequest = request;
+	m->tsoMss = mss;
+}
+
+mbuf_t mbuf_next(mbuf_t mbuf) {
+	return mbuf->next;
+}
+
+size_t mbuf_len(mbuf_t mbuf) {
+	return mbuf->len;
+}
+
+void *mbuf_data(mbuf_t mbuf) {
+	return mbuf->data;
+}
+
+size_t mbuf_pkthdr_len(mbuf_t mbuf) {
+	return mbuf->pkthdrLen;
+}
+
+void mbuf_setlen(mbuf_t mbuf, size_t len) {
+	mbuf->len = len;
+}
+
+void mbuf_pkthdr_setlen(mbuf_t mbuf, size_t len) {
+	mbuf->pkthdrLen = len;
+}
+
+errno_t mbuf_get_tso_requested(mbuf_t mbuf,
+	mbuf_tso_request_flags_t *request, uint32_t *value) {
+	*request = mbuf->tsoRequest;
+	*value = mbuf->tsoMss;
+	return 0;
+}
+
+errno_t mbuf_copydata(mbuf_t m, size_t offset, size_t length, void *out) {
+	uint8_t *dst = (uint8_t *)out;
+	for (; m && length; m = m->next) {
+		if (offset >= m->len) {
+			offset -= m->len;
+			continue;
+		}
+		const size_t n = std::min(m->len - offset, length);
+		memcpy(dst, m->data + offset, n);
+		dst += n;
+		length -= n;
+		offset = 0;
+	}
+	return length ? EINVAL : 0;
+}
+
+errno_t mbuf_copyback(mbuf_t m, size_t offset, size_t length,
+	const void *data, mbuf_how_t how) {
+	const uint8_t *src = (const uint8_t *)data;
+	for (; m && length; m = m->next) {
+		if (offset >= m->len) {
+			offset -= m->len;
+			continue;
+		}
+		const size_t n = std::min(m->len - offset, length);
+		memcpy(m->data + offset, src, n);
+		src += n;
+		length -= n;
+		offset = 0;
+	}
+	// The kernel would extend the chain: the callers here never need it.
+	return length ? ENOBUFS : 0;
+}
+
+errno_t mbuf_attachcluster(mbuf_how_t how, mbuf_type_t type, mbuf_t *mbuf,
+	caddr_t extbuf, void (*extfree)(caddr_t, u_int, caddr_t), size_t extsize,
+	caddr_t extarg) {
+	if (!extbuf || !extfree || !mbuf) {
+		return EINVAL;
+	}
+	mbuf_t m = *mbuf ? *mbuf : newMbuf();
+	m->data = (uint8_t *)extbuf;
+	m->len = 0;
+	m->extfree = extfree;
+	m->extbuf = extbuf;
+	m->extsize = (u_int)extsize;
+	m->extarg = extarg;
+	*mbuf = m;
+	return 0;
+}
+
+void mbuf_freem(mbuf_t m) {
+	while (m) {
+		mbuf_t next = m->next;
+		if (m->extfree) {
+			m->extfree(m->extbuf, m->extsize, m->extarg);
+		}
+		delete[] m->storage;
+		delete m;
+		gSimCounters.mbufs--;
+		m = next;
+	}
+}
+
+/***** libkern containers *****/
+
+OSObject::OSObject(): refs(1) {
+	gSimCounters.objects++;
+}
+
+OSObject::~OSObject() {
+	gSimCounters.objects--;
+}
+
+void OSObject::free() {
+	delete this;
+}
+
+void OSObject::retain() const {
+	refs++;
+}
+
+void OSObject::release() const {
+	if (refs <= 0) {
+		simPanic("over-release of %p", this);
+	}
+	if (--refs == 0) {
+		const_cast<OSObject *>(this)->free();
+	}
+}
+
+OSString *OSString::withCString(const char *cString) {
+	OSString *s = new OSString;
+	s->str = cString;
+	return s;
+}
+
+const OSSymbol *OSSymbol::withCString(const char *cString) {
+	OSSymbol *s = new OSSymbol;
+	s->str = cString;
+	return s;
+}
+
+OSNumber *OSNumber::withNumber(unsigned long long value,
+	unsigned int numberOfBits) {
+	OSNumber *num = new OSNumber;
+	num->value = value;
+	return num;
+}
+
+static OSBoolean sBooleanTrue(true);
+static OSBoolean sBooleanFalse(false);
+OSBoolean *const kOSBooleanTrue = &sBooleanTrue;
+OSBoolean *const kOSBooleanFalse = &sBooleanFalse;
+
+OSData *OSData::withBytes(const void *bytes, unsigned int numBytes) {
+	OSData *data = new OSData;
+	data->bytes.assign((const uint8_t *)bytes,
+		(const uint8_t *)bytes + numBytes);
+	return data;
+}
+
+OSArray *OSArray::withCapacity(unsigned int capacity) {
+	return new OSArray;
+}
+
+void OSArray::free() {
+	for (size_t i = 0; i < array.size(); i++) {
+		array[i]->release();
+	}
+	array.clear();
+	OSObject::free();
+}
+
+bool OSArray::setObject(const OSObject *anObject) {
+	if (!anObject) {
+		return false;
+	}
+	anObject->retain();
+	array.push_back(const_cast<OSObject *>(anObject));
+	return true;
+}
+
+OSDictionary *OSDictionary::withCapacity(unsigned int capacity) {
+	return new OSDictionary;
+}
+
+void OSDictionary::free() {
+	for (std::map<std::string, OSObject *>::iterator it = dict.begin();
+			it != dict.end(); ++it) {
+		it->second->release();
+	}
+	dict.clear();
+	OSObject::free();
+}
+
+bool OSDictionary::setObject(const char *key, const OSObject *anObject) {
+	if (!anObject) {
+		return false;
+	}
+	anObject->retain();
+	OSObject *&slot = dict[key];
+	if (slot) {
+		slot->release();
+	}
+	slot = const_cast<OSObject *>(anObject);
+	return true;
+}
+
+bool OSDictionary::setObject(const OSSymbol *key, const OSObject *anObject) {
+	return setObject(key->getCStringNoCopy(), anObject);
+}
+
+OSObject *OSDictionary::getObject(const char *key) const {
+	std::map<std::string, OSObject *>::const_iterator it = dict.find(key);
+	return it == dict.end() ? NULL : it->second;
+}
+
+void OSDictionary::removeObject(const char *key) {
+	std::map<std::string, OSObject *>::iterator it = dict.find(key);
+	if (it != dict.end()) {
+		it->second->release();
+		dict.erase(it);
+	}
+}
+
+OSCollectionIterator *OSCollectionIterator::withCollection(
+	const OSDictionary *inColl) {
+	OSCollectionIterator *it = new OSCollectionIterator;
+	for (std::map<std::string, OSObject *>::const_iterator i =
+			inColl->dict.begin(); i != inColl->dict.end(); ++i) {
+		it->keys.push_back(OSSymbol::withCString(i->first.c_str()));
+	}
+	return it;
+}
+
+void OSCollectionIterator::free() {
+	for (size_t i = 0; i < keys.size(); i++) {
+		keys[i]->release();
+	}
+	keys.clear();
+	OSObject::free();
+}
+
+OSObject *OSCollectionIterator::getNextObject() {
+	return next < keys.size() ? const_cast<OSSymbol *>(keys[next++]) : NULL;
+}
+
+/***** Registry and services *****/
+
+void IORegistryEntry::free() {
+	OSSafeReleaseNULL(properties);
+	OSObject::free();
+}
+
+OSObject *IORegistryEntry::getProperty(const char *aKey) const {
+	return properties ? properties->getObject(aKey) : NULL;
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, OSObject *anObject) {
+	if (!properties) {
+		properties = OSDictionary::withCapacity(8);
+	}
+	return properties->setObject(aKey, anObject);
+}
+
+bool IORegistryEntry::setProperty(const char *aKey, unsigned long long aValue,
+	unsigned int aNumberOfBits) {
+	OSNumber *num = OSNumber::withNumber(aValue, aNumberOfBits);
+	const bool result = setProperty(aKey, num);
+	num->release();
+	return result;
+}
+
+void IORegistryEntry::removeProperty(const char *aKey) {
+	if (properties) {
+		properties->removeObject(aKey);
+	}
+}
+
+OSIterator *IORegistryEntry::getChildIterator(
+	const IORegistryPlane *plane) const {
+	return NULL;
+}
+
+const char *IORegistryEntry::getName(const IORegistryPlane *plane) const {
+	return simName.c_str();
+}
+
+bool IOService::init(OSDictionary *dictionary) {
+	if (dictionary) {
+		dictionary->retain();
+		properties = dictionary;
+	}
+	return true;
+}
+
+void IOService::free() {
+	IORegistryEntry::free();
+}
+
+IOService *IOService::probe(IOService *provider, SInt32 *score) {
+	return this;
+}
+
+bool IOService::start(IOService *provider) {
+	this->provider = provider;
+	return true;
+}
+
+void IOService::stop(IOService *provider) {
+}
+
+bool IOService::willTerminate(IOService *provider, IOOptionBits options) {
+	return true;
+}
+
+bool IOService::open(IOService *forClient, IOOptionBits options, void *arg) {
+	if (openedBy && openedBy != forClient) {
+		return false;
+	}
+	openedBy = forClient;
+	return true;
+}
+
+void IOService::close(IOService *forClient, IOOptionBits options) {
+	if (openedBy == forClient) {
+		openedBy = NULL;
+	}
+}
+
+IOWorkLoop *IOService::getWorkLoop() const {
+	return NULL;
+}
+
+IOReturn IOService::message(UInt32 type, IOService *provider, void *argument) {
+	return kIOReturnUnsupported;
+}
+
+/***** Work loop, event sources, command gate *****/
+
+IOWorkLoop *IOWorkLoop::workLoop() {
+	return new IOWorkLoop;
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource *newEvent) {
+	return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource *toRemove) {
+	return kIOReturnSuccess;
+}
+
+namespace {
+
+// A thread blocked in 'commandSleep'. They nest: the innermost one runs
+// the event loop, the outer ones return once it's done.
+struct Sleeper {
+	void *event;
+	bool woken;
+};
+std::vector<Sleeper *> sSleepers;
+
+IOReturn sleepOn(void *event, uint64_t deadline) {
+	Sleeper me = { event, false };
+	sSleepers.push_back(&me);
+	simRun([&me] { return me.woken; }, deadline);
+	sSleepers.pop_back();
+	if (!me.woken && deadline == UINT64_MAX) {
+		simPanic("commandSleep(%p): nothing left that could wake it up",
+			event);
+	}
+	return me.woken ? THREAD_AWAKENED : THREAD_TIMED_OUT;
+}
+
+}  // namespace
+
+IOCommandGate *IOCommandGate::commandGate(OSObject *owner, Action action) {
+	IOCommandGate *gate = new IOCommandGate;
+	gate->owner = owner;
+	return gate;
+}
+
+IOReturn IOCommandGate::runAction(Action action, void *arg0, void *arg1,
+	void *arg2, void *arg3) {
+	return action(owner, arg0, arg1, arg2, arg3);
+}
+
+IOReturn IOCommandGate::commandSleep(void *event, UInt32 interruptible) {
+	return sleepOn(event, UINT64_MAX);
+}
+
+IOReturn IOCommandGate::commandSleep(void *event, AbsoluteTime deadline,
+	UInt32 interruptible) {
+	return sleepOn(event, deadline);
+}
+
+void IOCommandGate::commandWakeup(void *event, bool oneThread) {
+	for (size_t i = 0; i < sSleepers.size(); i++) {
+		if (sSleepers[i]->event == event) {
+			sSleepers[i]->woken = true;
+			if (oneThread) {
+				break;
+			}
+		}
+	}
+}
+
+IOTimerEventSource *IOTimerEventSource::timerEventSource(OSObject *owner,
+	Action action) {
+	IOTimerEventSource *timer = new IOTimerEventSource;
+	timer->owner = owner;
+	timer->action = action;
+	return timer;
+}
+
+void IOTimerEventSource::free() {
+	cancelTimeout();
+	IOEventSource::free();
+}
+
+IOReturn IOTimerEventSource::setTimeout(AbsoluteTime interval) {
+	cancelTimeout();
+	pendingEvent = simSchedule(sNow + interval, [this] {
+		pendingEvent = 0;
+		if (action) {
+			action(owner, this);
+		}
+	});
+	return kIOReturnSuccess;
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 ms) {
+	return setTimeout(ms * NSEC_PER_MSEC);
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 us) {
+	return setTimeout(us * NSEC_PER_USEC);
+}
+
+void IOTimerEventSource::cancelTimeout() {
+	if (pendingEvent) {
+		simCancel(pendingEvent);
+		pendingEvent = 0;
+	}
+}
+
+IOInterruptEventSource *IOInterruptEventSource::interruptEventSource(
+	OSObject *owner, Action action, IOService *provider, int intIndex) {
+	IOInterruptEventSource *source = new IOInterruptEventSource;
+	source->owner = owner;
+	source->action = action;
+	return source;
+}
+
+void IOInterruptEventSource::free() {
+	if (pendingEvent) {
+		simCancel(pendingEvent);
+		pendingEvent = 0;
+	}
+	IOEventSource::free();
+}
+
+void IOInterruptEventSource::interruptOccurred(void *refcon, IOService *nub,
+	int source) {
+	count++;
+	if (pendingEvent) {
+		return;
+	}
+	pendingEvent = simSchedule(sNow, [this] {
+		const int n = count;
+		pendingEvent = 0;
+		count = 0;
+		if (action) {
+			action(owner, this, n);
+		}
+	});
+}
+
+/***** Memory descriptors *****/
+
+IOMemoryDescriptor *IOMemoryDescriptor::withAddressRange(
+	mach_vm_address_t address, mach_vm_size_t length, IOOptionBits options,
+	task_t task) {
+	IOMemoryDescriptor *md = new IOMemoryDescriptor;
+	md->base = (uint8_t *)address;
+	md->length = length;
+	return md;
+}
+
+IOReturn IOMemoryDescriptor::prepare(IODirection forDirection) {
+	simPrepares++;
+	gSimCounters.prepares++;
+	return kIOReturnSuccess;
+}
+
+IOReturn IOMemoryDescriptor::complete(IODirection forDirection) {
+	if (simPrepares == 0) {
+		simPanic("complete() without prepare()");
+	}
+	simPrepares--;
+	gSimCounters.prepares--;
+	return kIOReturnSuccess;
+}
+
+void IOMemoryDescriptor::free() {
+	if (simPrepares) {
+		simPanic("descriptor freed while prepared");
+	}
+	OSObject::free();
+}
+
+IOByteCount IOMemoryDescriptor::readBytes(IOByteCount offset, void *bytes,
+	IOByteCount withLength) {
+	if (offset >= length) {
+		return 0;
+	}
+	const IOByteCount n = std::min(withLength, length - offset);
+	memcpy(bytes, base + offset, n);
+	return n;
+}
+
+IOByteCount IOMemoryDescriptor::writeBytes(IOByteCount offset,
+	const void *bytes, IOByteCount withLength) {
+	if (offset >= length) {
+		return 0;
+	}
+	const IOByteCount n = std::min(withLength, length - offset);
+	memcpy(base + offset, bytes, n);
+	return n;
+}
+
+IOMultiMemoryDescriptor *IOMultiMemoryDescriptor::withDescriptors(
+	IOMemoryDescriptor **descriptors, UInt32 withCount,
+	IODirection withDirection, bool asReference) {
+	IOMultiMemoryDescriptor *md = new IOMultiMemoryDescriptor;
+	for (UInt32 i = 0; i < withCount; i++) {
+		descriptors[i]->retain();
+		md->descs.push_back(descriptors[i]);
+		md->length += descriptors[i]->getLength();
+	}
+	return md;
+}
+
+void IOMultiMemoryDescriptor::free() {
+	for (size_t i = 0; i < descs.size(); i++) {
+		descs[i]->release();
+	}
+	descs.clear();
+	IOMemoryDescriptor::free();
+}
+
+IOByteCount IOMultiMemoryDescriptor::readBytes(IOByteCount offset,
+	void *bytes, IOByteCount withLength) {
+	IOByteCount done = 0;
+	for (size_t i = 0; i < descs.size() && done < withLength; i++) {
+		const IOByteCount len = descs[i]->getLength();
+		if (offset >= len) {
+			offset -= len;
+			continue;
+		}
+		done += descs[i]->readBytes(offset, (uint8_t *)bytes + done,
+			withLength - done);
+		offset = 0;
+	}
+	return done;
+}
+
+IOByteCount IOMultiMemoryDescriptor::writeBytes(IOByteCount offset,
+	const void *bytes, IOByteCount withLength) {
+	IOByteCount done = 0;
+	for (size_t i = 0; i < descs.size() && done < withLength; i++) {
+		const IOByteCount len = descs[i]->getLength();
+		if (offset >= len) {
+			offset -= len;
+			continue;
+		}
+		done += descs[i]->writeBytes(offset, (const uint8_t *)bytes + done,
+			withLength - done);
+		offset = 0;
+	}
+	return done;
+}
+
+IOBufferMemoryDescriptor *IOBufferMemoryDescriptor::withCapacity(
+	vm_size_t capacity, IODirection withDirection,
+	bool withContiguousMemory) {
+	void *ptr = NULL;
+	if (posix_memalign(&ptr, 64, capacity ? capacity : 1) != 0) {
+		return NULL;
+	}
+	IOBufferMemoryDescriptor *md = new IOBufferMemoryDescriptor;
+	md->base = (uint8_t *)ptr;
+	md->capacity = capacity;
+	md->length = capacity;
+	return md;
+}
+
+void IOBufferMemoryDescriptor::free() {
+	::free(base);
+	base = NULL;
+	IOMemoryDescriptor::free();
+}
+
+void IOBufferMemoryDescriptor::setLength(vm_size_t newLength) {
+	if (newLength > capacity) {
+		simPanic("setLength(%zu) over capacity %zu", newLength, capacity);
+	}
+	length = newLength;
+}
+
+/***** Networking *****/
+
+const OSSymbol *gIONetworkFilterGroup =
+	OSSymbol::withCString("IONetworkFilterGroup");
+const OSSymbol *gIOEthernetWakeOnLANFilterGroup =
+	OSSymbol::withCString("IOEthernetWakeOnLANFilterGroup");
+
+IONetworkMedium *IONetworkMedium::medium(UInt32 type, UInt64 speed,
+	UInt32 flags, UInt32 index, const OSSymbol *name) {
+	IONetworkMedium *medium = new IONetworkMedium;
+	medium->type = type;
+	medium->speed = speed;
+	return medium;
+}
+
+IOReturn IONetworkMedium::addMedium(OSDictionary *dict,
+	const IONetworkMedium *medium) {
+	char key[16];
+	snprintf(key, sizeof(key), "%x", medium->type);
+	return dict->setObject(key, medium) ? kIOReturnSuccess : kIOReturnError;
+}
+
+void IOOutputQueue::free() {
+	stop();
+	flush();
+	OSObject::free();
+}
+
+bool IOOutputQueue::start() {
+	running = true;
+	scheduleDequeue();
+	return true;
+}
+
+bool IOOutputQueue::stop() {
+	running = false;
+	if (pendingEvent) {
+		simCancel(pendingEvent);
+		pendingEvent = 0;
+	}
+	return true;
+}
+
+bool IOOutputQueue::setCapacity(UInt32 capacity) {
+	this->capacity = capacity;
+	return true;
+}
+
+UInt32 IOOutputQueue::flush() {
+	const UInt32 count = (UInt32)queue.size();
+	while (!queue.empty()) {
+		mbuf_freem(queue.front());
+		queue.pop_front();
+	}
+	return count;
+}
+
+bool IOOutputQueue::service(IOOptionBits options) {
+	stalled = false;
+	if ((options & kServiceAsync) || dequeuing) {
+		scheduleDequeue();
+	} else if (running) {
+		dequeue();
+	}
+	return true;
+}
+
+UInt32 IOOutputQueue::enqueue(mbuf_t m, void *param) {
+	if (queue.size() >= capacity) {
+		drops++;
+		mbuf_freem(m);
+		return 1;
+	}
+	queue.push_back(m);
+	scheduleDequeue();
+	return 0;
+}
+
+void IOOutputQueue::scheduleDequeue() {
+	// The gated queue dequeues on the work loop: after whatever is running.
+	if (!running || stalled || dequeuing || pendingEvent || queue.empty()) {
+		return;
+	}
+	pendingEvent = simSchedule(sNow, [this] {
+		pendingEvent = 0;
+		dequeue();
+	});
+}
+
+void IOOutputQueue::dequeue() {
+	if (dequeuing) {
+		return;
+	}
+	dequeuing = true;
+	while (running && !stalled && !queue.empty()) {
+		mbuf_t m = queue.front();
+		queue.pop_front();
+		const UInt32 status = target->outputPacket(m, NULL);
+		switch (status & kIOOutputStatusMask) {
+		case kIOOutputStatusRetry:
+			queue.push_front(m);
+			stalled = true;
+			break;
+		case kIOOutputStatusDropped:
+			drops++;  // The controller has freed it.
+			break;
+		default:
+			break;
+		}
+		if (status & kIOOutputCommandStall) {
+			stalled = true;
+		}
+		if (stalled) {
+			stalls++;
+		}
+	}
+	dequeuing = false;
+}
+
+IOBasicOutputQueue *IOBasicOutputQueue::withTarget(
+	IONetworkController *target, UInt32 capacity) {
+	IOBasicOutputQueue *q = new IOBasicOutputQueue;
+	q->target = target;
+	q->capacity = capacity;
+	return q;
+}
+
+IOGatedOutputQueue *IOGatedOutputQueue::withTarget(
+	IONetworkController *target, IOWorkLoop *workloop, UInt32 capacity) {
+	IOGatedOutputQueue *q = new IOGatedOutputQueue;
+	q->target = target;
+	q->capacity = capacity;
+	return q;
+}
+
+bool IONetworkController::start(IOService *provider) {
+	if (!IOService::start(provider)) {
+		return false;
+	}
+	workLoop = IOWorkLoop::workLoop();
+	commandGate = IOCommandGate::commandGate(this);
+	outputQueue = createOutputQueue();
+	return outputQueue != NULL;
+}
+
+void IONetworkController::stop(IOService *provider) {
+	// Detaches the interface: drops the reference "the registry" holds.
+	OSSafeReleaseNULL(simInterface);
+	IOService::stop(provider);
+}
+
+void IONetworkController::free() {
+	OSSafeReleaseNULL(simInterface);
+	OSSafeReleaseNULL(outputQueue);
+	OSSafeReleaseNULL(commandGate);
+	OSSafeReleaseNULL(workLoop);
+	if (mediumDict) {
+		mediumDict->release();
+		mediumDict = NULL;
+	}
+	IOService::free();
+}
+
+bool IONetworkController::configureInterface(IONetworkInterface *interface) {
+	return interface != NULL;
+}
+
+bool IONetworkController::attachInterface(IONetworkInterface **interface,
+	bool doRegister) {
+	IONetworkInterface *netif = createInterface();
+	if (!netif) {
+		return false;
+	}
+	if (!configureInterface(netif)) {
+		netif->release();
+		return false;
+	}
+	if (IOEthernetController *ec = OSDynamicCast(IOEthernetController, this)) {
+		// Published as the interface's MAC address:
+		if (ec->getHardwareAddress(&ec->simAddress) != kIOReturnSuccess) {
+			netif->release();
+			return false;
+		}
+	}
+	netif->retain();  // Attached.
+	simInterface = netif;
+	*interface = netif;
+	return true;
+}
+
+IOReturn IONetworkController::getMinPacketSize(UInt32 *minSize) const {
+	*minSize = kIOEthernetMinPacketSize;
+	return kIOReturnSuccess;
+}
+
+IOReturn IONetworkController::getPacketFilters(const OSSymbol *group,
+	UInt32 *filters) const {
+	*filters = (group == gIONetworkFilterGroup) ?
+		(kIOPacketFilterUnicast | kIOPacketFilterBroadcast) : 0;
+	return kIOReturnSuccess;
+}
+
+bool IONetworkController::setLinkStatus(UInt32 status,
+	const IONetworkMedium *activeMedium, UInt64 speed, OSData *data) {
+	if (status != simLinkStatus) {
+		simLinkChanges++;
+	}
+	simLinkStatus = status;
+	return true;
+}
+
+bool IONetworkController::setCurrentMedium(const IONetworkMedium *medium) {
+	currentMedium = medium;
+	return true;
+}
+
+bool IONetworkController::setSelectedMedium(const IONetworkMedium *medium) {
+	return setCurrentMedium(medium);
+}
+
+bool IONetworkController::publishMediumDictionary(
+	const OSDictionary *mediumDict) {
+	// The kernel copies it; keeping a reference does the same here.
+	mediumDict->retain();
+	if (this->mediumDict) {
+		this->mediumDict->release();
+	}
+	this->mediumDict = mediumDict;
+	return true;
+}
+
+mbuf_t IONetworkController::allocatePacket(UInt32 size) {
+	return simAllocPacket(NULL, size, 1);
+}
+
+void IONetworkController::freePacket(mbuf_t m, IOOptionBits options) {
+	mbuf_freem(m);
+}
+
+bool IOEthernetController::configureInterface(IONetworkInterface *interface) {
+	return IONetworkController::configureInterface(interface);
+}
+
+IOReturn IOEthernetController::getMaxPacketSize(UInt32 *maxSize) const {
+	*maxSize = kIOEthernetMaxPacketSize;
+	return kIOReturnSuccess;
+}
+
+bool IONetworkInterface::init(IONetworkController *controller) {
+	this->controller = controller;
+	simFeatures = controller->getFeatures();
+	memset(&simStats, 0, sizeof(simStats));
+	statsData = new IONetworkData;
+	statsData->buffer = &simStats;
+	mtu = 1500;
+	return true;
+}
+
+void IONetworkInterface::free() {
+	for (size_t i = 0; i < inputQueue.size(); i++) {
+		mbuf_freem(inputQueue[i]);
+	}
+	inputQueue.clear();
+	OSSafeReleaseNULL(statsData);
+	IOService::free();
+}
+
+UInt32 IONetworkInterface::inputPacket(mbuf_t m, UInt32 length,
+	IOOptionBits options, void *param) {
+	if (options & kInputOptionQueuePacket) {
+		inputQueue.push_back(m);
+		return 0;
+	}
+	if (simInputHook) {
+		simInputHook(m, simInputContext);
+	} else {
+		mbuf_freem(m);
+	}
+	return 1;
+}
+
+UInt32 IONetworkInterface::flushInputQueue() {
+	// The hook may queue more: take the current batch first.
+	std::vector<mbuf_t> batch;
+	batch.swap(inputQueue);
+	for (size_t i = 0; i < batch.size(); i++) {
+		inputPacket(batch[i]);
+	}
+	return (UInt32)batch.size();
+}
+
+IONetworkData *IONetworkInterface::getNetworkData(const char *aKey) const {
+	return strcmp(aKey, kIONetworkStatsKey) == 0 ? statsData : NULL;
+}
+
+bool IONetworkInterface::setMaxTransferUnit(UInt32 mtu) {
+	this->mtu = mtu;
+	return true;
+}
+
+bool IOEthernetInterface::init(IONetworkController *controller) {
+	return IONetworkInterface::init(controller);
+}
+
+int IOEthernetInterface::simSetMtu(UInt32 mtu) {
+	// As in xnu's 'IOEthernetInterface::syncSIOCSIFMTU': the controller
+	// only hears about the MTUs above the standard one.
+	const UInt32 kHeaderAndCrc = 14 + 4;
+	if (getMaxTransferUnit() == mtu) {
+		return 0;
+	}
+	UInt32 maxFrameSize = 1500 + kHeaderAndCrc, size;
+	if (getController()->getMaxPacketSize(&size) == kIOReturnSuccess) {
+		maxFrameSize = std::max(size, maxFrameSize);
+	}
+	if (mtu > maxFrameSize - kHeaderAndCrc) {
+		return EINVAL;
+	}
+	if ((mtu > 1500 || getMaxTransferUnit() > 1500) &&
+			getController()->setMaxPacketSize(mtu + kHeaderAndCrc) !=
+			kIOReturnSuccess) {
+		return EINVAL;
+	}
+	return setMaxTransferUnit(mtu) ? 0 : EINVAL;
+}
+
+/***** USB host *****/
+
+namespace StandardUSB {
+
+static const uint8_t *descEnd(const ConfigurationDescriptor *config) {
+	return (const uint8_t *)config + config->wTotalLength;
+}
+
+// The descriptor following 'current' (or the first one after the
+// configuration descriptor), of the given type; NULL at the end, or at a
+// descriptor of 'stopType'.
+static const void *nextDescriptor(const ConfigurationDescriptor *config,
+	const void *current, uint8_t type, uint8_t stopType) {
+	const uint8_t *p = (const uint8_t *)(current ? current : config);
+	const uint8_t *const end = descEnd(config);
+	p += p[0];
+	while (p + 2 <= end && p[0] >= 2) {
+		if (p[1] == type) {
+			return p;
+		}
+		if (p[1] == stopType) {
+			return NULL;
+		}
+		p += p[0];
+	}
+	return NULL;
+}
+
+const InterfaceDescriptor *getNextInterfaceDescriptor(
+	const ConfigurationDescriptor *configurationDescriptor,
+	const void *currentDescriptor) {
+	return (const InterfaceDescriptor *)nextDescriptor(
+		configurationDescriptor, currentDescriptor,
+		kDescriptorTypeInterface, 0);
+}
+
+const EndpointDescriptor *getNextEndpointDescriptor(
+	const ConfigurationDescriptor *configurationDescriptor,
+	const InterfaceDescriptor *interfaceDescriptor,
+	const void *currentDescriptor) {
+	return (const EndpointDescriptor *)nextDescriptor(
+		configurationDescriptor,
+		currentDescriptor ? currentDescriptor : interfaceDescriptor,
+		kDescriptorTypeEndpoint, kDescriptorTypeInterface);
+}
+
+}  // namespace StandardUSB
@@ -0,0 +1,885 @@
+/* SimKernel.h
+ * The subset of the XNU / IOKit / USB host API that HoRNDIS uses, implemented
+ * in userspace on top of a single-threaded discrete-event simulator.
+ *
+ * HoRNDIS.cpp is compiled unmodified against these declarations: the
+ * headers under "include/" just forward here. The simulated clock only
+ * moves when the event loop runs, and everything runs on one thread:
+ *  - USB completions, timers and thread calls are events.
+ *  - 'IOCommandGate::commandSleep', 'IOSleep' and the synchronous control
+ *    transfers run the event loop until they are woken up, or time out.
+ *    That mirrors the kernel, where they release the gate while sleeping.
+ *  - The command gate itself is a no-op.
+ *
+ * Only the behavior HoRNDIS relies on is implemented. Where the kernel
+ * leaves something unspecified (e.g. the order of completions vs. timers
+ * due at the same time), the event order (time, then FIFO) decides.
+ */
+
+#ifndef SIM_KERNEL_H
+#define SIM_KERNEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/***** Basic types and return codes *****/
+
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t SInt8;
+typedef int16_t SInt16;
+typedef int32_t SInt32;
+typedef int64_t SInt64;
+typedef int IOReturn;
+typedef uint32_t IOOptionBits;
+typedef uint64_t IOByteCount;
+typedef uint64_t AbsoluteTime;  // Nanoseconds, in the simulation.
+typedef uint32_t IODirection;
+typedef unsigned int u_int;
+typedef char *caddr_t;
+typedef int errno_t;
+typedef uint64_t mach_vm_address_t;
+typedef uint64_t mach_vm_size_t;
+typedef void *task_t;
+typedef size_t vm_size_t;
+
+#define kIOReturnSuccess        0
+#define kIOReturnError          ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory       ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources    ((IOReturn)0xe00002be)
+#define kIOReturnNoDevice       ((IOReturn)0xe00002c0)
+#define kIOReturnNotPrivileged  ((IOReturn)0xe00002c1)
+#define kIOReturnBadArgument    ((IOReturn)0xe00002c2)
+#define kIOReturnUnsupported    ((IOReturn)0xe00002c7)
+#define kIOReturnIOError        ((IOReturn)0xe00002ca)
+#define kIOReturnTimeout        ((IOReturn)0xe00002d6)
+#define kIOReturnNotReady       ((IOReturn)0xe00002d8)
+#define kIOReturnUnderrun       ((IOReturn)0xe00002e7)
+#define kIOReturnOverrun        ((IOReturn)0xe00002e8)
+#define kIOReturnAborted        ((IOReturn)0xe00002eb)
+#define kIOReturnNotResponding  ((IOReturn)0xe00002ed)
+#define kUSBHostReturnPipeStalled ((IOReturn)0xe0005000)
+
+#define THREAD_UNINT            0
+#define THREAD_INTERRUPTIBLE    1
+#define THREAD_AWAKENED         0
+#define THREAD_TIMED_OUT        1
+
+#define kNanosecondScale        1
+#define kMicrosecondScale       1000
+#define kMillisecondScale       1000000
+#define kSecondScale            1000000000
+#define NSEC_PER_USEC           1000ull
+#define NSEC_PER_MSEC           1000000ull
+#define NSEC_PER_SEC            1000000000ull
+
+#define OSSwapHostToLittleInt16(x)  ((uint16_t)(x))
+#define OSSwapHostToLittleInt32(x)  ((uint32_t)(x))
+#define OSSwapLittleToHostInt16(x)  ((uint16_t)(x))
+#define OSSwapLittleToHostInt32(x)  ((uint32_t)(x))
+#define OSSwapHostToBigInt16(x)     __builtin_bswap16(x)
+#define OSSwapBigToHostInt16(x)     __builtin_bswap16(x)
+#define OSSwapHostToBigInt32(x)     __builtin_bswap32(x)
+#define OSSwapBigToHostInt32(x)     __builtin_bswap32(x)
+
+static inline u_int min(u_int a, u_int b) { return a < b ? a : b; }
+static inline u_int max(u_int a, u_int b) { return a > b ? a : b; }
+
+#define assert(x) do { if (!(x)) simPanic("assertion failed: %s", #x); } while (0)
+
+extern "C" {
+void IOLog(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void IOSleep(unsigned ms);
+void IODelay(unsigned us);
+void *IOMalloc(size_t size);
+void IOFree(void *ptr, size_t size);
+void *IOMallocAligned(size_t size, size_t alignment);
+void IOFreeAligned(void *ptr, size_t size);
+
+void clock_get_uptime(uint64_t *result);
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result);
+void nanoseconds_to_absolutetime(uint64_t nanosecs, uint64_t *result);
+void clock_interval_to_deadline(uint32_t interval, uint32_t scale,
+	uint64_t *result);
+
+SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 *address);
+SInt32 OSIncrementAtomic(volatile SInt32 *address);
+SInt32 OSDecrementAtomic(volatile SInt32 *address);
+void OSMemoryBarrier(void);
+}
+
+// There's a single thread: taking a simple lock that is held would spin
+// forever, so it panics instead.
+typedef struct IOSimpleLockSim IOSimpleLock;
+IOSimpleLock *IOSimpleLockAlloc(void);
+void IOSimpleLockFree(IOSimpleLock *lock);
+void IOSimpleLockLock(IOSimpleLock *lock);
+void IOSimpleLockUnlock(IOSimpleLock *lock);
+
+struct thread;
+typedef struct thread *thread_t;
+thread_t current_thread(void);
+uint64_t thread_tid(thread_t thread);
+
+extern task_t kernel_task;
+task_t current_task(void);
+
+struct kmod_info_t {
+	char name[64];
+	char version[64];
+};
+
+/***** Thread calls *****/
+
+struct thread_call;
+typedef struct thread_call *thread_call_t;
+typedef void *thread_call_param_t;
+typedef void (*thread_call_func_t)(thread_call_param_t param0,
+	thread_call_param_t param1);
+
+thread_call_t thread_call_allocate(thread_call_func_t func,
+	thread_call_param_t param0);
+bool thread_call_enter(thread_call_t call);
+bool thread_call_cancel(thread_call_t call);
+bool thread_call_free(thread_call_t call);
+
+/***** mbufs *****/
+
+struct mbuf;
+typedef struct mbuf *mbuf_t;
+typedef int mbuf_how_t;
+typedef int mbuf_type_t;
+#define MBUF_WAITOK             0
+#define MBUF_DONTWAIT           1
+#define MBUF_TYPE_DATA          1
+typedef uint32_t mbuf_tso_request_flags_t;
+#define MBUF_TSO_IPV4           0x100000
+#define MBUF_TSO_IPV6           0x200000
+
+extern "C" {
+mbuf_t mbuf_next(mbuf_t mbuf);
+size_t mbuf_len(mbuf_t mbuf);
+void *mbuf_data(mbuf_t mbuf);
+size_t mbuf_pkthdr_len(mbuf_t mbuf);
+void mbuf_setlen(mbuf_t mbuf, size_t len);
+void mbuf_pkthdr_setlen(mbuf_t mbuf, size_t len);
+errno_t mbuf_copydata(mbuf_t mbuf, size_t offset, size_t length, void *out);
+errno_t mbuf_copyback(mbuf_t mbuf, size_t offset, size_t length,
+	const void *data, mbuf_how_t how);
+errno_t mbuf_attachcluster(mbuf_how_t how, mbuf_type_t type, mbuf_t *mbuf,
+	caddr_t extbuf, void (*extfree)(caddr_t, u_int, caddr_t), size_t extsize,
+	caddr_t extarg);
+void mbuf_freem(mbuf_t mbuf);
+errno_t mbuf_get_tso_requested(mbuf_t mbuf,
+	mbuf_tso_request_flags_t *request, uint32_t *value);
+}
+
+/***** libkern containers *****/
+
+#define OSDeclareDefaultStructors(className) \
+	public: className(); virtual ~className(); private:
+#define OSDefineMetaClassAndStructors(className, superName) \
+	className::className() {} className::~className() {}
+#define OSDynamicCast(type, inst) \
+	(dynamic_cast<type *>(const_cast<OSObject *>( \
+		static_cast<const OSObject *>(inst))))
+#define OSSafeReleaseNULL(inst) \
+	do { if (inst) { (inst)->release(); } (inst) = NULL; } while (0)
+
+class OSObject {
+public:
+	OSObject();
+	virtual ~OSObject();
+	virtual bool init() { return true; }
+	// As in libkern: the last 'release' calls 'free', that deletes.
+	virtual void free();
+	void retain() const;
+	void release() const;
+	int getRetainCount() const { return refs; }
+private:
+	mutable int refs;
+};
+
+class OSSerialize : public OSObject {};
+
+class OSString : public OSObject {
+public:
+	static OSString *withCString(const char *cString);
+	const char *getCStringNoCopy() const { return str.c_str(); }
+	std::string str;
+};
+
+class OSSymbol : public OSString {
+public:
+	static const OSSymbol *withCString(const char *cString);
+};
+
+class OSNumber : public OSObject {
+public:
+	static OSNumber *withNumber(unsigned long long value,
+		unsigned int numberOfBits);
+	unsigned long long unsigned64BitValue() const { return value; }
+	unsigned int unsigned32BitValue() const { return (unsigned int)value; }
+	void setValue(unsigned long long newValue) { value = newValue; }
+private:
+	unsigned long long value;
+};
+
+class OSBoolean : public OSObject {
+public:
+	explicit OSBoolean(bool v): value(v) {}
+	bool isTrue() const { return value; }
+	bool isFalse() const { return !value; }
+	bool getValue() const { return value; }
+	virtual void free() override {}  // Never goes away.
+private:
+	bool value;
+};
+extern OSBoolean *const kOSBooleanTrue;
+extern OSBoolean *const kOSBooleanFalse;
+
+class OSData : public OSObject {
+public:
+	static OSData *withBytes(const void *bytes, unsigned int numBytes);
+	const void *getBytesNoCopy() const { return bytes.data(); }
+	unsigned int getLength() const { return (unsigned int)bytes.size(); }
+private:
+	std::vector<uint8_t> bytes;
+};
+
+class OSIterator : public OSObject {
+public:
+	virtual OSObject *getNextObject() = 0;
+};
+
+class OSArray : public OSObject {
+public:
+	static OSArray *withCapacity(unsigned int capacity);
+	virtual void free() override;
+	bool setObject(const OSObject *anObject);
+	OSObject *getObject(unsigned int index) const {
+		return index < array.size() ? array[index] : NULL;
+	}
+	unsigned int getCount() const { return (unsigned int)array.size(); }
+private:
+	std::vector<OSObject *> array;
+};
+
+class OSDictionary : public OSObject {
+public:
+	static OSDictionary *withCapacity(unsigned int capacity);
+	virtual void free() override;
+	bool setObject(const char *key, const OSObject *anObject);
+	bool setObject(const OSSymbol *key, const OSObject *anObject);
+	OSObject *getObject(const char *key) const;
+	void removeObject(const char *key);
+	unsigned int getCount() const { return (unsigned int)dict.size(); }
+private:
+	friend class OSCollectionIterator;
+	std::map<std::string, OSObject *> dict;
+};
+
+// Over the keys of a dictionary, as of when it was made.
+class OSCollectionIterator : public OSObject {
+public:
+	static OSCollectionIterator *withCollection(const OSDictionary *inColl);
+	virtual void free() override;
+	OSObject *getNextObject();
+private:
+	std::vector<const OSSymbol *> keys;
+	size_t next = 0;
+};
+
+/***** Registry and services *****/
+
+class IORegistryPlane;
+#define gIOServicePlane         ((const IORegistryPlane *)NULL)
+#define kIOProviderClassKey     "IOProviderClass"
+
+class IORegistryEntry : public OSObject {
+public:
+	virtual void free() override;
+	OSObject *getProperty(const char *aKey) const;
+	bool setProperty(const char *aKey, OSObject *anObject);
+	bool setProperty(const char *aKey, unsigned long long aValue,
+		unsigned int aNumberOfBits);
+	void removeProperty(const char *aKey);
+	virtual bool serializeProperties(OSSerialize *s) const { return true; }
+	virtual IOReturn setProperties(OSObject *properties) {
+		return kIOReturnUnsupported;
+	}
+	virtual OSIterator *getChildIterator(const IORegistryPlane *plane) const;
+	virtual const char *getName(const IORegistryPlane *plane = 0) const;
+	void setName(const char *name) { simName = name; }
+protected:
+	OSDictionary *properties = NULL;
+	std::string simName;
+};
+
+class IOWorkLoop;
+class IOCommandGate;
+
+class IOService : public IORegistryEntry {
+public:
+	virtual bool init(OSDictionary *dictionary = 0);
+	virtual void free() override;
+	virtual IOService *probe(IOService *provider, SInt32 *score);
+	virtual bool start(IOService *provider);
+	virtual void stop(IOService *provider);
+	virtual bool willTerminate(IOService *provider, IOOptionBits options);
+	virtual bool open(IOService *forClient, IOOptionBits options = 0,
+		void *arg = 0);
+	virtual void close(IOService *forClient, IOOptionBits options = 0);
+	virtual IOWorkLoop *getWorkLoop() const;
+	virtual void registerService(IOOptionBits options = 0) {}
+	virtual IOReturn message(UInt32 type, IOService *provider,
+		void *argument = 0);
+	virtual IOService *getProvider() const { return provider; }
+protected:
+	IOService *provider = NULL;
+	IOService *openedBy = NULL;
+};
+
+#define kIOMessageServiceIsTerminated   0xe0000010
+
+// The caller's privilege is 'gSimClientIsAdmin':
+#define kIOClientPrivilegeAdministrator "root"
+class IOUserClient : public IOService {
+public:
+	static IOReturn clientHasPrivilege(void *securityToken,
+		const char *privilegeName);
+};
+
+/***** Work loop, event sources, command gate *****/
+
+class IOEventSource : public OSObject {
+public:
+	virtual void enable() {}
+	virtual void disable() {}
+};
+
+class IOWorkLoop : public OSObject {
+public:
+	static IOWorkLoop *workLoop();
+	IOReturn addEventSource(IOEventSource *newEvent);
+	IOReturn removeEventSource(IOEventSource *toRemove);
+};
+
+class IOCommandGate : public IOEventSource {
+public:
+	typedef IOReturn (*Action)(OSObject *owner, void *arg0, void *arg1,
+		void *arg2, void *arg3);
+	static IOCommandGate *commandGate(OSObject *owner, Action action = 0);
+	IOReturn runAction(Action action, void *arg0 = 0, void *arg1 = 0,
+		void *arg2 = 0, void *arg3 = 0);
+	// Run the event loop until 'commandWakeup(event)', or until 'deadline':
+	IOReturn commandSleep(void *event, UInt32 interruptible = THREAD_UNINT);
+	IOReturn commandSleep(void *event, AbsoluteTime deadline,
+		UInt32 interruptible);
+	void commandWakeup(void *event, bool oneThread = false);
+private:
+	OSObject *owner = NULL;
+};
+
+class IOTimerEventSource : public IOEventSource {
+public:
+	typedef void (*Action)(OSObject *owner, IOTimerEventSource *sender);
+	static IOTimerEventSource *timerEventSource(OSObject *owner,
+		Action action = 0);
+	virtual void free() override;
+	IOReturn setTimeoutMS(UInt32 ms);
+	IOReturn setTimeoutUS(UInt32 us);
+	IOReturn setTimeout(AbsoluteTime interval);
+	void cancelTimeout();
+private:
+	OSObject *owner = NULL;
+	Action action = NULL;
+	uint64_t pendingEvent = 0;
+};
+
+// Without a provider: 'interruptOccurred' runs the action on the work loop,
+// once for however many times it was signalled meanwhile.
+class IOInterruptEventSource : public IOEventSource {
+public:
+	typedef void (*Action)(OSObject *owner, IOInterruptEventSource *sender,
+		int count);
+	static IOInterruptEventSource *interruptEventSource(OSObject *owner,
+		Action action, IOService *provider = 0, int intIndex = 0);
+	virtual void free() override;
+	void interruptOccurred(void *refcon, IOService *nub, int source);
+private:
+	OSObject *owner = NULL;
+	Action action = NULL;
+	int count = 0;
+	uint64_t pendingEvent = 0;
+};
+
+/***** Memory descriptors *****/
+
+enum {
+	kIODirectionNone = 0,
+	kIODirectionIn = 1,
+	kIODirectionOut = 2,
+};
+
+class IOMemoryDescriptor : public OSObject {
+public:
+	static IOMemoryDescriptor *withAddressRange(mach_vm_address_t address,
+		mach_vm_size_t length, IOOptionBits options, task_t task);
+	virtual IOByteCount getLength() const { return length; }
+	virtual IOByteCount readBytes(IOByteCount offset, void *bytes,
+		IOByteCount withLength);
+	virtual IOByteCount writeBytes(IOByteCount offset, const void *bytes,
+		IOByteCount withLength);
+	IOReturn prepare(IODirection forDirection = kIODirectionNone);
+	IOReturn complete(IODirection forDirection = kIODirectionNone);
+	// Whether the memory may be the target of a transfer: prepared, or an
+	// IOBufferMemoryDescriptor, which comes wired.
+	virtual bool simWired() const { return simPrepares > 0; }
+	virtual void free() override;
+protected:
+	int simPrepares = 0;
+	uint8_t *base = NULL;
+	IOByteCount length = 0;
+};
+
+class IOMultiMemoryDescriptor : public IOMemoryDescriptor {
+public:
+	static IOMultiMemoryDescriptor *withDescriptors(
+		IOMemoryDescriptor **descriptors, UInt32 withCount,
+		IODirection withDirection, bool asReference = false);
+	virtual void free() override;
+	virtual IOByteCount readBytes(IOByteCount offset, void *bytes,
+		IOByteCount withLength) override;
+	virtual IOByteCount writeBytes(IOByteCount offset, const void *bytes,
+		IOByteCount withLength) override;
+private:
+	std::vector<IOMemoryDescriptor *> descs;
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor {
+public:
+	static IOBufferMemoryDescriptor *withCapacity(vm_size_t capacity,
+		IODirection withDirection, bool withContiguousMemory = false);
+	virtual void free() override;
+	void setLength(vm_size_t newLength);
+	void *getBytesNoCopy() { return base; }
+	vm_size_t getCapacity() const { return capacity; }
+	virtual bool simWired() const override { return true; }
+private:
+	vm_size_t capacity = 0;
+};
+
+/***** Networking *****/
+
+#define kIONetworkStatsKey              "IONetworkStatsKey"
+#define kIONetworkLinkValid             0x00000001
+#define kIONetworkLinkActive            0x00000002
+#define kIOMediumEthernetAuto           0x00000020
+#define kIOEthernetMaxPacketSize        1514
+#define kIOEthernetMinPacketSize        60
+
+#define kIOPacketFilterUnicast          0x1
+#define kIOPacketFilterBroadcast        0x2
+#define kIOPacketFilterMulticast        0x10
+#define kIOPacketFilterMulticastAll     0x20
+#define kIOPacketFilterPromiscuous      0x100
+
+enum {
+	kIOOutputStatusMask     = 0x00ff,
+	kIOOutputStatusAccepted = 0x0000,
+	kIOOutputStatusDropped  = 0x0001,
+	kIOOutputStatusRetry    = 0x0002,
+	kIOOutputCommandMask    = 0xff00,
+	kIOOutputCommandNone    = 0x0000,
+	kIOOutputCommandStall   = 0x0100,
+};
+enum {
+	kIOReturnOutputSuccess = kIOOutputStatusAccepted | kIOOutputCommandNone,
+	kIOReturnOutputStall   = kIOOutputStatusRetry | kIOOutputCommandStall,
+	kIOReturnOutputDropped = kIOOutputStatusDropped | kIOOutputCommandNone,
+};
+
+struct IOEthernetAddress {
+	UInt8 bytes[6];
+};
+
+struct IONetworkStats {
+	UInt32 inputPackets;
+	UInt32 inputErrors;
+	UInt32 outputPackets;
+	UInt32 outputErrors;
+	UInt32 collisions;
+};
+
+class IONetworkData : public OSObject {
+public:
+	void *getBuffer() const { return buffer; }
+	void *buffer = NULL;
+};
+
+class IONetworkMedium : public OSObject {
+public:
+	static IONetworkMedium *medium(UInt32 type, UInt64 speed,
+		UInt32 flags = 0, UInt32 index = 0, const OSSymbol *name = 0);
+	static IOReturn addMedium(OSDictionary *dict,
+		const IONetworkMedium *medium);
+	UInt64 getSpeed() const { return speed; }
+private:
+	UInt32 type = 0;
+	UInt64 speed = 0;
+};
+
+extern const OSSymbol *gIONetworkFilterGroup;
+extern const OSSymbol *gIOEthernetWakeOnLANFilterGroup;
+
+class IONetworkController;
+class IONetworkInterface;
+
+// The basic output queue (and the gated one) of the IONetworkingFamily:
+// a FIFO of mbufs, dequeued into the controller's 'outputPacket' until it
+// asks to stall; 'service' restarts it.
+class IOOutputQueue : public OSObject {
+public:
+	enum { kServiceAsync = 0x1 };
+	virtual void free() override;
+	bool start();
+	bool stop();
+	bool setCapacity(UInt32 capacity);
+	UInt32 getCapacity() const { return capacity; }
+	UInt32 getSize() const { return (UInt32)queue.size(); }
+	UInt32 flush();
+	bool service(IOOptionBits options = 0);
+	// Returns false, and frees the packet, if the queue is full:
+	UInt32 enqueue(mbuf_t m, void *param);
+	uint64_t getDropCount() const { return drops; }
+	uint64_t getStallCount() const { return stalls; }
+protected:
+	void scheduleDequeue();
+	void dequeue();
+	IONetworkController *target = NULL;
+	std::deque<mbuf_t> queue;
+	UInt32 capacity = 0;
+	bool running = false;
+	bool stalled = false;
+	bool dequeuing = false;
+	uint64_t pendingEvent = 0;
+	uint64_t drops = 0;
+	uint64_t stalls = 0;
+};
+
+class IOBasicOutputQueue : public IOOutputQueue {
+public:
+	static IOBasicOutputQueue *withTarget(IONetworkController *target,
+		UInt32 capacity = 0);
+};
+
+class IOGatedOutputQueue : public IOBasicOutputQueue {
+public:
+	static IOGatedOutputQueue *withTarget(IONetworkController *target,
+		IOWorkLoop *workloop, UInt32 capacity = 0);
+};
+
+enum {
+	kIONetworkFeatureTSOIPv4 = 0x10,
+	kIONetworkFeatureTSOIPv6 = 0x20,
+};
+
+class IONetworkController : public IOService {
+public:
+	virtual bool start(IOService *provider) override;
+	virtual void stop(IOService *provider) override;
+	virtual void free() override;
+	virtual IOWorkLoop *getWorkLoop() const override { return workLoop; }
+	virtual IOOutputQueue *createOutputQueue() { return NULL; }
+	IOOutputQueue *getOutputQueue() const { return outputQueue; }
+	IOCommandGate *getCommandGate() const { return commandGate; }
+	virtual IOReturn enable(IONetworkInterface *interface) {
+		return kIOReturnUnsupported;
+	}
+	virtual IOReturn disable(IONetworkInterface *interface) {
+		return kIOReturnUnsupported;
+	}
+	virtual bool configureInterface(IONetworkInterface *interface);
+	virtual IONetworkInterface *createInterface() = 0;
+	bool attachInterface(IONetworkInterface **interface,
+		bool doRegister = true);
+	virtual IOReturn getMaxPacketSize(UInt32 *maxSize) const = 0;
+	virtual IOReturn getMinPacketSize(UInt32 *minSize) const;
+	virtual IOReturn setMaxPacketSize(UInt32 maxSize) {
+		return kIOReturnUnsupported;
+	}
+	virtual IOReturn getPacketFilters(const OSSymbol *group,
+		UInt32 *filters) const;
+	virtual IOReturn selectMedium(const IONetworkMedium *medium) {
+		return kIOReturnUnsupported;
+	}
+	virtual UInt32 outputPacket(mbuf_t m, void *param) = 0;
+	virtual UInt32 getFeatures() const { return 0; }
+	bool setLinkStatus(UInt32 status, const IONetworkMedium *activeMedium = 0,
+		UInt64 speed = 0, OSData *data = 0);
+	const IONetworkMedium *getCurrentMedium() const { return currentMedium; }
+	bool setCurrentMedium(const IONetworkMedium *medium);
+	bool setSelectedMedium(const IONetworkMedium *medium);
+	bool publishMediumDictionary(const OSDictionary *mediumDict);
+	mbuf_t allocatePacket(UInt32 size);
+	void freePacket(mbuf_t m, IOOptionBits options = 0);
+
+	// Simulation state, for the harness:
+	IONetworkInterface *simInterface = NULL;  // Created by 'attachInterface'.
+	UInt32 simLinkStatus = 0;
+	uint64_t simLinkChanges = 0;
+private:
+	IOWorkLoop *workLoop = NULL;
+	IOCommandGate *commandGate = NULL;
+	IOOutputQueue *outputQueue = NULL;
+	const IONetworkMedium *currentMedium = NULL;
+	const OSDictionary *mediumDict = NULL;
+};
+
+class IOEthernetController : public IONetworkController {
+public:
+	virtual IOReturn getHardwareAddress(IOEthernetAddress *addrP) = 0;
+	virtual bool configureInterface(IONetworkInterface *interface) override;
+	virtual IOReturn getMaxPacketSize(UInt32 *maxSize) const override;
+	virtual IOReturn setMulticastMode(bool active) {
+		return kIOReturnUnsupported;
+	}
+	virtual IOReturn setMulticastList(IOEthernetAddress *addrs,
+		UInt32 count) {
+		return kIOReturnUnsupported;
+	}
+	virtual IOReturn setPromiscuousMode(bool active) {
+		return kIOReturnUnsupported;
+	}
+	IOEthernetAddress simAddress;  // From 'getHardwareAddress'.
+};
+
+// Frames handed to the network stack end up in this hook, which owns them:
+typedef void (*SimInputHook)(mbuf_t m, void *context);
+
+class IONetworkInterface : public IOService {
+public:
+	enum { kInputOptionQueuePacket = 0x1 };
+	virtual bool init(IONetworkController *controller);
+	virtual void free() override;
+	UInt32 inputPacket(mbuf_t m, UInt32 length = 0, IOOptionBits options = 0,
+		void *param = 0);
+	UInt32 flushInputQueue();
+	IONetworkData *getNetworkData(const char *aKey) const;
+	virtual bool setMaxTransferUnit(UInt32 mtu);
+	UInt32 getMaxTransferUnit() const { return mtu; }
+	IONetworkController *getController() const { return controller; }
+
+	IONetworkStats simStats;
+	UInt32 simFeatures = 0;  // The controller's, as of 'init'.
+	SimInputHook simInputHook = NULL;
+	void *simInputContext = NULL;
+private:
+	IONetworkController *controller = NULL;
+	IONetworkData *statsData = NULL;
+	std::vector<mbuf_t> inputQueue;
+	UInt32 mtu = 0;
+};
+
+class IOEthernetInterface : public IONetworkInterface {
+public:
+	virtual bool init(IONetworkController *controller) override;
+	// What "ifconfig mtu" does, by way of SIOCSIFMTU: returns an errno.
+	int simSetMtu(UInt32 mtu);
+};
+
+/***** USB host *****/
+
+struct DeviceDescriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t bcdUSB;
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bMaxPacketSize0;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t iManufacturer;
+	uint8_t iProduct;
+	uint8_t iSerialNumber;
+	uint8_t bNumConfigurations;
+} __attribute__((packed));
+
+struct ConfigurationDescriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t wTotalLength;
+	uint8_t bNumInterfaces;
+	uint8_t bConfigurationValue;
+	uint8_t iConfiguration;
+	uint8_t bmAttributes;
+	uint8_t bMaxPower;
+} __attribute__((packed));
+
+struct InterfaceDescriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bInterfaceNumber;
+	uint8_t bAlternateSetting;
+	uint8_t bNumEndpoints;
+	uint8_t bInterfaceClass;
+	uint8_t bInterfaceSubClass;
+	uint8_t bInterfaceProtocol;
+	uint8_t iInterface;
+} __attribute__((packed));
+
+struct EndpointDescriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bEndpointAddress;
+	uint8_t bmAttributes;
+	uint16_t wMaxPacketSize;
+	uint8_t bInterval;
+} __attribute__((packed));
+
+enum {
+	kDescriptorTypeConfiguration = 2,
+	kDescriptorTypeInterface = 4,
+	kDescriptorTypeEndpoint = 5,
+};
+
+enum {
+	kEndpointDescriptorNumber = 0x0f,
+	kEndpointDescriptorDirection = 0x80,
+	kEndpointDescriptorDirectionIn = 0x80,
+	kEndpointDescriptorTransferType = 0x03,
+	kEndpointDescriptorTransferTypeBulk = 2,
+	kEndpointDescriptorTransferTypeInterrupt = 3,
+};
+
+struct DeviceRequest {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+};
+
+enum {
+	kDeviceRequestDirectionOut = 0x00,
+	kDeviceRequestDirectionIn = 0x80,
+	kDeviceRequestTypeClass = 0x20,
+	kDeviceRequestRecipientInterface = 0x01,
+};
+
+namespace StandardUSB {
+const InterfaceDescriptor *getNextInterfaceDescriptor(
+	const ConfigurationDescriptor *configurationDescriptor,
+	const void *currentDescriptor);
+const EndpointDescriptor *getNextEndpointDescriptor(
+	const ConfigurationDescriptor *configurationDescriptor,
+	const InterfaceDescriptor *interfaceDescriptor,
+	const void *currentDescriptor);
+}
+
+typedef void (*IOUSBHostCompletionAction)(void *owner, void *parameter,
+	IOReturn status, uint32_t bytesTransferred);
+struct IOUSBHostCompletion {
+	void *owner;
+	IOUSBHostCompletionAction action;
+	void *parameter;
+};
+
+class IOUSBHostIOSource : public OSObject {
+public:
+	enum {
+		kAbortAsynchronous = 0,
+		kAbortSynchronous = 1,
+	};
+	virtual IOReturn abort(IOOptionBits options = kAbortAsynchronous,
+		IOReturn withError = kIOReturnAborted, IOService *forClient = NULL) = 0;
+};
+
+// The transfers themselves are carried out by the simulated device,
+// see SimDevice.h.
+class IOUSBHostPipe : public IOUSBHostIOSource {
+public:
+	virtual IOReturn io(IOMemoryDescriptor *dataBuffer,
+		uint32_t dataBufferLength, IOUSBHostCompletion *completion,
+		uint32_t completionTimeoutMs = 0) = 0;
+	virtual IOReturn clearStall(bool withRequest) = 0;
+	const EndpointDescriptor *getEndpointDescriptor() const { return desc; }
+protected:
+	const EndpointDescriptor *desc = NULL;
+};
+
+class IOUSBHostDevice;
+
+class IOUSBHostInterface : public IOService {
+public:
+	virtual const InterfaceDescriptor *getInterfaceDescriptor() const = 0;
+	virtual const ConfigurationDescriptor *getConfigurationDescriptor()
+		const = 0;
+	virtual IOUSBHostDevice *getDevice() const = 0;
+	virtual IOUSBHostPipe *copyPipe(uint8_t address) = 0;
+	virtual IOReturn deviceRequest(DeviceRequest &request, void *dataBuffer,
+		uint32_t &bytesTransferred, uint32_t completionTimeoutMs = 5000) = 0;
+};
+
+class IOUSBHostDevice : public IOService {
+public:
+	virtual const DeviceDescriptor *getDeviceDescriptor() const = 0;
+	virtual const ConfigurationDescriptor *getConfigurationDescriptor(
+		uint8_t index) = 0;
+	virtual IOReturn setConfiguration(uint8_t bConfigurationValue,
+		bool matchInterfaces = true) = 0;
+};
+
+/***** Simulation control *****/
+
+// Current simulated time, in nanoseconds:
+uint64_t simNow();
+// Run 'fn' at 'when' (absolute); returns an id for 'simCancel'.
+uint64_t simSchedule(uint64_t when, std::function<void()> fn);
+bool simCancel(uint64_t eventId);
+// Runs the events until 'until' returns true, or the time reaches 'deadline'
+// (then the clock is advanced to it). Returns false if 'until' is not true.
+bool simRun(const std::function<bool()> &until, uint64_t deadline);
+// Runs everything scheduled up to 'deadline', and advances the clock to it.
+void simRunFor(uint64_t ns);
+void simPanic(const char *fmt, ...) __attribute__((format(printf, 1, 2),
+	noreturn));
+
+// IOLog goes to stderr if set:
+extern bool gSimVerbose;
+// Whether 'IOUserClient::clientHasPrivilege' grants the administrator's:
+extern bool gSimClientIsAdmin;
+// Resource accounting, to check that everything is freed:
+struct SimCounters {
+	int64_t objects;  // Live OSObjects.
+	int64_t mbufs;
+	int64_t allocations;  // IOMalloc + IOMallocAligned.
+	int64_t allocationBytes;
+	uint64_t allocFreeMismatches;  // IOFree size did not match IOMalloc.
+	int64_t prepares;  // IOMemoryDescriptor::prepare without 'complete'.
+};
+extern SimCounters gSimCounters;
+
+// Creates an mbuf chain holding 'len' bytes, split into 'segments' mbufs:
+mbuf_t simAllocPacket(const void *data, size_t len, int segments);
+// What TCP does to a super-packet it hands to the driver for segmentation:
+void simSetTsoRequest(mbuf_t m, mbuf_tso_request_flags_t request,
+	uint32_t mss);
+
+#endif /* SIM_KERNEL_H */
@@ -0,0 +1,2 @@
+// Simulated kernel: see test/sim/SimKernel.h.
+#include "SimKernel.h"